@@ -15,6 +15,10 @@ QML_IMPORT_PATH =
 
 # Remove this to not use modern OpenGL
 DEFINES += HAVE_GL33
+
+# GL call validation and per frame statistics, build with
+# qmake CONFIG+=gl_diagnostics. Release builds call GL directly.
+gl_diagnostics: DEFINES += GL_DIAGNOSTICS
 win32:LIBS += -lopengl32
 
 # The .cpp file which was generated for your project. Feel free to hack it.
@@ -27,7 +31,13 @@ SOURCES += main.cpp \
     view.cpp \
     pathing.cpp \
     database.cpp \
-    gpsfakeprovider.cpp
+    gpsfakeprovider.cpp \
+    shaderlibrary.cpp \
+    gldiagnostics.cpp \
+    gputimer.cpp \
+    terrain.cpp \
+    background.cpp \
+    snapshot.cpp
 
 RESOURCES = application.qrc
 
@@ -51,7 +61,13 @@ HEADERS += \
     pathing.h \
     database.h \
     voxel2d.h \
-    gpsfakeprovider.h
+    gpsfakeprovider.h \
+    shaderlibrary.h \
+    gldiagnostics.h \
+    gputimer.h \
+    terrain.h \
+    background.h \
+    snapshot.h
 
 DISTFILES += \
     qml/GPSTracking/Velocimeter.qml \
@@ -63,9 +79,14 @@ DISTFILES += \
     qml/GPSTracking/SetButton.qml \
     shaders/pathing2_frag.glsl \
     shaders/pathing2_vertex.glsl \
+    shaders/frame_data.glsl \
     shaders/pathing_frag.glsl \
     shaders/pathing_vertex.glsl \
-    shaders/segment_vertex.glsl \
-    shaders/segment_frag.glsl \
+    shaders/floor_vertex.glsl \
+    shaders/floor_frag.glsl \
+    shaders/terrain_sample.glsl \
+    shaders/terrain_vertex.glsl \
+    shaders/terrain_frag.glsl \
+    shaders/background_sample.glsl \
     shaders/instances_vertex.glsl \
     shaders/instances_frag.glsl
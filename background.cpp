@@ -0,0 +1,403 @@
+#include "background.h"
+#include "database.h"
+#include "gldiagnostics.h"
+#include <QFile>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QtMath>
+#include <QDebug>
+
+#define BACKGROUND_NO_TILE   (~SCAST(quint64, 0))
+#define BACKGROUND_SLOTS     (BACKGROUND_ATLAS_SIDE * BACKGROUND_ATLAS_SIDE)
+
+/* Mean earth radius, the one QGeoCoordinate::distanceTo uses */
+#define EARTH_RADIUS_METERS  6371007.2
+
+#define SQL_TILE_RULE "SELECT tile_data FROM tiles WHERE zoom_level = ? AND "\
+                      "tile_column = ? AND tile_row = ?"
+
+static quint64 tile_key(int zoom, int x, int y){
+    return (SCAST(quint64, zoom) << 48) | (SCAST(quint64, y) << 24) | SCAST(quint64, x);
+}
+
+static double tile_x(double longitude, int zoom){
+    return (longitude + 180.0) / 360.0 * (1 << zoom);
+}
+
+static double tile_y(double latitude, int zoom){
+    double phi = qDegreesToRadians(latitude);
+    return (1.0 - std::asinh(qTan(phi)) / M_PI) / 2.0 * (1 << zoom);
+}
+
+static double tile_longitude(int x, int zoom){
+    return SCAST(double, x) / (1 << zoom) * 360.0 - 180.0;
+}
+
+static double tile_latitude(int y, int zoom){
+    double n = M_PI * (1.0 - 2.0 * y / (1 << zoom));
+    return qRadiansToDegrees(qAtan(std::sinh(n)));
+}
+
+BackgroundLoader::BackgroundLoader(const QString &_path, int index,
+                                   struct background_queue_t *_queue)
+{
+    path = _path;
+    queue = _queue;
+    connection = QString("mbtiles_%1_%2").arg(quintptr(_queue), 0, 16).arg(index);
+}
+
+void BackgroundLoader::run(){
+    {
+        QSqlDatabase db = QSqlDatabase::addDatabase(DATABASE_DRIVER, connection);
+        db.setDatabaseName(path);
+        db.setConnectOptions("QSQLITE_OPEN_READONLY");
+        QSqlQuery query(db);
+        bool prepared = false;
+        if(db.open()){
+            prepared = query.prepare(SQL_TILE_RULE);
+        }else{
+            qDebug() << "Background decoder could not open " << path;
+        }
+
+        for(;;){
+            queue->mutex.lock();
+            while(!queue->stopping && queue->requests.isEmpty()){
+                queue->wakeUp.wait(&queue->mutex);
+            }
+
+            if(queue->stopping){
+                queue->mutex.unlock();
+                break;
+            }
+
+            struct background_tile_t tile;
+            tile.key = queue->requests.takeLast(); // newest first
+            tile.status = TileMissing;
+            queue->mutex.unlock();
+
+            int zoom = SCAST(int, tile.key >> 48);
+            int y = SCAST(int, (tile.key >> 24) & 0xffffff);
+            int x = SCAST(int, tile.key & 0xffffff);
+            if(prepared){
+                query.addBindValue(zoom);
+                query.addBindValue(x);
+                query.addBindValue((1 << zoom) - 1 - y); // TMS rows start at the south
+                if(query.exec() && query.next()){
+                    QImage image = QImage::fromData(query.value(0).toByteArray());
+                    if(!image.isNull()){
+                        if(image.width() != BACKGROUND_TILE_SIZE ||
+                           image.height() != BACKGROUND_TILE_SIZE)
+                        {
+                            image = image.scaled(BACKGROUND_TILE_SIZE, BACKGROUND_TILE_SIZE,
+                                                 Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+                        }
+                        tile.image = image.convertToFormat(QImage::Format_RGBA8888);
+                        tile.status = TileDecoded;
+                    }
+                }
+                query.finish();
+            }
+
+            queue->mutex.lock();
+            queue->ready.push_back(tile);
+            queue->mutex.unlock();
+        }
+
+        db.close();
+    }
+    QSqlDatabase::removeDatabase(connection);
+}
+
+Background::Background(){
+    minZoom = 0;
+    maxZoom = 0;
+    texture = 0;
+    frame = 0;
+    queue.stopping = false;
+    window = QVector4D(0, 0, 1, 1);
+    for(int i = 0; i < BACKGROUND_SLOTS; i += 1){
+        slotKeys[i] = BACKGROUND_NO_TILE;
+        slotUsed[i] = 0;
+    }
+    for(int i = 0; i < BACKGROUND_GRID * BACKGROUND_GRID; i += 1){
+        windowSlots[i] = -1;
+    }
+}
+
+/*
+ * The atlas must be released with release_gl() while the context is
+ * current, only the decoders can be stopped here.
+ */
+Background::~Background(){
+    stop_workers();
+}
+
+bool Background::is_open(){
+    return !workers.isEmpty();
+}
+
+QString Background::file_path(){
+    return path;
+}
+
+/*
+ * Reads the zoom range, from the metadata table or from the tiles when the
+ * file has no metadata, and starts the decoders.
+ */
+bool Background::open(const QString &_path){
+    if(is_open()){
+        qDebug() << "Background already open, close it first";
+        return false;
+    }
+
+    if(!QFile::exists(_path)){
+        qDebug() << "Background imagery not found " << _path;
+        return false;
+    }
+
+    bool ok = false;
+    QString connection = QString("mbtiles_%1").arg(quintptr(this), 0, 16);
+    {
+        QSqlDatabase db = QSqlDatabase::addDatabase(DATABASE_DRIVER, connection);
+        db.setDatabaseName(_path);
+        db.setConnectOptions("QSQLITE_OPEN_READONLY");
+        if(db.open()){
+            QSqlQuery query(db);
+            minZoom = -1;
+            maxZoom = -1;
+            if(query.exec("SELECT name, value FROM metadata")){
+                while(query.next()){
+                    QString name = query.value(0).toString();
+                    if(name == "minzoom") minZoom = query.value(1).toInt();
+                    if(name == "maxzoom") maxZoom = query.value(1).toInt();
+                }
+            }
+
+            if((minZoom < 0 || maxZoom < 0) &&
+               query.exec("SELECT MIN(zoom_level), MAX(zoom_level) FROM tiles") && query.next())
+            {
+                minZoom = query.value(0).toInt();
+                maxZoom = query.value(1).toInt();
+            }
+
+            ok = minZoom >= 0 && maxZoom >= minZoom && maxZoom < 24;
+            db.close();
+        }
+    }
+    QSqlDatabase::removeDatabase(connection);
+
+    if(!ok){
+        qDebug() << "Invalid MBTiles file " << _path;
+        return false;
+    }
+
+    path = _path;
+    queue.stopping = false;
+    for(int i = 0; i < BACKGROUND_WORKERS; i += 1){
+        BackgroundLoader *worker = new BackgroundLoader(path, i, &queue);
+        worker->start(QThread::LowPriority);
+        workers.push_back(worker);
+    }
+
+    qDebug() << "Background " << path << ": zoom " << minZoom << " to " << maxZoom;
+    return true;
+}
+
+void Background::stop_workers(){
+    queue.mutex.lock();
+    queue.stopping = true;
+    queue.wakeUp.wakeAll();
+    queue.mutex.unlock();
+
+    for(BackgroundLoader *worker : workers){
+        worker->wait();
+        delete worker;
+    }
+
+    workers.clear();
+    queue.requests.clear();
+    queue.ready.clear();
+}
+
+void Background::close(OpenGLFunctions *GLptr){
+    release_gl(GLptr);
+    stop_workers();
+    path.clear();
+    pending.clear();
+    missing.clear();
+    for(int i = 0; i < BACKGROUND_GRID * BACKGROUND_GRID; i += 1){
+        windowSlots[i] = -1;
+    }
+}
+
+void Background::release_gl(OpenGLFunctions *GLptr){
+    if(texture){
+        GL_CHK(glDeleteTextures(1, &texture), GLptr);
+        texture = 0;
+    }
+
+    residentSlots.clear();
+    for(int i = 0; i < BACKGROUND_SLOTS; i += 1){
+        slotKeys[i] = BACKGROUND_NO_TILE;
+        slotUsed[i] = 0;
+    }
+}
+
+int Background::acquire_slot(){
+    int best = 0;
+    for(int i = 0; i < BACKGROUND_SLOTS; i += 1){
+        if(slotKeys[i] == BACKGROUND_NO_TILE) return i;
+        if(slotUsed[i] < slotUsed[best]) best = i;
+    }
+
+    residentSlots.remove(slotKeys[best]);
+    slotKeys[best] = BACKGROUND_NO_TILE;
+    return best;
+}
+
+/*
+ * Finest zoom whose texels are not smaller than a screen pixel, one texel
+ * covers one to two pixels so the window is also wide enough for the view.
+ */
+int Background::select_zoom(double latitude, float metersPerPixel){
+    double world = 2.0 * M_PI * EARTH_RADIUS_METERS * qCos(qDegreesToRadians(latitude));
+    double zoom = qFloor(std::log2(world / (BACKGROUND_TILE_SIZE * metersPerPixel)));
+    return qBound(minZoom, SCAST(int, zoom), maxZoom);
+}
+
+/*
+ * Per frame step: upload what the decoders finished, pick the zoom for
+ * @metersPerPixel and the window of tiles around @focus, and queue the ones
+ * that are not resident, on their way or known to be missing.
+ */
+void Background::update(QGeoCoordinate anchor, QVector3D anchorLocal, QVector3D focus,
+                        float metersPerPixel, OpenGLFunctions *GLptr)
+{
+    if(!is_open() || !anchor.isValid() || metersPerPixel <= 0.0f) return;
+    frame += 1;
+
+    int atlasSize = BACKGROUND_TILE_SIZE * BACKGROUND_ATLAS_SIDE;
+    if(!texture){
+        GL_CHK(glGenTextures(1, &texture), GLptr);
+        GL_CHK(glBindTexture(GL_TEXTURE_2D, texture), GLptr);
+        GL_CHK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR), GLptr);
+        GL_CHK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR), GLptr);
+        GL_CHK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE), GLptr);
+        GL_CHK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE), GLptr);
+        GL_CHK(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, atlasSize, atlasSize, 0,
+                            GL_RGBA, GL_UNSIGNED_BYTE, nullptr), GLptr);
+        GL_CHK(glBindTexture(GL_TEXTURE_2D, 0), GLptr);
+    }
+
+    QVector<struct background_tile_t> finished;
+    queue.mutex.lock();
+    while(finished.size() < BACKGROUND_UPLOADS_PER_FRAME && !queue.ready.isEmpty()){
+        finished.push_back(queue.ready.takeFirst());
+    }
+    queue.mutex.unlock();
+
+    for(struct background_tile_t &tile : finished){
+        pending.remove(tile.key);
+        if(tile.status == TileMissing){
+            missing.insert(tile.key, true);
+        }
+
+        if(tile.status != TileDecoded || residentSlots.contains(tile.key)) continue;
+
+        int slot = acquire_slot();
+        GL_CHK(glBindTexture(GL_TEXTURE_2D, texture), GLptr);
+        GL_CHK(glPixelStorei(GL_UNPACK_ALIGNMENT, 4), GLptr);
+        GL_CHK(glTexSubImage2D(GL_TEXTURE_2D, 0,
+                               (slot % BACKGROUND_ATLAS_SIDE) * BACKGROUND_TILE_SIZE,
+                               (slot / BACKGROUND_ATLAS_SIDE) * BACKGROUND_TILE_SIZE,
+                               BACKGROUND_TILE_SIZE, BACKGROUND_TILE_SIZE, GL_RGBA,
+                               GL_UNSIGNED_BYTE, tile.image.constBits()), GLptr);
+        GL_STAT_UPLOAD(tile.image.sizeInBytes());
+        GL_CHK(glBindTexture(GL_TEXTURE_2D, 0), GLptr);
+
+        residentSlots.insert(tile.key, slot);
+        slotKeys[slot] = tile.key;
+        slotUsed[slot] = frame;
+    }
+
+    // the renderer frame has +X east and +Z north, meters from the anchor
+    double lat0 = anchor.latitude();
+    double lon0 = anchor.longitude();
+    double metersPerDegree = qDegreesToRadians(EARTH_RADIUS_METERS);
+    double cosLat0 = qCos(qDegreesToRadians(lat0));
+    double latitude  = lat0 + (focus.z() - anchorLocal.z()) / metersPerDegree;
+    double longitude = lon0 + (focus.x() - anchorLocal.x()) / (metersPerDegree * cosLat0);
+
+    int zoom = select_zoom(latitude, metersPerPixel);
+    int tiles = 1 << zoom;
+    int windowX = qFloor(tile_x(longitude, zoom) - BACKGROUND_GRID * 0.5 + 0.5);
+    int windowY = qFloor(tile_y(latitude, zoom) - BACKGROUND_GRID * 0.5 + 0.5);
+
+    double west  = anchorLocal.x() + (tile_longitude(windowX, zoom) - lon0) *
+                   metersPerDegree * cosLat0;
+    double east  = anchorLocal.x() + (tile_longitude(windowX + BACKGROUND_GRID, zoom) - lon0) *
+                   metersPerDegree * cosLat0;
+    double north = anchorLocal.z() + (tile_latitude(windowY, zoom) - lat0) * metersPerDegree;
+    double south = anchorLocal.z() + (tile_latitude(windowY + BACKGROUND_GRID, zoom) - lat0) *
+                   metersPerDegree;
+    window = QVector4D(west, north, (east - west) / BACKGROUND_GRID,
+                       (north - south) / BACKGROUND_GRID);
+
+    QVector<quint64> requests;
+    for(int j = 0; j < BACKGROUND_GRID; j += 1){
+        for(int i = 0; i < BACKGROUND_GRID; i += 1){
+            int tx = windowX + i;
+            int ty = windowY + j;
+            GLint *slot = &windowSlots[j * BACKGROUND_GRID + i];
+            *slot = -1;
+            if(tx < 0 || ty < 0 || tx >= tiles || ty >= tiles) continue;
+
+            quint64 key = tile_key(zoom, tx, ty);
+            QHash<quint64, int>::iterator it = residentSlots.find(key);
+            if(it != residentSlots.end()){
+                *slot = it.value();
+                slotUsed[it.value()] = frame;
+            }else if(!pending.contains(key) && !missing.contains(key)){
+                pending.insert(key, true);
+                requests.push_back(key);
+            }
+        }
+    }
+
+    if(requests.isEmpty()) return;
+
+    queue.mutex.lock();
+    queue.requests += requests;
+    while(queue.requests.size() > BACKGROUND_MAX_QUEUE){
+        struct background_tile_t dropped;
+        dropped.key = queue.requests.takeFirst();
+        dropped.status = TileDropped; // lets it be requested again
+        queue.ready.push_back(dropped);
+    }
+    queue.wakeUp.wakeAll();
+    queue.mutex.unlock();
+}
+
+/*
+ * Sets the imagery uniforms of the bound @program and binds the atlas to
+ * BACKGROUND_TEXTURE_UNIT. Without a file every tile reads as missing.
+ */
+void Background::bind_imagery(QOpenGLShaderProgram *program, OpenGLFunctions *GLptr){
+    program->setUniformValue("backgroundWindow", window);
+    GL_STAT_UNIFORM(1);
+    if(is_open()){
+        program->setUniformValueArray("backgroundSlots", windowSlots,
+                                      BACKGROUND_GRID * BACKGROUND_GRID);
+        GL_STAT_UNIFORM(1);
+    }else{
+        GLint missingSlots[BACKGROUND_GRID * BACKGROUND_GRID];
+        for(int i = 0; i < BACKGROUND_GRID * BACKGROUND_GRID; i += 1) missingSlots[i] = -1;
+        program->setUniformValueArray("backgroundSlots", missingSlots,
+                                      BACKGROUND_GRID * BACKGROUND_GRID);
+        GL_STAT_UNIFORM(1);
+    }
+
+    GL_CHK(glActiveTexture(GL_TEXTURE0 + BACKGROUND_TEXTURE_UNIT), GLptr);
+    GL_CHK(glBindTexture(GL_TEXTURE_2D, texture), GLptr);
+    GL_CHK(glActiveTexture(GL_TEXTURE0), GLptr);
+}
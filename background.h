@@ -0,0 +1,128 @@
+#ifndef BACKGROUND_H
+#define BACKGROUND_H
+#include "common.h"
+#include <QGeoCoordinate>
+#include <QHash>
+#include <QImage>
+#include <QMutex>
+#include <QThread>
+#include <QVector>
+#include <QWaitCondition>
+
+/*
+ * Imagery tiles kept around the camera, per side. The shaders index a
+ * BACKGROUND_GRID x BACKGROUND_GRID table so this is also a shader define.
+ */
+#define BACKGROUND_GRID             5
+
+/* Side of a tile in the atlas, tiles of another size are rescaled */
+#define BACKGROUND_TILE_SIZE        256
+
+/* Atlas is BACKGROUND_ATLAS_SIDE^2 tiles, 2048^2 RGBA8 (16 MB) */
+#define BACKGROUND_ATLAS_SIDE       8
+
+/* Decoded tiles moved to the atlas per frame */
+#define BACKGROUND_UPLOADS_PER_FRAME 4
+
+/* Decoder threads, each one with its own SQLite connection */
+#define BACKGROUND_WORKERS          2
+
+/*
+ * Requests waiting for a decoder. Workers take the newest first, once the
+ * queue is full the oldest requests (for a view we already left) are dropped.
+ */
+#define BACKGROUND_MAX_QUEUE        64
+
+/* Texture unit the atlas is bound to while drawing */
+#define BACKGROUND_TEXTURE_UNIT     3
+
+typedef enum{
+    TileDecoded = 0, TileMissing, TileDropped
+}BackgroundTileStatus;
+
+struct background_tile_t{
+    quint64 key;
+    int status;
+    QImage image;
+};
+
+/*
+ * Requests and results shared by the decoder threads and the render thread.
+ */
+struct background_queue_t{
+    QMutex mutex;
+    QWaitCondition wakeUp;
+    QVector<quint64> requests;
+    QVector<struct background_tile_t> ready;
+    bool stopping;
+};
+
+/*
+ * One decoder thread. Reads tile blobs from the MBTiles file and decodes
+ * them to RGBA8888 with QImage, so the render thread only copies pixels.
+ */
+class BackgroundLoader : public QThread{
+public:
+    BackgroundLoader(const QString &path, int index, struct background_queue_t *queue);
+
+protected:
+    void run() override;
+
+private:
+    QString path;
+    QString connection;
+    struct background_queue_t *queue;
+};
+
+/*
+ * Orthophoto layer read from a local MBTiles file (SQLite, Web Mercator
+ * tiles, TMS rows). The floor and terrain programs compiled with BACKGROUND
+ * include shaders/background_sample.glsl and take their color from it
+ * wherever a tile is resident, the grid is left everywhere else.
+ *
+ * Geographic positions are placed in the renderer frame relative to an
+ * anchor, a fix with both its coordinate and its local position, with an
+ * equirectangular approximation that is good for the few kilometers the
+ * window covers.
+ *
+ * update() never waits on the decoders: it uploads at most
+ * BACKGROUND_UPLOADS_PER_FRAME finished tiles into the atlas, evicting the
+ * least recently used slots, and queues requests for what is missing.
+ */
+class Background{
+public:
+    Background();
+    ~Background();
+    bool open(const QString &path);
+    void close(OpenGLFunctions *GLptr);
+    bool is_open();
+    QString file_path();
+
+    void update(QGeoCoordinate anchor, QVector3D anchorLocal, QVector3D focus,
+                float metersPerPixel, OpenGLFunctions *GLptr);
+    void bind_imagery(QOpenGLShaderProgram *program, OpenGLFunctions *GLptr);
+    void release_gl(OpenGLFunctions *GLptr);
+
+private:
+    void stop_workers();
+    int acquire_slot();
+    int select_zoom(double latitude, float metersPerPixel);
+
+    QString path;
+    int minZoom, maxZoom;
+    struct background_queue_t queue;
+    QVector<BackgroundLoader *> workers;
+
+    GLuint texture;
+    QHash<quint64, int> residentSlots;
+    QHash<quint64, bool> pending;
+    QHash<quint64, bool> missing;
+    quint64 slotKeys[BACKGROUND_ATLAS_SIDE * BACKGROUND_ATLAS_SIDE];
+    qint64 slotUsed[BACKGROUND_ATLAS_SIDE * BACKGROUND_ATLAS_SIDE];
+    qint64 frame;
+
+    QVector4D window;
+    GLint windowSlots[BACKGROUND_GRID * BACKGROUND_GRID];
+};
+
+#endif // BACKGROUND_H
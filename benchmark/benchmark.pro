@@ -0,0 +1,46 @@
+# Headless renderer benchmark, see benchmark/main.cpp for usage.
+# Builds the renderer sources of the application with GL_DIAGNOSTICS
+# so per frame statistics (triangles, uploads) are available. They are
+# switched off at runtime while frames are timed, see main.cpp.
+QT += gui positioning sql
+CONFIG += console
+CONFIG -= app_bundle
+
+TARGET = gps_benchmark
+INCLUDEPATH += $$PWD/..
+DEPENDPATH += $$PWD/..
+
+DEFINES += HAVE_GL33 GL_DIAGNOSTICS
+win32:LIBS += -lopengl32
+
+SOURCES += main.cpp \
+    ../gpsoptions.cpp \
+    ../gpsprovider.cpp \
+    ../gpsrender.cpp \
+    ../graphics.cpp \
+    ../view.cpp \
+    ../pathing.cpp \
+    ../database.cpp \
+    ../shaderlibrary.cpp \
+    ../gldiagnostics.cpp \
+    ../gputimer.cpp \
+    ../terrain.cpp \
+    ../background.cpp \
+    ../snapshot.cpp
+
+HEADERS += \
+    ../gpsoptions.h \
+    ../gpsprovider.h \
+    ../gpsrender.h \
+    ../graphics.h \
+    ../view.h \
+    ../pathing.h \
+    ../database.h \
+    ../shaderlibrary.h \
+    ../gldiagnostics.h \
+    ../gputimer.h \
+    ../terrain.h \
+    ../background.h \
+    ../snapshot.h
+
+RESOURCES = ../application.qrc
@@ -0,0 +1,20 @@
+# GPS point store write benchmark, see benchmark/database/main.cpp for usage.
+QT += positioning sql
+QT -= gui
+CONFIG += console
+CONFIG -= app_bundle
+
+TARGET = gps_db_benchmark
+INCLUDEPATH += $$PWD/../..
+DEPENDPATH += $$PWD/../..
+
+# fsync/fdatasync are wrapped by the executable to count them, the symbols
+# must be visible to the SQLite driver plugin loaded at runtime
+linux: QMAKE_LFLAGS += -rdynamic
+linux: LIBS += -ldl
+
+SOURCES += main.cpp \
+    ../../database.cpp
+
+HEADERS += \
+    ../../database.h
@@ -0,0 +1,252 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QTextStream>
+#include <QThread>
+#include <QAtomicInteger>
+#include <QVector>
+#include <QPointF>
+#include "database.h"
+
+#ifdef Q_OS_LINUX
+#include <dlfcn.h>
+#include <unistd.h>
+#define BENCHMARK_COUNTS_SYNCS 1
+#endif
+
+/**
+ * Write benchmark for the GPS point store. Rows go through
+ * Database::insert_gps_coord like GPSProvider does, so batching follows
+ * the same group commit policy, then Database::flush() waits for the tail:
+ *
+ *      gps_db_benchmark --rows 200000 --sync normal --journal wal --commit-rows 64 /media/sdcard/bench.db
+ *
+ * Put the file on the storage being evaluated (an SD card mount for the
+ * cab units). Existing files with that name are removed. It prints the
+ * sustained rows per second, the number of transactions, the bytes per row
+ * on disk (database plus WAL) and, on Linux, fsync/fdatasync calls per row. The sync calls are counted by wrapping
+ * the libc functions in this executable, so they cover the whole process.
+ *
+ * --rate paces the producer (rows per second) to see how big the batches
+ * get at a realistic fix rate, 0 pushes rows as fast as possible.
+ * --commit-rows and --commit-ms set Database::set_commit_policy, the queue
+ * line shows how far the database thread fell behind the producer and the
+ * slowest insert_gps_coord call, which should stay in the microseconds.
+ *
+ * --storage picks rows, blocks or journal (DatabaseStorage), the reload
+ * line times streaming the session back. To compare the formats, run each
+ * on a track the size of scripts/output.csv and on a day long one at 1 Hz:
+ *
+ *      gps_db_benchmark --storage blocks --track scripts/output.csv --rows 10000 out.db
+ *      gps_db_benchmark --storage blocks --rows 86400 day.db
+ *
+ * --track replays the "Longitude, Latitude" csv (repeated up to --rows),
+ * without it the synthetic walk below is used.
+ */
+
+#ifdef BENCHMARK_COUNTS_SYNCS
+static QAtomicInteger<qint64> syncCalls(0);
+
+extern "C" int fsync(int fd){
+    typedef int (*sync_fn)(int);
+    static sync_fn real = reinterpret_cast<sync_fn>(dlsym(RTLD_NEXT, "fsync"));
+    syncCalls += 1;
+    return real(fd);
+}
+
+extern "C" int fdatasync(int fd){
+    typedef int (*sync_fn)(int);
+    static sync_fn real = reinterpret_cast<sync_fn>(dlsym(RTLD_NEXT, "fdatasync"));
+    syncCalls += 1;
+    return real(fd);
+}
+#endif
+
+static DatabaseSync parse_sync(QString value){
+    value = value.toLower();
+    if(value == "off") return DatabaseSyncOff;
+    if(value == "full") return DatabaseSyncFull;
+    return DatabaseSyncNormal;
+}
+
+/* Longitude, latitude pairs of a scripts/output.csv style file */
+static QVector<QPointF> read_track(const QString &path){
+    QVector<QPointF> track;
+    QFile file(path);
+    if(!file.open(QIODevice::ReadOnly | QIODevice::Text)) return track;
+
+    QTextStream in(&file);
+    while(!in.atEnd()){
+        QStringList fields = in.readLine().split(',');
+        bool lonOk = false, latOk = false;
+        if(fields.size() < 2) continue;
+        double lon = fields.at(0).trimmed().toDouble(&lonOk);
+        double lat = fields.at(1).trimmed().toDouble(&latOk);
+        if(lonOk && latOk) track.push_back(QPointF(lon, lat));
+    }
+
+    return track;
+}
+
+int main(int argc, char *argv[]){
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("gps_db_benchmark");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("GPS point store write benchmark");
+    parser.addHelpOption();
+    parser.addPositionalArgument("file", "Database file, created on the storage to test");
+    QCommandLineOption rowsOption("rows", "Rows inserted", "count", "100000");
+    QCommandLineOption rateOption("rate", "Rows per second, 0 for unpaced", "rows", "0");
+    QCommandLineOption syncOption("sync", "PRAGMA synchronous: off, normal or full", "mode", "normal");
+    QCommandLineOption journalOption("journal", "Journal mode: wal or delete", "mode", "wal");
+    QCommandLineOption sectionsOption("sections", "Sections per row mask", "count", "80");
+    QCommandLineOption commitRowsOption("commit-rows", "Rows waiting that trigger a commit, 0 for none",
+                                        "rows", QString::number(DATABASE_COMMIT_ROWS));
+    QCommandLineOption commitMsOption("commit-ms", "Milliseconds between commits, 0 for none",
+                                      "ms", QString::number(DATABASE_COMMIT_MS));
+    parser.addOption(rowsOption);
+    parser.addOption(rateOption);
+    parser.addOption(syncOption);
+    parser.addOption(journalOption);
+    parser.addOption(sectionsOption);
+    QCommandLineOption storageOption("storage", "Point storage: rows, blocks or journal", "format", "rows");
+    QCommandLineOption trackOption("track", "Longitude, latitude csv replayed instead of the synthetic walk", "file");
+    parser.addOption(commitRowsOption);
+    parser.addOption(commitMsOption);
+    parser.addOption(storageOption);
+    parser.addOption(trackOption);
+    parser.process(app);
+
+    if(parser.positionalArguments().isEmpty()){
+        parser.showHelp(1);
+    }
+
+    QString path = parser.positionalArguments().at(0);
+    int rows = qMax(1, parser.value(rowsOption).toInt());
+    int rate = qMax(0, parser.value(rateOption).toInt());
+    int sections = qBound(1, parser.value(sectionsOption).toInt(), 80);
+    bool wal = parser.value(journalOption).toLower() != "delete";
+    QString storageName = parser.value(storageOption).toLower();
+    DatabaseStorage storage = DatabaseStorageRows;
+    if(storageName == "blocks") storage = DatabaseStorageBlocks;
+    if(storageName == "journal") storage = DatabaseStorageJournal;
+    QVector<QPointF> track;
+    if(parser.isSet(trackOption)){
+        track = read_track(parser.value(trackOption));
+        if(track.isEmpty()){
+            qWarning("No points in %s", qPrintable(parser.value(trackOption)));
+            return 1;
+        }
+    }
+
+    QFile::remove(path);
+    QFile::remove(path + "-wal");
+    QFile::remove(path + "-shm");
+    QFile::remove(path + "-journal");
+    // the file is new so the benchmark session gets the first ID
+    QString journalPath = DBJournal::path_for(path, 1);
+    QFile::remove(journalPath);
+
+    Database::set_journal_wal(wal);
+    Database::set_synchronous(parse_sync(parser.value(syncOption)));
+    Database::set_commit_policy(parser.value(commitRowsOption).toInt(),
+                                parser.value(commitMsOption).toInt());
+    Database::set_storage(storage);
+    Database::init(path, true);
+
+    DBSession session;
+    session.name = "Benchmark";
+    session.samples = 1;
+    session.qdate = QDateTime::currentDateTime();
+    QStringList widths;
+    for(int i = 0; i < sections; i += 1) widths << "0.2";
+    session.segments = widths.join("|");
+    Database::open_session(session);
+
+#ifdef BENCHMARK_COUNTS_SYNCS
+    qint64 syncsBefore = syncCalls.load();
+#endif
+
+    QElapsedTimer timer;
+    timer.start();
+    qint64 slowestInsertNs = 0;
+    for(int i = 0; i < rows; i += 1){
+        DBGeoCoordinate coord;
+        if(!track.isEmpty()){
+            const QPointF &point = track.at(i % track.size());
+            coord.coord = QGeoCoordinate(point.y(), point.x());
+        }else{
+            // a slow walk, about 1 m between fixes
+            coord.coord = QGeoCoordinate(-23.5505 + i * 0.000009, -46.6333 + (i % 200) * 0.000001);
+        }
+        coord.segCount = sections;
+        memset(coord.applicationMaskEx, 0, sizeof(coord.applicationMaskEx));
+        for(int s = 0; s < sections; s += 1){
+            if((i / 50 + s) % 7 != 0){
+                coord.applicationMaskEx[s / 8] |= (1 << (s % 8));
+            }
+        }
+
+        qint64 before = timer.nsecsElapsed();
+        Database::insert_gps_coord(coord);
+        slowestInsertNs = qMax(slowestInsertNs, timer.nsecsElapsed() - before);
+
+        if(rate > 0){
+            qint64 due = static_cast<qint64>(i + 1) * 1000000000LL / rate;
+            qint64 ahead = due - timer.nsecsElapsed();
+            if(ahead > 0) QThread::usleep(static_cast<unsigned long>(ahead / 1000));
+        }
+    }
+
+    Database::flush();
+    double seconds = timer.nsecsElapsed() / 1000000000.0;
+
+    qint64 written = 0, batches = 0;
+    Database::get_write_stats(&written, &batches);
+    DBQueueStats queue;
+    Database::get_queue_stats(&queue);
+
+    QElapsedTimer reloadTimer;
+    reloadTimer.start();
+    qint64 reloaded = 0;
+    DBLoadStream *stream = Database::stream_all();
+    QVector<DBGeoCoordinate> chunk;
+    while(stream->take(&chunk)){
+        reloaded += chunk.size();
+    }
+    double reloadSeconds = reloadTimer.nsecsElapsed() / 1000000000.0;
+
+    QTextStream out(stdout);
+    out << "journal " << (wal ? "wal" : "delete") << ", synchronous "
+        << parser.value(syncOption).toLower() << ", storage " << storageName << "\n";
+    out << "rows " << written << " in " << QString::number(seconds, 'f', 3) << " s, "
+        << QString::number(written / seconds, 'f', 0) << " rows/s\n";
+    out << "transactions " << batches << ", "
+        << QString::number(batches > 0 ? static_cast<double>(written) / batches : 0.0, 'f', 1)
+        << " rows per transaction\n";
+    out << "queue high water " << queue.highWater << " rows, overflow " << queue.overflowRows
+        << " rows, slowest commit " << queue.maxCommitMs << " ms, slowest insert "
+        << QString::number(slowestInsertNs / 1000.0, 'f', 1) << " us\n";
+    qint64 fileBytes = QFileInfo(path).size() + QFileInfo(path + "-wal").size() +
+                       QFileInfo(journalPath).size();
+    out << "file " << fileBytes << " bytes, "
+        << QString::number(written > 0 ? static_cast<double>(fileBytes) / written : 0.0, 'f', 1)
+        << " bytes per row\n";
+    out << "reload " << reloaded << " rows in " << QString::number(reloadSeconds, 'f', 3) << " s, "
+        << QString::number(reloadSeconds > 0 ? reloaded / reloadSeconds : 0.0, 'f', 0) << " rows/s\n";
+#ifdef BENCHMARK_COUNTS_SYNCS
+    qint64 syncs = syncCalls.load() - syncsBefore;
+    out << "syncs " << syncs << ", "
+        << QString::number(written > 0 ? static_cast<double>(syncs) / written : 0.0, 'f', 4)
+        << " per row\n";
+#else
+    out << "syncs not counted on this platform\n";
+#endif
+    out.flush();
+
+    Database::finalize();
+    return written == rows && reloaded == rows ? 0 : 1;
+}
@@ -0,0 +1,224 @@
+#include <QGuiApplication>
+#include <QOffscreenSurface>
+#include <QOpenGLContext>
+#include <QOpenGLFramebufferObject>
+#include <QCommandLineParser>
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QTextStream>
+#include <QImage>
+#include "gpsrender.h"
+#include "gpsprovider.h"
+#include "gldiagnostics.h"
+
+#define BENCHMARK_ZOOM_LEVELS   5
+#define BENCHMARK_WARMUP_FRAMES 10
+
+/**
+ * Headless benchmark for the renderer. It renders into a framebuffer object
+ * on a QOffscreenSurface so it needs neither a display nor a GPU, running it
+ * with QT_QPA_PLATFORM=offscreen and LIBGL_ALWAYS_SOFTWARE=1 uses Mesa llvmpipe:
+ *
+ *      gps_benchmark --frames 200 --size 1280x720 track.csv
+ *
+ * The track is a text file with one 'latitude,longitude' per line, extra
+ * columns and lines that don't parse (headers) are ignored, so the files
+ * read by GPSFakeProvider and the ones under scripts/ can be used directly.
+ * Every fix goes through GPSProvider like the application does, without a
+ * database session, then the scene is rendered at each zoom level.
+ *
+ * For each level it prints the average/max CPU frame time (render() plus a
+ * glFinish), triangles, draw calls, uniform uploads and bytes uploaded per
+ * frame, and a SHA-1 of the last frame so image changes between renderer
+ * versions are visible.
+ * Frames are timed like a release build: the context is not a debug one and
+ * GLDiagnostics is disabled. The counters come from one more frame rendered
+ * after the timed ones with GLDiagnostics enabled, it is not timed.
+ *
+ * --compare-sections runs the sweep a second time with SECTION_LOOP, the path
+ * shader walking pData for every fragment as it did before the section lookup
+ * texture. The closest zoom levels are fill bound, so they give the fill-rate
+ * difference. Checksums may differ where a fragment lands on a section border,
+ * which the lookup rounds to one of its texels. Equal sections skip the lookup,
+ * --uneven alternates 0.2 m and 0.3 m ones so the fetch is what is measured.
+ *
+ * --terrain drapes the track on a DEM file, scripts/make_dem.py writes a
+ * synthetic one, --background draws an MBTiles file under it and
+ * scripts/make_mbtiles.py writes one around a coordinate of the track.
+ * Tiles stream in during the warm up frames.
+ */
+
+static int load_track(QString path, GPSProvider *provider){
+    QFile file(path);
+    if(!file.open(QFile::ReadOnly)){
+        qDebug() << "Could not open track " << path;
+        return -1;
+    }
+
+    int fixes = 0;
+    QTextStream stream(&file);
+    while(!stream.atEnd()){
+        QStringList fields = stream.readLine().split(",");
+        if(fields.size() < 2) continue;
+
+        bool latOk = false, lonOk = false;
+        double lat = fields.at(0).trimmed().toDouble(&latOk);
+        double lon = fields.at(1).trimmed().toDouble(&lonOk);
+        if(latOk && lonOk){
+            provider->populate(QGeoCoordinate(lat, lon));
+            fixes += 1;
+        }
+    }
+
+    return fixes;
+}
+
+int main(int argc, char *argv[]){
+    QGuiApplication app(argc, argv);
+    QCoreApplication::setApplicationName("gps_benchmark");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Offscreen renderer benchmark");
+    parser.addHelpOption();
+    parser.addPositionalArgument("track", "Recorded track, one 'latitude,longitude' per line");
+    QCommandLineOption framesOption("frames", "Frames rendered per zoom level", "count", "100");
+    QCommandLineOption sizeOption("size", "Framebuffer size", "WxH", "1280x720");
+    QCommandLineOption sectionsOption("sections", "Number of 0.2 m boom sections", "count", "80");
+    QCommandLineOption unevenOption("uneven", "Alternate 0.2 m and 0.3 m sections");
+    QCommandLineOption compareOption("compare-sections", "Run again walking pData per "
+                                     "fragment like the shader before the section lookup");
+    QCommandLineOption terrainOption("terrain", "DEM tile file to drape the track on", "file");
+    parser.addOption(framesOption);
+    parser.addOption(sizeOption);
+    parser.addOption(sectionsOption);
+    parser.addOption(unevenOption);
+    parser.addOption(compareOption);
+    QCommandLineOption backgroundOption("background", "MBTiles imagery drawn on the ground", "file");
+    parser.addOption(terrainOption);
+    parser.addOption(backgroundOption);
+    parser.process(app);
+
+    if(parser.positionalArguments().isEmpty()){
+        parser.showHelp(1);
+    }
+
+    int frames   = qMax(1, parser.value(framesOption).toInt());
+    int sections = qBound(1, parser.value(sectionsOption).toInt(), MAX_SEGMENTS);
+    QStringList size = parser.value(sizeOption).split("x");
+    int width  = size.size() == 2 ? size.at(0).toInt() : 1280;
+    int height = size.size() == 2 ? size.at(1).toInt() : 720;
+
+    QSurfaceFormat format;
+    format.setDepthBufferSize(16);
+    format.setStencilBufferSize(8);
+    if(QOpenGLContext::openGLModuleType() == QOpenGLContext::LibGL){
+        format.setVersion(3, 3);
+        format.setProfile(QSurfaceFormat::CompatibilityProfile);
+    }else{
+        format.setVersion(3, 0);
+    }
+
+    QOpenGLContext context;
+    context.setFormat(format);
+    QOffscreenSurface surface;
+    surface.setFormat(format);
+    surface.create();
+    if(!context.create() || !context.makeCurrent(&surface)){
+        qDebug() << "Failed to create an offscreen OpenGL context";
+        return 1;
+    }
+
+    QOpenGLFramebufferObjectFormat fboFormat;
+    fboFormat.setAttachment(QOpenGLFramebufferObject::CombinedDepthStencil);
+    QOpenGLFramebufferObject fbo(width, height, fboFormat);
+
+    QVector<float> segmentsLen(sections, 0.2f);
+    if(parser.isSet(unevenOption)){
+        for(int i = 1; i < sections; i += 2) segmentsLen[i] = 0.3f;
+    }
+    GPSOptions options(segmentsLen, 1);
+    options.terrainPath = parser.value(terrainOption);
+    options.backgroundPath = parser.value(backgroundOption);
+    Metrics::initialize(options);
+
+    uchar allOn[MAX_MASK_SEG];
+    memset(allOn, 0xFF, MAX_MASK_SEG);
+    Metrics::set_line_state(allOn);
+
+    GPSProvider provider;
+    QElapsedTimer replayTimer;
+    replayTimer.start();
+    int fixes = load_track(parser.positionalArguments().at(0), &provider);
+    if(fixes < 0) return 1;
+
+    QTextStream out(stdout);
+    out << "Replayed " << fixes << " fixes in " << replayTimer.elapsed() << " ms\n";
+
+    fbo.bind();
+    GLDiagnostics::set_enabled(false);
+    GPSRenderer renderer;
+    renderer.setViewportSize(QSize(width, height));
+    renderer.setViewportPoint(QPoint(0, 0));
+    renderer.setVisible(true);
+
+    QOpenGLFunctions *gl = context.functions();
+    int variants = parser.isSet(compareOption) ? 2 : 1;
+    for(int variant = 0; variant < variants; variant += 1){
+        // the second sweep finds path sections the way the shader did before the lookup
+        GPSOptions current = Metrics::get_gps_option();
+        current.sectionLoop = variant == 1;
+        Metrics::update_gps_options(current);
+        for(int i = 0; i < BENCHMARK_ZOOM_LEVELS; i += 1){
+            renderer.zoom_in(); // clamps at the closest level
+        }
+
+        out << (current.sectionLoop ? "Sections walking pData\n" : "Sections from the lookup\n");
+        out << "zoom  avg_ms   max_ms   triangles  draws  uniforms  upload_bytes  checksum\n";
+        for(int level = 0; level < BENCHMARK_ZOOM_LEVELS; level += 1){
+            for(int i = 0; i < BENCHMARK_WARMUP_FRAMES; i += 1){
+                renderer.render();
+            }
+            gl->glFinish();
+
+            double totalMs = 0.0, maxMs = 0.0;
+            QElapsedTimer timer;
+            for(int i = 0; i < frames; i += 1){
+                timer.start();
+                renderer.render();
+                gl->glFinish();
+                double ms = timer.nsecsElapsed() / 1000000.0;
+                totalMs += ms;
+                maxMs = qMax(maxMs, ms);
+            }
+
+            QImage image = fbo.toImage();
+            fbo.bind(); // toImage() may rebind
+
+            GLDiagnostics::set_enabled(true);
+            renderer.render();
+            gl->glFinish();
+            struct gl_frame_stats_t stats = GLDiagnostics::last_frame();
+            GLDiagnostics::set_enabled(false);
+
+            QByteArray checksum = QCryptographicHash::hash(
+                        QByteArray::fromRawData(reinterpret_cast<const char *>(image.constBits()),
+                                                image.sizeInBytes()),
+                        QCryptographicHash::Sha1).toHex();
+
+            out << qSetFieldWidth(4) << level << qSetFieldWidth(0) << "  "
+                << QString::number(totalMs / frames, 'f', 3) << "    "
+                << QString::number(maxMs, 'f', 3) << "    "
+                << stats.triangles << "  " << stats.drawCalls << "  "
+                << stats.uniformUploads << "  " << stats.uploadBytes << "  " << checksum << "\n";
+            out.flush();
+
+            renderer.zoom_out();
+        }
+    }
+
+    renderer.clear_shaders();
+    fbo.release();
+    context.doneCurrent();
+    return 0;
+}
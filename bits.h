@@ -12,7 +12,6 @@ public:
         return (value >> which) & 1U;
     }
 
-    //rev
     static int single_bit_is_setEx(unsigned char *value, int which){
         int index = which / 8;
         int num = which % 8;
@@ -24,7 +23,6 @@ public:
         return value;
     }
 
-    //rev
     static unsigned int single_bit_setEx(unsigned char* value, int which){
         int index = which / 8;
         int num = which % 8;
@@ -37,13 +35,25 @@ public:
         return value;
     }
 
-    //rev
     static unsigned int single_bit_clearEx(unsigned char* value, int which){
         int index = which / 8;
         int num = which % 8;
         value[index] &= ~(1U << num);
         return 0;
     }
+
+    static void mask_to_words(const unsigned char *mask, int bytes, unsigned int *words, int count){
+        for(int i = 0; i < count; ++i)
+            words[i] = 0;
+
+        for(int i = 0; i < bytes && i / 4 < count; ++i)
+            words[i / 4] |= (unsigned int)mask[i] << (8 * (i % 4));
+    }
+
+    static void words_to_mask(const unsigned int *words, int count, unsigned char *mask, int bytes){
+        for(int i = 0; i < bytes; ++i)
+            mask[i] = i / 4 < count ? (unsigned char)(words[i / 4] >> (8 * (i % 4))) : 0;
+    }
 };
 
 #endif // BITS_H
@@ -6,6 +6,7 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtx/string_cast.hpp>
 #include <QVector>
+#include <QAtomicInt>
 #include <vector>
 #include <QOpenGLFunctions>
 #include <QOpenGLExtraFunctions>
@@ -23,6 +24,15 @@
  */
 #define MAX_SEGMENTS               80
 #define MAX_MASK_SEG               10 //  = 80 / 8
+#define MAX_MASK_WORDS             4  // >= MAX_MASK_SEG / 4, one uvec4 in GLSL
+
+/**
+ * Amount of texels in the section lookup texture. The fragment shader
+ * maps the normalized position on the boom [0, 1] to a texel and reads
+ * the section index from it, so this only needs to be large enough that
+ * the smallest section spans a few texels.
+ */
+#define SECTION_LUT_SIZE           1024
 
 /**
  * This is only used for the path switching part of the renderer
@@ -81,6 +91,10 @@
  */
 extern std::vector<glm::vec4> controlPoints;
 extern GLfloat configSegments[MAX_SEGMENTS];
+extern GLubyte sectionLookup[SECTION_LUT_SIZE];
+/* Bumped with release order once sectionLookup is rebuilt, it is written on
+ * the provider thread and read by the renderer */
+extern QAtomicInt sectionLookupVersion;
 #define SCAST(type, val) static_cast<type>(val)
 #define DCAST(type, val) dynamic_cast<type>(val)
 #define Q3_MAKE_GLM3(val) glm::vec3((val).x(), (val).y(), (val).z())
@@ -289,11 +303,86 @@ inline QString print_binary_mask(unsigned char *mask,int segCount)
  * functions. A miss-configuration or invalid field might
  * generate a black screen and be very hard to debug.
  */
+/**
+ * Mask record for the path geometry, one per GPS fix stored in a container.
+ * Masks are integers so that bits can be tested directly in GLSL, bit 'i'
+ * lives in word i / 32 like the uchar masks. Records are uploaded into an
+ * integer texture (PATH_MASK_TEXTURE_WIDTH wide, 2 texels per record) and
+ * fetched by the vertex shader through path_vertex_t::mask.
+ */
+#define PATH_MASK_TEXTURE_WIDTH    1024
+
+struct path_mask_t{
+    glm::uvec4 hitMask;
+    glm::uvec4 appMask;
+};
+
+/**
+ * Path vertex. Triangles emitted for the same fix share their vertices,
+ * and consecutive fixes share the cross-section between them when their
+ * masks and elevation match, triangles are described by an index list.
+ *
+ * Positions are stored relative to the center of the container voxel in
+ * fixed point with PATH_POSITION_SCALE steps per meter. Containers are 160m
+ * across and a triangle may reach out of its container by about the boom
+ * length, at 1/128 m steps int16 covers +-256m from the center which leaves
+ * plenty of room. The elevation slot uses the same scale. Positions take 6
+ * bytes against the 12 of a glm::vec3, half, and a vertex 12 bytes.
+ */
+#define PATH_POSITION_SCALE        128.0f
+
+struct path_vertex_t{
+    GLshort x, z;
+    GLshort elevation;
+    GLshort segment;
+    GLuint mask; // index in the container mask table
+};
+
 struct geometry_simple_t{
-    std::vector<glm::vec3> *data;
-    std::vector<glm::mat3> *extraEx;//rev
-    GLuint vao, vbo[2];
+    std::vector<path_vertex_t> *data;
+    std::vector<GLuint> *indices;
+    std::vector<path_mask_t> *masks;
+    glm::vec2 origin; // container center, positions are relative to it
+    GLuint vao, vbo, ibo, maskTexture;
+    size_t vboCapacity, iboCapacity;
+    int maskRows;
+    bool reversed; // upload triangles newest first
+    size_t drawIndices; // only this many indices from the start of 'indices' are used
+    std::vector<GLuint> scratch;
+    bool is_binded;
+};
+
+/* Texture that maps normalized boom position into section index */
+struct section_lookup_t{
+    GLuint texture;
+    int version;
+    bool is_binded;
+};
+
+/**
+ * Mirrors the std140 layout of the FrameData uniform block declared in
+ * shaders/frame_data.glsl, anything changed here must be changed there.
+ * Every program gets this block bound at FRAME_DATA_BINDING and it is
+ * uploaded once per frame, so per draw we only touch the model matrix,
+ * colors and elevation.
+ */
+#define FRAME_DATA_BINDING         0
+
+struct frame_data_std140_t{
+    GLfloat projection[16];
+    GLfloat view[16];
+    GLfloat viewport[16];
+    GLint   zoomLevel;
+    GLint   segmentCount;
+    GLfloat segmentLength;
+    GLfloat padding;
+    GLfloat pData[MAX_SEGMENTS]; // vec4[MAX_SEGMENTS / 4]
+};
+
+struct frame_uniforms_t{
+    GLuint ubo;
     bool is_binded;
+    struct frame_data_std140_t data;
 };
 
 /* Representation of a geometry buffer needed to be render */
@@ -306,7 +395,6 @@ struct geometry_base_t{
     std::vector<glm::vec2> uvs;
     std::vector<ushort> triindices, quadindices;
     std::vector<glm::mat4> instancedModels;
-    std::vector<QMatrix4x4> qInstancedModels;
 
     QMatrix4x4 modelMatrix;
 
@@ -330,90 +418,41 @@ struct plane_t{
     glm::vec3 left, right;
 };
 
-struct plane_grid_t{
-    struct plane_t *plane;
-    int numLines, numCols;
-    int nCount;
-    float length;
-    Vec2 p0, p1, p2, p3;
-    Vec2 center;
-
-    void initialize_for(int count, float sideL,
-                        QVector3D qcenter = QVector3D(0.0f, 0.0f, 0.0f))
-    {
-        numLines = 2 * count + 1;
-        numCols  = 2 * count + 1;
-        nCount = count;
-        length = sideL;
-        float l2 = length/ 2.0f;
-        center.x = qcenter.x();
-        center.y = qcenter.y();
-        plane->geometry->qInstancedModels.clear();
-        p0 = Vec2Maths::add(center, Vec2{l2,  l2});
-        p1 = Vec2Maths::add(center, Vec2{-l2, -l2});
-        p2 = Vec2Maths::add(center, Vec2{-l2, l2});
-        p3 = Vec2Maths::add(center, Vec2{l2,  -l2});
-
-        for(int i = count; i >= -count; i -= 1){
-            for(int j = -count; j <= count; j += 1){
-                QMatrix4x4 model;
-                float dx = j * sideL;
-                float dz = i * sideL;
-                model.translate(qcenter.x() + dx,
-                                qcenter.y() + 0.0f,
-                                qcenter.z() + dz);
-                plane->geometry->qInstancedModels.push_back(model);
-            }
-        }
-    }
-
-    /**
-     * I swear to god I saw this thing miss-calculate once but I'm unnable
-     * to reproduce. Keep an eye out in case you have the feeling the object
-     * is not aligned with the planes. All tests I make with small planes
-     * gives perfect result, I have rewritten the four innequations multiple
-     * times, it should be:
-     *      1 - Px <= P3x or P0x
-     *      2 - Px >= P1x or P2x
-     *      3 - Pz >= P3y or P1y
-     *      4 - Pz <= P2y or P0y
-     * But the eyes don't lie ...
-     */
-    void update_if_needed(glm::vec3 point){
-        bool pxbeqp1x = Vec2Maths::float_beq(point.x, p1.x); // point.x >= p1.x
-        bool p2ybeqpy = Vec2Maths::float_beq(point.z, p3.y); // point.z >= p3.y
-        if(!(pxbeqp1x && p0.x > point.x && p2ybeqpy && p2.y > point.z)){
-            float x = hash_1D(point.x, length);
-            float z = hash_1D(point.z, length);
-            initialize_for(nCount, length,
-                           QVector3D(x, 0.0f, z));
-        }
-    }
-
-    int get_count(){
-        return numLines * numCols;
-    }
+/*
+ * Floor is drawn procedurally as a single fullscreen triangle, the grid is
+ * computed analytically by intersecting each pixel ray with the y = 0 plane
+ * so there is no per-tile state to keep around, only an empty VAO since
+ * core profiles refuse to draw without one.
+ */
+struct floor_t{
+    GLuint vao;
+    bool is_binded;
+};
 
-    QMatrix4x4 get_model(int i){
-        QMatrix4x4 model;
-        model.setToIdentity();
-        bool hasAny = plane->geometry->qInstancedModels.size();
-        if(i >= 0 && i < numLines * numCols && hasAny){
-            model = plane->geometry->qInstancedModels[i];
-        }
-        return model;
-    }
+/*
+ * Grid covering the terrain tile window in [0, 1], displaced in the vertex
+ * shader so it is built once and never updated.
+ */
+struct terrain_mesh_t{
+    GLuint vao, vbo, ebo;
+    GLsizei indexCount;
+    bool is_binded;
+};
 
-    QMatrix4x4 get_model(int i, int j){
-        QMatrix4x4 model;
-        model.setToIdentity();
-        bool hasAny = plane->geometry->qInstancedModels.size();
-        if(i >= 0 && j >= 0 && i < numLines && j < numCols && hasAny){
-            int idx = i * numCols + j;
-            model = plane->geometry->qInstancedModels[idx];
-        }
-        return model;
-    }
+/*
+ * Offscreen color target the path layer is drawn into when rendering at a
+ * reduced resolution, composited over the floor with a fullscreen triangle.
+ * Sizes are kept in multiples of COVERAGE_TARGET_ALIGN so small changes in
+ * the scale do not reallocate the attachments every frame.
+ */
+#define COVERAGE_TARGET_ALIGN 16
+struct coverage_target_t{
+    GLuint fbo;
+    GLuint color;
+    GLuint depthStencil;
+    GLuint vao;
+    int width, height;
+    bool is_binded;
 };
 
 /* Geometric target (arrow) */
@@ -430,6 +469,7 @@ struct target_t{
     qreal differentialDistance;
     glm::quat rotationQuaternion;
     int quaternionInited;
+    float groundHeight; // terrain below graphicalLocation, 0 without a DEM
 };
 
 struct OpenGLFunctions{
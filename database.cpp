@@ -4,38 +4,125 @@
 #include <QDateTime>
 #include <QMutex>
 #include <QByteArray>
+#include <QAtomicInteger>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <QFileInfo>
+#include <QDir>
+#include <QtMath>
+#include <cmath>
+#include <limits>
+
+#ifdef Q_OS_UNIX
+#include <unistd.h>
+#endif
 
 //#define DISABLE_LOAD
 
-#define DATBASE_BUFFER              1
 #define DATABASE_TIMESTAMP_FMT      "dd mm yyyy hh:mm:ss"
 
 /* Checks for existence of the table Location, inspect Sqlite3 master component and check for our table */
 static const char * SQL_EXISTS_RULE = "SELECT count(*) FROM sqlite_master WHERE type = \'table\' AND name = \'%1\';";
 
-/* Creates the standard table we are going to use, has an autoincrement ID */
-static const char * SQL_CREATE_DATA_RULE = "CREATE TABLE %1(ID INTEGER PRIMARY KEY AUTOINCREMENT, Latitude REAL, Longitude REAL,AppMaskEx TEXT);";
-
 static const char * SQL_CREATE_SESSION_RULE = "CREATE TABLE %1(ID INTEGER PRIMARY KEY AUTOINCREMENT, Segments TEXT, Samples INTEGER, Date TEXT, Name TEXT);";
 
+/*
+ * Points of every session. The primary key is the b-tree itself (WITHOUT
+ * ROWID) so the rows of a session are stored together in Seq order and
+ * reading one back is a single range scan. Time, ms since epoch, has its
+ * own index for queries across sessions.
+ */
+static const char * SQL_CREATE_POINTS_RULE = "CREATE TABLE IF NOT EXISTS %1(SessionID INTEGER NOT NULL, Seq INTEGER NOT NULL, Time INTEGER, Latitude REAL, Longitude REAL, AppMask BLOB, PRIMARY KEY (SessionID, Seq)) WITHOUT ROWID;";
+
+static const char * SQL_CREATE_POINTS_TIME_RULE = "CREATE INDEX IF NOT EXISTS %1Time ON %1(Time);";
+
+/* Points of DatabaseStorageBlocks sessions, Count points from FirstSeq on */
+static const char * SQL_CREATE_BLOCKS_RULE = "CREATE TABLE IF NOT EXISTS %1(SessionID INTEGER NOT NULL, FirstSeq INTEGER NOT NULL, Count INTEGER NOT NULL, Data BLOB, PRIMARY KEY (SessionID, FirstSeq)) WITHOUT ROWID;";
+
+/* The open block is written again on every commit until it is full */
+static const char * SQL_REPLACE_BLOCK_RULE = "INSERT OR REPLACE INTO %1 (SessionID, FirstSeq, Count, Data) VALUES (?, ?, ?, ?);";
+
+/* Blocks holding Seq %3 and after, a block never has more than DATABASE_BLOCK_POINTS */
+static const char * SQL_SELECT_BLOCKS_RULE = "SELECT FirstSeq, Count, Data FROM %1 WHERE SessionID = %2 AND FirstSeq > %3 ORDER BY FirstSeq;";
+
+static const char * SQL_COUNT_BLOCKS_RULE = "SELECT ifnull(sum(Count), 0) FROM %1 WHERE SessionID = %2;";
+
+static const char * SQL_LAST_BLOCK_RULE = "SELECT FirstSeq, Count, Data FROM %1 WHERE SessionID = %2 ORDER BY FirstSeq DESC LIMIT 1;";
+
+static const char * SQL_NEXT_BLOCK_SEQ_RULE = "SELECT max(FirstSeq + Count) FROM %1 WHERE SessionID = %2;";
+
+/* Needs SQLite built with SQLITE_ENABLE_RTREE, without it there is no coverage */
+static const char * SQL_CREATE_COVERAGE_RULE = "CREATE VIRTUAL TABLE IF NOT EXISTS %1 USING rtree(ID, MinLat, MaxLat, MinLon, MaxLon);";
+
+static const char * SQL_CREATE_COVERAGE_CELLS_RULE = "CREATE TABLE IF NOT EXISTS %1(ID INTEGER PRIMARY KEY, SessionID INTEGER NOT NULL, CellLat INTEGER NOT NULL, CellLon INTEGER NOT NULL, UNIQUE (SessionID, CellLat, CellLon));";
+
+static const char * SQL_SELECT_COVERAGE_CELL_RULE = "SELECT k.ID, c.MinLat, c.MaxLat, c.MinLon, c.MaxLon FROM %1 k LEFT JOIN %2 c ON c.ID = k.ID WHERE k.SessionID = %3 AND k.CellLat = %4 AND k.CellLon = %5;";
+
+static const char * SQL_INSERT_COVERAGE_CELL_RULE = "INSERT INTO %1 (SessionID, CellLat, CellLon) VALUES (%2, %3, %4);";
+
+static const char * SQL_REPLACE_COVERAGE_RULE = "INSERT OR REPLACE INTO %1 (ID, MinLat, MaxLat, MinLon, MaxLon) VALUES (?, ?, ?, ?, ?);";
+
+/* Sessions with a box overlapping the area, %3 to %6 are south, north, west and east */
+static const char * SQL_SELECT_SESSIONS_IN_RULE = "SELECT s.ID, s.Segments, s.Samples, s.Date, s.Name FROM %1 s WHERE s.ID IN (SELECT k.SessionID FROM %2 c JOIN %3 k ON k.ID = c.ID WHERE c.MaxLat >= %4 AND c.MinLat <= %5 AND c.MaxLon >= %6 AND c.MinLon <= %7) ORDER BY s.ID;";
+
 static const char * SQL_INSERT_SESSION_RULE = "INSERT INTO %1 (Segments, Samples, Date, Name) VALUES (\'%2\', %3, \'%4\', \'%5\');";
 
-static const char * SQL_SESSION_EXISTS_RULE = "SELECT count(*) FROM %1 WHERE Name = \'%2\';";
+static const char * SQL_SESSION_ID_RULE = "SELECT ID FROM %1 WHERE Name = \'%2\' ORDER BY ID LIMIT 1;";
 
 static const char * SQL_SELECT_ALL_RULE = "SELECT * from %1 ORDER BY ID;";
 
+/* Prepared once per session and executed with execBatch for every buffer */
+static const char * SQL_INSERT_DATA_RULE = "INSERT INTO %1 (SessionID, Seq, Time, Latitude, Longitude, AppMask) VALUES (?, ?, ?, ?, ?, ?);";
+
+static const char * SQL_SELECT_DATA_RULE = "SELECT Latitude, Longitude, AppMask, Time, Seq FROM %1 WHERE SessionID = %2 ORDER BY Seq;";
+
+static const char * SQL_SELECT_DATA_FROM_RULE = "SELECT Latitude, Longitude, AppMask, Time, Seq FROM %1 WHERE SessionID = %2 ORDER BY Seq LIMIT %3 OFFSET %4;";
+
+/* Seq %3 and after, a seek on the primary key where OFFSET walks every row it skips */
+static const char * SQL_SELECT_DATA_SEQ_RULE = "SELECT Latitude, Longitude, AppMask, Time, Seq FROM %1 WHERE SessionID = %2 AND Seq >= %3 ORDER BY Seq LIMIT %4;";
+
+static const char * SQL_LAST_DATA_RULE = "SELECT Latitude, Longitude FROM %1 WHERE SessionID = %2 ORDER BY Seq DESC LIMIT 1;";
+
+static const char * SQL_COUNT_DATA_RULE = "SELECT count(*) FROM %1 WHERE SessionID = %2;";
+
+static const char * SQL_LAST_SEQ_RULE = "SELECT max(Seq) FROM %1 WHERE SessionID = %2;";
+
+/* Migration of the table per session layout, see DATABASE_SCHEMA_VERSION */
+static const char * SQL_MIGRATE_BLOB_RULE = "INSERT INTO %1 (SessionID, Seq, Time, Latitude, Longitude, AppMask) SELECT %2, ID, NULL, Latitude, Longitude, AppMask FROM \"%3\";";
+
+static const char * SQL_SELECT_LEGACY_TEXT_RULE = "SELECT ID, Latitude, Longitude, AppMaskEx FROM \"%1\" ORDER BY ID;";
+
+/* Sessions created before masks were BLOBs have an AppMaskEx column instead */
+static const char * SQL_TEXT_MASKS_RULE = "SELECT count(*) FROM pragma_table_info('%1') WHERE name = 'AppMaskEx';";
+
+static const char * synchronousNames[] = { "OFF", "NORMAL", "FULL" };
+
 QString Database::DATABASE_NAME("database.db");
 QThread *Database::managerThread = nullptr;
 AssyncManager *Database::aManager = nullptr;
-AssyncReceiver *Database::aReceiver = nullptr;
+DBLoadStream Database::loadStream;
 
-static QVector<DBGeoCoordinate> sector0;
-static QVector<DBGeoCoordinate> sector1;
+static DBRingBuffer ring;
+static QQueue<DBGeoCoordinate> overflow; // provider side, rows that found the ring full
 static bool mInited = false;
 static QSqlDatabase mDatabase;
 static bool mOk = false;
 static QMutex *dbMutex = nullptr;
-static bool managerBusy = false;
+static bool mJournalWAL = true;
+static int mSynchronous = DatabaseSyncNormal;
+static QAtomicInteger<qint64> mRowsWritten(0);
+static QAtomicInteger<qint64> mBatchesWritten(0);
+static QAtomicInteger<qint64> mQueueHighWater(0);
+static QAtomicInteger<qint64> mOverflowRows(0);
+static QAtomicInteger<qint64> mOverflowQueued(0);
+static QAtomicInteger<qint64> mMaxCommitMs(0);
+static QAtomicInt mDrainPosted(0);
+static int mCommitRows = DATABASE_COMMIT_ROWS;
+static int mCommitMs = DATABASE_COMMIT_MS;
+static int mStorage = DatabaseStorageRows;
+static bool mCoverageOk = false;
+
+static void migrate_sessions();
 
 static QSqlQuery internal_exec_query(QString str_query){
     QSqlQuery query;
@@ -65,6 +152,18 @@ static void init_manager(QString path, bool initIfNone, QString sessionTable){
             mDatabase.setDatabaseName(path);
             mOk = mDatabase.open();
 
+            /*
+             * WAL appends commits to a log instead of rewriting pages through a
+             * rollback journal, on flash storage this turns several syncs per
+             * transaction into (with NORMAL) none until a checkpoint.
+             */
+            if(mOk){
+                QString journal = mJournalWAL ? "WAL" : "DELETE";
+                Q_UNUSED(internal_exec_query(QString("PRAGMA journal_mode = %1;").arg(journal)));
+                Q_UNUSED(internal_exec_query(QString("PRAGMA synchronous = %1;")
+                                             .arg(synchronousNames[mSynchronous])));
+            }
+
             if(initIfNone){
                 QString rule(SQL_EXISTS_RULE);
                 QString str_query = rule.arg(sessionTable);
@@ -81,6 +180,20 @@ static void init_manager(QString path, bool initIfNone, QString sessionTable){
                 }
             }
 
+            if(mOk){
+                Q_UNUSED(internal_exec_query(QString(SQL_CREATE_POINTS_RULE).arg(DATABASE_POINTS_TABLE)));
+                Q_UNUSED(internal_exec_query(QString(SQL_CREATE_POINTS_TIME_RULE).arg(DATABASE_POINTS_TABLE)));
+                Q_UNUSED(internal_exec_query(QString(SQL_CREATE_BLOCKS_RULE).arg(DATABASE_BLOCKS_TABLE)));
+
+                QSqlQuery coverage(mDatabase);
+                mCoverageOk = coverage.exec(QString(SQL_CREATE_COVERAGE_RULE).arg(DATABASE_COVERAGE_TABLE)) &&
+                              coverage.exec(QString(SQL_CREATE_COVERAGE_CELLS_RULE).arg(DATABASE_COVERAGE_CELLS_TABLE));
+                if(!mCoverageOk){
+                    qDebug() << "No coverage index " << coverage.lastError().text();
+                }
+                migrate_sessions();
+            }
+
             mInited = true;
             qDebug() << "Database initialized";
         }
@@ -93,61 +206,530 @@ static void init_manager(QString path, bool initIfNone, QString sessionTable){
 
 void AssyncManager::initialize(QString path, bool initIfNone){
     init_manager(path, initIfNone, DATABASE_SESSIONS_TABLE);
+
+    // latency side of the commit policy, the size side is posted by the producer
+    if(!commitTimer && mCommitMs > 0){
+        commitTimer = new QTimer(this);
+        QObject::connect(commitTimer, SIGNAL(timeout()), this, SLOT(drain()));
+        commitTimer->start(mCommitMs);
+    }
 }
 
-QString mask2string(unsigned char *mask,int segCount)
+/* Old text format, one '0'/'1' per section. Only read when migrating sessions that have it */
+int string2mask(QString str,unsigned char *mask)
 {
-    unsigned char maskEx[100]="";
-    for(int i = 0 ; i < segCount ; ++i)
-    {
-        int index = i / 8;
-        int num = i % 8;
-        maskEx[i] = (mask[index] >> num) & 1U ;
+    int segCount = qMin(str.size(), DATABASE_MASK_BYTES * 8);
+    memset(mask, 0, DATABASE_MASK_BYTES);
+    for(int i = 0; i < segCount; i += 1){
+        if(str.at(i) == QChar('1')){
+            mask[i / 8] |= static_cast<unsigned char>(1U << (i % 8));
+        }
     }
 
-    QString str="";
-    for(int i = 0; i < segCount ; i++ )
-        str += QString::number( maskEx[i]);
+    return segCount;
+}
 
-    return str;
+static void reset_mask_state(struct DBMaskState *state){
+    memset(state->mask, 0, DATABASE_MASK_BYTES);
+    state->segCount = 0;
+    state->sinceKeyframe = 0;
+    state->valid = false;
 }
-//rev
-int string2mask(QString str,unsigned char *mask)
+
+/*
+ * Picks the smallest encoding of @mask against the previous row, see
+ * DatabaseMaskEncoding. Rows usually share their mask with the previous one
+ * so most of them take a single byte.
+ */
+static QByteArray encode_mask(const unsigned char *mask, int segCount,
+                              struct DBMaskState *state)
 {
-    for(int i = 0; i < str.size() ; i++ )
-        mask[i] = (unsigned char)QString(str.at(i)).toUInt();
+    int bytes = (qBound(0, segCount, DATABASE_MASK_BYTES * 8) + 7) / 8;
+    QByteArray blob;
+    bool delta = state->valid && state->segCount == segCount &&
+                 state->sinceKeyframe < DATABASE_MASK_KEYFRAME;
+
+    if(delta){
+        QByteArray changes;
+        for(int i = 0; i < bytes; i += 1){
+            unsigned char x = mask[i] ^ state->mask[i];
+            if(x){
+                changes.append(static_cast<char>(i));
+                changes.append(static_cast<char>(x));
+            }
+        }
 
-    return str.size();
+        if(changes.isEmpty()){
+            blob.append(static_cast<char>(MaskSame));
+        }else if(changes.size() < bytes + 1){
+            blob.append(static_cast<char>(MaskXor));
+            blob.append(changes);
+        }
+        state->sinceKeyframe += 1;
+    }
+
+    if(blob.isEmpty()){
+        blob.append(static_cast<char>(MaskRaw));
+        blob.append(static_cast<char>(segCount));
+        blob.append(reinterpret_cast<const char *>(mask), bytes);
+        state->sinceKeyframe = 0;
+    }
+
+    memset(state->mask, 0, DATABASE_MASK_BYTES);
+    memcpy(state->mask, mask, bytes);
+    state->segCount = segCount;
+    state->valid = true;
+    return blob;
 }
 
+/*
+ * Inverse of encode_mask, rows must be decoded in ID order. A delta with no
+ * row before it (a damaged file) decodes against an empty mask.
+ */
+static bool decode_mask(const QByteArray &blob, unsigned char *mask, int *segCount,
+                        struct DBMaskState *state)
+{
+    if(blob.isEmpty()) return false;
+
+    const unsigned char *data = reinterpret_cast<const unsigned char *>(blob.constData());
+    int size = blob.size();
+    switch(data[0]){
+    case MaskRaw:{
+        if(size < 2) return false;
+        int count = qMin(static_cast<int>(data[1]), DATABASE_MASK_BYTES * 8);
+        memset(state->mask, 0, DATABASE_MASK_BYTES);
+        memcpy(state->mask, data + 2, qMin(size - 2, (count + 7) / 8));
+        state->segCount = count;
+        state->valid = true;
+    } break;
+    case MaskSame:
+        break;
+    case MaskXor:
+        for(int i = 1; i + 1 < size; i += 2){
+            if(data[i] < DATABASE_MASK_BYTES){
+                state->mask[data[i]] ^= data[i + 1];
+            }
+        }
+        break;
+    default:
+        return false;
+    }
+
+    if(!state->valid){
+        qDebug() << "Mask delta without a previous row";
+        state->valid = true;
+    }
+
+    memcpy(mask, state->mask, DATABASE_MASK_BYTES);
+    *segCount = state->segCount;
+    return true;
+}
+
+static void put_varint(QByteArray *out, quint64 value){
+    while(value >= 0x80){
+        out->append(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out->append(static_cast<char>(value));
+}
+
+static quint64 zigzag(qint64 value){
+    return (static_cast<quint64>(value) << 1) ^ static_cast<quint64>(value >> 63);
+}
+
+static qint64 unzigzag(quint64 value){
+    return static_cast<qint64>(value >> 1) ^ -static_cast<qint64>(value & 1);
+}
+
+static qint64 to_fixed(double degrees){
+    return qRound64(degrees * DATABASE_BLOCK_SCALE);
+}
+
+/* Reads a varint at *@offset of @data, false if it runs past @size */
+static bool get_varint(const unsigned char *data, int size, int *offset, quint64 *value){
+    *value = 0;
+    for(int shift = 0; shift < 64 && *offset < size; shift += 7){
+        unsigned char byte = data[*offset];
+        *offset += 1;
+        *value |= static_cast<quint64>(byte & 0x7f) << shift;
+        if(!(byte & 0x80)) return true;
+    }
+
+    return false;
+}
+
+static void reset_block(struct DBBlockState *block, qint64 firstSeq){
+    block->firstSeq = firstSeq;
+    block->count = 0;
+    block->data.clear();
+    block->latitude = 0;
+    block->longitude = 0;
+    block->time = 0;
+    reset_mask_state(&block->mask);
+}
+
+/* Appends @coord to @block, see DatabaseStorageBlocks */
+static void block_append(struct DBBlockState *block, const DBGeoCoordinate &coord){
+    qint64 latitude = to_fixed(coord.coord.latitude());
+    qint64 longitude = to_fixed(coord.coord.longitude());
+    QByteArray mask = encode_mask(coord.applicationMaskEx, coord.segCount, &block->mask);
+
+    put_varint(&block->data, zigzag(latitude - block->latitude));
+    put_varint(&block->data, zigzag(longitude - block->longitude));
+    put_varint(&block->data, zigzag(coord.time - block->time));
+    put_varint(&block->data, static_cast<quint64>(mask.size()));
+    block->data.append(mask);
+
+    block->latitude = latitude;
+    block->longitude = longitude;
+    block->time = coord.time;
+    block->count += 1;
+}
+
+/* Decodes the @count points of a block into @out, false if it is damaged */
+static bool decode_block(const QByteArray &blob, int count, QVector<DBGeoCoordinate> *out){
+    const unsigned char *data = reinterpret_cast<const unsigned char *>(blob.constData());
+    int size = blob.size();
+    int offset = 0;
+    qint64 latitude = 0, longitude = 0, time = 0;
+    struct DBMaskState state;
+    reset_mask_state(&state);
+
+    for(int i = 0; i < count; i += 1){
+        quint64 dLat, dLon, dTime, maskSize;
+        if(!get_varint(data, size, &offset, &dLat) ||
+           !get_varint(data, size, &offset, &dLon) ||
+           !get_varint(data, size, &offset, &dTime) ||
+           !get_varint(data, size, &offset, &maskSize) ||
+           maskSize > static_cast<quint64>(size - offset))
+        {
+            return false;
+        }
+
+        latitude += unzigzag(dLat);
+        longitude += unzigzag(dLon);
+        time += unzigzag(dTime);
+
+        DBGeoCoordinate coord;
+        QByteArray mask = QByteArray::fromRawData(reinterpret_cast<const char *>(data + offset),
+                                                  static_cast<int>(maskSize));
+        offset += static_cast<int>(maskSize);
+        if(!decode_mask(mask, coord.applicationMaskEx, &coord.segCount, &state)) return false;
+
+        coord.coord = QGeoCoordinate(latitude / DATABASE_BLOCK_SCALE,
+                                     longitude / DATABASE_BLOCK_SCALE);
+        coord.time = time;
+        coord.seq = -1;
+        out->push_back(coord);
+    }
+
+    return true;
+}
+
+/*
+ * Copies a session recorded with text masks into DATABASE_POINTS_TABLE,
+ * encoding its masks on the way.
+ */
+static bool migrate_text_session(qint64 sessionId, const QString &table){
+    QSqlQuery rows(mDatabase);
+    rows.setForwardOnly(true);
+    if(!rows.exec(QString(SQL_SELECT_LEGACY_TEXT_RULE).arg(table))) return false;
+
+    QVariantList ids, seqs, times, lats, lons, masks;
+    struct DBMaskState state;
+    reset_mask_state(&state);
+    while(rows.next()){
+        unsigned char mask[DATABASE_MASK_BYTES];
+        int segCount = string2mask(rows.value(3).toString(), mask);
+        ids.push_back(sessionId);
+        seqs.push_back(rows.value(0));
+        times.push_back(QVariant(QVariant::LongLong));
+        lats.push_back(rows.value(1));
+        lons.push_back(rows.value(2));
+        masks.push_back(encode_mask(mask, segCount, &state));
+    }
+    rows.finish();
+
+    if(ids.isEmpty()) return true;
+
+    QSqlQuery insert(mDatabase);
+    if(!insert.prepare(QString(SQL_INSERT_DATA_RULE).arg(DATABASE_POINTS_TABLE))) return false;
+    insert.addBindValue(ids);
+    insert.addBindValue(seqs);
+    insert.addBindValue(times);
+    insert.addBindValue(lats);
+    insert.addBindValue(lons);
+    insert.addBindValue(masks);
+    bool ok = insert.execBatch();
+    insert.finish();
+    return ok;
+}
+
+/*
+ * Moves the sessions of a version 0 file, one table per session, into
+ * DATABASE_POINTS_TABLE. The old IDs become Seq so the mask deltas keep
+ * their order. Each session is copied and dropped in one transaction, an
+ * interrupted migration continues with the remaining tables next time.
+ */
+static void migrate_sessions(){
+    QSqlQuery query = internal_exec_query("PRAGMA user_version;");
+    bool current = query.next() && query.value(0).toInt() >= DATABASE_SCHEMA_VERSION;
+    query.finish();
+    if(current) return;
+
+    QVector<QPair<qint64, QString>> sessions;
+    query = internal_exec_query(QString(SQL_SELECT_ALL_RULE).arg(DATABASE_SESSIONS_TABLE));
+    while(query.next()){
+        sessions.push_back(qMakePair(query.value(0).toLongLong(), query.value(4).toString()));
+    }
+    query.finish();
+
+    for(const QPair<qint64, QString> &session : sessions){
+        query = internal_exec_query(QString(SQL_EXISTS_RULE).arg(session.second));
+        bool exists = query.next() && query.value(0).toInt() > 0;
+        query.finish();
+        if(!exists) continue;
+
+        query = internal_exec_query(QString(SQL_TEXT_MASKS_RULE).arg(session.second));
+        bool textMasks = query.next() && query.value(0).toInt() > 0;
+        query.finish();
+
+        QElapsedTimer timer;
+        timer.start();
+        bool ok = mDatabase.transaction();
+        if(textMasks){
+            ok = ok && migrate_text_session(session.first, session.second);
+        }else{
+            QSqlQuery copy(mDatabase);
+            ok = ok && copy.exec(QString(SQL_MIGRATE_BLOB_RULE).arg(DATABASE_POINTS_TABLE)
+                                 .arg(session.first).arg(session.second));
+        }
+
+        QSqlQuery drop(mDatabase);
+        ok = ok && drop.exec(QString("DROP TABLE \"%1\";").arg(session.second));
+        ok = ok && mDatabase.commit();
+        if(!ok){
+            qDebug() << "Failed to migrate session " << session.second << " "
+                     << mDatabase.lastError().text();
+            mDatabase.rollback();
+            return; // stays at the old version, retried on the next start
+        }
+
+        qDebug() << "Migrated session" << session.second << "in" << timer.elapsed() << "ms";
+    }
+
+    Q_UNUSED(internal_exec_query(QString("PRAGMA user_version = %1;").arg(DATABASE_SCHEMA_VERSION)));
+}
+
+/*
+ * Writes @buffer as one transaction, a commit (and whatever sync the journal
+ * mode needs) per buffer instead of per row. The coverage boxes go in the
+ * same transaction, for a journal session in one of their own.
+ */
 void AssyncManager::insert(QVector<DBGeoCoordinate> *buffer){
     if(opened){
         QMutexLocker locker(dbMutex);
-        QString str_query("INSERT INTO ");
-        str_query += QString(DATABASE_TABLE) + QString("(Latitude, Longitude,AppMaskEx) VALUES ");
-        for(int i = 0; i < buffer->size(); i += 1){
-            DBGeoCoordinate coords = buffer->at(i);
-            QString lat  = QString::number(coords.coord.latitude(), 'f', 9);
-            QString lon  = QString::number(coords.coord.longitude(), 'f', 9);
-            QString maskEx = mask2string(coords.applicationMaskEx,coords.segCount);//rev
-
-            str_query += QString("(") + lat + QString(",") +
-                         lon + /*QString(",") + mask +*/ QString(",'") + maskEx +QString("')");
-            if(i < buffer->size() - 1){
-                str_query += QString(", ");
+        QElapsedTimer timer;
+        timer.start();
+        struct DBBlockState savedBlock = block;
+        bool ok = false;
+        if(storage == DatabaseStorageJournal){
+            ok = write_journal(buffer);
+            if(ok && !(mDatabase.transaction() && write_coverage(buffer) && mDatabase.commit())){
+                qDebug() << "Failed to update coverage " << mDatabase.lastError().text();
+                mDatabase.rollback();
+                coverage.clear();
+            }
+        }else{
+            ok = mDatabase.transaction();
+            if(storage == DatabaseStorageBlocks){
+                ok = ok && write_blocks(buffer);
             }else{
-                str_query += QString(";");
+                ok = ok && write_rows(buffer);
+            }
+            ok = ok && write_coverage(buffer);
+            ok = ok && mDatabase.commit();
+            if(!ok){
+                mDatabase.rollback();
+                block = savedBlock;
+                reset_mask_state(&encoderState); // the next row can't be a delta of lost ones
+                coverage.clear(); // read back from the file when touched again
             }
         }
 
-        internal_exec_query(str_query);
+        if(ok){
+            nextSeq += buffer->size();
+            mRowsWritten += buffer->size();
+            mBatchesWritten += 1;
+            qint64 ms = timer.elapsed();
+            if(ms > mMaxCommitMs.load()) mMaxCommitMs.store(ms);
+        }else{
+            qDebug() << "Failed to insert " << buffer->size() << " rows "
+                     << mDatabase.lastError().text();
+        }
 
         buffer->clear();
     }else{
         qDebug() << "Requested insertion without session opened";
+        buffer->clear();
+    }
+}
+
+/* DatabaseStorageRows, one row per coordinate through the prepared insert */
+bool AssyncManager::write_rows(QVector<DBGeoCoordinate> *buffer){
+    QVariantList ids, seqs, times, lats, lons, masks;
+    ids.reserve(buffer->size());
+    seqs.reserve(buffer->size());
+    times.reserve(buffer->size());
+    lats.reserve(buffer->size());
+    lons.reserve(buffer->size());
+    masks.reserve(buffer->size());
+    for(int i = 0; i < buffer->size(); i += 1){
+        DBGeoCoordinate coords = buffer->at(i);
+        ids.push_back(sessionId);
+        seqs.push_back(nextSeq + i);
+        times.push_back(coords.time);
+        lats.push_back(coords.coord.latitude());
+        lons.push_back(coords.coord.longitude());
+        masks.push_back(encode_mask(coords.applicationMaskEx, coords.segCount,
+                                    &encoderState));
     }
 
-    emit done();
+    insertQuery.addBindValue(ids);
+    insertQuery.addBindValue(seqs);
+    insertQuery.addBindValue(times);
+    insertQuery.addBindValue(lats);
+    insertQuery.addBindValue(lons);
+    insertQuery.addBindValue(masks);
+    if(!insertQuery.execBatch()){
+        qDebug() << "Failed to write rows " << insertQuery.lastError().text();
+        return false;
+    }
+
+    return true;
+}
+
+/* DatabaseStorageBlocks, appends to the open block and writes every block touched */
+bool AssyncManager::write_blocks(QVector<DBGeoCoordinate> *buffer){
+    bool ok = true;
+    for(int i = 0; ok && i < buffer->size(); i += 1){
+        block_append(&block, buffer->at(i));
+        if(block.count == DATABASE_BLOCK_POINTS){
+            ok = write_block();
+            reset_block(&block, block.firstSeq + block.count);
+        }
+    }
+
+    if(ok && block.count > 0) ok = write_block();
+    return ok;
+}
+
+/* Box of cell (@cellLat, @cellLon) for the open session, created on first use */
+struct DBCoverageCell * AssyncManager::coverage_cell(qint64 cellLat, qint64 cellLon){
+    quint64 key = (static_cast<quint64>(static_cast<quint32>(cellLat)) << 32) |
+                  static_cast<quint32>(cellLon);
+    QHash<quint64, struct DBCoverageCell>::iterator it = coverage.find(key);
+    if(it != coverage.end()) return &it.value();
+
+    struct DBCoverageCell cell;
+    cell.minLat = cell.minLon = std::numeric_limits<double>::max();
+    cell.maxLat = cell.maxLon = -std::numeric_limits<double>::max();
+    cell.dirty = false;
+
+    QSqlQuery query = internal_exec_query(QString(SQL_SELECT_COVERAGE_CELL_RULE)
+                                          .arg(DATABASE_COVERAGE_CELLS_TABLE).arg(DATABASE_COVERAGE_TABLE)
+                                          .arg(sessionId).arg(cellLat).arg(cellLon));
+    if(query.next()){ // a previous run of this session worked here
+        cell.id = query.value(0).toLongLong();
+        if(!query.value(1).isNull()){
+            cell.minLat = query.value(1).toDouble();
+            cell.maxLat = query.value(2).toDouble();
+            cell.minLon = query.value(3).toDouble();
+            cell.maxLon = query.value(4).toDouble();
+        }
+    }else{
+        query = internal_exec_query(QString(SQL_INSERT_COVERAGE_CELL_RULE)
+                                    .arg(DATABASE_COVERAGE_CELLS_TABLE)
+                                    .arg(sessionId).arg(cellLat).arg(cellLon));
+        QVariant id = query.lastInsertId();
+        if(!id.isValid()) return nullptr;
+        cell.id = id.toLongLong();
+    }
+
+    return &coverage.insert(key, cell).value();
+}
+
+/*
+ * Widens the boxes of the cells @buffer falls in by the swath of every fix
+ * and writes the ones that changed.
+ */
+bool AssyncManager::write_coverage(QVector<DBGeoCoordinate> *buffer){
+    if(!mCoverageOk) return true;
+
+    for(int i = 0; i < buffer->size(); i += 1){
+        double lat = buffer->at(i).coord.latitude();
+        double lon = buffer->at(i).coord.longitude();
+        struct DBCoverageCell *cell = coverage_cell(static_cast<qint64>(std::floor(lat / DATABASE_COVERAGE_CELL)),
+                                                    static_cast<qint64>(std::floor(lon / DATABASE_COVERAGE_CELL)));
+        if(!cell) return false;
+
+        double dLat = swathHalfWidth / 111320.0;
+        double dLon = dLat / qMax(std::cos(qDegreesToRadians(lat)), 0.01);
+        cell->minLat = qMin(cell->minLat, lat - dLat);
+        cell->maxLat = qMax(cell->maxLat, lat + dLat);
+        cell->minLon = qMin(cell->minLon, lon - dLon);
+        cell->maxLon = qMax(cell->maxLon, lon + dLon);
+        cell->dirty = true;
+    }
+
+    for(QHash<quint64, struct DBCoverageCell>::iterator it = coverage.begin(); it != coverage.end(); ++it){
+        struct DBCoverageCell *cell = &it.value();
+        if(!cell->dirty) continue;
+
+        cell->dirty = false;
+        coverageQuery.addBindValue(cell->id);
+        coverageQuery.addBindValue(cell->minLat);
+        coverageQuery.addBindValue(cell->maxLat);
+        coverageQuery.addBindValue(cell->minLon);
+        coverageQuery.addBindValue(cell->maxLon);
+        if(!coverageQuery.exec()){
+            qDebug() << "Failed to write coverage " << coverageQuery.lastError().text();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* DatabaseStorageJournal, the batch is a single append to the session file */
+bool AssyncManager::write_journal(QVector<DBGeoCoordinate> *buffer){
+    return journal.append(*buffer);
+}
+
+/* Makes everything appended to the journal durable, see Database::flush */
+void AssyncManager::sync(){
+    if(journal.is_open()) journal.sync();
+}
+
+bool AssyncManager::write_block(){
+    insertQuery.addBindValue(sessionId);
+    insertQuery.addBindValue(block.firstSeq);
+    insertQuery.addBindValue(block.count);
+    insertQuery.addBindValue(block.data);
+    if(!insertQuery.exec()){
+        qDebug() << "Failed to write block " << insertQuery.lastError().text();
+        return false;
+    }
+
+    return true;
+}
+
+void AssyncManager::drain(){
+    // cleared before popping so rows pushed from now on post a new drain
+    mDrainPosted.store(0);
+    while(ring.pop(&batch, DATABASE_RING_CAPACITY) > 0){
+        insert(&batch);
+    }
 }
 
 void AssyncManager::get_sessions(QVector<DBSession> *buffer){
@@ -167,111 +749,769 @@ void AssyncManager::get_sessions(QVector<DBSession> *buffer){
     }
 }
 
+/* Sessions whose coverage overlaps @area, a box is in degrees so it must not cross 180 */
+void AssyncManager::get_sessions_in(QGeoRectangle area, QVector<DBSession> *buffer){
+    if(buffer && mCoverageOk){
+        QMutexLocker locker(dbMutex);
+        QString str_query = QString(SQL_SELECT_SESSIONS_IN_RULE).arg(DATABASE_SESSIONS_TABLE)
+                            .arg(DATABASE_COVERAGE_TABLE).arg(DATABASE_COVERAGE_CELLS_TABLE)
+                            .arg(area.bottomLeft().latitude(), 0, 'f', 8)
+                            .arg(area.topRight().latitude(), 0, 'f', 8)
+                            .arg(area.bottomLeft().longitude(), 0, 'f', 8)
+                            .arg(area.topRight().longitude(), 0, 'f', 8);
+        QSqlQuery query = internal_exec_query(str_query);
+        while(query.next()){
+            DBSession session;
+            session.segments          = query.value(1).toString();
+            session.samples           = query.value(2).toInt();
+            session.qdate             = query.value(3).toDateTime();
+            session.name              = query.value(4).toString();
+            buffer->push_back(session);
+        }
+    }
+}
+
 void AssyncManager::start_session(DBSession session, int *exists){
     QMutexLocker locker(dbMutex);
-    bool create = true;
-    QString str_query(SQL_SESSION_EXISTS_RULE);
+    QString str_query(SQL_SESSION_ID_RULE);
     str_query = str_query.arg(DATABASE_SESSIONS_TABLE).arg(session.name);
     QSqlQuery query = internal_exec_query(str_query);
     *exists = 0;
-    DATABASE_TABLE = session.name;
+    sessionId = 0;
     if(query.next()){ // this session already exists just get a handle to it
-        int r = query.value(0).toInt();
-        if(r != 0){
-            *exists = 1;
-            create = false;
-        }
-    }
-
-    if(create){
-        str_query = QString(SQL_CREATE_DATA_RULE);
-        str_query = str_query.arg(session.name);
-        Q_UNUSED(internal_exec_query(str_query));
-
+        sessionId = query.value(0).toLongLong();
+        *exists = 1;
+    }else{
         str_query = QString(SQL_INSERT_SESSION_RULE);
         QString date = session.qdate.toString(DATABASE_TIMESTAMP_FMT);
         str_query = str_query.arg(DATABASE_SESSIONS_TABLE).arg(session.segments)
                     .arg(session.samples).arg(date).arg(session.name);
-        Q_UNUSED(internal_exec_query(str_query));
+        query = internal_exec_query(str_query);
+        sessionId = query.lastInsertId().toLongLong();
+    }
+
+    // a session recorded in one format stays in it
+    nextSeq = 0;
+    storage = mStorage;
+    if(*exists){
+        str_query = QString(SQL_NEXT_BLOCK_SEQ_RULE).arg(DATABASE_BLOCKS_TABLE).arg(sessionId);
+        query = internal_exec_query(str_query);
+        if(query.next() && !query.value(0).isNull()){
+            nextSeq = query.value(0).toLongLong();
+            storage = DatabaseStorageBlocks;
+        }
+
+        str_query = QString(SQL_LAST_SEQ_RULE).arg(DATABASE_POINTS_TABLE).arg(sessionId);
+        query = internal_exec_query(str_query);
+        if(query.next() && !query.value(0).isNull()){
+            nextSeq = query.value(0).toLongLong() + 1;
+            storage = DatabaseStorageRows;
+        }else if(nextSeq == 0 &&
+                 QFile::exists(DBJournal::path_for(mDatabase.databaseName(), sessionId)))
+        {
+            storage = DatabaseStorageJournal;
+        }
+    }
+
+    journal.close();
+    if(storage == DatabaseStorageJournal){
+        QString path = DBJournal::path_for(mDatabase.databaseName(), sessionId);
+        if(!journal.open(path, sessionId, static_cast<DatabaseSync>(mSynchronous))){
+            qDebug() << "Failed to open journal " << path;
+        }
+        nextSeq = journal.records();
+    }
+
+    double width = 0;
+    for(const QString &segment : session.segments.split('|', QString::SkipEmptyParts)){
+        width += segment.toDouble();
+    }
+    swathHalfWidth = width / 2.0;
+    coverage.clear();
+    coverageQuery = QSqlQuery(mDatabase);
+    if(mCoverageOk && !coverageQuery.prepare(QString(SQL_REPLACE_COVERAGE_RULE).arg(DATABASE_COVERAGE_TABLE))){
+        qDebug() << "Failed to prepare coverage " << coverageQuery.lastError().text();
+        mCoverageOk = false;
+    }
+
+    // the first row appended in this run is always a keyframe, and a new block
+    reset_mask_state(&encoderState);
+    reset_block(&block, nextSeq);
+    QString table = storage == DatabaseStorageBlocks ? DATABASE_BLOCKS_TABLE : DATABASE_POINTS_TABLE;
+    QString rule = storage == DatabaseStorageBlocks ? SQL_REPLACE_BLOCK_RULE : SQL_INSERT_DATA_RULE;
+    insertQuery = QSqlQuery(mDatabase);
+    if(storage != DatabaseStorageJournal && !insertQuery.prepare(rule.arg(table))){
+        qDebug() << "Failed to prepare insert " << insertQuery.lastError().text();
     }
 
     opened = true;
 }
 
+/* Decodes the current row of a SQL_SELECT_DATA_RULE query */
+static bool read_row(QSqlQuery &query, struct DBMaskState *state, DBGeoCoordinate *coord){
+    bool r0Ok, r1Ok, maskOk;
+    qreal lat = query.value(0).toDouble(&r0Ok);
+    qreal lon = query.value(1).toDouble(&r1Ok);
+    maskOk = decode_mask(query.value(2).toByteArray(), coord->applicationMaskEx,
+                         &coord->segCount, state);
+
+    coord->coord = QGeoCoordinate(lat,lon);
+    coord->time = query.value(3).toLongLong();
+    coord->seq = query.value(4).toLongLong();
+    return r0Ok && r1Ok && maskOk;
+}
+
+/*
+ * Producer side of AssyncManager::stream_all for DatabaseStorageBlocks
+ * sessions. Seq is the row index there, so skipping the first @from rows
+ * starts at the block holding row from - 1 instead of reading them all.
+ */
+static void stream_blocks(DBLoadStream *stream, qint64 sessionId, qint64 from, qint64 to,
+                          const DBGeoCoordinate &anchor)
+{
+    QSqlQuery count = internal_exec_query(QString(SQL_COUNT_BLOCKS_RULE)
+                                          .arg(DATABASE_BLOCKS_TABLE).arg(sessionId));
+    qint64 rows = count.next() ? count.value(0).toLongLong() : 0;
+    if(to >= 0) rows = qMin(rows, to);
+    stream->set_total(qMax(Q_INT64_C(0), rows - from));
+
+    QSqlQuery query(mDatabase);
+    query.setForwardOnly(true);
+    QString str_query = QString(SQL_SELECT_BLOCKS_RULE).arg(DATABASE_BLOCKS_TABLE).arg(sessionId)
+                        .arg(from > 0 ? from - 1 - DATABASE_BLOCK_POINTS : -1);
+    if(!query.exec(str_query)){
+        qDebug() << "Failed to execute " << query.lastError().text() << " " << str_query;
+        return;
+    }
+
+    // coordinates were stored in fixed point, the anchor is compared the same way
+    bool anchored = from == 0;
+    bool consuming = true;
+    QVector<DBGeoCoordinate> points, chunk;
+    chunk.reserve(DATABASE_LOAD_CHUNK);
+    while(consuming && query.next()){
+        qint64 seq = query.value(0).toLongLong();
+        points.clear();
+        if(!decode_block(query.value(2).toByteArray(), query.value(1).toInt(), &points)){
+            qDebug() << "Damaged block " << seq << " of session " << sessionId;
+        }
+
+        for(int i = 0; consuming && i < points.size(); i += 1, seq += 1){
+            if(seq < from - 1) continue;
+            if(seq >= rows){
+                consuming = false;
+                break;
+            }
+            if(seq == from - 1){
+                anchored = to_fixed(points[i].coord.latitude()) == to_fixed(anchor.coord.latitude()) &&
+                           to_fixed(points[i].coord.longitude()) == to_fixed(anchor.coord.longitude());
+                if(anchored) stream->set_anchored();
+                consuming = anchored;
+                continue;
+            }
+
+            consuming = anchored;
+            if(!consuming) break;
+            chunk.push_back(points[i]);
+            if(chunk.size() >= DATABASE_LOAD_CHUNK){
+                consuming = stream->push(chunk);
+            }
+        }
+    }
+
+    if(consuming && !chunk.isEmpty()){
+        stream->push(chunk);
+    }
+}
+
+/*
+ * Producer side of AssyncManager::stream_all for DatabaseStorageJournal
+ * sessions. Records are fixed size so row from - 1 is read directly.
+ */
+static void stream_journal(DBLoadStream *stream, qint64 sessionId, qint64 from, qint64 to,
+                           const DBGeoCoordinate &anchor)
+{
+    QFile file(DBJournal::path_for(mDatabase.databaseName(), sessionId));
+    qint64 rows = 0;
+    const struct DBJournalRecord *records = DBJournal::map(&file, sessionId, &rows);
+    if(to >= 0) rows = qMin(rows, to);
+    stream->set_total(qMax(Q_INT64_C(0), rows - from));
+    if(!records || from > rows) return;
+
+    if(from > 0){
+        const struct DBJournalRecord &record = records[from - 1];
+        if(record.latitude != anchor.coord.latitude() ||
+           record.longitude != anchor.coord.longitude())
+        {
+            return;
+        }
+        stream->set_anchored();
+    }
+
+    QVector<DBGeoCoordinate> chunk;
+    chunk.reserve(DATABASE_LOAD_CHUNK);
+    for(qint64 i = from; i < rows; i += 1){
+        DBGeoCoordinate coord;
+        DBJournal::to_coordinate(records[i], &coord);
+        chunk.push_back(coord);
+        if(chunk.size() >= DATABASE_LOAD_CHUNK && !stream->push(chunk)){
+            return;
+        }
+    }
+
+    if(!chunk.isEmpty()){
+        stream->push(chunk);
+    }
+}
+
 void AssyncManager::load_all(QVector<DBGeoCoordinate> *buffer){
 #ifndef DISABLE_LOAD
-    if(buffer && opened){
+    if(buffer && opened && storage == DatabaseStorageJournal){
         QMutexLocker locker(dbMutex);
         buffer->clear();
-        QString str_query(SQL_SELECT_ALL_RULE);
-        str_query = str_query.arg(DATABASE_TABLE);
+        QFile file(DBJournal::path_for(mDatabase.databaseName(), sessionId));
+        qint64 rows = 0;
+        const struct DBJournalRecord *records = DBJournal::map(&file, sessionId, &rows);
+        buffer->reserve(static_cast<int>(rows));
+        for(qint64 i = 0; records && i < rows; i += 1){
+            DBGeoCoordinate coord;
+            DBJournal::to_coordinate(records[i], &coord);
+            buffer->push_back(coord);
+        }
+    }else if(buffer && opened && storage == DatabaseStorageBlocks){
+        QMutexLocker locker(dbMutex);
+        buffer->clear();
+        QString str_query = QString(SQL_SELECT_BLOCKS_RULE).arg(DATABASE_BLOCKS_TABLE)
+                            .arg(sessionId).arg(-1);
         QSqlQuery query = internal_exec_query(str_query);
-        qreal lat, lon;
-        int mask;
-        bool r0Ok, r1Ok, uiOk;
-        unsigned char maskEx[100];//rev
         while(query.next()){
-            lat = query.value(1).toDouble(&r0Ok);
-            lon = query.value(2).toDouble(&r1Ok);
-            mask = query.value(3).toInt(&uiOk);
-            int segCount = string2mask(query.value(4).toString(),maskEx);//rev
+            if(!decode_block(query.value(2).toByteArray(), query.value(1).toInt(), buffer)){
+                qDebug() << "Damaged block " << query.value(0).toLongLong();
+            }
+        }
+    }else if(buffer && opened){
+        QMutexLocker locker(dbMutex);
+        buffer->clear();
+        QString str_query(SQL_SELECT_DATA_RULE);
+        str_query = str_query.arg(DATABASE_POINTS_TABLE).arg(sessionId);
+        QSqlQuery query = internal_exec_query(str_query);
+        struct DBMaskState decoderState;
+        reset_mask_state(&decoderState);
+        while(query.next()){
+            DBGeoCoordinate coord;
+            if(read_row(query, &decoderState, &coord)){
+                buffer->push_back(coord);
+            }
+        }
+    }else if(!opened){
+        qDebug() << "Requested data load without session opened";
+    }
+#else
+    qDebug() << "Warning: Skipping database load";
+#endif
+}
+
+/*
+ * Producer side of Database::stream_all, walks the session with a forward
+ * only cursor and hands DATABASE_LOAD_CHUNK rows at a time to @stream. The
+ * stream is always finished, even when nothing could be read.
+ *
+ * With @from > 0 the rows before it are skipped: row from - 1 must be at the
+ * coordinate of @anchor and the mask decoder resumes from the mask of @anchor,
+ * otherwise nothing is streamed and the stream is not anchored. With @to >= 0
+ * the stream ends before row @to instead of at the end of the session.
+ *
+ * Rows come with their Seq, an @anchor that was read back from this session
+ * has it and the rows path seeks to it. Without one (a snapshot anchor) it
+ * falls back to OFFSET, which steps over every row before @from.
+ */
+void AssyncManager::stream_all(DBLoadStream *stream, qint64 from, qint64 to, DBGeoCoordinate anchor){
+#ifndef DISABLE_LOAD
+    if(opened && storage == DatabaseStorageBlocks){
+        QMutexLocker locker(dbMutex);
+        stream_blocks(stream, sessionId, from, to, anchor);
+    }else if(opened && storage == DatabaseStorageJournal){
+        QMutexLocker locker(dbMutex);
+        stream_journal(stream, sessionId, from, to, anchor);
+    }else if(opened){
+        QMutexLocker locker(dbMutex);
+        // Seq can have gaps (migrated rows keep their old IDs), the anchor's own
+        // Seq is what lets a range start with a seek instead of an OFFSET
+        bool seeking = from > 0 && anchor.seq >= 0;
+        qint64 rows = to;
+        if(!seeking || to < 0){
+            QSqlQuery count = internal_exec_query(QString(SQL_COUNT_DATA_RULE)
+                                                  .arg(DATABASE_POINTS_TABLE).arg(sessionId));
+            rows = count.next() ? count.value(0).toLongLong() : 0;
+            if(to >= 0) rows = qMin(rows, to);
+        }
+        stream->set_total(qMax(Q_INT64_C(0), rows - from));
+
+        QSqlQuery query(mDatabase);
+        query.setForwardOnly(true);
+        QString str_query;
+        qint64 offset = from > 0 ? from - 1 : 0; // the anchor row is read too
+        qint64 limit = to >= 0 ? qMax(Q_INT64_C(0), rows - offset) : -1;
+        if(seeking){
+            str_query = QString(SQL_SELECT_DATA_SEQ_RULE).arg(DATABASE_POINTS_TABLE)
+                        .arg(sessionId).arg(anchor.seq).arg(limit);
+        }else if(from > 0 || to >= 0){
+            str_query = QString(SQL_SELECT_DATA_FROM_RULE).arg(DATABASE_POINTS_TABLE)
+                        .arg(sessionId).arg(limit).arg(offset);
+        }else{
+            str_query = QString(SQL_SELECT_DATA_RULE).arg(DATABASE_POINTS_TABLE).arg(sessionId);
+        }
 
-            if(r0Ok && r1Ok && uiOk){
+        if(query.exec(str_query)){
+            struct DBMaskState decoderState;
+            reset_mask_state(&decoderState);
+            bool consuming = true;
+            if(from > 0){
+                consuming = query.next() &&
+                            query.value(0).toDouble() == anchor.coord.latitude() &&
+                            query.value(1).toDouble() == anchor.coord.longitude() &&
+                            (!seeking || query.value(4).toLongLong() == anchor.seq);
+                if(consuming){
+                    memcpy(decoderState.mask, anchor.applicationMaskEx, DATABASE_MASK_BYTES);
+                    decoderState.segCount = anchor.segCount;
+                    decoderState.valid = true;
+                    stream->set_anchored();
+                }
+            }
+
+            QVector<DBGeoCoordinate> chunk;
+            chunk.reserve(DATABASE_LOAD_CHUNK);
+            while(consuming && query.next()){
                 DBGeoCoordinate coord;
-                coord.coord = QGeoCoordinate(lat,lon);
-                //coord.applicationMask = (unsigned int)mask;
-                coord.segCount = segCount;
-
-                memset(coord.applicationMaskEx,10, 1);
-                for(int i = 0 ; i < segCount ; ++i)
-                {
-                    int index = segCount / 8;
-                    int num = segCount % 8;
-                    coord.applicationMaskEx[index] |= (maskEx[i] << num);
+                if(read_row(query, &decoderState, &coord)){
+                    chunk.push_back(coord);
                 }
 
+                if(chunk.size() >= DATABASE_LOAD_CHUNK){
+                    consuming = stream->push(chunk);
+                }
+            }
 
-                buffer->push_back(coord);
+            if(consuming && !chunk.isEmpty()){
+                stream->push(chunk);
             }
+        }else{
+            qDebug() << "Failed to execute " << query.lastError().text() << " " << str_query;
         }
-    }else if(!opened){
+    }else{
         qDebug() << "Requested data load without session opened";
     }
 #else
+    Q_UNUSED(from);
+    Q_UNUSED(to);
+    Q_UNUSED(anchor);
     qDebug() << "Warning: Skipping database load";
 #endif
+    stream->finish();
 }
 
-void AssyncReceiver::onDone(){
-    QVector<DBGeoCoordinate>*ptr = &sector0;
-    if(userCanUse != 0){
-        ptr = &sector1;
+void AssyncManager::last_coordinate(QGeoCoordinate *coord){
+    if(!opened){
+        qDebug() << "Requested data load without session opened";
+        return;
     }
 
-    if(ptr->size() > DATBASE_BUFFER){
-        QMetaObject::invokeMethod(caller, "insert",
-                                  Qt::QueuedConnection,
-                                  Q_ARG(QVector<DBGeoCoordinate>*, ptr));
-        managerBusy = true;
-        inUse = userCanUse;
-        userCanUse = 1 - userCanUse;
+    QMutexLocker locker(dbMutex);
+    if(storage == DatabaseStorageJournal){
+        QFile file(DBJournal::path_for(mDatabase.databaseName(), sessionId));
+        qint64 rows = 0;
+        const struct DBJournalRecord *records = DBJournal::map(&file, sessionId, &rows);
+        if(records && rows > 0){
+            *coord = QGeoCoordinate(records[rows - 1].latitude, records[rows - 1].longitude);
+        }
+    }else if(storage == DatabaseStorageBlocks){
+        QSqlQuery query = internal_exec_query(QString(SQL_LAST_BLOCK_RULE)
+                                              .arg(DATABASE_BLOCKS_TABLE).arg(sessionId));
+        QVector<DBGeoCoordinate> points;
+        if(query.next() && decode_block(query.value(2).toByteArray(), query.value(1).toInt(), &points) &&
+           !points.isEmpty())
+        {
+            *coord = points.last().coord;
+        }
     }else{
-        managerBusy = false;
+        QSqlQuery query = internal_exec_query(QString(SQL_LAST_DATA_RULE)
+                                              .arg(DATABASE_POINTS_TABLE).arg(sessionId));
+        if(query.next()){
+            *coord = QGeoCoordinate(query.value(0).toDouble(), query.value(1).toDouble());
+        }
+    }
+}
+
+DBLoadStream::DBLoadStream(){
+    reset();
+}
+
+void DBLoadStream::reset(){
+    QMutexLocker locker(&mutex);
+    chunks.clear();
+    total = 0;
+    producerWaitNs = 0;
+    consumerWaitNs = 0;
+    finished = false;
+    cancelled = false;
+    anchored = false;
+}
+
+void DBLoadStream::set_total(qint64 rows){
+    QMutexLocker locker(&mutex);
+    total = rows;
+}
+
+qint64 DBLoadStream::get_total(){
+    QMutexLocker locker(&mutex);
+    return total;
+}
+
+void DBLoadStream::set_anchored(){
+    QMutexLocker locker(&mutex);
+    anchored = true;
+}
+
+/*
+ * Whether a stream started past the first row found its anchor, final once
+ * take() returned for the first time.
+ */
+bool DBLoadStream::is_anchored(){
+    QMutexLocker locker(&mutex);
+    return anchored;
+}
+
+/*
+ * Queues @chunk (left empty for reuse), blocking while the queue is full.
+ * Returns false once the consumer cancelled, the producer should stop.
+ */
+bool DBLoadStream::push(QVector<DBGeoCoordinate> &chunk){
+    QMutexLocker locker(&mutex);
+    QElapsedTimer timer;
+    timer.start();
+    while(!cancelled && chunks.size() >= DATABASE_LOAD_QUEUE){
+        notFull.wait(&mutex);
+    }
+    producerWaitNs += timer.nsecsElapsed();
+
+    if(cancelled) return false;
+
+    chunks.enqueue(chunk);
+    chunk.clear();
+    notEmpty.wakeOne();
+    return true;
+}
+
+void DBLoadStream::finish(){
+    QMutexLocker locker(&mutex);
+    finished = true;
+    notEmpty.wakeAll();
+}
+
+/*
+ * Next chunk into @chunk, blocking until one is available. Returns false
+ * when the producer finished and everything was taken.
+ */
+bool DBLoadStream::take(QVector<DBGeoCoordinate> *chunk){
+    QMutexLocker locker(&mutex);
+    QElapsedTimer timer;
+    timer.start();
+    while(!finished && chunks.isEmpty()){
+        notEmpty.wait(&mutex);
+    }
+    consumerWaitNs += timer.nsecsElapsed();
+
+    if(chunks.isEmpty()) return false;
+
+    *chunk = chunks.dequeue();
+    notFull.wakeOne();
+    return true;
+}
+
+void DBLoadStream::cancel(){
+    QMutexLocker locker(&mutex);
+    cancelled = true;
+    chunks.clear();
+    notFull.wakeAll();
+}
+
+qint64 DBLoadStream::producer_wait_ns(){
+    QMutexLocker locker(&mutex);
+    return producerWaitNs;
+}
+
+qint64 DBLoadStream::consumer_wait_ns(){
+    QMutexLocker locker(&mutex);
+    return consumerWaitNs;
+}
+
+DBRingBuffer::DBRingBuffer(){
+    head.store(0);
+    tail.store(0);
+}
+
+/* Producer only, false when the ring is full */
+bool DBRingBuffer::push(const DBGeoCoordinate &coord){
+    quint32 t = tail.load();
+    if(t - head.loadAcquire() >= DATABASE_RING_CAPACITY) return false;
+    rows[t & (DATABASE_RING_CAPACITY - 1)] = coord;
+    tail.storeRelease(t + 1);
+    return true;
+}
+
+/* Consumer only, appends up to @max rows to @out and returns how many */
+int DBRingBuffer::pop(QVector<DBGeoCoordinate> *out, int max){
+    quint32 h = head.load();
+    quint32 count = qMin(tail.loadAcquire() - h, static_cast<quint32>(max));
+    for(quint32 i = 0; i < count; i += 1){
+        out->push_back(rows[(h + i) & (DATABASE_RING_CAPACITY - 1)]);
+    }
+    head.storeRelease(h + count);
+    return static_cast<int>(count);
+}
+
+int DBRingBuffer::size(){
+    quint32 h = head.loadAcquire();
+    return static_cast<int>(tail.loadAcquire() - h);
+}
+
+Q_STATIC_ASSERT(sizeof(struct DBJournalHeader) == 24);
+Q_STATIC_ASSERT(sizeof(struct DBJournalRecord) == 40);
+
+static quint32 crc32(const void *data, size_t size){
+    static quint32 table[256] = { 0 };
+    if(table[1] == 0){
+        for(quint32 i = 0; i < 256; i += 1){
+            quint32 c = i;
+            for(int k = 0; k < 8; k += 1){
+                c = (c & 1) ? 0xedb88320U ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+    }
+
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+    quint32 crc = 0xffffffffU;
+    for(size_t i = 0; i < size; i += 1){
+        crc = table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc ^ 0xffffffffU;
+}
+
+static quint32 record_checksum(const struct DBJournalRecord &record){
+    return crc32(&record, offsetof(struct DBJournalRecord, checksum));
+}
+
+DBJournal::DBJournal(){
+    syncMode = DatabaseSyncNormal;
+    count = 0;
+    dirty = false;
+}
+
+/* Journal of session @sessionId, next to the database file */
+QString DBJournal::path_for(const QString &database, qint64 sessionId){
+    QFileInfo info(database);
+    return info.absoluteDir().filePath(info.completeBaseName() +
+                                       QString(".%1.journal").arg(sessionId));
+}
+
+/*
+ * Maps the journal in @file and returns its first record, @records is set to
+ * the records before the first one with a bad checksum. Null when the file
+ * does not exist or is not a journal of @sessionId. The mapping lives as
+ * long as @file.
+ */
+const struct DBJournalRecord * DBJournal::map(QFile *file, qint64 sessionId, qint64 *records){
+    *records = 0;
+    if(!file->isOpen() && !file->open(QIODevice::ReadOnly)) return nullptr;
+
+    qint64 size = file->size();
+    if(size < static_cast<qint64>(sizeof(struct DBJournalHeader))) return nullptr;
+
+    const uchar *data = file->map(0, size);
+    if(!data){
+        qDebug() << "Failed to map journal " << file->fileName() << " " << file->errorString();
+        return nullptr;
+    }
+
+    struct DBJournalHeader header;
+    memcpy(&header, data, sizeof(header));
+    if(header.magic != DATABASE_JOURNAL_MAGIC || header.version != DATABASE_JOURNAL_VERSION ||
+       header.recordSize != sizeof(struct DBJournalRecord) || header.sessionId != sessionId)
+    {
+        qDebug() << "Not a journal of session " << sessionId << " " << file->fileName();
+        return nullptr;
+    }
+
+    const struct DBJournalRecord *first = reinterpret_cast<const struct DBJournalRecord *>(
+                data + sizeof(header));
+    qint64 total = (size - static_cast<qint64>(sizeof(header))) /
+                   static_cast<qint64>(sizeof(struct DBJournalRecord));
+    qint64 good = 0;
+    while(good < total && record_checksum(first[good]) == first[good].checksum){
+        good += 1;
+    }
+
+    *records = good;
+    return first;
+}
+
+void DBJournal::to_coordinate(const struct DBJournalRecord &record, DBGeoCoordinate *coord){
+    coord->coord = QGeoCoordinate(record.latitude, record.longitude);
+    coord->time = record.time;
+    coord->segCount = record.segCount;
+    coord->seq = -1;
+    memcpy(coord->applicationMaskEx, record.mask, DATABASE_MASK_BYTES);
+}
+
+/*
+ * Opens, or creates, the journal at @path for appending. A tail that did not
+ * make it to the disk whole (short or failing its checksum) is cut off, a
+ * file that is not a journal of @sessionId is moved aside.
+ */
+bool DBJournal::open(const QString &path, qint64 sessionId, DatabaseSync sync){
+    close();
+    syncMode = sync;
+    count = 0;
+
+    qint64 size = QFileInfo(path).size();
+    if(QFile::exists(path) && size > 0){
+        QFile reader(path);
+        qint64 records = 0;
+        bool valid = map(&reader, sessionId, &records) != nullptr;
+        reader.close();
+
+        if(!valid){
+            QString damaged = path + ".damaged";
+            QFile::remove(damaged);
+            QFile::rename(path, damaged);
+            qDebug() << "Moved unreadable journal to " << damaged;
+        }else{
+            count = records;
+            qint64 good = static_cast<qint64>(sizeof(struct DBJournalHeader)) +
+                          records * static_cast<qint64>(sizeof(struct DBJournalRecord));
+            if(good != size){
+                qDebug() << "Recovered journal " << path << " cutting " << size - good
+                         << " bytes after " << records << " records";
+                if(!QFile::resize(path, good)) return false;
+            }
+        }
+    }
+
+    file.setFileName(path);
+    if(!file.open(QIODevice::ReadWrite | QIODevice::Append)){
+        qDebug() << "Failed to open journal " << path << " " << file.errorString();
+        return false;
+    }
+
+    if(file.size() == 0){
+        struct DBJournalHeader header;
+        memset(&header, 0, sizeof(header));
+        header.magic      = DATABASE_JOURNAL_MAGIC;
+        header.version    = DATABASE_JOURNAL_VERSION;
+        header.recordSize = sizeof(struct DBJournalRecord);
+        header.sessionId  = sessionId;
+        if(file.write(reinterpret_cast<const char *>(&header), sizeof(header)) !=
+           static_cast<qint64>(sizeof(header)) || !file.flush())
+        {
+            qDebug() << "Failed to write journal header " << file.errorString();
+            file.close();
+            return false;
+        }
+        dirty = true;
+    }
+
+    sinceSync.start();
+    return true;
+}
+
+void DBJournal::close(){
+    if(file.isOpen()){
+        sync();
+        file.close();
+    }
+    count = 0;
+}
+
+/*
+ * Appends @rows with a single write. DatabaseSyncFull syncs every append,
+ * DatabaseSyncNormal every DATABASE_JOURNAL_SYNC_MS and DatabaseSyncOff
+ * leaves it to the system. A failed write is cut back off the file.
+ */
+bool DBJournal::append(const QVector<DBGeoCoordinate> &rows){
+    if(!file.isOpen()) return false;
+
+    buffer.resize(rows.size() * static_cast<int>(sizeof(struct DBJournalRecord)));
+    struct DBJournalRecord *records = reinterpret_cast<struct DBJournalRecord *>(buffer.data());
+    for(int i = 0; i < rows.size(); i += 1){
+        struct DBJournalRecord *record = &records[i];
+        const DBGeoCoordinate &coord = rows.at(i);
+        memset(record, 0, sizeof(*record));
+        record->latitude  = coord.coord.latitude();
+        record->longitude = coord.coord.longitude();
+        record->time      = coord.time;
+        record->segCount  = static_cast<quint8>(qBound(0, coord.segCount, DATABASE_MASK_BYTES * 8));
+        memcpy(record->mask, coord.applicationMaskEx, DATABASE_MASK_BYTES);
+        record->checksum  = record_checksum(*record);
+    }
+
+    if(file.write(buffer) != buffer.size() || !file.flush()){
+        qDebug() << "Failed to append to journal " << file.errorString();
+        file.resize(static_cast<qint64>(sizeof(struct DBJournalHeader)) +
+                    count * static_cast<qint64>(sizeof(struct DBJournalRecord)));
+        return false;
+    }
+
+    count += rows.size();
+    dirty = true;
+    if(syncMode == DatabaseSyncFull ||
+       (syncMode == DatabaseSyncNormal && sinceSync.elapsed() >= DATABASE_JOURNAL_SYNC_MS))
+    {
+        sync();
+    }
+
+    return true;
+}
+
+void DBJournal::sync(){
+    if(!dirty || !file.isOpen()) return;
+#if defined(Q_OS_LINUX)
+    fdatasync(file.handle());
+#elif defined(Q_OS_UNIX)
+    fsync(file.handle());
+#endif
+    dirty = false;
+    sinceSync.restart();
+}
+
+bool DBJournal::is_open(){
+    return file.isOpen();
+}
+
+qint64 DBJournal::records(){
+    return count;
+}
+
+/* Moves rows left over from a full ring back into it, oldest first */
+static void refill_ring(){
+    while(!overflow.isEmpty() && ring.push(overflow.head())){
+        overflow.dequeue();
+    }
+    mOverflowQueued.store(overflow.size());
+}
+
+static void post_drain(AssyncManager *manager){
+    if(mDrainPosted.testAndSetOrdered(0, 1)){
+        QMetaObject::invokeMethod(manager, "drain", Qt::QueuedConnection);
     }
 }
 
 void Database::init(QString path, bool initIfNone){
     if(!aManager){
+        DATABASE_NAME = path;
         aManager = new AssyncManager();
-        aReceiver = new AssyncReceiver();
-        aReceiver->caller = aManager;
         managerThread = new QThread();
         aManager->moveToThread(managerThread);
-
-        QObject::connect(aManager, SIGNAL(done()),
-                         aReceiver, SLOT(onDone()),
-                         Qt::QueuedConnection);
-
         managerThread->start();
         QMetaObject::invokeMethod(aManager, "initialize",
                                   Qt::QueuedConnection,
@@ -307,10 +1547,125 @@ int Database::load_all(QVector<DBGeoCoordinate> *buffer){
     return elements > 0 ? 1 : 0;
 }
 
+/*
+ * Starts reading the open session on the database thread and returns right
+ * away, rows are taken from the returned stream while they are still being
+ * read. Only one stream can be active, take() until it returns false (or
+ * cancel it) before calling this again.
+ */
+DBLoadStream * Database::stream_all(){
+    return stream_all(0, DBGeoCoordinate());
+}
+
+/*
+ * Same as stream_all() but only the rows after the first @from ones, see
+ * AssyncManager::stream_all for how @anchor is used. Check is_anchored()
+ * after the first take(), the rows streamed are only good if it is set.
+ */
+DBLoadStream * Database::stream_all(qint64 from, DBGeoCoordinate anchor){
+    return stream_range(from, -1, anchor);
+}
+
+/*
+ * Same as stream_all(@from, @anchor) but only up to row @to (excluded), for
+ * reading back part of a session.
+ */
+DBLoadStream * Database::stream_range(qint64 from, qint64 to, DBGeoCoordinate anchor){
+    init(DATABASE_NAME, true);
+    loadStream.reset();
+    QMetaObject::invokeMethod(aManager, "stream_all",
+                              Qt::QueuedConnection,
+                              Q_ARG(DBLoadStream*, &loadStream),
+                              Q_ARG(qint64, from),
+                              Q_ARG(qint64, to),
+                              Q_ARG(DBGeoCoordinate, anchor));
+    return &loadStream;
+}
+
+/*
+ * Coordinate of the last row of the open session, invalid when it has none.
+ * Only reads that row, it does not walk the session.
+ */
+QGeoCoordinate Database::last_coordinate(){
+    init(DATABASE_NAME, true);
+    QGeoCoordinate coord;
+    QMetaObject::invokeMethod(aManager, "last_coordinate",
+                              Qt::BlockingQueuedConnection,
+                              Q_ARG(QGeoCoordinate*, &coord));
+    return coord;
+}
+
+/* Path of the database file, valid after the first init() */
+QString Database::file_path(){
+    return DATABASE_NAME;
+}
+
 void Database::initialize(){
     init(DATABASE_NAME, true);
 }
 
+void Database::set_journal_wal(bool wal){
+    if(mInited){
+        qDebug() << "Journal mode must be set before the database is initialized";
+    }
+    mJournalWAL = wal;
+}
+
+void Database::set_synchronous(DatabaseSync mode){
+    if(mInited){
+        qDebug() << "Synchronous mode must be set before the database is initialized";
+    }
+    mSynchronous = mode;
+}
+
+/*
+ * Durability policy of the write pipeline: a transaction is written once
+ * @rows rows are waiting or every @milliseconds, 0 disables either trigger.
+ * Must be set before the database is initialized.
+ */
+void Database::set_commit_policy(int rows, int milliseconds){
+    if(mInited){
+        qDebug() << "Commit policy must be set before the database is initialized";
+    }
+    mCommitRows = qBound(0, rows, DATABASE_RING_CAPACITY);
+    mCommitMs = qMax(0, milliseconds);
+}
+
+/* Format of the sessions created from now on, see DatabaseStorage */
+void Database::set_storage(DatabaseStorage storage){
+    if(mInited){
+        qDebug() << "Storage must be set before the database is initialized";
+    }
+    mStorage = storage;
+}
+
+void Database::get_write_stats(qint64 *rows, qint64 *batches){
+    *rows = mRowsWritten.load();
+    *batches = mBatchesWritten.load();
+}
+
+void Database::get_queue_stats(struct DBQueueStats *stats){
+    stats->queued       = ring.size() + mOverflowQueued.load();
+    stats->highWater    = mQueueHighWater.load();
+    stats->overflowRows = mOverflowRows.load();
+    stats->commits      = mBatchesWritten.load();
+    stats->rows         = mRowsWritten.load();
+    stats->maxCommitMs  = mMaxCommitMs.load();
+}
+
+/*
+ * Blocks until every queued coordinate is committed. Must be called from
+ * the thread calling insert_gps_coord, it owns the overflow rows.
+ */
+void Database::flush(){
+    init(DATABASE_NAME, true);
+    do{
+        refill_ring();
+        QMetaObject::invokeMethod(aManager, "drain", Qt::BlockingQueuedConnection);
+    }while(!overflow.isEmpty() || ring.size() > 0);
+    QMetaObject::invokeMethod(aManager, "sync", Qt::BlockingQueuedConnection);
+}
+
 void Database::finalize()
 {
     mDatabase.close();
@@ -328,24 +1683,39 @@ QVector<DBSession> Database::get_sessions(){
     return sessions;
 }
 
+/*
+ * Sessions that worked somewhere inside @area, read from the coverage index
+ * so no session is replayed. Sessions recorded before the index existed are
+ * never returned.
+ */
+QVector<DBSession> Database::get_sessions_in(const QGeoRectangle &area){
+    init(DATABASE_NAME, true);
+    QVector<DBSession> sessions;
+    QMetaObject::invokeMethod(aManager, "get_sessions_in",
+                              Qt::BlockingQueuedConnection,
+                              Q_ARG(QGeoRectangle, area),
+                              Q_ARG(QVector<DBSession> *, &sessions));
+    return sessions;
+}
+
 void Database::insert_gps_coord(DBGeoCoordinate coords){
     init(DATABASE_NAME, true);
-    QVector<DBGeoCoordinate>*ptr = &sector0;
-    if(aReceiver->userCanUse != 0){
-        ptr = &sector1;
+    coords.time = QDateTime::currentMSecsSinceEpoch();
+
+    /*
+     * Never waits on the database thread. When it falls behind and the ring
+     * fills up rows are kept here, in order, until there is room again.
+     */
+    refill_ring();
+    if(!overflow.isEmpty() || !ring.push(coords)){
+        overflow.enqueue(coords);
+        mOverflowQueued.store(overflow.size());
+        mOverflowRows += 1;
     }
 
-    if(managerBusy){
-        ptr->push_back(coords);
-    }else{
-        ptr->push_back(coords);
-        if(ptr->size() > DATBASE_BUFFER){
-            managerBusy = true;
-            aReceiver->inUse = aReceiver->userCanUse;
-            aReceiver->userCanUse = 1 - aReceiver->userCanUse;
-            QMetaObject::invokeMethod(aManager, "insert",
-                                      Qt::QueuedConnection,
-                                      Q_ARG(QVector<DBGeoCoordinate>*, ptr));
-        }
+    int queued = ring.size();
+    if(queued > mQueueHighWater.load()) mQueueHighWater.store(queued);
+    if((mCommitRows > 0 && queued >= mCommitRows) || !overflow.isEmpty()){
+        post_drain(aManager);
     }
 }
@@ -7,18 +7,180 @@
 #include <QSqlError>
 #include <QSqlQuery>
 #include <QGeoCoordinate>
+#include <QGeoRectangle>
+#include <QHash>
 #include <QList>
 #include <QThread>
 #include <QDateTime>
+#include <QMutex>
+#include <QAtomicInteger>
+#include <QQueue>
+#include <QWaitCondition>
+#include <QFile>
+#include <QElapsedTimer>
 #include <glm/glm.hpp>
 
+class QTimer;
+
 #define DATABASE_DRIVER "QSQLITE"
 #define DATABASE_SESSIONS_TABLE "Sessions"
+#define DATABASE_POINTS_TABLE "Points"
+#define DATABASE_BLOCKS_TABLE "Blocks"
+#define DATABASE_COVERAGE_TABLE "Coverage"
+#define DATABASE_COVERAGE_CELLS_TABLE "CoverageCells"
+
+/*
+ * PRAGMA user_version of the current layout. Version 0 files keep one table
+ * per session, named after it, and are moved into DATABASE_POINTS_TABLE the
+ * first time they are opened.
+ */
+#define DATABASE_SCHEMA_VERSION 1
+
+/*
+ * SQLite PRAGMA synchronous levels. With WAL, DatabaseSyncNormal only syncs
+ * on checkpoints, a power cut can lose the last commits but never corrupts
+ * the file. DatabaseSyncFull also syncs every commit.
+ */
+typedef enum{
+    DatabaseSyncOff = 0, DatabaseSyncNormal, DatabaseSyncFull
+}DatabaseSync;
+
+/* Bytes of a section mask, one bit per section (MAX_MASK_SEG) */
+#define DATABASE_MASK_BYTES 10
+
+/*
+ * Section masks are stored as AppMask BLOBs, the first byte tells how:
+ *      MaskRaw   - segment count followed by the mask bytes;
+ *      MaskSame  - nothing else, same mask as the previous row;
+ *      MaskXor   - (byte index, xor) pairs for the bytes that changed
+ *                  since the previous row.
+ * Every DATABASE_MASK_KEYFRAME rows, and for the first row written after a
+ * session is opened, the mask is MaskRaw so decoding can restart there.
+ * Sessions recorded before this format had an AppMaskEx TEXT column, they
+ * are encoded like this when migrated.
+ */
+typedef enum{
+    MaskRaw = 0, MaskSame, MaskXor
+}DatabaseMaskEncoding;
+
+#define DATABASE_MASK_KEYFRAME 256
+
+/*
+ * How new sessions store their points, sessions already in the file keep
+ * the format they were recorded with.
+ *      DatabaseStorageRows   - one DATABASE_POINTS_TABLE row per fix;
+ *      DatabaseStorageBlocks - up to DATABASE_BLOCK_POINTS fixes per
+ *                              DATABASE_BLOCKS_TABLE row;
+ *      DatabaseStorageJournal - a DBJournal file per session, SQLite only
+ *                              keeps the session in DATABASE_SESSIONS_TABLE.
+ * A block is a sequence of points, each one zigzag varints of the latitude,
+ * longitude and time deltas to the previous point followed by a varint length
+ * and the AppMask encoding of its mask. Coordinates are fixed point, units of
+ * 1 / DATABASE_BLOCK_SCALE degrees (about a centimeter). The first point of
+ * a block is a delta to zero and its mask is MaskRaw, so any block decodes
+ * without the ones before it.
+ */
+typedef enum{
+    DatabaseStorageRows = 0, DatabaseStorageBlocks, DatabaseStorageJournal
+}DatabaseStorage;
+
+#define DATABASE_BLOCK_POINTS 256
+#define DATABASE_BLOCK_SCALE  1e7
 
 struct DBGeoCoordinate{
     QGeoCoordinate coord;
-    unsigned char applicationMaskEx[10];
+    unsigned char applicationMaskEx[DATABASE_MASK_BYTES];
+    int segCount;
+    qint64 time; // ms since epoch (UTC) when stored, 0 for migrated rows
+    qint64 seq;  // Seq it was read from in DATABASE_POINTS_TABLE, -1 otherwise
+};
+
+/* Previous mask, carried between rows by the encoder and the decoder */
+struct DBMaskState{
+    unsigned char mask[DATABASE_MASK_BYTES];
     int segCount;
+    int sinceKeyframe;
+    bool valid;
+};
+
+/* Block being appended to by a DatabaseStorageBlocks session */
+struct DBBlockState{
+    qint64 firstSeq;
+    int count;
+    QByteArray data;
+    qint64 latitude, longitude, time; // last point, fixed point
+    struct DBMaskState mask;
+};
+
+#define DATABASE_JOURNAL_MAGIC   0x4c4e524a // "JRNL"
+#define DATABASE_JOURNAL_VERSION 1
+
+/* With DatabaseSyncNormal the journal is synced at most this often */
+#define DATABASE_JOURNAL_SYNC_MS 5000
+
+/* Journal file header, native endianness like the snapshot files */
+struct DBJournalHeader{
+    quint32 magic;
+    quint32 version;
+    quint32 recordSize;
+    quint32 padding;
+    qint64 sessionId;
+};
+
+/* One fix, checksum is the CRC-32 of every byte before it */
+struct DBJournalRecord{
+    double latitude, longitude;
+    qint64 time;
+    quint8 mask[DATABASE_MASK_BYTES];
+    quint8 segCount;
+    quint8 padding;
+    quint32 checksum;
+};
+
+/*
+ * Append-only file of DBJournalRecord after a DBJournalHeader. Rows are only
+ * ever appended, a batch with a single write, so after a power cut the file
+ * is a run of good records followed at most by a torn one. open() finds the
+ * last record whose checksum matches and cuts the file there.
+ */
+class DBJournal{
+public:
+    DBJournal();
+    static QString path_for(const QString &database, qint64 sessionId);
+    static const struct DBJournalRecord * map(QFile *file, qint64 sessionId, qint64 *records);
+    static void to_coordinate(const struct DBJournalRecord &record, DBGeoCoordinate *coord);
+    bool open(const QString &path, qint64 sessionId, DatabaseSync sync);
+    void close();
+    bool append(const QVector<DBGeoCoordinate> &rows);
+    void sync();
+    bool is_open();
+    qint64 records();
+
+private:
+    QFile file;
+    QByteArray buffer;
+    QElapsedTimer sinceSync;
+    DatabaseSync syncMode;
+    qint64 count;
+    bool dirty;
+};
+
+/*
+ * Area worked by every session, for finding the sessions near a position
+ * without replaying them. Fixes are grouped in cells of a global grid of
+ * DATABASE_COVERAGE_CELL degrees (around a container, see voxel2d.h, but
+ * the same for every session) and each (session, cell) keeps the bounding
+ * box of its fixes widened by half the implement in DATABASE_COVERAGE_TABLE,
+ * an R*Tree. DATABASE_COVERAGE_CELLS_TABLE maps the R*Tree IDs to them.
+ * Boxes are updated in the transaction storing the fixes.
+ */
+#define DATABASE_COVERAGE_CELL 0.001
+
+/* Box of a cell of the open session, as last written */
+struct DBCoverageCell{
+    qint64 id;
+    double minLat, maxLat, minLon, maxLon;
+    bool dirty;
 };
 
 struct DBSession{
@@ -29,41 +191,126 @@ struct DBSession{
     QDateTime qdate;
 };
 
+/* Rows per chunk and chunks in flight when streaming a session back */
+#define DATABASE_LOAD_CHUNK  1024
+#define DATABASE_LOAD_QUEUE  4
+
+/*
+ * Bounded queue between the cursor reading a session on the database thread
+ * and whoever replays it. The producer blocks while DATABASE_LOAD_QUEUE
+ * chunks are waiting, so memory stays bounded no matter the session size,
+ * and the consumer blocks until a chunk arrives or the stream finishes.
+ */
+class DBLoadStream{
+public:
+    DBLoadStream();
+    void reset();
+    void set_total(qint64 rows);
+    qint64 get_total();
+    void set_anchored();
+    bool is_anchored();
+    bool push(QVector<DBGeoCoordinate> &chunk);
+    void finish();
+    bool take(QVector<DBGeoCoordinate> *chunk);
+    void cancel();
+    qint64 producer_wait_ns();
+    qint64 consumer_wait_ns();
+
+private:
+    QMutex mutex;
+    QWaitCondition notFull, notEmpty;
+    QQueue<QVector<DBGeoCoordinate>> chunks;
+    qint64 total;
+    qint64 producerWaitNs, consumerWaitNs;
+    bool finished, cancelled, anchored;
+};
+
+/*
+ * Rows between the provider and the database thread. Producer and consumer
+ * only share the two indices so neither ever waits on the other, a full
+ * ring is handled by the producer (see Database::insert_gps_coord).
+ */
+#define DATABASE_RING_CAPACITY 4096 // power of two
+
+/*
+ * Default group commit policy, a transaction is written once this many
+ * rows are waiting or every this many milliseconds, whatever comes first.
+ * Rows younger than the period are lost on a crash.
+ */
+#define DATABASE_COMMIT_ROWS   64
+#define DATABASE_COMMIT_MS     1000
+
+/* Single producer, single consumer ring buffer of DATABASE_RING_CAPACITY rows */
+class DBRingBuffer{
+public:
+    DBRingBuffer();
+    bool push(const DBGeoCoordinate &coord);
+    int pop(QVector<DBGeoCoordinate> *out, int max);
+    int size();
+
+private:
+    DBGeoCoordinate rows[DATABASE_RING_CAPACITY];
+    QAtomicInteger<quint32> head; // next row to pop, written by the consumer
+    QAtomicInteger<quint32> tail; // next free slot, written by the producer
+};
+
+/* Write pipeline counters, see Database::get_queue_stats */
+struct DBQueueStats{
+    qint64 queued;       // rows waiting in the ring and in the overflow
+    qint64 highWater;    // most rows ever waiting in the ring
+    qint64 overflowRows; // rows that found the ring full
+    qint64 commits;      // transactions written
+    qint64 rows;         // rows written
+    qint64 maxCommitMs;  // slowest transaction
+};
+
 Q_DECLARE_METATYPE(DBGeoCoordinate)
 Q_DECLARE_METATYPE(DBSession)
 Q_DECLARE_METATYPE(QVector<DBGeoCoordinate>*)
 Q_DECLARE_METATYPE(QVector<DBSession>*)
+Q_DECLARE_METATYPE(DBLoadStream*)
+Q_DECLARE_METATYPE(QGeoCoordinate*)
 
 class AssyncManager : public QObject{
     Q_OBJECT
     friend class Database;
 private:
-    QString DATABASE_TABLE;
+    qint64 sessionId;     // Sessions.ID of the open session
+    qint64 nextSeq;       // Seq of the next row appended to it
+    int storage;          // DatabaseStorage of the open session
     bool opened;
+    QSqlQuery insertQuery; // prepared by start_session
+    struct DBMaskState encoderState;
+    struct DBBlockState block;
+    DBJournal journal;
+    QSqlQuery coverageQuery; // prepared by start_session
+    QHash<quint64, struct DBCoverageCell> coverage;
+    double swathHalfWidth; // meters
+    QTimer *commitTimer;
+    QVector<DBGeoCoordinate> batch;
+
+    void insert(QVector<DBGeoCoordinate> *coord);
+    bool write_rows(QVector<DBGeoCoordinate> *coord);
+    bool write_blocks(QVector<DBGeoCoordinate> *coord);
+    bool write_block();
+    bool write_journal(QVector<DBGeoCoordinate> *coord);
+    bool write_coverage(QVector<DBGeoCoordinate> *coord);
+    struct DBCoverageCell * coverage_cell(qint64 cellLat, qint64 cellLon);
 public:
-    explicit AssyncManager(){opened = false;}
+    explicit AssyncManager(){opened = false; sessionId = 0; nextSeq = 0;
+                             storage = DatabaseStorageRows; block.count = 0; swathHalfWidth = 0;
+                             encoderState.valid = false; commitTimer = nullptr;}
 
-signals:
-    void done();
 private slots:
-    void insert(QVector<DBGeoCoordinate> *coord);
+    void drain();
+    void sync();
     void load_all(QVector<DBGeoCoordinate> *coord);
+    void stream_all(DBLoadStream *stream, qint64 from, qint64 to, DBGeoCoordinate anchor);
+    void last_coordinate(QGeoCoordinate *coord);
     void initialize(QString path, bool initIfNone);
     void start_session(DBSession session, int *exists);
     void get_sessions(QVector<DBSession> *buffer);
-};
-
-class AssyncReceiver : public QObject{
-    Q_OBJECT
-    friend class Database;
-private:
-    int userCanUse;
-    int inUse;
-    QObject *caller;
-public:
-    explicit AssyncReceiver(){userCanUse = 0;}
-private slots:
-    void onDone();
+    void get_sessions_in(QGeoRectangle area, QVector<DBSession> *buffer);
 };
 
 class Database : public QObject
@@ -73,16 +320,31 @@ private:
     static QString DATABASE_NAME;
     static QThread *managerThread;
     static AssyncManager *aManager;
-    static AssyncReceiver *aReceiver;
+    static DBLoadStream loadStream;
 public:
     static QVector<DBSession> get_sessions();
+    static QVector<DBSession> get_sessions_in(const QGeoRectangle &area);
     static void init(QString path, bool initIfNone);
     static int open_session(DBSession session);
 //    static void set_database_file(QString path);
     static void insert_gps_coord(DBGeoCoordinate coords);
     static int load_all(QVector<DBGeoCoordinate> *buffer);
+    static DBLoadStream * stream_all();
+    static DBLoadStream * stream_all(qint64 from, DBGeoCoordinate anchor);
+    static DBLoadStream * stream_range(qint64 from, qint64 to, DBGeoCoordinate anchor);
+    static QGeoCoordinate last_coordinate();
+    static QString file_path();
     static void initialize();
     static void finalize();
+    static void flush();
+
+    /* Must be set before the database is first used */
+    static void set_journal_wal(bool wal);
+    static void set_synchronous(DatabaseSync mode);
+    static void set_commit_policy(int rows, int milliseconds);
+    static void set_storage(DatabaseStorage storage);
+    static void get_write_stats(qint64 *rows, qint64 *batches);
+    static void get_queue_stats(struct DBQueueStats *stats);
 
 signals:
 
@@ -0,0 +1,171 @@
+#include "gldiagnostics.h"
+
+#if defined(GL_DIAGNOSTICS)
+#include <QOpenGLDebugLogger>
+#include <QDebug>
+#include <QString>
+#include <atomic>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+
+static std::atomic<bool> diagnosticsEnabled(true);
+static QOpenGLDebugLogger *debugLogger = nullptr;
+static struct gl_frame_stats_t currentFrame = {0, 0, 0, 0, 0, 0};
+static struct gl_frame_stats_t previousFrame = {0, 0, 0, 0, 0, 0};
+static int frameCounter = 0;
+
+static std::string
+translateGLError(int errorCode) {
+    std::string error;
+    switch (errorCode)
+    {
+        case GL_INVALID_ENUM:                  error = "INVALID_ENUM"; break;
+        case GL_INVALID_VALUE:                 error = "INVALID_VALUE"; break;
+        case GL_INVALID_OPERATION:             error = "INVALID_OPERATION"; break;
+        case GL_OUT_OF_MEMORY:                 error = "OUT_OF_MEMORY"; break;
+        case GL_INVALID_FRAMEBUFFER_OPERATION: error = "INVALID_FRAMEBUFFER_OPERATION"; break;
+        default: error = "Unknown Error";
+    }
+    return error;
+}
+
+static bool starts_with(const char *cmd, const char *prefix){
+    return strncmp(cmd, prefix, strlen(prefix)) == 0;
+}
+
+/*
+ * Needs a context created with QSurfaceFormat::DebugContext (main.cpp does
+ * that in diagnostic builds), otherwise we stay on glGetError. The logger is
+ * never started on other contexts, it would turn on GL_DEBUG_OUTPUT there.
+ */
+void GLDiagnostics::initialize(QOpenGLContext *context){
+    if(debugLogger || !context) return;
+
+    if(!context->format().testOption(QSurfaceFormat::DebugContext)){
+        qDebug() << "Not a debug context, using glGetError";
+        return;
+    }
+
+    if(!context->hasExtension(QByteArrayLiteral("GL_KHR_debug"))){
+        qDebug() << "GL_KHR_debug not available, using glGetError";
+        return;
+    }
+
+    debugLogger = new QOpenGLDebugLogger();
+    if(!debugLogger->initialize()){
+        qDebug() << "Failed to start QOpenGLDebugLogger, using glGetError";
+        delete debugLogger;
+        debugLogger = nullptr;
+        return;
+    }
+
+    QObject::connect(debugLogger, &QOpenGLDebugLogger::messageLogged,
+                     [](const QOpenGLDebugMessage &message){
+        if(message.severity() != QOpenGLDebugMessage::NotificationSeverity){
+            qDebug() << message;
+        }
+    });
+
+    debugLogger->startLogging(QOpenGLDebugLogger::AsynchronousLogging);
+}
+
+void GLDiagnostics::finalize(){
+    if(debugLogger){
+        debugLogger->stopLogging();
+        delete debugLogger;
+        debugLogger = nullptr;
+    }
+}
+
+void GLDiagnostics::set_enabled(bool enabled){
+    diagnosticsEnabled = enabled;
+}
+
+bool GLDiagnostics::is_enabled(){
+    return diagnosticsEnabled;
+}
+
+void GLDiagnostics::begin_frame(){
+    currentFrame = {0, 0, 0, 0, 0, 0};
+}
+
+void GLDiagnostics::end_frame(){
+    previousFrame = currentFrame;
+    frameCounter += 1;
+    if(diagnosticsEnabled && frameCounter % TARGET_FPS == 0){
+        qDebug() << "GL frame: draws " << previousFrame.drawCalls
+                 << " triangles " << previousFrame.triangles
+                 << " state changes " << previousFrame.stateChanges
+                 << " program binds " << previousFrame.programBinds
+                 << " uniform uploads " << previousFrame.uniformUploads
+                 << " uploaded " << previousFrame.uploadBytes << " bytes";
+    }
+}
+
+struct gl_frame_stats_t GLDiagnostics::last_frame(){
+    return previousFrame;
+}
+
+void GLDiagnostics::count_call(const char *cmd){
+    if(starts_with(cmd, "glDraw")){
+        currentFrame.drawCalls += 1;
+    }else if(starts_with(cmd, "glBind")    || starts_with(cmd, "glEnable")  ||
+             starts_with(cmd, "glDisable") || starts_with(cmd, "glBlend")   ||
+             starts_with(cmd, "glStencil") || starts_with(cmd, "glDepth")   ||
+             starts_with(cmd, "glActiveTexture") || starts_with(cmd, "glViewport"))
+    {
+        currentFrame.stateChanges += 1;
+    }
+}
+
+void GLDiagnostics::count_upload(qint64 bytes){
+    if(diagnosticsEnabled){
+        currentFrame.uploadBytes += bytes;
+    }
+}
+
+void GLDiagnostics::count_triangles(qint64 triangles){
+    if(diagnosticsEnabled){
+        currentFrame.triangles += triangles;
+    }
+}
+
+void GLDiagnostics::count_program_bind(){
+    if(diagnosticsEnabled){
+        currentFrame.programBinds += 1;
+    }
+}
+
+void GLDiagnostics::count_uniform_uploads(int count){
+    if(diagnosticsEnabled){
+        currentFrame.uniformUploads += count;
+    }
+}
+
+void GLDiagnostics::clear_errors(OpenGLFunctions *ptr){
+    if(debugLogger) return;
+    while (ptr->functions->glGetError()) {
+        ;
+    }
+}
+
+void GLDiagnostics::validate(const char *cmd, int line, const char *fileName,
+                             OpenGLFunctions *ptr)
+{
+    if(debugLogger) return; // errors are reported by the logger
+    GLenum val = ptr->functions->glGetError();
+    if (val != GL_NO_ERROR) {
+        QString msg = QString(cmd) + QString(" => ") + QString::number(val);
+        msg += "[ ";
+        msg += translateGLError(val).c_str();
+        msg += " ]";
+        msg += QString("::") + QString(fileName);
+        msg += "::" + QString::number(line);
+        qDebug() << msg;
+        getchar();
+        exit(0);
+    }
+}
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef GLDIAGNOSTICS_H
+#define GLDIAGNOSTICS_H
+#include "common.h"
+#include <QOpenGLContext>
+
+/*
+ * GL instrumentation layer. Every GL call in the renderer goes through
+ * GL_CHK, what it expands to depends on how the project is built:
+ *
+ *      release (default)        - the bare call, no error checks and no counters;
+ *      CONFIG += gl_diagnostics - defines GL_DIAGNOSTICS, calls are counted and
+ *                                 checked while GLDiagnostics is enabled at runtime.
+ *
+ * In diagnostic builds errors come from a KHR_debug logger when the context
+ * supports it, messages arrive asynchronously and no glGetError is issued.
+ * Without KHR_debug it falls back to glGetError around every call, which
+ * syncs with the GPU on most drivers so timings taken like that are off.
+ *
+ * Counters are per frame and reset by begin_frame(), end_frame() prints them
+ * once every TARGET_FPS frames.
+ */
+struct gl_frame_stats_t{
+    int drawCalls;
+    qint64 triangles;
+    int stateChanges;
+    int programBinds;
+    qint64 uploadBytes;
+    int uniformUploads;   // setUniformValue calls plus FrameData block updates
+};
+
+#if defined(GL_DIAGNOSTICS)
+class GLDiagnostics{
+public:
+    static void initialize(QOpenGLContext *context);
+    static void finalize();
+    static void set_enabled(bool enabled);
+    static bool is_enabled();
+    static void begin_frame();
+    static void end_frame();
+    static struct gl_frame_stats_t last_frame();
+
+    static void count_call(const char *cmd);
+    static void count_upload(qint64 bytes);
+    static void count_triangles(qint64 triangles);
+    static void count_program_bind();
+    static void count_uniform_uploads(int count);
+    static void clear_errors(OpenGLFunctions *ptr);
+    static void validate(const char *cmd, int line, const char *fileName,
+                         OpenGLFunctions *ptr);
+};
+
+#define GL_CHK(x, ptr) do{ if(GLDiagnostics::is_enabled()){\
+                               GLDiagnostics::clear_errors(ptr);\
+                               ptr->extraFunctions->x;\
+                               GLDiagnostics::count_call(#x);\
+                               GLDiagnostics::validate(#x, __LINE__, __FILE__, ptr);\
+                           }else{ ptr->extraFunctions->x; } }while(0)
+#define GL_STAT_UPLOAD(bytes)  GLDiagnostics::count_upload(SCAST(qint64, (bytes)))
+#define GL_STAT_PROGRAM_BIND() GLDiagnostics::count_program_bind()
+#define GL_STAT_UNIFORM(count) GLDiagnostics::count_uniform_uploads(count)
+#define GL_STAT_TRIANGLES(count) GLDiagnostics::count_triangles(SCAST(qint64, (count)))
+#else
+class GLDiagnostics{
+public:
+    static void initialize(QOpenGLContext *){}
+    static void finalize(){}
+    static void set_enabled(bool){}
+    static bool is_enabled(){ return false; }
+    static void begin_frame(){}
+    static void end_frame(){}
+    static struct gl_frame_stats_t last_frame(){ return {0, 0, 0, 0, 0, 0}; }
+};
+
+#define GL_CHK(x, ptr) do{ ptr->extraFunctions->x; }while(0)
+#define GL_STAT_UPLOAD(bytes)  do{}while(0)
+#define GL_STAT_PROGRAM_BIND() do{}while(0)
+#define GL_STAT_UNIFORM(count) do{}while(0)
+#define GL_STAT_TRIANGLES(count) do{}while(0)
+#endif
+
+#endif // GLDIAGNOSTICS_H
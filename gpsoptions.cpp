@@ -37,12 +37,23 @@ void GPSOptions::reset_debug_vars(){
     renderControlPoints = false;
     filterMovement = true;
     enableDebugVars = false;
+    debugSectionColors = false;
+    measureOverdraw = false;
+    sectionLoop = false;
+    measurePassTimes = false;
 }
 
 void GPSOptions::internal_init(){
     segments = -1;
     sampleCount = -1;
     renderWireframe = false;
+    coverageRenderMode = CoverageOverwrite;
+    dynamicResolution = false;
+    coverageFrameBudget = 8.0f;
+    minResolutionScale = 0.5f;
+    sequenceCutoff = 0;
+    terrainPath.clear();
+    backgroundPath.clear();
     reset_debug_vars();
 }
 
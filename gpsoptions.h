@@ -5,6 +5,18 @@
 #include <common.h>
 #include <database.h>
 
+/*
+ * How overlapping path triangles are resolved:
+ *      CoverageOverwrite - every triangle is shaded and newer ones overwrite
+ *                          older ones through the blend equation;
+ *      CoverageStencil   - triangles are drawn newest first and the stencil
+ *                          buffer rejects pixels that were already covered,
+ *                          each pixel is written once.
+ */
+typedef enum{
+    CoverageOverwrite = 0, CoverageStencil
+}CoverageRenderMode;
+
 class GPSOptions
 {
 public:
@@ -39,6 +51,7 @@ public:
 
     // debug variables
     bool enableDebugVars;
+    bool debugSectionColors; // each path section in its own color
     QVector3D debugCPointsColor;
     QVector3D debugVoxelPrimaryColor;
     QVector3D debugVoxelNeighboorColor;
@@ -46,6 +59,38 @@ public:
     QVector3D debugVoxelError;
     bool renderWireframe;
     bool renderControlPoints;
+
+    int coverageRenderMode;
+    bool measureOverdraw; // replaces the path color with a per pixel fragment count
+    bool sectionLoop; // path sections found walking pData per fragment, for the benchmark
+    bool measurePassTimes; // GPU timer queries around each render pass
+
+    /*
+     * Dynamic resolution for the path layer, when enabled the layer is drawn
+     * offscreen at a scale in [minResolutionScale, 1] picked so that the pass
+     * stays around coverageFrameBudget milliseconds.
+     */
+    bool dynamicResolution;
+    float coverageFrameBudget;
+    float minResolutionScale;
+
+    /*
+     * Playback, when non zero only triangles stamped with a sequence number
+     * up to this value are drawn (see Voxel::trianglesSequence). Zero is live.
+     */
+    unsigned int sequenceCutoff;
+
+    /*
+     * DEM tile file (see terrain.h) the floor and the paths are draped on,
+     * empty keeps the flat world. scripts/make_dem.py writes a synthetic one.
+     */
+    QString terrainPath;
+
+    /*
+     * MBTiles file (see background.h) drawn on the floor or the terrain,
+     * empty keeps the grid. scripts/make_mbtiles.py writes a test one.
+     */
+    QString backgroundPath;
 };
 
 #endif // GPSOPTIONS_H
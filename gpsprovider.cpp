@@ -1,21 +1,49 @@
 #include "gpsprovider.h"
 #include <QThread>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QGeoCircle>
 #include <QtDebug>
 #include <sys/file.h>
 #include <unistd.h>
 #include <cstdio>
 #include "graphics.h"
+#include "snapshot.h"
 
 #define PRINT_REAL_VALUE(coord)  QString("%1").arg(coord, 0, 'g', 14)
 
+/*
+ * Rows [first, last) of the session skipped by a progressive reload, they
+ * are read back with Database::stream_range and replayed from 'entry'.
+ * background_reload moves 'anchor' to the last row of every read, its seq
+ * lets the next read seek there instead of stepping over the rows before.
+ */
+struct reload_run_t{
+    qint64 first, last;
+    Orientation_t entry;    // reckoned state before row 'first'
+    DBGeoCoordinate anchor; // row first - 1
+};
+
+static QVector<struct reload_run_t> reloadRuns;
+
 GPSProvider::GPSProvider(){
     //currentHitMask = 0x00;
     initedDb = false;
+    storedRows = 0;
+    snapshotRows = 0;
+    snapshotFrames = 0;
+    memset(lastStored.applicationMaskEx, 0, MAX_MASK_SEG);
+    lastStored.segCount = 0;
+    lastStored.seq = -1;
+    backgroundLoad = false;
+    reloadGeneration = 0;
 
     memset(currentHitMaskEx,0,MAX_MASK_SEG);
 }
 
 void GPSProvider::internal_update(QGeoCoordinate &coord) {
+    QByteArray snapshot;
     if (coord.isValid())
     {
 //        if (coord.longitude() > 0.0) // this is wrong
@@ -48,8 +76,10 @@ void GPSProvider::internal_update(QGeoCoordinate &coord) {
         int segments        = out.segments;
         uchar *hitMaskEx    = out.currentHitMaskEx;
 
-        // if there's a change in bitmask, will emit signal with it
-        if (memcmp(hitMaskEx, currentHitMaskEx, MAX_MASK_SEG)) {
+        // if there's a change in bitmask, will emit signal with it. While far
+        // rows are still replayed in the background the world is partial and a
+        // miss may be ground not loaded yet, hold the report until it is whole
+        if (!backgroundLoad && memcmp(hitMaskEx, currentHitMaskEx, MAX_MASK_SEG)) {
 
             //** [SET SECTION STATUS TO GRID IN FRONTEND] **//
             ///////////
@@ -83,14 +113,46 @@ void GPSProvider::internal_update(QGeoCoordinate &coord) {
             DBGeoCoordinate currentLocation;
             currentLocation.coord = curr.geoCoord;
             currentLocation.segCount = segments;
+            currentLocation.seq = -1;
             memcpy(currentLocation.applicationMaskEx, out.movementMaskEx, MAX_MASK_SEG);
 
-            if (initedDb)
+            if (initedDb){
                 Database::insert_gps_coord(currentLocation);
+                storedRows += 1;
+                lastStored = currentLocation;
+                if (!backgroundLoad && storedRows - snapshotRows >= SNAPSHOT_EVERY_ROWS)
+                    snapshot = capture_snapshot();
+            }
         }
     }
 
     Metrics::unlock_series_update();
+
+    if (!snapshot.isEmpty())
+        save_snapshot(snapshot);
+}
+
+/*
+ * Serializes what the geometry gained since the last snapshot, or all of
+ * it every SNAPSHOT_MAX_FRAMES snapshots. Hold the series lock.
+ */
+QByteArray GPSProvider::capture_snapshot(){
+    QByteArray data;
+    if (storedRows > 0 && !snapshotPath.isEmpty()) {
+        quint32 frame = snapshotFrames < SNAPSHOT_MAX_FRAMES ? snapshotFrames : 0;
+        data = Snapshot::capture(frame, storedRows, lastStored.coord.latitude(),
+                                 lastStored.coord.longitude(),
+                                 lastStored.applicationMaskEx, lastStored.segCount);
+        snapshotRows = storedRows;
+        snapshotFrames = frame + 1;
+    }
+    return data;
+}
+
+/* Writes a capture_snapshot() result, after releasing the series lock */
+void GPSProvider::save_snapshot(const QByteArray &data){
+    if (!Snapshot::save(snapshotPath, data, snapshotFrames > 1))
+        snapshotFrames = 0; // the next one rewrites the file
 }
 void GPSProvider::populate(QGeoCoordinate coord)
 {
@@ -118,6 +180,17 @@ void GPSProvider::init_database(DBSession session){
 
 void GPSProvider::finalize_database()
 {
+    reloadGeneration += 1; // stops a background reload
+    if(initedDb){
+        Database::flush();
+        if(!backgroundLoad && storedRows > snapshotRows){
+            Metrics::lock_for_series_update();
+            QByteArray snapshot = capture_snapshot();
+            Metrics::unlock_series_update();
+            save_snapshot(snapshot);
+        }
+    }
+    backgroundLoad = false;
     initedDb = false;
 //    Database::finalize();
 }
@@ -133,39 +206,258 @@ void GPSProvider::get_available_sessions(QVector<DBSession> *sessions){
     }
 }
 
+/* Sessions that worked within @radius meters of @center */
+void GPSProvider::get_sessions_near(QGeoCoordinate center, double radius,
+                                    QVector<DBSession> *sessions)
+{
+    if(!initedDb){
+       Database::initialize();
+       initedDb = true;
+    }
+
+    if(sessions){
+        *sessions = Database::get_sessions_in(QGeoCircle(center, radius).boundingGeoRectangle());
+    }
+}
+
+/*
+ * Replays the session while the database thread is still reading it, the
+ * cursor hands over DATABASE_LOAD_CHUNK rows at a time so the geometry
+ * rebuild overlaps the reads and a long session never sits whole in memory.
+ *
+ * When the session has a snapshot whose last row is still in the database
+ * the geometry is read from it and only the rows stored after it are
+ * replayed, otherwise everything is.
+ *
+ * When that is at least RELOAD_PROGRESSIVE_ROWS rows the replay is
+ * progressive. Every row still goes through Metrics::reckon, which is cheap,
+ * but only the ones near the last stored row get geometry, each run of them
+ * joined from the reckoned state of its first row. The others are kept as
+ * row ranges for background_reload, after the map is handed over.
+ */
 void GPSProvider::internal_init(DBSession target){
+    QElapsedTimer usableTimer;
+    usableTimer.start();
+    reloadGeneration += 1;
+    backgroundLoad = false;
+    reloadRuns.clear();
+
     int exists = Database::open_session(target);
+    QByteArray snapshot;
+    snapshotPath = Snapshot::path_for(Database::file_path(), target.name);
+    storedRows = 0;
+    snapshotRows = 0;
+    snapshotFrames = 0;
+    qint64 inserted = 0, farRows = 0;
+
     Metrics::load_start();
     if(exists){
         qDebug() << "Checking for previous data";
-        QVector<DBGeoCoordinate> buffer;
-        Database::load_all(&buffer);
-        int total = buffer.size();
-        float ftotal = SCAST(float, total);
-        float inserted = 0.0f;
-        float oldPct = 0.0f;
-        float curPct = 0.0f;
-        int percentage = 0;
-
-        if(total > 0){
-            for(DBGeoCoordinate &coord : buffer){
+        QElapsedTimer timer;
+        timer.start();
+
+        // read before streaming, the database thread is busy until a stream ends
+        QGeoCoordinate center = Database::last_coordinate();
+
+        DBLoadStream *stream = nullptr;
+        QVector<DBGeoCoordinate> chunk;
+        bool pending = false;
+        struct snapshot_frame_t frame;
+        if(Snapshot::peek(snapshotPath, &frame)){
+            DBGeoCoordinate anchor;
+            anchor.coord = QGeoCoordinate(frame.anchorLatitude, frame.anchorLongitude);
+            memcpy(anchor.applicationMaskEx, frame.anchorMask, MAX_MASK_SEG);
+            anchor.segCount = frame.anchorSegCount;
+            anchor.seq = -1; // a row count, not its Seq
+
+            stream = Database::stream_all(frame.rows, anchor);
+            pending = stream->take(&chunk);
+            if(stream->is_anchored() && Snapshot::adopt(snapshotPath)){
+                storedRows = frame.rows;
+                snapshotRows = frame.rows;
+                snapshotFrames = frame.index + 1;
+                lastStored = anchor;
+            }else{
+                qDebug() << "Snapshot does not match the session, replaying everything";
+                if(pending) stream->cancel();
+                while(pending) pending = stream->take(&chunk);
+                stream = nullptr;
+            }
+        }
+
+        if(!stream){
+            stream = Database::stream_all();
+            pending = stream->take(&chunk);
+        }
+
+        // the snapshot tail when one was adopted, what the replay starts from
+        Orientation_t reckoned = Metrics::get_orientation_unsafe();
+        bool progressive = center.isValid() && stream->get_total() >= RELOAD_PROGRESSIVE_ROWS;
+        bool skipping = false;
+        qint64 row = storedRows;
+        DBGeoCoordinate previous = lastStored;
+        int oldPct = 0;
+        while(pending){
+            for(DBGeoCoordinate &coord : chunk){
                 QGeoCoordinate qcoord = coord.coord;
                 unsigned char *maskEx = coord.applicationMaskEx;//rev
-                Metrics::load_updateEx(qcoord, maskEx);//rev
-
-                inserted += 1.0f;
-                curPct = (inserted / ftotal) * 100.0f;
-                if(curPct - oldPct > 1 && SCAST(int, inserted) != total){
-                    oldPct = curPct;
-                    percentage = SCAST(int, std::floor(curPct));
-//                    emit loadPercetangeChanged(percentage, 0);
+                if(progressive){
+                    Orientation_t before = reckoned;
+                    Metrics::reckon(&reckoned, qcoord);
+                    if(qcoord.distanceTo(center) > RELOAD_PRIORITY_RADIUS){
+                        if(!skipping){
+                            struct reload_run_t run;
+                            run.first = row;
+                            run.entry = before;
+                            run.anchor = previous;
+                            reloadRuns.push_back(run);
+                        }
+                        reloadRuns.last().last = row + 1;
+                        farRows += 1;
+                        skipping = true;
+                    }else if(skipping){
+                        Metrics::load_jump(before);
+                        skipping = false;
+                    }
                 }
+
+                if(!skipping) Metrics::load_updateEx(qcoord, maskEx);//rev
+                previous = coord;
+                row += 1;
             }
+
+            inserted += chunk.size();
+            lastStored = chunk.last();
+            qint64 total = stream->get_total();
+            if(total > 0){
+                int percentage = SCAST(int, (inserted * 100) / total);
+                if(percentage > oldPct && inserted < total){
+                    oldPct = percentage;
+                    emit loadPercetangeChanged(percentage, 0);
+                }
+            }
+
+            pending = stream->take(&chunk);
         }
+        storedRows += inserted;
+
+        double seconds = timer.nsecsElapsed() / 1000000000.0;
+        double rate = seconds > 0.0 ? inserted / seconds : 0.0;
+        qDebug() << "Loaded" << inserted << "points in" << seconds << "s," << rate << "points/s"
+                 << "(reader waited" << stream->producer_wait_ns() / 1000000 << "ms, replay waited"
+                 << stream->consumer_wait_ns() / 1000000 << "ms)";
+        if(reloadRuns.isEmpty()){
+            emit loadFinished(SCAST(int, inserted), rate);
+            if(storedRows - snapshotRows >= SNAPSHOT_EVERY_ROWS){
+                snapshot = capture_snapshot();
+            }
+        }else{
+            qDebug() << "Replayed" << inserted - farRows << "points near the end of the session,"
+                     << farRows << "in" << reloadRuns.size() << "runs left for the background";
+        }
+    }else{
+        QFile::remove(snapshotPath); // left by an older session with this name
     }
 
-//    qDebug() << "Loaded 100 %";
-//    emit loadPercetangeChanged(100, 1);
+    emit loadPercetangeChanged(100, 1);
 
     Metrics::load_finish();
+
+    // the renderer places the target and draws the final geometry from here on
+    int usable = SCAST(int, usableTimer.elapsed());
+    qDebug() << "Session usable after" << usable << "ms";
+    emit loadUsable(usable);
+
+    if(!snapshot.isEmpty()){
+        save_snapshot(snapshot);
+    }
+
+    if(!reloadRuns.isEmpty()){
+        background_reload(inserted, usableTimer);
+    }
+}
+
+/*
+ * Second half of a progressive reload, reads back the runs internal_init
+ * skipped and replays them while live fixes keep coming. Each batch swaps
+ * the live path state out and back in under the series lock, the events in
+ * between deliver the live fixes. A read is taken whole before that so no
+ * stream is open while other slots run. Stops when the session is closed
+ * or reopened. Section hits are not reported meanwhile, the first fix after
+ * it reports them against the whole session.
+ */
+void GPSProvider::background_reload(qint64 rows, QElapsedTimer sinceOpen){
+    int generation = reloadGeneration;
+    backgroundLoad = true;
+    QElapsedTimer timer;
+    timer.start();
+
+    struct snapshot_tail_t live, far;
+    std::vector<glm::vec3> liveDynamic, farDynamic;
+    bool continuing = false;
+    qint64 replayed = 0;
+    QVector<DBGeoCoordinate> read, chunk;
+    read.reserve(RELOAD_BACKGROUND_READ);
+    for(int r = 0; r < reloadRuns.size(); r += 1){
+        struct reload_run_t run = reloadRuns[r];
+        DBGeoCoordinate anchor = run.anchor;
+        bool entering = true;
+        for(qint64 from = run.first; from < run.last; from += RELOAD_BACKGROUND_READ){
+            DBLoadStream *stream = Database::stream_range(from, qMin(from + RELOAD_BACKGROUND_READ,
+                                                                     run.last), anchor);
+            read.clear();
+            while(stream->take(&chunk)) read += chunk;
+            if(from > 0 && !stream->is_anchored()){
+                qDebug() << "Rows" << from << "to" << run.last << "changed, not replayed";
+                break;
+            }
+            if(read.isEmpty()) break;
+            anchor = read.last();
+
+            for(int first = 0; first < read.size(); first += RELOAD_BACKGROUND_ROWS){
+                int last = qMin(first + RELOAD_BACKGROUND_ROWS, read.size());
+
+                Metrics::lock_for_series_update();
+                Metrics::get_snapshot_tail(&live, &liveDynamic);
+                if(continuing){
+                    far.totalTriangles = Metrics::get_sequence_total();
+                    Metrics::set_snapshot_tail(&far, farDynamic.data());
+                }
+
+                if(entering){
+                    Metrics::load_jump(run.entry);
+                    entering = false;
+                }
+
+                for(int i = first; i < last; i += 1){
+                    Metrics::load_updateEx(read[i].coord, read[i].applicationMaskEx);
+                }
+
+                Metrics::get_snapshot_tail(&far, &farDynamic);
+                continuing = true;
+                live.totalTriangles = Metrics::get_sequence_total();
+                Metrics::set_snapshot_tail(&live, liveDynamic.data());
+                Metrics::unlock_series_update();
+
+                QCoreApplication::processEvents();
+                if(generation != reloadGeneration) return;
+            }
+            replayed += read.size();
+        }
+    }
+
+    double seconds = timer.nsecsElapsed() / 1000000000.0;
+    qDebug() << "Replayed the other" << replayed << "points in the background in"
+             << seconds << "s";
+    backgroundLoad = false;
+    reloadRuns.clear();
+    double total = sinceOpen.nsecsElapsed() / 1000000000.0;
+    emit loadFinished(SCAST(int, rows), total > 0.0 ? rows / total : 0.0);
+
+    if(storedRows - snapshotRows >= SNAPSHOT_EVERY_ROWS){
+        Metrics::lock_for_series_update();
+        QByteArray snapshot = capture_snapshot();
+        Metrics::unlock_series_update();
+        save_snapshot(snapshot);
+    }
 }
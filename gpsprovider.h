@@ -6,10 +6,24 @@
 #include <QList>
 #include <QTimer>
 #include <QMutex>
+#include <QElapsedTimer>
 #include <string>
 #include <common.h>
 #include "database.h"
 
+/*
+ * Reloads replaying at least this many rows are progressive: fixes within
+ * RELOAD_PRIORITY_RADIUS meters of the last stored one are rebuilt first,
+ * the rest after the map is handed over, RELOAD_BACKGROUND_ROWS at a time
+ * between live fixes. The background reads RELOAD_BACKGROUND_READ rows per
+ * query, they all fit in the DBLoadStream so the database thread never
+ * waits on the replay.
+ */
+#define RELOAD_PROGRESSIVE_ROWS 20000
+#define RELOAD_PRIORITY_RADIUS  150.0
+#define RELOAD_BACKGROUND_ROWS  256
+#define RELOAD_BACKGROUND_READ  (DATABASE_LOAD_CHUNK * DATABASE_LOAD_QUEUE)
+
 class GPSProvider : public QObject
 {
     Q_OBJECT
@@ -18,7 +32,9 @@ public:
     void populate(QGeoCoordinate coord);
 
 signals:
-//    void loadPercetangeChanged(int percentage, int done);
+    void loadPercetangeChanged(int percentage, int done);
+    void loadFinished(int rows, double rowsPerSecond);
+    void loadUsable(int milliseconds);
 //    void hitStatusChanged(uchar *hitMask);
     void sectionChanged(int index, int value);
 
@@ -31,6 +47,7 @@ public slots:
      * and not a direct call. Remenber this is a thread.
     */
     void get_available_sessions(QVector<DBSession> *sessions);
+    void get_sessions_near(QGeoCoordinate center, double radius, QVector<DBSession> *sessions);
     void init_database(DBSession session);
     void finalize_database();
 
@@ -39,8 +56,21 @@ private:
     bool initedDb;
     QGeoCoordinate pre;
 
+    /* Rows of the session in the database and the last snapshot, see snapshot.h */
+    QString snapshotPath;
+    qint64 storedRows, snapshotRows;
+    quint32 snapshotFrames; // frames in the snapshot file, 0 writes it whole
+    DBGeoCoordinate lastStored;
+
+    /* Background half of a progressive reload, see RELOAD_PROGRESSIVE_ROWS */
+    bool backgroundLoad;
+    int reloadGeneration;
+
     void internal_init(DBSession session);
     void internal_update(QGeoCoordinate &coord);
+    QByteArray capture_snapshot();
+    void save_snapshot(const QByteArray &data);
+    void background_reload(qint64 rows, QElapsedTimer sinceOpen);
 
 };
 
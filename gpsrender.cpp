@@ -1,7 +1,9 @@
 #include "gpsrender.h"
+#include "gldiagnostics.h"
 #include "polyline2d/include/Polyline2D.h"
 #include <glm/gtx/vector_angle.hpp>
 #include <QFile>
+#include <QtMath>
 
 std::vector<glm::vec4> cPoints;
 
@@ -10,17 +12,28 @@ GPSRenderer::GPSRenderer(){
     program = nullptr;
     programPath = nullptr;
     programPath2 = nullptr;
+    programComposite = nullptr;
+    programTerrain = nullptr;
     handledLoad = false;
     runningES = true; //assume it is ES unless told otherwise
     viewportSize  = QSize(0, 0);
     viewportPoint = QPoint(0, 0);
     pGeometry = Graphics::new_empty_simple_geometry();
-
-    pGrid.plane = Graphics::plane_new(glm::vec3(0.0f),
-                                      glm::vec3(0.0f, 1.0f, 0.0),
-                                      400.0f, 3);
-//                                      20.0f, 15);
-    pGrid.initialize_for(3, pGrid.plane->sideL);
+    sectionLUT.texture = 0;
+    sectionLUT.version = -1;
+    sectionLUT.is_binded = false;
+    frameUniforms.ubo = 0;
+    frameUniforms.is_binded = false;
+    overdrawFrames = 0;
+    coverageTarget.is_binded = false;
+    coverageTarget.width = 0;
+    coverageTarget.height = 0;
+    resolutionScale = 1.0f;
+    resolutionSamples = 0;
+
+    floor.vao = 0;
+    floor.is_binded = false;
+    terrainMesh.is_binded = false;
 
     target = Graphics::target_new(3.0f, 0.2f);
 
@@ -36,6 +49,10 @@ GPSRenderer::GPSRenderer(){
     cache_shaders();
 }
 
+float GPSRenderer::pass_time_ms(RenderPass pass){
+    return passTimer.average_ms(pass);
+}
+
 void GPSRenderer::swap_view_mode(){
     view_system->swap_mode();
 }
@@ -45,13 +62,25 @@ void GPSRenderer::setVisible(bool _visible){
 }
 
 void GPSRenderer::clear_shaders(){
-    if(program)     delete program;
-    if(programPath) delete programPath;
-    if(programPath2) delete programPath2;
+    if(GLfunc){
+        Graphics::coverage_target_release_GL33(&coverageTarget, GLfunc);
+        passTimer.release(GLfunc);
+        Graphics::terrain_mesh_release_GL33(&terrainMesh, GLfunc);
+        terrain.release_gl(GLfunc);
+        background.release_gl(GLfunc);
+    }
+    shaderLibrary.clear();
+    program = nullptr;
+    programPath = nullptr;
+    programPath2 = nullptr;
+    programComposite = nullptr;
+    programTerrain = nullptr;
+    GraphicsDebugger::debuggerShader = nullptr;
 }
 
 GPSRenderer::~GPSRenderer(){
     clear_shaders();
+    GLDiagnostics::finalize();
 }
 
 void GPSRenderer::setViewportSize(const QSize &size){
@@ -65,62 +94,26 @@ void GPSRenderer::setViewportPoint(const QPoint &point){
 void GPSRenderer::cache_shaders(){
     QOpenGLContext *glCtx = QOpenGLContext::currentContext();
     runningES             = glCtx->isOpenGLES();
-    cachedSegVertex       = load_versioned_shader(":/shaders/segment_vertex.glsl");
-    cachedSegFrag         = load_versioned_shader(":/shaders/segment_frag.glsl");
-    cachedInstVertex      = load_versioned_shader(":/shaders/instances_vertex.glsl");
-    cachedInstFrag        = load_versioned_shader(":/shaders/instances_frag.glsl");
-    cachedPathingVertex   = load_versioned_shader(":/shaders/pathing_vertex.glsl");
-    cachedPathingFrag     = load_versioned_shader(":/shaders/pathing_frag.glsl");
-    cachedPathing2Vertex  = load_versioned_shader(":/shaders/pathing2_vertex.glsl");
-    cachedPathing2Frag    = load_versioned_shader(":/shaders/pathing2_frag.glsl");
+    shaderLibrary.load_sources(runningES);
 }
 
-void GPSRenderer::setShaders(){
-    clear_shaders();
-
-    program      = new QOpenGLShaderProgram();
-    programPath  = new QOpenGLShaderProgram();
-    programPath2 = new QOpenGLShaderProgram();
-
-    programPath->addShaderFromSourceCode(QOpenGLShader::Vertex,
-                                         cachedPathingVertex);
-
-    programPath->addShaderFromSourceCode(QOpenGLShader::Fragment,
-                                         cachedPathingFrag);
-
-    programPath2->addShaderFromSourceCode(QOpenGLShader::Vertex,
-                                          cachedPathing2Vertex);
-
-    programPath2->addShaderFromSourceCode(QOpenGLShader::Fragment,
-                                          cachedPathing2Frag);
-
-    program->addShaderFromSourceCode(QOpenGLShader::Vertex,
-                                     cachedSegVertex);
-
-    program->addShaderFromSourceCode(QOpenGLShader::Fragment,
-                                     cachedSegFrag);
+/*
+ * Picks the shader variants matching the current options, variants are
+ * compiled only the first time a configuration is seen so this is cheap
+ * enough to be done every frame.
+ */
+void GPSRenderer::setShaders(const GPSOptions &options){
+    program      = shaderLibrary.get_program(ShaderFloor, options);
+    programPath  = shaderLibrary.get_program(ShaderPathing, options);
+    programPath2 = shaderLibrary.get_program(ShaderPath, options);
+    programComposite = shaderLibrary.get_program(ShaderComposite, options);
+    if(!options.terrainPath.isEmpty()){
+        programTerrain = shaderLibrary.get_program(ShaderTerrain, options);
+    }
 
     GraphicsDebugger::debuggerShader = programPath;
 }
 
-QString GPSRenderer::load_versioned_shader(QString path){
-    QString str;
-    QFile file(path);
-    if(file.open(QFile::ReadOnly)){
-        QTextStream ss(&file);
-        QString code = ss.readAll();
-        if(runningES){
-            str = "#version 300 es\n"
-                  "precision mediump float;\n";
-        }else{
-            str = "#version 330\n";
-        }
-
-        str += code;
-    }
-    return str;
-}
-
 void GPSRenderer::assure_gl_functions(){
     QOpenGLContext *ctx = QOpenGLContext::currentContext();
     if(!ctx){
@@ -155,8 +148,11 @@ void GPSRenderer::init(){
     assure_gl_functions();
     this->initializeOpenGLFunctions();
     qDebug() << "Vendor " << (char *)glGetString(GL_VENDOR);
+    GLDiagnostics::initialize(QOpenGLContext::currentContext());
+    passTimer.initialize(QOpenGLContext::currentContext(), GLfunc);
 
-    setShaders();
+    setShaders(Metrics::get_gps_option());
+    shaderLibrary.report_timings();
 }
 
 void GPSRenderer::zoom_in(){
@@ -216,42 +212,147 @@ void GPSRenderer::render_debug(GPSOptions *options){
 
 void GPSRenderer::render_voxel_triangles(Voxel2D::Voxel *vox, GPSOptions *options){
     if(vox){
-        int triangleCount = (int)vox->trianglesVertex->size() / 3;
-        int maxSize = MAX_TRIANGLES_PER_CALL * 3;
-        if(likely(triangleCount < MAX_TRIANGLES_PER_CALL)){            
-            pGeometry->data  = vox->trianglesVertex;
-            pGeometry->extraEx = vox->trianglesMaskEx;
-
-            Graphics::geometry_simple_bind_GL33(pGeometry, GLfunc);
-            Graphics::path_render_GL33(pGeometry, programPath2,
-                                       view_system, GLfunc, *options);
-        }else{
-            int it = 0;
-            int len = (int)vox->trianglesVertex->size();
-            std::vector<glm::vec3> data, extra;
-            std::vector<glm::mat3> extraEx;//rev
-            while(triangleCount > 0){
-                int amount = it + maxSize > len ? len : it + maxSize;
-                data.insert(data.end(), vox->trianglesVertex->begin() + it,
-                            vox->trianglesVertex->begin() + amount);
-                extraEx.insert(extraEx.end(), vox->trianglesMaskEx->begin() + it,
-                            vox->trianglesMaskEx->begin() + amount);
-
-                qDebug() << "Rendering " << it << " => " << amount;
-                it = amount;
-                pGeometry->data = &data;
-                pGeometry->extraEx = &extraEx;
-                Graphics::geometry_simple_bind_GL33(pGeometry, GLfunc);
-                Graphics::path_render_GL33(pGeometry, programPath2,
-                                           view_system, GLfunc, *options);
-                data.clear();
-                extraEx.clear();
-                triangleCount -= MAX_TRIANGLES_PER_CALL;
-            }
+        pGeometry->data    = vox->trianglesVertex;
+        pGeometry->indices = vox->trianglesIndex;
+        pGeometry->masks   = vox->trianglesMaskEx;
+        pGeometry->origin  = glm::vec2(vox->center.x, vox->center.y);
+        pGeometry->drawIndices = options->sequenceCutoff > 0 ?
+                                 vox->indices_until(options->sequenceCutoff) :
+                                 vox->trianglesIndex->size();
+
+        Graphics::geometry_simple_bind_GL33(pGeometry, GLfunc);
+        Graphics::path_render_GL33(pGeometry, &sectionLUT, programPath2,
+                                   view_system, GLfunc, *options);
+    }
+}
+
+/*
+ * Reads back the path pass when GPSOptions::measureOverdraw is on, the red
+ * channel holds how many path fragments were shaded on each pixel. This
+ * stalls the pipeline, it is only meant for comparing coverage modes.
+ */
+void GPSRenderer::measure_overdraw(){
+    int width  = viewportSize.width();
+    int height = viewportSize.height();
+    if(width <= 0 || height <= 0) return;
+
+    overdrawPixels.resize(width * height * 4);
+    GLfunc->functions->glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    GLfunc->functions->glReadPixels(viewportPoint.x(), viewportPoint.y(), width, height,
+                                    GL_RGBA, GL_UNSIGNED_BYTE, overdrawPixels.data());
+
+    qint64 shaded = 0;
+    int covered = 0, maxCount = 0;
+    for(int i = 0; i < width * height; i += 1){
+        int count = overdrawPixels[4 * i];
+        if(count > 0){
+            covered += 1;
+            shaded += count;
+            if(count > maxCount) maxCount = count;
+        }
+    }
+
+    overdrawFrames += 1;
+    if(overdrawFrames % TARGET_FPS == 0){
+        double average = covered > 0 ? SCAST(double, shaded) / covered : 0.0;
+        qDebug() << "Overdraw: covered " << covered << " pixels, shaded " << shaded
+                 << " fragments, average " << average << " max " << maxCount;
+    }
+}
+
+/*
+ * Moves the path layer scale towards GPSOptions::coverageFrameBudget. The
+ * time is the GPU average of the coverage pass, read from timer queries a
+ * few frames late so the CPU never waits on the GPU. The cost of the pass
+ * follows the pixel count, so the correction is the square root of the time
+ * ratio, it is only applied once it is larger than a small step and after a
+ * resize the average gets RESOLUTION_SETTLE_SAMPLES new samples first.
+ * Without timer queries the layer stays at its current scale.
+ */
+void GPSRenderer::update_resolution_scale(const GPSOptions &options){
+    int samples = passTimer.sample_count(PassCoverage);
+    if(samples - resolutionSamples < RESOLUTION_SETTLE_SAMPLES) return;
+
+    float elapsedMs = passTimer.average_ms(PassCoverage);
+    float budget = options.coverageFrameBudget;
+    if(elapsedMs <= 0.0f || budget <= 0.0f) return;
+
+    if(elapsedMs > budget || elapsedMs < 0.7f * budget){
+        float scale = resolutionScale * qSqrt(0.85f * budget / elapsedMs);
+        scale = qBound(options.minResolutionScale, scale, 1.0f);
+        if(qAbs(scale - resolutionScale) >= 0.05f){
+            resolutionScale = scale;
+            resolutionSamples = samples;
         }
     }
 }
 
+/*
+ * Follows GPSOptions::terrainPath, (re)opening the DEM when it changes, and
+ * streams the tiles around the target. The level of detail follows the
+ * distance from the camera to what it is looking at.
+ */
+void GPSRenderer::update_terrain(const GPSOptions &options){
+    if(terrain.is_open() && terrain.file_path() != options.terrainPath){
+        terrain.close(GLfunc);
+    }
+
+    if(!terrain.is_open() && !options.terrainPath.isEmpty() &&
+       options.terrainPath != failedTerrainPath)
+    {
+        if(!terrain.open(options.terrainPath)){
+            failedTerrainPath = options.terrainPath; // don't retry every frame
+        }
+    }
+
+    target->groundHeight = 0.0f;
+    if(terrain.is_open()){
+        Camera *camera = view_system->get_camera();
+        terrain.update(target->graphicalLocation,
+                       (camera->eye - camera->target).length(), GLfunc);
+        target->groundHeight = terrain.height_at(target->graphicalLocation.x(),
+                                                 target->graphicalLocation.z());
+    }
+}
+
+/*
+ * Ground size of a pixel around the target, from how far one meter east of
+ * it lands on screen.
+ */
+float GPSRenderer::ground_meters_per_pixel(){
+    QMatrix4x4 viewProjection = view_system->get_projection_matrix() *
+                                view_system->get_camera()->get_view_matrix();
+    QVector3D center(target->graphicalLocation.x(), 0, target->graphicalLocation.z());
+    QVector3D a = viewProjection.map(center);
+    QVector3D b = viewProjection.map(center + QVector3D(1, 0, 0));
+    float pixels = QVector2D((b.x() - a.x()) * viewportSize.width()  * 0.5f,
+                             (b.y() - a.y()) * viewportSize.height() * 0.5f).length();
+    return pixels > 0.0f ? 1.0f / pixels : 0.0f;
+}
+
+/*
+ * Same as update_terrain for GPSOptions::backgroundPath. Tiles are placed
+ * relative to the last fix, so nothing is requested before the first one.
+ */
+void GPSRenderer::update_background(const GPSOptions &options){
+    if(background.is_open() && background.file_path() != options.backgroundPath){
+        background.close(GLfunc);
+    }
+
+    if(!background.is_open() && !options.backgroundPath.isEmpty() &&
+       options.backgroundPath != failedBackgroundPath)
+    {
+        if(!background.open(options.backgroundPath)){
+            failedBackgroundPath = options.backgroundPath; // don't retry every frame
+        }
+    }
+
+    if(background.is_open()){
+        background.update(anchorCoordinate, anchorLocation, target->graphicalLocation,
+                          ground_meters_per_pixel(), GLfunc);
+    }
+}
+
 void GPSRenderer::gl_render_scene(){
     /**
      * Render Pipeline:
@@ -262,33 +363,115 @@ void GPSRenderer::gl_render_scene(){
      *          blend equations becomes zero with GL_ZERO, this will erase
      *          previous colors. Disable the depth test and let the triangles
      *          intersect each other, the blend equation will render only
-     *          the most recent which will be correct;
+     *          the most recent which will be correct. With CoverageStencil
+     *          the newest voxels are drawn first and the stencil rejects any
+     *          later fragment on an already written pixel, same result but each
+     *          pixel is shaded once. With GPSOptions::dynamicResolution the
+     *          paths go to coverageTarget at resolutionScale and are then
+     *          composited over the floor, the target stays at full resolution.
+     *          Over a DEM the terrain depth is drawn into the target first;
      *
      *      3 - Restore the blend equation to additive with GL_ONE, GL_ONE
      *          also enable again the depth test with GL_DEPTH_TEST this will
      *          make our target render on top of everything and we are done!
      */
     GPSOptions options = Metrics::get_gps_option();
-
-    GLfunc->functions->glEnable(GL_DEPTH_TEST);
-    GLfunc->functions->glDepthFunc(GL_LEQUAL);
-    if(!pGrid.plane->geometry->is_binded){
-        Graphics::geometry_bind_GL33(pGrid.plane->geometry, GLfunc);
+    setShaders(options);
+    if(!program || !programPath || !programPath2 || !programComposite){
+        return; // no variant ever linked, ShaderLibrary logged why
+    }
+    update_terrain(options);
+    update_background(options);
+    bool newestFirst = options.coverageRenderMode == CoverageStencil;
+    bool offscreen   = options.dynamicResolution && !options.measureOverdraw;
+    passTimer.begin_frame(options.measurePassTimes || offscreen,
+                          options.measurePassTimes, GLfunc);
+    Graphics::frame_uniforms_update_GL33(&frameUniforms, view_system, GLfunc);
+
+    GL_CHK(glEnable(GL_DEPTH_TEST), GLfunc);
+    GL_CHK(glDepthFunc(GL_LEQUAL), GLfunc);
+    passTimer.begin_pass(PassFloor, GLfunc);
+    bool draped = terrain.is_open() && programTerrain;
+    if(!options.backgroundPath.isEmpty()){
+        QOpenGLShaderProgram *ground = draped ? programTerrain : program;
+        ground->bind();
+        background.bind_imagery(ground, GLfunc);
+        ground->release();
     }
 
-    Graphics::plane_grid_render_GL33(&pGrid, program, view_system,GLfunc, options);
+    if(draped){
+        Graphics::terrain_render_GL33(&terrainMesh, &terrain, programTerrain,
+                                      view_system, GLfunc, options);
+    }else{
+        Graphics::floor_render_GL33(&floor, program, view_system, GLfunc, options);
+    }
+    passTimer.end_pass(GLfunc);
+
+    passTimer.begin_pass(PassCoverage, GLfunc);
+
+    int layerWidth   = viewportSize.width();
+    int layerHeight  = viewportSize.height();
+    GLint sceneFramebuffer = 0;
+    if(offscreen){
+        update_resolution_scale(options);
+        layerWidth  = qMax(1, SCAST(int, layerWidth  * resolutionScale));
+        layerHeight = qMax(1, SCAST(int, layerHeight * resolutionScale));
+        Graphics::coverage_target_resize_GL33(&coverageTarget, layerWidth,
+                                              layerHeight, GLfunc);
+
+        GLfunc->functions->glGetIntegerv(GL_FRAMEBUFFER_BINDING, &sceneFramebuffer);
+        GL_CHK(glBindFramebuffer(GL_FRAMEBUFFER, coverageTarget.fbo), GLfunc);
+        GL_CHK(glViewport(0, 0, layerWidth, layerHeight), GLfunc);
+        GL_CHK(glClearColor(0, 0, 0, 0), GLfunc);
+        GL_CHK(glClearStencil(0), GLfunc);
+        GL_CHK(glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT |
+                       GL_STENCIL_BUFFER_BIT), GLfunc);
+
+        if(draped){
+            /*
+             * The layer has its own depth buffer, lay the terrain depth down
+             * again at the layer resolution so hills still hide the paths
+             * behind them. A blit from the scene would need matching depth
+             * formats and a single sampled window surface, neither is ours.
+             */
+            GL_CHK(glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE), GLfunc);
+            Graphics::terrain_render_GL33(&terrainMesh, &terrain, programTerrain,
+                                          view_system, GLfunc, options);
+            GL_CHK(glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE), GLfunc);
+        }
+    }
 
-    GLfunc->functions->glEnable(GL_BLEND);
-    GLfunc->functions->glBlendFunc(GL_ONE, GL_ZERO);
-    GLfunc->functions->glBlendEquation(GL_FUNC_ADD);
+    GL_CHK(glEnable(GL_BLEND), GLfunc);
+    if(options.measureOverdraw){
+        // only the fragment count must be in the color buffer
+        GL_CHK(glClearColor(0, 0, 0, 0), GLfunc);
+        GL_CHK(glClear(GL_COLOR_BUFFER_BIT), GLfunc);
+        GL_CHK(glBlendFunc(GL_ONE, GL_ONE), GLfunc);
+    }else if(offscreen){
+        // alpha is the coverage for the composite pass, always write 1
+        GL_CHK(glBlendColor(0, 0, 0, 1), GLfunc);
+        GL_CHK(glBlendFuncSeparate(GL_ONE, GL_ZERO, GL_CONSTANT_ALPHA, GL_ZERO), GLfunc);
+    }else{
+        GL_CHK(glBlendFunc(GL_ONE, GL_ZERO), GLfunc);
+    }
+    GL_CHK(glBlendEquation(GL_FUNC_ADD), GLfunc);
 
     view_system->compute_vp_matrix();
     pGeometry->data = nullptr;
+    pGeometry->reversed = newestFirst;
+    Graphics::section_lookup_bind_GL33(&sectionLUT, GLfunc);
+    if(!options.terrainPath.isEmpty()){
+        // the uniforms stick to the program, set them once for every container
+        programPath2->bind();
+        terrain.bind_heights(programPath2, GLfunc);
+        programPath2->release();
+    }
 
     if(voxWorld){
         voxWorld->lock_voxels();
         Voxel2D::Voxel *vox = voxWorld->voxelListHead;
         int done = vox ? 0 : 1;
+        visibleVoxels.clear();
         while(!done){
             bool renderVoxel = vox->containerVoxel !=
                                voxWorld->centerVoxel->containerVoxel;
@@ -297,7 +480,7 @@ void GPSRenderer::gl_render_scene(){
             }
 
             if(renderVoxel){
-                render_voxel_triangles(vox, &options);
+                visibleVoxels.push_back(vox);
                 if(options.enableDebugVars){
                     GraphicsDebugger::render_voxel_GL33(vox,
                                                         view_system,
@@ -321,25 +504,70 @@ void GPSRenderer::gl_render_scene(){
             done = vox ? 0 : 1;
         }
 
-        // render the center voxel on top of everything
-        if(voxWorld->centerVoxel){
-            vox = voxWorld->centerVoxel->containerVoxel;
-            render_voxel_triangles(vox, &options);
+        Voxel2D::Voxel *center = voxWorld->centerVoxel ?
+                                 voxWorld->centerVoxel->containerVoxel : nullptr;
+
+        if(newestFirst){
+            /*
+             * Stencil starts at 0 and each written pixel is set to 1, fragments
+             * landing on a pixel with 1 are rejected. Drawing the center voxel
+             * first and the rest in reverse order keeps the same 'most recent
+             * wins' result as the overwrite mode while each pixel is written once.
+             * Discarded fragments (section off) don't touch the stencil so the
+             * older triangles below still show through, like before.
+             */
+            GL_CHK(glEnable(GL_STENCIL_TEST), GLfunc);
+            GL_CHK(glStencilMask(0xFF), GLfunc);
+            GL_CHK(glStencilFunc(GL_NOTEQUAL, 1, 0xFF), GLfunc);
+            GL_CHK(glStencilOp(GL_KEEP, GL_KEEP, GL_REPLACE), GLfunc);
+
+            render_voxel_triangles(center, &options);
+            for(int i = SCAST(int, visibleVoxels.size()) - 1; i >= 0; i -= 1){
+                render_voxel_triangles(visibleVoxels[i], &options);
+            }
+
+            GL_CHK(glDisable(GL_STENCIL_TEST), GLfunc);
+        }else{
+            for(Voxel2D::Voxel *visible : visibleVoxels){
+                render_voxel_triangles(visible, &options);
+            }
+
+            // render the center voxel on top of everything
+            render_voxel_triangles(center, &options);
         }
 
         voxWorld->unlock_voxels();
     }
 
-    GLfunc->functions->glBlendFunc(GL_ONE, GL_ONE);
-    GLfunc->functions->glBlendEquation(GL_FUNC_ADD);
-    GLfunc->functions->glDisable(GL_BLEND);
+    if(options.measureOverdraw){
+        measure_overdraw();
+    }
+
+    if(offscreen){
+        GL_CHK(glBindFramebuffer(GL_FRAMEBUFFER, SCAST(GLuint, sceneFramebuffer)), GLfunc);
+        GL_CHK(glViewport(viewportPoint.x(), viewportPoint.y(),
+                          viewportSize.width(), viewportSize.height()), GLfunc);
+        GL_CHK(glDisable(GL_DEPTH_TEST), GLfunc);
+        GL_CHK(glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA), GLfunc);
+        Graphics::coverage_composite_GL33(&coverageTarget, layerWidth, layerHeight,
+                                          programComposite, GLfunc);
+        GL_CHK(glEnable(GL_DEPTH_TEST), GLfunc);
+    }
+    passTimer.end_pass(GLfunc);
+
+    GL_CHK(glBlendFunc(GL_ONE, GL_ONE), GLfunc);
+    GL_CHK(glBlendEquation(GL_FUNC_ADD), GLfunc);
+    GL_CHK(glDisable(GL_BLEND), GLfunc);
 
     if(!target->geometry->is_binded){
         Graphics::geometry_bind_GL33(target->geometry, GLfunc);
     }
 
+    passTimer.begin_pass(PassTarget, GLfunc);
     Graphics::target_render_GL33(target, programPath, view_system,
                                  GLfunc, options);
+    passTimer.end_pass(GLfunc);
+    passTimer.end_frame();
 
     if(options.enableDebugVars){
         render_debug(&options);
@@ -355,6 +583,11 @@ void GPSRenderer::render(){
         }
 
         Orientation_t oLoc = Metrics::get_orientation_safe(&cPoints, 1);
+        if(oLoc.valid == 1){
+            anchorCoordinate = oLoc.geoCoord;
+            anchorLocation   = QVector3D(oLoc.pos.x, 0, oLoc.pos.z);
+        }
+
         if(oLoc.changed){
             if(!handledLoad){
                 bool isLoading = false;
@@ -379,7 +612,6 @@ void GPSRenderer::render(){
                     target->graphicalLocation    = realPosition;
                     target->differentialAngle    = oLoc.dA;
                     target->differentialDistance = oLoc.distance;
-                    pGrid.update_if_needed(glm::vec3(realPosition.x(), 0.0f, realPosition.z()));
                     handledLoad = true;
                 }
             }else{
@@ -400,7 +632,6 @@ void GPSRenderer::render(){
                 target->graphicalLocation    = realPosition;
                 target->differentialAngle    = oLoc.dA;
                 target->differentialDistance = oLoc.distance;
-                pGrid.update_if_needed(glm::vec3(realPosition.x(), 0.0f, realPosition.z()));
             }
         }
 
@@ -410,8 +641,11 @@ void GPSRenderer::render(){
         view_system->frame_update();
         view_system->update_dimension(width, height);
         glClearColor(0, 0, 0, 1);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        glClearStencil(0);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
         glViewport(viewportPoint.x(), viewportPoint.y(), width, height);
+        GLDiagnostics::begin_frame();
         gl_render_scene();
+        GLDiagnostics::end_frame();
     }
 }
@@ -5,8 +5,17 @@
 #include <QtGui/QOpenGLFunctions>
 #include "graphics.h"
 #include "database.h"
+#include "shaderlibrary.h"
+#include "gputimer.h"
 #include <QTimer>
 
+/*
+ * Coverage pass samples to wait after the path layer is resized before
+ * looking at the time again, the pass average needs that many to forget
+ * the old size (GPUPassTimer weights new samples by 1/8).
+ */
+#define RESOLUTION_SETTLE_SAMPLES 16
+
 class GPSRenderer : public QObject, protected QOpenGLFunctions
 {
     Q_OBJECT
@@ -24,16 +33,21 @@ public:
     void cache_shaders();
     void assure_gl_functions();
     void clear_shaders();
-    QString load_versioned_shader(QString path);
+    float pass_time_ms(RenderPass pass);
 
 public slots:
     void render();
 
 private:
     void init();
-    void setShaders();
+    void setShaders(const GPSOptions &options);
     void render_debug(GPSOptions *options);
     void render_voxel_triangles(Voxel2D::Voxel *vox, GPSOptions *options);
+    void measure_overdraw();
+    void update_resolution_scale(const GPSOptions &options);
+    void update_terrain(const GPSOptions &options);
+    void update_background(const GPSOptions &options);
+    float ground_meters_per_pixel();
 
 private:
     QSize viewportSize;
@@ -41,6 +55,8 @@ private:
     QOpenGLShaderProgram *program;
     QOpenGLShaderProgram *programPath;
     QOpenGLShaderProgram *programPath2;
+    QOpenGLShaderProgram *programComposite;
+    QOpenGLShaderProgram *programTerrain;
     struct OpenGLFunctions *GLfunc;
     View * view_system;
     bool visible;
@@ -48,13 +64,26 @@ private:
     bool handledLoad;
 
     struct geometry_simple_t *pGeometry;
-    struct plane_grid_t pGrid;
+    struct section_lookup_t sectionLUT;
+    struct frame_uniforms_t frameUniforms;
+    std::vector<Voxel2D::Voxel *> visibleVoxels;
+    QVector<uchar> overdrawPixels;
+    int overdrawFrames;
+    struct coverage_target_t coverageTarget;
+    float resolutionScale;
+    int resolutionSamples;
+    GPUPassTimer passTimer;
+    struct floor_t floor;
+    Terrain terrain;
+    struct terrain_mesh_t terrainMesh;
+    QString failedTerrainPath;
+    Background background;
+    QString failedBackgroundPath;
+    QGeoCoordinate anchorCoordinate;
+    QVector3D anchorLocation;
     struct target_t *target;
 
-    QString cachedSegFrag, cachedSegVertex;
-    QString cachedInstFrag, cachedInstVertex;
-    QString cachedPathingVertex, cachedPathingFrag;
-    QString cachedPathing2Vertex, cachedPathing2Frag;
+    ShaderLibrary shaderLibrary;
 };
 
 #endif // GPSRENDER_H
@@ -1,4 +1,5 @@
 #include "gpsview.h"
+#include "gldiagnostics.h"
 #include <QtQuick/QQuickWindow>
 #include <QDebug>
 #include <QMetaObject>
@@ -10,6 +11,9 @@ GPSView::GPSView(QQuickItem *parent) : QQuickItem(parent)
 
     renderer = nullptr;
     isMouseButtonPressed = false;
+    for(int i = 0; i < PassCount; i += 1){
+        passTimes[i] = 0.0f;
+    }
 
     float time_es = 1000.0f / static_cast<float>(TARGET_FPS);
     fps_thread = new QThread();
@@ -51,6 +55,18 @@ void GPSView::sync(){
     renderer->setViewportSize(QSize(static_cast<int>(width()), static_cast<int>(height())));
     renderer->setViewportPoint(QPoint(static_cast<int>(x()), static_cast<int>(y())));
     renderer->render();
+
+    /* the GUI thread is blocked during sync, notify it once it runs again */
+    bool changed = false;
+    for(int i = 0; i < PassCount; i += 1){
+        float value = renderer->pass_time_ms(SCAST(RenderPass, i));
+        changed = changed || value != passTimes[i];
+        passTimes[i] = value;
+    }
+
+    if(changed){
+        QMetaObject::invokeMethod(this, "passTimesChanged", Qt::QueuedConnection);
+    }
 }
 
 void GPSView::swap_control_point_mode(){
@@ -65,6 +81,60 @@ void GPSView::swap_wire_frame_mode(){
     Metrics::update_gps_options(options);
 }
 
+void GPSView::swap_coverage_mode(){
+    GPSOptions options = Metrics::get_gps_option();
+    options.coverageRenderMode = options.coverageRenderMode == CoverageStencil ?
+                                 CoverageOverwrite : CoverageStencil;
+    Metrics::update_gps_options(options);
+}
+
+void GPSView::swap_overdraw_mode(){
+    GPSOptions options = Metrics::get_gps_option();
+    options.measureOverdraw = !options.measureOverdraw;
+    Metrics::update_gps_options(options);
+}
+
+void GPSView::swap_section_colors(){
+    GPSOptions options = Metrics::get_gps_option();
+    options.debugSectionColors = !options.debugSectionColors;
+    Metrics::update_gps_options(options);
+}
+
+void GPSView::swap_resolution_mode(){
+    GPSOptions options = Metrics::get_gps_option();
+    options.dynamicResolution = !options.dynamicResolution;
+    Metrics::update_gps_options(options);
+}
+
+/* Only meaningful on builds with CONFIG += gl_diagnostics */
+void GPSView::swap_gl_diagnostics(){
+    GLDiagnostics::set_enabled(!GLDiagnostics::is_enabled());
+}
+
+void GPSView::swap_pass_timing_mode(){
+    GPSOptions options = Metrics::get_gps_option();
+    options.measurePassTimes = !options.measurePassTimes;
+    Metrics::update_gps_options(options);
+}
+
+/*
+ * Shows the coverage as it was when @fraction (0 to 1) of the triangles of
+ * the session had been inserted, nothing is rebuilt so this can be scrubbed.
+ */
+void GPSView::set_playback_position(qreal fraction){
+    GPSOptions options = Metrics::get_gps_option();
+    qreal clamped = qBound(0.0, fraction, 1.0);
+    unsigned int cutoff = SCAST(unsigned int, clamped * Metrics::get_sequence_total());
+    options.sequenceCutoff = cutoff > 0 ? cutoff : 1;
+    Metrics::update_gps_options(options);
+}
+
+void GPSView::stop_playback(){
+    GPSOptions options = Metrics::get_gps_option();
+    options.sequenceCutoff = 0;
+    Metrics::update_gps_options(options);
+}
+
 void GPSView::onChangedVisible(){
     if(renderer)
         renderer->setVisible(this->isVisible());
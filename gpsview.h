@@ -10,10 +10,19 @@
 class GPSView : public QQuickItem
 {
     Q_OBJECT
+    Q_PROPERTY(float floorPassTime READ floorPassTime NOTIFY passTimesChanged)
+    Q_PROPERTY(float coveragePassTime READ coveragePassTime NOTIFY passTimesChanged)
+    Q_PROPERTY(float targetPassTime READ targetPassTime NOTIFY passTimesChanged)
 
 public:
     GPSView(QQuickItem *parent = nullptr);
     ~GPSView();
+    float floorPassTime() const { return passTimes[PassFloor]; }
+    float coveragePassTime() const { return passTimes[PassCoverage]; }
+    float targetPassTime() const { return passTimes[PassTarget]; }
+
+signals:
+    void passTimesChanged();
 
 public slots:
     void sync();
@@ -24,6 +33,14 @@ public slots:
     void swap_view_mode();
     void swap_wire_frame_mode();
     void swap_control_point_mode();
+    void swap_coverage_mode();
+    void swap_overdraw_mode();
+    void swap_section_colors();
+    void swap_resolution_mode();
+    void swap_gl_diagnostics();
+    void swap_pass_timing_mode();
+    void set_playback_position(qreal fraction);
+    void stop_playback();
 
 //protected:
 //    virtual void mouseReleaseEvent(QMouseEvent *event);
@@ -43,6 +60,7 @@ private:
     GPSRenderer *renderer;
     QTimer *fps_timer;
     QThread *fps_thread;
+    float passTimes[PassCount]; // GPU milliseconds, copied from the renderer on sync
 };
 
 #endif // GPSVIEW_H
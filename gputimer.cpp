@@ -0,0 +1,141 @@
+#include "gputimer.h"
+#include <QDebug>
+
+#ifndef GL_TIME_ELAPSED
+#define GL_TIME_ELAPSED 0x88BF
+#endif
+
+#ifndef GL_GPU_DISJOINT_EXT
+#define GL_GPU_DISJOINT_EXT 0x8FBB
+#endif
+
+static const char *passNames[PassCount] = {
+    "floor", "coverage", "target"
+};
+
+GPUPassTimer::GPUPassTimer(){
+    frame = 0;
+    activePass = -1;
+    logCounter = 0;
+    available = false;
+    running = false;
+    logging = false;
+    checkDisjoint = false;
+    for(int p = 0; p < PassCount; p += 1){
+        averages[p] = 0.0f;
+        samples[p] = 0;
+        for(int f = 0; f < GPU_TIMER_FRAMES; f += 1){
+            queries[f][p] = 0;
+            issued[f][p] = false;
+        }
+    }
+}
+
+void GPUPassTimer::initialize(QOpenGLContext *context, OpenGLFunctions *GLptr){
+    if(available || !context) return;
+
+    if(context->isOpenGLES()){
+        available = context->hasExtension(QByteArrayLiteral("GL_EXT_disjoint_timer_query"));
+        checkDisjoint = available;
+    }else{
+        QPair<int, int> version = context->format().version();
+        available = version >= qMakePair(3, 3) ||
+                    context->hasExtension(QByteArrayLiteral("GL_ARB_timer_query"));
+    }
+
+    if(!available){
+        qDebug() << "Timer queries not supported, pass timing disabled";
+        return;
+    }
+
+    GLptr->extraFunctions->glGenQueries(GPU_TIMER_FRAMES * PassCount, &queries[0][0]);
+    if(checkDisjoint){
+        GLint disjoint = 0; // reading it also clears it
+        GLptr->functions->glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+    }
+}
+
+void GPUPassTimer::release(OpenGLFunctions *GLptr){
+    if(available){
+        GLptr->extraFunctions->glDeleteQueries(GPU_TIMER_FRAMES * PassCount, &queries[0][0]);
+        available = false;
+        running = false;
+    }
+}
+
+bool GPUPassTimer::is_available(){
+    return available;
+}
+
+/*
+ * Collects the queries issued GPU_TIMER_FRAMES frames ago, they share the
+ * slot we are about to reuse. A disjoint event (frequency change, context
+ * loss) invalidates everything in flight so those samples are thrown away.
+ */
+void GPUPassTimer::begin_frame(bool enabled, bool log, OpenGLFunctions *GLptr){
+    running = available && enabled;
+    logging = log;
+    if(!running) return;
+
+    int slot = frame % GPU_TIMER_FRAMES;
+    bool disjoint = false;
+    if(checkDisjoint){
+        GLint value = 0;
+        GLptr->functions->glGetIntegerv(GL_GPU_DISJOINT_EXT, &value);
+        disjoint = value != 0;
+    }
+
+    for(int p = 0; p < PassCount; p += 1){
+        if(!issued[slot][p]) continue;
+        issued[slot][p] = false;
+
+        GLuint ready = 0;
+        GLptr->extraFunctions->glGetQueryObjectuiv(queries[slot][p],
+                                                   GL_QUERY_RESULT_AVAILABLE, &ready);
+        if(!ready || disjoint) continue;
+
+        GLuint elapsed = 0;
+        GLptr->extraFunctions->glGetQueryObjectuiv(queries[slot][p], GL_QUERY_RESULT, &elapsed);
+        float ms = SCAST(float, elapsed) / 1000000.0f;
+        averages[p] = averages[p] > 0.0f ? averages[p] + (ms - averages[p]) * 0.125f : ms;
+        samples[p] += 1;
+    }
+}
+
+void GPUPassTimer::begin_pass(RenderPass pass, OpenGLFunctions *GLptr){
+    if(!running || activePass >= 0) return;
+
+    int slot = frame % GPU_TIMER_FRAMES;
+    GLptr->extraFunctions->glBeginQuery(GL_TIME_ELAPSED, queries[slot][pass]);
+    issued[slot][pass] = true;
+    activePass = pass;
+}
+
+void GPUPassTimer::end_pass(OpenGLFunctions *GLptr){
+    if(activePass < 0) return;
+
+    GLptr->extraFunctions->glEndQuery(GL_TIME_ELAPSED);
+    activePass = -1;
+}
+
+void GPUPassTimer::end_frame(){
+    if(!running) return;
+
+    frame += 1;
+    logCounter += 1;
+    if(logging && logCounter % (TARGET_FPS * 2) == 0){
+        QString msg = "GPU passes (ms):";
+        for(int p = 0; p < PassCount; p += 1){
+            msg += QString(" ") + passNames[p] + " " + QString::number(averages[p], 'f', 3);
+        }
+        qDebug() << msg;
+    }
+}
+
+float GPUPassTimer::average_ms(RenderPass pass){
+    return averages[pass];
+}
+
+int GPUPassTimer::sample_count(RenderPass pass){
+    return samples[pass];
+}
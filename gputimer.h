@@ -0,0 +1,58 @@
+#ifndef GPUTIMER_H
+#define GPUTIMER_H
+#include "common.h"
+#include <QOpenGLContext>
+
+/*
+ * Frames a query result may take to come back. Results are read when the
+ * slot comes around again, if one is still not available it is dropped
+ * instead of waiting on it.
+ */
+#define GPU_TIMER_FRAMES 4
+
+typedef enum{
+    PassFloor = 0, PassCoverage, PassTarget, PassCount
+}RenderPass;
+
+/*
+ * GPU time of each render pass through GL_TIME_ELAPSED queries, needs
+ * ARB_timer_query (core in 3.3) or EXT_disjoint_timer_query on ES. Without
+ * them is_available() is false and every call is a no-op, so callers don't
+ * need to check. The same goes for frames started with @enabled off.
+ *
+ * Passes can't overlap, TIME_ELAPSED queries don't nest. Averages are
+ * exponential with a weight of 1/8 per new sample, roughly the last second
+ * at the usual frame rates. sample_count() tells callers that react to the
+ * averages (dynamic resolution) when a new result came in. The averages are
+ * only printed for frames started with @log on.
+ */
+class GPUPassTimer{
+public:
+    GPUPassTimer();
+    void initialize(QOpenGLContext *context, OpenGLFunctions *GLptr);
+    void release(OpenGLFunctions *GLptr);
+    bool is_available();
+
+    void begin_frame(bool enabled, bool log, OpenGLFunctions *GLptr);
+    void begin_pass(RenderPass pass, OpenGLFunctions *GLptr);
+    void end_pass(OpenGLFunctions *GLptr);
+    void end_frame();
+
+    float average_ms(RenderPass pass);
+    int sample_count(RenderPass pass);
+
+private:
+    GLuint queries[GPU_TIMER_FRAMES][PassCount];
+    bool issued[GPU_TIMER_FRAMES][PassCount];
+    float averages[PassCount];
+    int samples[PassCount];
+    int frame;
+    int activePass;
+    int logCounter;
+    bool available;
+    bool running;
+    bool logging;
+    bool checkDisjoint;
+};
+
+#endif // GPUTIMER_H
@@ -2,6 +2,7 @@
 #include <QDebug>
 #include <QString>
 #include <qmath.h>
+#include <cstddef>
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/gtx/quaternion.hpp>
 #include <glm/gtc/quaternion.hpp>
@@ -9,56 +10,17 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtx/string_cast.hpp>
 #include <QMutex>
+#include <QHash>
 #include "polyline2d/include/Polyline2D.h"
 #include <bits.h>
+#include "gldiagnostics.h"
 
-#define GL_CHK(x, ptr) do{ __gl_clear_errors(ptr); ptr->extraFunctions->x; __gl_validate(#x, __LINE__, __FILE__, ptr);}while(0)
 /****************************************************************************/
 /*                 G R A P H I C S      F U N C T I O N S                   */
 /****************************************************************************/
 
 static glm::vec2 get_segment_and_length();
 
-static std::string
-translateGLError(int errorCode) {
-    std::string error;
-    switch (errorCode)
-    {
-        case GL_INVALID_ENUM:                  error = "INVALID_ENUM"; break;
-        case GL_INVALID_VALUE:                 error = "INVALID_VALUE"; break;
-        case GL_INVALID_OPERATION:             error = "INVALID_OPERATION"; break;
-        case GL_OUT_OF_MEMORY:                 error = "OUT_OF_MEMORY"; break;
-        case GL_INVALID_FRAMEBUFFER_OPERATION: error = "INVALID_FRAMEBUFFER_OPERATION"; break;
-        default: error = "Unknown Error";
-    }
-    return error;
-}
-
-void __gl_clear_errors(OpenGLFunctions *ptr) {
-    while (ptr->functions->glGetError()) {
-        ;
-    }
-}
-
-void __gl_validate(const char *cmd, int line, const char *fileName,
-                   OpenGLFunctions * ptr)
-{
-    (void)(fileName);
-    (void)(line);
-    GLenum val = ptr->functions->glGetError();
-    if (val != GL_NO_ERROR) {
-        QString msg = QString(cmd) + QString(" => ") + QString::number(val);
-        msg += "[ ";
-        msg += translateGLError(val).c_str();
-        msg += " ]";
-        msg += QString("::") + QString(fileName);
-        msg += "::" + QString::number(line);
-        qDebug() << msg;
-        getchar();
-        exit(0);
-    }
-}
-
 static void clear_gl_buffers_GL33(struct geometry_base_t *geometry,
                                   OpenGLFunctions * GLptr)
 {
@@ -82,63 +44,190 @@ static void clear_gl_buffers_GL33(struct geometry_base_t *geometry,
     }
 }
 
+/*
+ * Grows @capacity by half until it can hold @required, buffers are only
+ * re-created when a container larger than anything seen so far shows up.
+ */
+static size_t grow_capacity(size_t capacity, size_t required){
+    if(capacity == 0) capacity = 3 * MAX_TRIANGLES_PER_CALL;
+    while(capacity < required){
+        capacity += capacity / 2;
+    }
+    return capacity;
+}
+
+/*
+ * Uploads the mask table into the integer mask texture, each record takes
+ * two RGBA32UI texels (hit, app) in rows of PATH_MASK_TEXTURE_WIDTH texels.
+ */
+static void upload_path_masks(struct geometry_simple_t *geometry, OpenGLFunctions *GLptr){
+    int texels = SCAST(int, geometry->masks->size()) * 2;
+    int rows   = (texels + PATH_MASK_TEXTURE_WIDTH - 1) / PATH_MASK_TEXTURE_WIDTH;
+    const GLuint *raw = &(geometry->masks->operator[](0).hitMask[0]);
+
+    GL_STAT_UPLOAD(sizeof(GLuint) * 4 * texels);
+    GL_CHK(glBindTexture(GL_TEXTURE_2D, geometry->maskTexture), GLptr);
+    if(rows > geometry->maskRows){
+        int capacity = geometry->maskRows > 0 ? geometry->maskRows : 1;
+        while(capacity < rows) capacity *= 2;
+        GL_CHK(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32UI, PATH_MASK_TEXTURE_WIDTH, capacity,
+                            0, GL_RGBA_INTEGER, GL_UNSIGNED_INT, NULL), GLptr);
+        geometry->maskRows = capacity;
+    }
+
+    int fullRows = texels / PATH_MASK_TEXTURE_WIDTH;
+    int remainder = texels % PATH_MASK_TEXTURE_WIDTH;
+    if(fullRows > 0){
+        GL_CHK(glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, PATH_MASK_TEXTURE_WIDTH, fullRows,
+                               GL_RGBA_INTEGER, GL_UNSIGNED_INT, raw), GLptr);
+    }
+
+    if(remainder > 0){
+        GL_CHK(glTexSubImage2D(GL_TEXTURE_2D, 0, 0, fullRows, remainder, 1,
+                               GL_RGBA_INTEGER, GL_UNSIGNED_INT,
+                               raw + 4 * fullRows * PATH_MASK_TEXTURE_WIDTH), GLptr);
+    }
+    GL_CHK(glBindTexture(GL_TEXTURE_2D, 0), GLptr);
+}
+
+/*
+ * Playback draws only the triangles older than the cutoff, which always are
+ * the start of the index list (see Voxel::indices_until).
+ */
+static size_t drawn_indices(struct geometry_simple_t *geometry){
+    size_t size = geometry->indices->size();
+    return geometry->drawIndices < size ? geometry->drawIndices : size;
+}
+
 /**
  * For dynamic drawing (path) is better to use glBufferSubData
- * instead of re-creating the GPU buffers.
+ * instead of re-creating the GPU buffers. Vertex and index buffers grow
+ * when needed so a container is always uploaded in one go.
  */
 void Graphics::geometry_simple_bind_GL33(struct geometry_simple_t *geometry,
                                          OpenGLFunctions *GLptr)
 {
     if(geometry){
-        if(geometry->data){
-            if(geometry->is_binded){
+        if(geometry->data && geometry->indices && geometry->masks){
+            if(geometry->data->empty() || drawn_indices(geometry) == 0) return;
+
+            if(!geometry->is_binded){
+                GL_CHK(glGenVertexArrays(1, &geometry->vao), GLptr);
                 GL_CHK(glBindVertexArray(geometry->vao), GLptr);
-                GL_CHK(glBindBuffer(GL_ARRAY_BUFFER, geometry->vbo[0]), GLptr);
-                GL_CHK(glBufferSubData(GL_ARRAY_BUFFER, 0,
-                                       3 * sizeof(GLfloat) * geometry->data->size(),
-                                       &(geometry->data->operator[](0))), GLptr);
-
-                GL_CHK(glBindBuffer(GL_ARRAY_BUFFER, geometry->vbo[1]), GLptr);
-                GL_CHK(glBufferSubData(GL_ARRAY_BUFFER, 0,
-                                       sizeof(glm::mat3) * geometry->extraEx->size(),
-                                       &(geometry->extraEx->operator[](0))), GLptr);
-
-               GL_CHK(glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(glm::mat3), (const GLvoid*)0), GLptr);
-               GL_CHK(glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(glm::mat3), (const GLvoid*)12), GLptr);
-               GL_CHK(glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(glm::mat3), (const GLvoid*)24), GLptr);
+                GL_CHK(glGenBuffers(1, &geometry->vbo), GLptr);
+                GL_CHK(glGenBuffers(1, &geometry->ibo), GLptr);
+                GL_CHK(glGenTextures(1, &geometry->maskTexture), GLptr);
+
+                GL_CHK(glBindTexture(GL_TEXTURE_2D, geometry->maskTexture), GLptr);
+                GL_CHK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST), GLptr);
+                GL_CHK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST), GLptr);
+                GL_CHK(glBindTexture(GL_TEXTURE_2D, 0), GLptr);
+
+                GL_CHK(glBindBuffer(GL_ARRAY_BUFFER, geometry->vbo), GLptr);
+                GL_CHK(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geometry->ibo), GLptr);
+
+                /*
+                 * x, z and elevation are fixed point and become floats on the GPU,
+                 * the shader scales them back. Mask index is an integer, it must
+                 * not go through float conversion.
+                 */
+                GLsizei stride = sizeof(path_vertex_t);
+                GL_CHK(glVertexAttribPointer(0, 3, GL_SHORT, GL_FALSE, stride,
+                                             (const GLvoid*)offsetof(path_vertex_t, x)), GLptr);
+                GL_CHK(glVertexAttribPointer(1, 1, GL_SHORT, GL_FALSE, stride,
+                                             (const GLvoid*)offsetof(path_vertex_t, segment)), GLptr);
+                GL_CHK(glVertexAttribIPointer(2, 1, GL_UNSIGNED_INT, stride,
+                                              (const GLvoid*)offsetof(path_vertex_t, mask)), GLptr);
+                GL_CHK(glEnableVertexAttribArray(0), GLptr);
+                GL_CHK(glEnableVertexAttribArray(1), GLptr);
+                GL_CHK(glEnableVertexAttribArray(2), GLptr);
+
+                geometry->vboCapacity = 0;
+                geometry->iboCapacity = 0;
+                geometry->maskRows = 0;
+                geometry->is_binded = true;
             }else{
-                GL_CHK(glGenVertexArrays(1, &geometry->vao), GLptr);
                 GL_CHK(glBindVertexArray(geometry->vao), GLptr);
-                GL_CHK(glGenBuffers(2, geometry->vbo), GLptr);
+                GL_CHK(glBindBuffer(GL_ARRAY_BUFFER, geometry->vbo), GLptr);
+            }
 
-                GL_CHK(glBindBuffer(GL_ARRAY_BUFFER, geometry->vbo[0]), GLptr);
-                GL_CHK(glBufferData(GL_ARRAY_BUFFER,
-                                    9 * sizeof(GLfloat) * MAX_TRIANGLES_PER_CALL,
+            size_t vertices = geometry->data->size();
+            if(vertices > geometry->vboCapacity){
+                geometry->vboCapacity = grow_capacity(geometry->vboCapacity, vertices);
+                GL_CHK(glBufferData(GL_ARRAY_BUFFER, sizeof(path_vertex_t) * geometry->vboCapacity,
                                     NULL, GL_DYNAMIC_DRAW), GLptr);
+            }
+            GL_CHK(glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(path_vertex_t) * vertices,
+                                   &(geometry->data->operator[](0))), GLptr);
+            GL_STAT_UPLOAD(sizeof(path_vertex_t) * vertices);
+
+            /*
+             * Triangles are appended in time order, for newest first rendering
+             * the triangle order is reversed (not the vertices, winding stays).
+             */
+            const GLuint *indexData = &(geometry->indices->operator[](0));
+            size_t indices = drawn_indices(geometry);
+            if(geometry->reversed){
+                geometry->scratch.resize(indices);
+                for(size_t i = 0; i + 2 < indices; i += 3){
+                    size_t r = indices - 3 - i;
+                    geometry->scratch[r + 0] = indexData[i + 0];
+                    geometry->scratch[r + 1] = indexData[i + 1];
+                    geometry->scratch[r + 2] = indexData[i + 2];
+                }
+                indexData = &geometry->scratch[0];
+            }
 
-                GL_CHK(glBufferSubData(GL_ARRAY_BUFFER, 0,
-                                       3 * sizeof(GLfloat) * geometry->data->size(),
-                                       &(geometry->data->operator[](0))), GLptr);
-                GL_CHK(glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, NULL), GLptr);
-
-                GL_CHK(glBindBuffer(GL_ARRAY_BUFFER, geometry->vbo[1]), GLptr);
-                GL_CHK(glBufferData(GL_ARRAY_BUFFER,
-                                    3 * sizeof(glm::mat3) * MAX_TRIANGLES_PER_CALL,
+            /* element buffer binding is part of the VAO state */
+            if(indices > geometry->iboCapacity){
+                geometry->iboCapacity = grow_capacity(geometry->iboCapacity, indices);
+                GL_CHK(glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * geometry->iboCapacity,
                                     NULL, GL_DYNAMIC_DRAW), GLptr);
-
-                GL_CHK(glBufferSubData(GL_ARRAY_BUFFER, 0,
-                                       sizeof(glm::mat3) * geometry->extraEx->size(),
-                                       &(geometry->extraEx->operator[](0))), GLptr);
-
-                GL_CHK(glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(glm::mat3), (const GLvoid*)0), GLptr);
-                GL_CHK(glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(glm::mat3), (const GLvoid*)12), GLptr);
-                GL_CHK(glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(glm::mat3), (const GLvoid*)24), GLptr);
-
-                geometry->is_binded = true;
             }
+            GL_CHK(glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, sizeof(GLuint) * indices,
+                                   indexData), GLptr);
+            GL_STAT_UPLOAD(sizeof(GLuint) * indices);
+
             GL_CHK(glBindBuffer(GL_ARRAY_BUFFER, 0), GLptr);
             GL_CHK(glBindVertexArray(0), GLptr);
+
+            upload_path_masks(geometry, GLptr);
+        }
+    }
+}
+
+/**
+ * The section lookup is a SECTION_LUT_SIZE x 1 integer texture (GL_R8UI) where
+ * each texel holds the section index for that normalized boom position. It is
+ * rebuilt by Metrics whenever the segment configuration changes, here we only
+ * re-upload when the version we hold is outdated.
+ */
+void Graphics::section_lookup_bind_GL33(struct section_lookup_t *lookup,
+                                        OpenGLFunctions *GLptr)
+{
+    if(lookup){
+        // acquire pairs with the bump after the table is written
+        int version = sectionLookupVersion.loadAcquire();
+        if(!lookup->is_binded){
+            GL_CHK(glGenTextures(1, &lookup->texture), GLptr);
+            GL_CHK(glBindTexture(GL_TEXTURE_2D, lookup->texture), GLptr);
+            GL_CHK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST), GLptr);
+            GL_CHK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST), GLptr);
+            GL_CHK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE), GLptr);
+            GL_CHK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE), GLptr);
+            GL_CHK(glPixelStorei(GL_UNPACK_ALIGNMENT, 1), GLptr);
+            GL_CHK(glTexImage2D(GL_TEXTURE_2D, 0, GL_R8UI, SECTION_LUT_SIZE, 1, 0,
+                                GL_RED_INTEGER, GL_UNSIGNED_BYTE, sectionLookup), GLptr);
+            lookup->version = version;
+            lookup->is_binded = true;
+        }else if(lookup->version != version){
+            GL_CHK(glBindTexture(GL_TEXTURE_2D, lookup->texture), GLptr);
+            GL_CHK(glPixelStorei(GL_UNPACK_ALIGNMENT, 1), GLptr);
+            GL_CHK(glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, SECTION_LUT_SIZE, 1,
+                                   GL_RED_INTEGER, GL_UNSIGNED_BYTE, sectionLookup), GLptr);
+            lookup->version = version;
         }
+        GL_CHK(glBindTexture(GL_TEXTURE_2D, 0), GLptr);
     }
 }
 
@@ -373,45 +462,151 @@ static void plane_generate_geometry_aligned(struct plane_t *plane){
     }
 }
 
-static void bind_global_uniforms(QOpenGLShaderProgram *program, View *view_system,
-                                 QVector4D baseColor, QVector4D lineColor,
-                                 QMatrix4x4 modelMatrix, float segLen,
-                                 int totalSegments)
+/*
+ * Uniforms that still change per draw. Everything else lives in the FrameData
+ * block so locations are resolved once per program instead of on every draw.
+ */
+struct program_uniforms_t{
+    int model;
+    int baseColor;
+    int lineColor;
+    int elevation;
+    int inverseViewProjection;
+    int containerOrigin;
+};
+
+static QHash<QOpenGLShaderProgram *, struct program_uniforms_t> programUniforms;
+
+/*
+ * Links (if needed) and binds @program. The first time a program is seen the
+ * FrameData block is attached to FRAME_DATA_BINDING, samplers are pointed to
+ * their units and the per-draw locations are cached.
+ */
+static struct program_uniforms_t bind_program(QOpenGLShaderProgram *program,
+                                              OpenGLFunctions *GLptr)
+{
+    if(!program->isLinked()){
+        program->link();
+    }
+
+    program->bind();
+    GL_STAT_PROGRAM_BIND();
+    QHash<QOpenGLShaderProgram *, struct program_uniforms_t>::iterator it;
+    it = programUniforms.find(program);
+    if(it != programUniforms.end()){
+        return it.value();
+    }
+
+    struct program_uniforms_t uniforms;
+    uniforms.model                 = program->uniformLocation("model");
+    uniforms.baseColor             = program->uniformLocation("baseColor");
+    uniforms.lineColor             = program->uniformLocation("lineColor");
+    uniforms.elevation             = program->uniformLocation("elevation");
+    uniforms.inverseViewProjection = program->uniformLocation("inverseViewProjection");
+    uniforms.containerOrigin       = program->uniformLocation("containerOrigin");
+
+    GLuint blockIndex = GLptr->extraFunctions->glGetUniformBlockIndex(program->programId(),
+                                                                      "FrameData");
+    if(blockIndex != GL_INVALID_INDEX){
+        GL_CHK(glUniformBlockBinding(program->programId(), blockIndex,
+                                     FRAME_DATA_BINDING), GLptr);
+    }
+
+    int lookupUniformLocation = program->uniformLocation("sectionLookup");
+    if(lookupUniformLocation > -1){
+        program->setUniformValue(lookupUniformLocation, 0);
+        GL_STAT_UNIFORM(1);
+    }
+
+    int masksUniformLocation = program->uniformLocation("pathMasks");
+    if(masksUniformLocation > -1){
+        program->setUniformValue(masksUniformLocation, 1);
+        GL_STAT_UNIFORM(1);
+    }
+
+    int layerUniformLocation = program->uniformLocation("coverageLayer");
+    if(layerUniformLocation > -1){
+        program->setUniformValue(layerUniformLocation, 0);
+        GL_STAT_UNIFORM(1);
+    }
+
+    int heightsUniformLocation = program->uniformLocation("terrainHeights");
+    if(heightsUniformLocation > -1){
+        program->setUniformValue(heightsUniformLocation, TERRAIN_TEXTURE_UNIT);
+        GL_STAT_UNIFORM(1);
+    }
+
+    int atlasUniformLocation = program->uniformLocation("backgroundAtlas");
+    if(atlasUniformLocation > -1){
+        program->setUniformValue(atlasUniformLocation, BACKGROUND_TEXTURE_UNIT);
+        GL_STAT_UNIFORM(1);
+    }
+
+    programUniforms.insert(program, uniforms);
+    return uniforms;
+}
+
+static void bind_draw_uniforms(QOpenGLShaderProgram *program,
+                               struct program_uniforms_t &uniforms,
+                               QVector4D baseColor, QVector4D lineColor,
+                               QMatrix4x4 modelMatrix)
 {
+    if(uniforms.model > -1){
+        program->setUniformValue(uniforms.model, modelMatrix);
+        GL_STAT_UNIFORM(1);
+    }
+    if(uniforms.baseColor > -1){
+        program->setUniformValue(uniforms.baseColor, baseColor);
+        GL_STAT_UNIFORM(1);
+    }
+    if(uniforms.lineColor > -1){
+        program->setUniformValue(uniforms.lineColor, lineColor);
+        GL_STAT_UNIFORM(1);
+    }
+}
 
-    int matrixUniformLocation   = program->uniformLocation("projection");
-    int viewUniformLocation     = program->uniformLocation("view");
-    int modelUniformLocation    = program->uniformLocation("model");
-    int viewportUniformLocation = program->uniformLocation("viewportMatrix");
-    int colorUniformLocation    = program->uniformLocation("baseColor");
-    int lineUniformLocation     = program->uniformLocation("lineColor");
-    int segLenUniformLocation   = program->uniformLocation("segmentLength");
-    int segCntUniformLocation   = program->uniformLocation("segmentCount");
-    int zoomLvlUniformLocation  = program->uniformLocation("zoomLevel");
-    int pDataUniformLocation    = program->uniformLocation("pData");
+void Graphics::release_program(QOpenGLShaderProgram *program){
+    programUniforms.remove(program);
+}
 
+/*
+ * Fills the FrameData block for this frame and binds it. The upload is skipped
+ * when nothing changed since the last frame, which is the common case while
+ * the tracker is standing still.
+ */
+void Graphics::frame_uniforms_update_GL33(struct frame_uniforms_t *frame, View *view_system,
+                                          OpenGLFunctions *GLptr)
+{
+    struct frame_data_std140_t data;
+    glm::vec2 segAndLen = get_segment_and_length();
     Camera *camera = view_system->get_camera();
-    if(matrixUniformLocation > -1)
-        program->setUniformValue(matrixUniformLocation, view_system->get_projection_matrix());
-    if(viewUniformLocation > -1)
-        program->setUniformValue(viewUniformLocation, camera->get_view_matrix());
-    if(viewUniformLocation > -1)
-        program->setUniformValue(viewportUniformLocation, view_system->get_viewport_matrix());
-    if(modelUniformLocation > - 1)
-        program->setUniformValue(modelUniformLocation, modelMatrix);
-    if(colorUniformLocation > - 1)
-        program->setUniformValue(colorUniformLocation, baseColor);
-    if(lineUniformLocation > - 1)
-        program->setUniformValue(lineUniformLocation, lineColor);
-    if(segLenUniformLocation > -1)
-        program->setUniformValue(segLenUniformLocation, segLen);
-    if(segCntUniformLocation > -1)
-        program->setUniformValue(segCntUniformLocation, totalSegments);
-    if(zoomLvlUniformLocation > -1)
-        program->setUniformValue(zoomLvlUniformLocation, camera->currentZoomLevel+1);
-    if(pDataUniformLocation > -1)
-        program->setUniformValueArray(pDataUniformLocation,
-                                      configSegments, MAX_SEGMENTS, 1);
+    memset(&data, 0, sizeof(data));
+    memcpy(data.projection, view_system->get_projection_matrix().constData(),
+           sizeof(data.projection));
+    memcpy(data.view, camera->get_view_matrix().constData(), sizeof(data.view));
+    memcpy(data.viewport, view_system->get_viewport_matrix().constData(),
+           sizeof(data.viewport));
+    memcpy(data.pData, configSegments, sizeof(data.pData));
+    data.zoomLevel     = camera->currentZoomLevel + 1;
+    data.segmentCount  = SCAST(GLint, segAndLen.x);
+    data.segmentLength = segAndLen.y;
+
+    if(!frame->is_binded){
+        GL_CHK(glGenBuffers(1, &frame->ubo), GLptr);
+        GL_CHK(glBindBuffer(GL_UNIFORM_BUFFER, frame->ubo), GLptr);
+        GL_CHK(glBufferData(GL_UNIFORM_BUFFER, sizeof(data), &data, GL_DYNAMIC_DRAW), GLptr);
+        GL_STAT_UNIFORM(1);
+        frame->data = data;
+        frame->is_binded = true;
+    }else if(memcmp(&data, &frame->data, sizeof(data)) != 0){
+        GL_CHK(glBindBuffer(GL_UNIFORM_BUFFER, frame->ubo), GLptr);
+        GL_CHK(glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(data), &data), GLptr);
+        GL_STAT_UPLOAD(sizeof(data));
+        GL_STAT_UNIFORM(1);
+        frame->data = data;
+    }
+
+    GL_CHK(glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_DATA_BINDING, frame->ubo), GLptr);
 }
 
 template<typename Vec>
@@ -421,26 +616,20 @@ static void inner_render_triangulation_GL33(std::vector<Vec> *data, GLuint vao,
                                             QVector4D baseColor, QVector4D lineColor,
                                             float elevation)
 {
-    glm::vec2 segAndLen = get_segment_and_length();
     int len = SCAST(int, data->size());
     if(len > 0){
-        int elevationLocation = -1;
-        if(!program->isLinked()){
-            program->link();
-        }
-
-        program->bind();
+        struct program_uniforms_t uniforms = bind_program(program, GLptr);
         GL_CHK(glBindVertexArray(vao), GLptr);
         GL_CHK(glEnableVertexAttribArray(0), GLptr);
         GL_CHK(glEnableVertexAttribArray(1), GLptr);
         GL_CHK(glEnableVertexAttribArray(2), GLptr);
         GL_CHK(glEnableVertexAttribArray(3), GLptr);
 
-        bind_global_uniforms(program, view_system, baseColor, lineColor,
-                             modelMatrix, segAndLen.y, SCAST(int, segAndLen.x));
-        elevationLocation = program->uniformLocation("elevation");
-        if(elevationLocation > -1)
-            program->setUniformValue(elevationLocation, elevation);
+        bind_draw_uniforms(program, uniforms, baseColor, lineColor, modelMatrix);
+        if(uniforms.elevation > -1){
+            program->setUniformValue(uniforms.elevation, elevation);
+            GL_STAT_UNIFORM(1);
+        }
 
         GL_CHK(glDrawArrays(GL_TRIANGLES, 0, len), GLptr);
 
@@ -454,16 +643,6 @@ static void inner_render_triangulation_GL33(std::vector<Vec> *data, GLuint vao,
     }
 }
 
-void Graphics::render_triangulation_GL33(struct geometry_simple_t *geometry, QOpenGLShaderProgram *program,
-                                         View *view_system, OpenGLFunctions *GLptr,
-                                         QVector4D baseColor, QVector4D lineColor)
-{
-    QMatrix4x4 model; model.setToIdentity();
-    inner_render_triangulation_GL33<glm::vec3>(geometry->data, geometry->vao, model, program,
-                                               view_system, GLptr, baseColor, lineColor,
-                                               0.1f);
-}
-
 void Graphics::render_triangulation_GL33(struct geometry_base_t *geometry, QOpenGLShaderProgram *program,
                                          View *view_system, OpenGLFunctions *GLptr,
                                          QVector4D baseColor, QVector4D lineColor)
@@ -478,72 +657,156 @@ void Graphics::render_indexed_triangulation_GL33(struct geometry_base_t *geometr
                                                  View *view_system, OpenGLFunctions * GLptr,
                                                  QVector4D baseColor, QVector4D lineColor)
 {
-    glm::vec2 segAndLen = get_segment_and_length();
-    static int warnMessage = 0;
-    if(!program->isLinked()){
-        program->link();
-    }
-    program->bind();
+    struct program_uniforms_t uniforms = bind_program(program, GLptr);
     GL_CHK(glBindVertexArray(geometry->vao), GLptr);
     GL_CHK(glEnableVertexAttribArray(0), GLptr);
     GL_CHK(glEnableVertexAttribArray(1), GLptr);
     GL_CHK(glEnableVertexAttribArray(2), GLptr);
     GL_CHK(glEnableVertexAttribArray(3), GLptr);
 
-    bind_global_uniforms(program, view_system, baseColor, lineColor,
-                         geometry->modelMatrix, segAndLen.y, SCAST(int, segAndLen.x));
+    bind_draw_uniforms(program, uniforms, baseColor, lineColor, geometry->modelMatrix);
 
     GL_CHK(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geometry->triibo), GLptr);
+    GL_CHK(glDrawElements(GL_TRIANGLES, geometry->triindices.size(),
+                          GL_UNSIGNED_SHORT, (void *)0), GLptr);
+    GL_STAT_TRIANGLES(geometry->triindices.size() / 3);
 
-    /* Temporary: Not ideal but I'm having trouble instancing geometry shaders, will take a look later */
-    int count = static_cast<int>(geometry->qInstancedModels.size());
+    GL_CHK(glDisableVertexAttribArray(0), GLptr);
+    GL_CHK(glDisableVertexAttribArray(1), GLptr);
+    GL_CHK(glDisableVertexAttribArray(2), GLptr);
+    GL_CHK(glDisableVertexAttribArray(3), GLptr);
+    GL_CHK(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0), GLptr);
+    GL_CHK(glBindVertexArray(0), GLptr);
+    program->release();
+}
 
-    if(count > 0){
-        if(warnMessage < 1){
-            qDebug() << "Warning: Inneficient rendering method call [" << count << "], "
-                     << "you should use instancing rendering for this @geometry";
-            warnMessage = 1;
-        }
+/*
+ * Renders the floor grid with a single draw. The vertex shader generates a
+ * triangle covering the whole viewport from gl_VertexID and the fragment shader
+ * unprojects each pixel with the inverse view-projection to find where it hits
+ * the ground, so the cost does not depend on where the tracker is.
+ */
+void Graphics::floor_render_GL33(struct floor_t *floor, QOpenGLShaderProgram *program,
+                                 View *view_system, OpenGLFunctions * GLptr, GPSOptions options)
+{
+    if(!floor->is_binded){
+        GL_CHK(glGenVertexArrays(1, &floor->vao), GLptr);
+        floor->is_binded = true;
+    }
 
-        int modelUniformLocation = program->uniformLocation("model");
-//        int colorUniformLocation = program->uniformLocation("baseColor");
-        for(int i = 0; i < count; i += 1){
-            if(modelUniformLocation > -1){
-                program->setUniformValue(modelUniformLocation, geometry->qInstancedModels.at(i));
-            }
+    QMatrix4x4 model; model.setToIdentity();
+    QVector4D baseColor(options.floorSquareColor, 1.0);
+    QVector4D lineColor(options.floorLinesColor, 1.0);
+    QMatrix4x4 viewProjection = view_system->get_projection_matrix() *
+                                view_system->get_camera()->get_view_matrix();
+
+    struct program_uniforms_t uniforms = bind_program(program, GLptr);
+    bind_draw_uniforms(program, uniforms, baseColor, lineColor, model);
+    if(uniforms.inverseViewProjection > -1){
+        program->setUniformValue(uniforms.inverseViewProjection, viewProjection.inverted());
+        GL_STAT_UNIFORM(1);
+    }
 
-//            if(i == count/2 && colorUniformLocation > -1){
-//                program->setUniformValue(colorUniformLocation, QVector4D(1.0, 0.0, 0.0, 1.0));
-//            }else{
-//                program->setUniformValue(colorUniformLocation, baseColor);
-//            }
+    GL_CHK(glBindVertexArray(floor->vao), GLptr);
+    GL_CHK(glDrawArrays(GL_TRIANGLES, 0, 3), GLptr);
+    GL_STAT_TRIANGLES(1);
+    GL_CHK(glBindVertexArray(0), GLptr);
+    program->release();
+}
 
-            GL_CHK(glDrawElements(GL_TRIANGLES, geometry->triindices.size(),
-                                  GL_UNSIGNED_SHORT, (void *)0), GLptr);
+/*
+ * Builds the (TERRAIN_MESH_RESOLUTION + 1)^2 vertex grid the terrain is
+ * drawn with, positions are in [0, 1] across the tile window.
+ */
+static void terrain_mesh_bind_GL33(struct terrain_mesh_t *mesh, OpenGLFunctions *GLptr){
+    const int side = TERRAIN_MESH_RESOLUTION + 1;
+    std::vector<GLfloat> vertices;
+    std::vector<GLuint> indices;
+    vertices.reserve(side * side * 2);
+    indices.reserve(TERRAIN_MESH_RESOLUTION * TERRAIN_MESH_RESOLUTION * 6);
+
+    for(int j = 0; j < side; j += 1){
+        for(int i = 0; i < side; i += 1){
+            vertices.push_back(SCAST(float, i) / TERRAIN_MESH_RESOLUTION);
+            vertices.push_back(SCAST(float, j) / TERRAIN_MESH_RESOLUTION);
         }
-    }else{
-        GL_CHK(glDrawElements(GL_TRIANGLES, geometry->triindices.size(),
-                              GL_UNSIGNED_SHORT, (void *)0), GLptr);
     }
 
-    GL_CHK(glDisableVertexAttribArray(0), GLptr);
-    GL_CHK(glDisableVertexAttribArray(1), GLptr);
-    GL_CHK(glDisableVertexAttribArray(2), GLptr);
-    GL_CHK(glDisableVertexAttribArray(3), GLptr);
-    GL_CHK(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0), GLptr);
+    for(int j = 0; j < TERRAIN_MESH_RESOLUTION; j += 1){
+        for(int i = 0; i < TERRAIN_MESH_RESOLUTION; i += 1){
+            GLuint v = SCAST(GLuint, j * side + i);
+            indices.push_back(v);
+            indices.push_back(v + side);
+            indices.push_back(v + 1);
+            indices.push_back(v + 1);
+            indices.push_back(v + side);
+            indices.push_back(v + side + 1);
+        }
+    }
+
+    GL_CHK(glGenVertexArrays(1, &mesh->vao), GLptr);
+    GL_CHK(glGenBuffers(1, &mesh->vbo), GLptr);
+    GL_CHK(glGenBuffers(1, &mesh->ebo), GLptr);
+
+    GL_CHK(glBindVertexArray(mesh->vao), GLptr);
+    GL_CHK(glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo), GLptr);
+    GL_CHK(glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(GLfloat),
+                        vertices.data(), GL_STATIC_DRAW), GLptr);
+    GL_STAT_UPLOAD(vertices.size() * sizeof(GLfloat));
+    GL_CHK(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ebo), GLptr);
+    GL_CHK(glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint),
+                        indices.data(), GL_STATIC_DRAW), GLptr);
+    GL_STAT_UPLOAD(indices.size() * sizeof(GLuint));
+    GL_CHK(glEnableVertexAttribArray(0), GLptr);
+    GL_CHK(glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, (void *)0), GLptr);
     GL_CHK(glBindVertexArray(0), GLptr);
-    program->release();
+    GL_CHK(glBindBuffer(GL_ARRAY_BUFFER, 0), GLptr);
+    GL_CHK(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0), GLptr);
+
+    mesh->indexCount = SCAST(GLsizei, indices.size());
+    mesh->is_binded = true;
 }
 
-void Graphics::plane_grid_render_GL33(struct plane_grid_t *pGrid, QOpenGLShaderProgram *program,
-                                       View *view_system, OpenGLFunctions * GLptr, GPSOptions options)
+/*
+ * Replaces the floor when a DEM is loaded. The mesh only covers the tile
+ * window, heights and the window placement come from @terrain. The polygon
+ * offset pushes the ground back so the paths draped on the same heights
+ * win the depth test.
+ */
+void Graphics::terrain_render_GL33(struct terrain_mesh_t *mesh, Terrain *terrain,
+                                   QOpenGLShaderProgram *program, View *view_system,
+                                   OpenGLFunctions *GLptr, GPSOptions options)
 {
-    struct geometry_base_t * geometry = pGrid->plane->geometry;
-    geometry->modelMatrix.setToIdentity();
+    Q_UNUSED(view_system);
+    if(!mesh->is_binded){
+        terrain_mesh_bind_GL33(mesh, GLptr);
+    }
+
+    QMatrix4x4 model; model.setToIdentity();
     QVector4D baseColor(options.floorSquareColor, 1.0);
     QVector4D lineColor(options.floorLinesColor, 1.0);
-    render_indexed_triangulation_GL33(geometry, program, view_system, GLptr,
-                                      baseColor, lineColor);
+
+    struct program_uniforms_t uniforms = bind_program(program, GLptr);
+    bind_draw_uniforms(program, uniforms, baseColor, lineColor, model);
+    terrain->bind_heights(program, GLptr);
+
+    GL_CHK(glEnable(GL_POLYGON_OFFSET_FILL), GLptr);
+    GL_CHK(glPolygonOffset(1.0f, 1.0f), GLptr);
+    GL_CHK(glBindVertexArray(mesh->vao), GLptr);
+    GL_CHK(glDrawElements(GL_TRIANGLES, mesh->indexCount, GL_UNSIGNED_INT, (void *)0), GLptr);
+    GL_STAT_TRIANGLES(mesh->indexCount / 3);
+    GL_CHK(glBindVertexArray(0), GLptr);
+    GL_CHK(glDisable(GL_POLYGON_OFFSET_FILL), GLptr);
+    program->release();
+}
+
+void Graphics::terrain_mesh_release_GL33(struct terrain_mesh_t *mesh, OpenGLFunctions *GLptr){
+    if(mesh->is_binded){
+        GL_CHK(glDeleteVertexArrays(1, &mesh->vao), GLptr);
+        GL_CHK(glDeleteBuffers(1, &mesh->vbo), GLptr);
+        GL_CHK(glDeleteBuffers(1, &mesh->ebo), GLptr);
+        mesh->is_binded = false;
+    }
 }
 
 void Graphics::target_render_GL33(struct target_t *target, QOpenGLShaderProgram *program,
@@ -556,14 +819,142 @@ void Graphics::target_render_GL33(struct target_t *target, QOpenGLShaderProgram
                                       baseColor, baseColor);
 }
 
-void Graphics::path_render_GL33(struct geometry_simple_t *geometry, QOpenGLShaderProgram *program,
-                                View *view_system, OpenGLFunctions *GLptr, GPSOptions options)
+/*
+ * Draws the container currently uploaded in @geometry. Indices are split in
+ * chunks of MAX_TRIANGLES_PER_CALL triangles by offset, no data is copied.
+ */
+void Graphics::path_render_GL33(struct geometry_simple_t *geometry, struct section_lookup_t *lookup,
+                                QOpenGLShaderProgram *program, View *view_system,
+                                OpenGLFunctions *GLptr, GPSOptions options)
 {
+    Q_UNUSED(view_system);
+    if(!geometry->is_binded || !geometry->indices || drawn_indices(geometry) == 0) return;
+
     QMatrix4x4 model; model.setToIdentity();
     QVector4D baseColor(options.normalPathColor, 1.0);
-    inner_render_triangulation_GL33<glm::vec3>(geometry->data, geometry->vao, model, program,
-                                               view_system, GLptr, baseColor, baseColor,
-                                               0.1f);
+    struct program_uniforms_t uniforms = bind_program(program, GLptr);
+    bind_draw_uniforms(program, uniforms, baseColor, baseColor, model);
+    if(uniforms.elevation > -1){
+        program->setUniformValue(uniforms.elevation, 0.1f);
+        GL_STAT_UNIFORM(1);
+    }
+    if(uniforms.containerOrigin > -1){
+        program->setUniformValue(uniforms.containerOrigin,
+                                 geometry->origin.x, geometry->origin.y);
+        GL_STAT_UNIFORM(1);
+    }
+
+    GL_CHK(glActiveTexture(GL_TEXTURE1), GLptr);
+    GL_CHK(glBindTexture(GL_TEXTURE_2D, geometry->maskTexture), GLptr);
+    GL_CHK(glActiveTexture(GL_TEXTURE0), GLptr);
+    GL_CHK(glBindTexture(GL_TEXTURE_2D, lookup->texture), GLptr);
+    GL_CHK(glBindVertexArray(geometry->vao), GLptr);
+
+    int total = SCAST(int, drawn_indices(geometry));
+    int chunk = 3 * MAX_TRIANGLES_PER_CALL;
+    for(int start = 0; start < total; start += chunk){
+        int count = total - start < chunk ? total - start : chunk;
+        GL_CHK(glDrawElements(GL_TRIANGLES, count, GL_UNSIGNED_INT,
+                              (const GLvoid*)(sizeof(GLuint) * start)), GLptr);
+        GL_STAT_TRIANGLES(count / 3);
+    }
+
+    GL_CHK(glBindVertexArray(0), GLptr);
+    GL_CHK(glBindTexture(GL_TEXTURE_2D, 0), GLptr);
+    GL_CHK(glActiveTexture(GL_TEXTURE1), GLptr);
+    GL_CHK(glBindTexture(GL_TEXTURE_2D, 0), GLptr);
+    GL_CHK(glActiveTexture(GL_TEXTURE0), GLptr);
+    program->release();
+}
+
+/*
+ * (Re)allocates the offscreen path layer for a @width x @height region,
+ * rounded up to COVERAGE_TARGET_ALIGN. Depth and stencil share one renderbuffer
+ * so the stencil coverage mode keeps working offscreen.
+ */
+void Graphics::coverage_target_resize_GL33(struct coverage_target_t *target, int width,
+                                           int height, OpenGLFunctions *GLptr)
+{
+    int alignedWidth  = ((width  + COVERAGE_TARGET_ALIGN - 1) / COVERAGE_TARGET_ALIGN) *
+                        COVERAGE_TARGET_ALIGN;
+    int alignedHeight = ((height + COVERAGE_TARGET_ALIGN - 1) / COVERAGE_TARGET_ALIGN) *
+                        COVERAGE_TARGET_ALIGN;
+    if(target->is_binded && target->width == alignedWidth &&
+       target->height == alignedHeight) return;
+
+    if(!target->is_binded){
+        GL_CHK(glGenFramebuffers(1, &target->fbo), GLptr);
+        GL_CHK(glGenTextures(1, &target->color), GLptr);
+        GL_CHK(glGenRenderbuffers(1, &target->depthStencil), GLptr);
+        GL_CHK(glGenVertexArrays(1, &target->vao), GLptr);
+        target->is_binded = true;
+    }
+
+    target->width  = alignedWidth;
+    target->height = alignedHeight;
+
+    GL_CHK(glBindTexture(GL_TEXTURE_2D, target->color), GLptr);
+    GL_CHK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR), GLptr);
+    GL_CHK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR), GLptr);
+    GL_CHK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE), GLptr);
+    GL_CHK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE), GLptr);
+    GL_CHK(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, alignedWidth, alignedHeight, 0,
+                        GL_RGBA, GL_UNSIGNED_BYTE, nullptr), GLptr);
+    GL_CHK(glBindTexture(GL_TEXTURE_2D, 0), GLptr);
+
+    GL_CHK(glBindRenderbuffer(GL_RENDERBUFFER, target->depthStencil), GLptr);
+    GL_CHK(glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8,
+                                 alignedWidth, alignedHeight), GLptr);
+    GL_CHK(glBindRenderbuffer(GL_RENDERBUFFER, 0), GLptr);
+
+    GLint previous = 0;
+    GLptr->functions->glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previous);
+    GL_CHK(glBindFramebuffer(GL_FRAMEBUFFER, target->fbo), GLptr);
+    GL_CHK(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                                  GL_TEXTURE_2D, target->color, 0), GLptr);
+    GL_CHK(glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT,
+                                     GL_RENDERBUFFER, target->depthStencil), GLptr);
+    GLenum status = GLptr->functions->glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if(status != GL_FRAMEBUFFER_COMPLETE){
+        qDebug() << "Coverage target incomplete, status " << status;
+    }
+    GL_CHK(glBindFramebuffer(GL_FRAMEBUFFER, SCAST(GLuint, previous)), GLptr);
+}
+
+void Graphics::coverage_target_release_GL33(struct coverage_target_t *target,
+                                            OpenGLFunctions *GLptr)
+{
+    if(target->is_binded){
+        GL_CHK(glDeleteFramebuffers(1, &target->fbo), GLptr);
+        GL_CHK(glDeleteTextures(1, &target->color), GLptr);
+        GL_CHK(glDeleteRenderbuffers(1, &target->depthStencil), GLptr);
+        GL_CHK(glDeleteVertexArrays(1, &target->vao), GLptr);
+        target->is_binded = false;
+    }
+}
+
+/*
+ * Draws the @width x @height corner of the layer over the currently bound
+ * framebuffer, the caller is responsible for the viewport.
+ */
+void Graphics::coverage_composite_GL33(struct coverage_target_t *target, int width, int height,
+                                       QOpenGLShaderProgram *program, OpenGLFunctions *GLptr)
+{
+    if(!target->is_binded) return;
+
+    bind_program(program, GLptr);
+    program->setUniformValue("layerScale",
+                             QVector2D(SCAST(float, width) / target->width,
+                                       SCAST(float, height) / target->height));
+    GL_STAT_UNIFORM(1);
+
+    GL_CHK(glActiveTexture(GL_TEXTURE0), GLptr);
+    GL_CHK(glBindTexture(GL_TEXTURE_2D, target->color), GLptr);
+    GL_CHK(glBindVertexArray(target->vao), GLptr);
+    GL_CHK(glDrawArrays(GL_TRIANGLES, 0, 3), GLptr);
+    GL_CHK(glBindVertexArray(0), GLptr);
+    GL_CHK(glBindTexture(GL_TEXTURE_2D, 0), GLptr);
+    program->release();
 }
 
 struct target_t * Graphics::target_new(float length, float baseHeight){
@@ -582,6 +973,7 @@ struct target_t * Graphics::target_new(float length, float baseHeight){
     target->differentialDistance = 0.0;
     target->quaternionInited = 0.0;
     target->graphicalRotation = -1.0;
+    target->groundHeight = 0.0f;
     target->geometry->is_binded = false;
     return target;
 }
@@ -619,6 +1011,15 @@ struct plane_t * Graphics::plane_new(glm::vec3 bpoint, glm::vec3 bnormal,
 
 struct geometry_simple_t * Graphics::new_empty_simple_geometry(){
     struct geometry_simple_t *simple = new struct geometry_simple_t;
+    simple->data = nullptr;
+    simple->indices = nullptr;
+    simple->masks = nullptr;
+    simple->origin = glm::vec2(0.0f);
+    simple->vboCapacity = 0;
+    simple->iboCapacity = 0;
+    simple->maskRows = 0;
+    simple->reversed = false;
+    simple->drawIndices = 0;
     simple->is_binded = false;
     return simple;
 }
@@ -639,8 +1040,30 @@ static int anyLoad = 0;
 
 Voxel2D::VoxelWorld *voxWorld = nullptr;
 GLfloat configSegments[MAX_SEGMENTS];
+GLubyte sectionLookup[SECTION_LUT_SIZE];
+QAtomicInt sectionLookupVersion(0);
 std::vector<glm::vec4> controlPoints;
 
+/**
+ * Builds the table used by the path fragment shader to resolve in which
+ * section a fragment lies. This used to be a loop over pData for every fragment,
+ * the result only depends on the normalized position so we sample it once here.
+ * Must be called after configSegments is filled.
+ */
+static void build_section_lookup(int segments, float length){
+    float start = 0.0f;
+    int section = 0;
+    for(int i = 0; i < SECTION_LUT_SIZE; i += 1){
+        float u = (SCAST(float, i) + 0.5f) / SCAST(float, SECTION_LUT_SIZE);
+        while(section < segments - 1 && (start + configSegments[section]) / length <= u){
+            start += configSegments[section];
+            section += 1;
+        }
+        sectionLookup[i] = SCAST(GLubyte, section);
+    }
+    sectionLookupVersion.fetchAndAddRelease(1);
+}
+
 static glm::vec2 get_segment_and_length(){
     QMutexLocker locker(&optionsMutex);
     return glm::vec2(gpsOptions.segments, gpsOptions.length);
@@ -666,6 +1089,11 @@ void Metrics::set_line_state(int line, int isOn)
     path.set_segment_state(line, isOn);
 }
 
+/* Current value of the triangle counter stamped on every inserted triangle */
+unsigned int Metrics::get_sequence_total(){
+    return path.totalTriangles;
+}
+
 // your risk
 void Metrics::update_gps_options(GPSOptions options){
     QMutexLocker locker(&optionsMutex);
@@ -720,6 +1148,7 @@ void Metrics::initialize(GPSOptions options){
         }
     }
 
+    build_section_lookup(options.segments, options.length);
     path.set_segment_count(options.segments);
 }
 
@@ -770,6 +1199,8 @@ void Metrics::initialize()
             configSegments[i] = 0;
         }
     }
+
+    build_section_lookup(preGpsOptions.segments, preGpsOptions.length);
     path.reset_state();
     path.set_segment_count(preGpsOptions.segments);
 //    path.totalTriangles = total;
@@ -782,6 +1213,8 @@ void Metrics::finalize(GPSOptions options)
 
     controlPoints.clear();
     memset(configSegments, 0, sizeof(configSegments));
+    memset(sectionLookup, 0, sizeof(sectionLookup));
+    sectionLookupVersion.fetchAndAddRelease(1);
     path.set_segment_count(0);
 
     delete voxWorld;
@@ -840,7 +1273,7 @@ QMatrix4x4 Metrics::get_target_model_matrix(struct target_t *target){
     glm::mat4 rot = glm::toMat4(target->rotationQuaternion);
     QMatrix4x4 R(glm::value_ptr(rot));
     model.setToIdentity();
-    model.translate(target->graphicalLocation);
+    model.translate(target->graphicalLocation + QVector3D(0, target->groundHeight, 0));
     model = model * R;
     return model;
 }
@@ -933,6 +1366,69 @@ void Metrics::load_updateEx(QGeoCoordinate newLocation, unsigned char* moveMask)
     anyLoad = 1;
 }
 
+/*
+ * Moves @state to @newLocation the way update_orientation moves the
+ * Orientation, without touching the path or the voxels. Replaying every fix
+ * through it from the Orientation at load_start gives the position the fix
+ * is built at, no matter which fixes get geometry.
+ */
+void Metrics::reckon(Orientation_t *state, const QGeoCoordinate &newLocation){
+    if(state->valid != 1){
+        state->valid = 1;
+        state->fromNorthAngle = -1.0;
+        state->geoCoord = newLocation;
+        return;
+    }
+
+    glm::vec3 north(0.0f, 0.0f, 1.0f);
+    double distance  = state->geoCoord.distanceTo(newLocation);
+    double azimuthTo = state->geoCoord.azimuthTo(newLocation);
+    double rAngle    = glm::radians(azimuthTo);
+    double sinAngle  = glm::sin(rAngle);
+    double cosAngle  = glm::cos(rAngle);
+    double dX = north.x * cosAngle  + north.z * sinAngle;
+    double dY = north.y;
+    double dZ = -north.x * sinAngle + north.z * cosAngle;
+
+    glm::vec3 newDir(dX, dY, dZ);
+    newDir = glm::normalize(newDir);
+    double dA = SCAST(double, glm_extend::dp_angle(newDir, state->dir));
+    glm::vec3 transition(dX * distance, dY * distance, dZ * distance);
+    state->realDir = newDir;
+    state->realPos = state->realPos + transition;
+
+    if(!gpsOptions.filterMovement || distance > Metrics::min_dD){
+        state->prevDir = state->dir;
+        state->fromNorthAngle = azimuthTo;
+        state->dir = newDir;
+        state->distance = SCAST(float, distance);
+        state->pos = state->pos + transition;
+        state->geoCoord = newLocation;
+        state->dX = dX;
+        state->dY = dY;
+        state->dZ = dZ;
+        state->dA = dA;
+        state->is_first = 0;
+    }
+}
+
+/*
+ * Continues the replay at @state (see reckon) with a new line, as if the
+ * session started there, so the next fix is joined to it and not to the last
+ * one replayed. Hold the series lock.
+ */
+void Metrics::load_jump(const Orientation_t &state){
+    Orientation = state;
+    Orientation.changed = 1;
+    path.segments.clear();
+    path.clear_dynamic_triangles();
+    path.lastPoint = Vec2{state.pos.x, state.pos.z};
+    path.lastPolyPoint = path.lastPoint;
+    if(voxWorld){
+        voxWorld->update_center_voxel(Vec2{state.pos.x, state.pos.z});
+    }
+}
+
 int Metrics::get_load_vectors(glm::vec3 &last, glm::vec3 &curr,
                               bool &isLoading, float &elevation)
 {
@@ -1098,6 +1594,147 @@ update_data Metrics::update_orientation(QGeoCoordinate newLocation, int &changed
     return ret;
 }
 
+static void point_to_snapshot(const Vec2 &p, struct snapshot_point_t *out){
+    out->x = p.x;
+    out->y = p.y;
+    out->valid = p.valid;
+}
+
+static Vec2 point_from_snapshot(const struct snapshot_point_t &p){
+    Vec2 out{p.x, p.y};
+    out.valid = p.valid;
+    return out;
+}
+
+/*
+ * Copies the state carried between fixes into @tail and the dynamic (not
+ * yet committed) triangles into @dynamic. Hold the series lock.
+ */
+void Metrics::get_snapshot_tail(struct snapshot_tail_t *tail, std::vector<glm::vec3> *dynamic){
+    memset(tail, 0, sizeof(struct snapshot_tail_t));
+    tail->latitude       = Orientation.geoCoord.latitude();
+    tail->longitude      = Orientation.geoCoord.longitude();
+    tail->altitude       = Orientation.geoCoord.altitude();
+    tail->fromNorthAngle = Orientation.fromNorthAngle;
+    tail->dX = Orientation.dX;
+    tail->dY = Orientation.dY;
+    tail->dZ = Orientation.dZ;
+    tail->dA = Orientation.dA;
+    for(int i = 0; i < 3; i += 1){
+        tail->realPos[i] = Orientation.realPos[i];
+        tail->realDir[i] = Orientation.realDir[i];
+        tail->dir[i]     = Orientation.dir[i];
+        tail->prevDir[i] = Orientation.prevDir[i];
+        tail->pos[i]     = Orientation.pos[i];
+        tail->loadLastPos[i] = loadLastPos[i];
+        tail->loadCurrPos[i] = loadCurrPos[i];
+    }
+    tail->distance = Orientation.distance;
+    tail->valid    = Orientation.valid;
+    tail->changed  = Orientation.changed;
+    tail->isFirst  = Orientation.is_first;
+    tail->currentElevation = currentElevation;
+
+    memcpy(tail->currentHitMaskEx, path.currentHitMaskEx, MAX_MASK_SEG);
+    memcpy(tail->movementHitMaskEx, path.movementHitMaskEx, MAX_MASK_SEG);
+    tail->lineCount      = path.lineCount;
+    tail->thickness      = path.thickness;
+    tail->totalTriangles = path.totalTriangles;
+    point_to_snapshot(path.lastPoint, &tail->lastPoint);
+    point_to_snapshot(path.lastPolyPoint, &tail->lastPolyPoint);
+    point_to_snapshot(path.nextStart1, &tail->nextStart1);
+    point_to_snapshot(path.nextStart2, &tail->nextStart2);
+    point_to_snapshot(path.start1, &tail->start1);
+    point_to_snapshot(path.start2, &tail->start2);
+    point_to_snapshot(path.end1, &tail->end1);
+    point_to_snapshot(path.end2, &tail->end2);
+
+    size_t count = path.segments.size();
+    size_t first = count > SNAPSHOT_TAIL_SEGMENTS ? count - SNAPSHOT_TAIL_SEGMENTS : 0;
+    tail->segmentCount = SCAST(qint32, count - first);
+    for(size_t i = first; i < count; i += 1){
+        const PolySegment<Vec2> &seg = path.segments[i];
+        struct snapshot_point_t *out = tail->segments[i - first];
+        point_to_snapshot(seg.center.a, &out[0]);
+        point_to_snapshot(seg.center.b, &out[1]);
+        point_to_snapshot(seg.edge1.a, &out[2]);
+        point_to_snapshot(seg.edge1.b, &out[3]);
+        point_to_snapshot(seg.edge2.a, &out[4]);
+        point_to_snapshot(seg.edge2.b, &out[5]);
+    }
+
+    dynamic->assign(path.dynamicGeometry->positions.begin(),
+                    path.dynamicGeometry->positions.end());
+    tail->dynamicTriangles = SCAST(qint32, dynamic->size() / 3);
+}
+
+/*
+ * Inverse of get_snapshot_tail, continues the path from a snapshot. The
+ * voxel world must already hold the snapshot containers. Hold the series lock.
+ */
+void Metrics::set_snapshot_tail(const struct snapshot_tail_t *tail, const glm::vec3 *dynamic){
+    if(std::isnan(tail->altitude)){
+        Orientation.geoCoord = QGeoCoordinate(tail->latitude, tail->longitude);
+    }else{
+        Orientation.geoCoord = QGeoCoordinate(tail->latitude, tail->longitude, tail->altitude);
+    }
+    Orientation.fromNorthAngle = tail->fromNorthAngle;
+    Orientation.dX = tail->dX;
+    Orientation.dY = tail->dY;
+    Orientation.dZ = tail->dZ;
+    Orientation.dA = tail->dA;
+    Orientation.realPos = glm::vec3(tail->realPos[0], tail->realPos[1], tail->realPos[2]);
+    Orientation.realDir = glm::vec3(tail->realDir[0], tail->realDir[1], tail->realDir[2]);
+    Orientation.dir     = glm::vec3(tail->dir[0], tail->dir[1], tail->dir[2]);
+    Orientation.prevDir = glm::vec3(tail->prevDir[0], tail->prevDir[1], tail->prevDir[2]);
+    Orientation.pos     = glm::vec3(tail->pos[0], tail->pos[1], tail->pos[2]);
+    Orientation.distance = tail->distance;
+    Orientation.valid    = tail->valid;
+    Orientation.changed  = 1;
+    Orientation.is_first = tail->isFirst;
+    currentElevation = tail->currentElevation;
+    loadLastPos = glm::vec3(tail->loadLastPos[0], tail->loadLastPos[1], tail->loadLastPos[2]);
+    loadCurrPos = glm::vec3(tail->loadCurrPos[0], tail->loadCurrPos[1], tail->loadCurrPos[2]);
+    anyLoad = 1;
+
+    memcpy(path.currentHitMaskEx, tail->currentHitMaskEx, MAX_MASK_SEG);
+    memcpy(path.movementHitMaskEx, tail->movementHitMaskEx, MAX_MASK_SEG);
+    path.lineCount      = tail->lineCount;
+    path.thickness      = tail->thickness;
+    path.totalTriangles = tail->totalTriangles;
+    path.lastPoint      = point_from_snapshot(tail->lastPoint);
+    path.lastPolyPoint  = point_from_snapshot(tail->lastPolyPoint);
+    path.nextStart1     = point_from_snapshot(tail->nextStart1);
+    path.nextStart2     = point_from_snapshot(tail->nextStart2);
+    path.start1         = point_from_snapshot(tail->start1);
+    path.start2         = point_from_snapshot(tail->start2);
+    path.end1           = point_from_snapshot(tail->end1);
+    path.end2           = point_from_snapshot(tail->end2);
+
+    path.segments.clear();
+    for(int i = 0; i < tail->segmentCount && i < SNAPSHOT_TAIL_SEGMENTS; i += 1){
+        const struct snapshot_point_t *in = tail->segments[i];
+        LineSegment<Vec2> center(point_from_snapshot(in[0]), point_from_snapshot(in[1]));
+        PolySegment<Vec2> seg(center, 0.0f);
+        seg.edge1 = LineSegment<Vec2>(point_from_snapshot(in[2]), point_from_snapshot(in[3]));
+        seg.edge2 = LineSegment<Vec2>(point_from_snapshot(in[4]), point_from_snapshot(in[5]));
+        path.segments.push_back(seg);
+    }
+
+    path.clear_dynamic_triangles();
+    for(int i = 0; i < tail->dynamicTriangles; i += 1){
+        const glm::vec3 *v = &dynamic[3 * i];
+        path.dynamicGeometry->positions.push_back(v[0]);
+        path.dynamicGeometry->positions.push_back(v[1]);
+        path.dynamicGeometry->positions.push_back(v[2]);
+        path.dynamicGeometry->triangles += 1;
+    }
+
+    if(Orientation.valid == 1 && voxWorld){
+        voxWorld->update_center_voxel(Vec2{Orientation.pos.x, Orientation.pos.z});
+    }
+}
+
 void Metrics::setPath(Pathing *prePath){
     memcpy(prePath->currentHitMaskEx, path.currentHitMaskEx, MAX_MASK_SEG);
     memcpy(prePath->movementHitMaskEx, path.movementHitMaskEx, MAX_MASK_SEG);
@@ -1341,9 +1978,7 @@ void GraphicsDebugger::render_voxel_GL33(Voxel2D::Voxel *vox, View *view_system,
                 debuggerVoxelGeometry->normals   = cube_data;
             }
 
-            glm::vec2 segAndLen = get_segment_and_length();
-
-            debuggerShader->bind();
+            struct program_uniforms_t uniforms = bind_program(debuggerShader, GLptr);
             GraphicsDebugger::bind_simple_geometry_GL33(debuggerVoxelGeometry, GLptr);
             GL_CHK(glBindVertexArray(debuggerVoxelGeometry->vao), GLptr);
             GL_CHK(glEnableVertexAttribArray(0), GLptr);
@@ -1358,9 +1993,7 @@ void GraphicsDebugger::render_voxel_GL33(Voxel2D::Voxel *vox, View *view_system,
             model.translate(QVector3D(vox->center.x, 2.01f, vox->center.y));
             model.scale(QVector3D(scale, 2.0f, scale));
             QVector4D color4(color, 1.0);
-            bind_global_uniforms(debuggerShader, view_system,
-                                 color4, color4, model, segAndLen.y,
-                                 SCAST(int, segAndLen.x));
+            bind_draw_uniforms(debuggerShader, uniforms, color4, color4, model);
 
 //            glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 //            GL_CHK(glDrawArrays(GL_TRIANGLES, 0, 36), GLptr);
@@ -1443,21 +2076,18 @@ void GraphicsDebugger::render_points_GL33(std::vector<glm::vec4>points,
                                           OpenGLFunctions * GLptr)
 {
     if(GraphicsDebugger::debuggerShader){
-        glm::vec2 segAndLen = get_segment_and_length();
         GraphicsDebugger::push_geometry(points, GLptr);
 
         QMatrix4x4 model; model.setToIdentity();
         QVector4D color4(color, 1.0);
 
         GraphicsDebugger::bind_simple_geometry_GL33(debuggerGeometry, GLptr);
-        debuggerShader->bind();
+        struct program_uniforms_t uniforms = bind_program(debuggerShader, GLptr);
         GL_CHK(glBindVertexArray(debuggerGeometry->vao), GLptr);
         GL_CHK(glEnableVertexAttribArray(0), GLptr);
         GL_CHK(glEnableVertexAttribArray(1), GLptr);
 
-        bind_global_uniforms(debuggerShader, view_system,
-                             color4, color4, model, segAndLen.y,
-                             SCAST(int, segAndLen.x));
+        bind_draw_uniforms(debuggerShader, uniforms, color4, color4, model);
         int len = SCAST(int, points.size());
 
         /*
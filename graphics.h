@@ -5,6 +5,9 @@
 #include "pathing.h"
 #include <gpsoptions.h>
 #include <voxel2d.h>
+#include "terrain.h"
+#include "background.h"
+#include "snapshot.h"
 
 /*
  * TODO[Must](Felipe): Agroup all painting/drawing properties inside a Themes class/struct
@@ -89,9 +92,14 @@ public:
     static void load_start();
     static void load_updateEx(QGeoCoordinate newLocation, unsigned char* moveMask);
     static void load_finish();
+    static void reckon(Orientation_t *state, const QGeoCoordinate &newLocation);
+    static void load_jump(const Orientation_t &state);
     static int get_load_vectors(glm::vec3 &last, glm::vec3 &curr,
                                 bool &isLoading, float &elevation);
 
+    static unsigned int get_sequence_total();
+    static void get_snapshot_tail(struct snapshot_tail_t *tail, std::vector<glm::vec3> *dynamic);
+    static void set_snapshot_tail(const struct snapshot_tail_t *tail, const glm::vec3 *dynamic);
     static void setPath(Pathing *prePath);
     static void addPath(Pathing prePath);
 };
@@ -110,11 +118,6 @@ private:
                                           View *view_system, OpenGLFunctions *GLptr,
                                           QVector4D baseColor, QVector4D lineColor);
 
-    static void render_triangulation_GL33(struct geometry_simple_t *geometry,
-                                          QOpenGLShaderProgram *program,
-                                          View *view_system, OpenGLFunctions *GLptr,
-                                          QVector4D baseColor, QVector4D lineColor);
-
     static void render_indexed_triangulation_GL33(struct geometry_base_t *geometry,
                                                   QOpenGLShaderProgram *program,
                                                   View *view_system, OpenGLFunctions * GLptr,
@@ -128,20 +131,44 @@ public:
 
     static struct target_t * target_new(float length, float baseHeight);
 
-    static void plane_grid_render_GL33(struct plane_grid_t *pGrid, QOpenGLShaderProgram *program,
-                                       View *view_system, OpenGLFunctions * GLptr, GPSOptions options);
+    static void floor_render_GL33(struct floor_t *floor, QOpenGLShaderProgram *program,
+                                  View *view_system, OpenGLFunctions * GLptr, GPSOptions options);
+
+    static void terrain_render_GL33(struct terrain_mesh_t *mesh, Terrain *terrain,
+                                    QOpenGLShaderProgram *program, View *view_system,
+                                    OpenGLFunctions *GLptr, GPSOptions options);
+
+    static void terrain_mesh_release_GL33(struct terrain_mesh_t *mesh, OpenGLFunctions *GLptr);
 
     static void target_render_GL33(struct target_t *target, QOpenGLShaderProgram *program,
                                    View *view_system, OpenGLFunctions * GLptr, GPSOptions options);
 
-    static void path_render_GL33(struct geometry_simple_t *geometry, QOpenGLShaderProgram *program,
-                                 View *view_system, OpenGLFunctions *GLptr, GPSOptions options);
+    static void path_render_GL33(struct geometry_simple_t *geometry, struct section_lookup_t *lookup,
+                                 QOpenGLShaderProgram *program, View *view_system,
+                                 OpenGLFunctions *GLptr, GPSOptions options);
 
     static void geometry_bind_GL33(struct geometry_base_t *geometry, OpenGLFunctions * GLptr,
                                    bool instanceSupport = false);
 
     static void geometry_simple_bind_GL33(struct geometry_simple_t *geometry,
                                           OpenGLFunctions *GLptr);
+
+    static void section_lookup_bind_GL33(struct section_lookup_t *lookup,
+                                         OpenGLFunctions *GLptr);
+
+    static void frame_uniforms_update_GL33(struct frame_uniforms_t *frame, View *view_system,
+                                           OpenGLFunctions *GLptr);
+
+    static void coverage_target_resize_GL33(struct coverage_target_t *target, int width,
+                                            int height, OpenGLFunctions *GLptr);
+
+    static void coverage_target_release_GL33(struct coverage_target_t *target,
+                                             OpenGLFunctions *GLptr);
+
+    static void coverage_composite_GL33(struct coverage_target_t *target, int width, int height,
+                                        QOpenGLShaderProgram *program, OpenGLFunctions *GLptr);
+
+    static void release_program(QOpenGLShaderProgram *program);
 };
 
 class GraphicsDebugger{
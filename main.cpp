@@ -32,6 +32,11 @@ int main(int argc, char *argv[]){
 
     format.setSwapInterval(0);
 
+#if defined(GL_DIAGNOSTICS)
+    /* KHR_debug messages are only delivered on debug contexts */
+    format.setOption(QSurfaceFormat::DebugContext);
+#endif
+
     /**
      * Look Qt is a bit weird, we are going to try to request 3.3 but if it can it
      * might return 4.0+. In any case this is only important so that we find if we are
@@ -97,7 +102,8 @@ int main(int argc, char *argv[]){
      * can provide the ability to reload a previous work.
      * The steps to start a session and the database is as follows:
      *          0 [Optional] - Query for your previous sessions so that you
-     *                         see what is saved;
+     *                         see what is saved, 'get_sessions_near' only
+     *                         returns the ones that worked around a position;
      */
     QVector<DBSession> sessions;
     QMetaObject::invokeMethod(provider, "get_available_sessions",
@@ -140,7 +146,11 @@ int main(int argc, char *argv[]){
      * This will start loading any previous saved worked. This process might take a while,
      * if you wish to implement a Loading screen you can make a custom object
      * and connect to the signal 'loadPercetangeChanged' present in the GPSProvider,
-     * it is triggered whenever the loading process increases by 1%.
+     * it is triggered whenever the loading process increases by 1% and once with
+     * (100, 1) when it is over. 'loadFinished' reports the points replayed and
+     * the rate they were loaded at. Large sessions become usable before every
+     * point is replayed, 'loadUsable' reports after how many milliseconds and
+     * 'loadFinished' only comes once the background part is done.
      *
      * QMetaObject::invokeMethod(provider, "init_database", Qt::QueuedConnection,
      *                         Q_ARG(DBSession, target));
@@ -183,6 +193,8 @@ int main(int argc, char *argv[]){
     GPSOptions::setValue(&options.debugCPointsColor,        QVector3D(1.0f, 1.0f, 1.0f));
     GPSOptions::setValue(&options.debugVoxelContainerColor, QVector3D(1.0f, 1.0f, 1.0f));
 //    options.enableDebugVars = true;
+//    options.terrainPath = "field.dem";
+//    options.backgroundPath = "field.mbtiles";
 
     /* reset ALL options, including debug variables */
 //    options.make_default();
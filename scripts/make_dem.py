@@ -0,0 +1,58 @@
+import math
+import struct
+import sys
+
+# Writes a synthetic DEM tile file for the terrain renderer (layout in
+# terrain.h). The heights are a sum of sines plus a ridge, enough to see
+# the paths drape and the level of detail change.
+#
+#   python make_dem.py field.dem [tiles] [tile_size] [levels] [spacing]
+#
+# The grid is centered on the session origin, which is where the renderer
+# places the first fix.
+
+DEM_MAGIC = 0x4d454447
+DEM_VERSION = 1
+
+out = sys.argv[1] if len(sys.argv) > 1 else "field.dem"
+tiles = int(sys.argv[2]) if len(sys.argv) > 2 else 16
+tile_size = int(sys.argv[3]) if len(sys.argv) > 3 else 65
+levels = int(sys.argv[4]) if len(sys.argv) > 4 else 4
+spacing = float(sys.argv[5]) if len(sys.argv) > 5 else 2.0
+
+height_scale = 0.01
+height_offset = -100.0
+extent = tiles * (tile_size - 1) * spacing
+origin = -extent / 2.0
+
+def height(x, z):
+    h = 6.0 * math.sin(x / 90.0) * math.cos(z / 120.0)
+    h += 2.5 * math.sin((x + z) / 35.0)
+    h += 0.8 * math.sin(x / 9.0) * math.sin(z / 11.0)
+    h += 12.0 * math.exp(-((x - 0.3 * z - 150.0) / 60.0) ** 2)
+    return h
+
+def quantize(h):
+    s = int(round((h - height_offset) / height_scale))
+    return max(0, min(65535, s))
+
+with open(out, "wb") as fd:
+    fd.write(struct.pack("<6I5f", DEM_MAGIC, DEM_VERSION, tile_size, levels,
+                         tiles, tiles, origin, origin, spacing,
+                         height_scale, height_offset))
+
+    for level in range(levels):
+        step = spacing * (1 << level)
+        count = (tiles + (1 << level) - 1) >> level
+        for tz in range(count):
+            for tx in range(count):
+                x0 = origin + tx * (tile_size - 1) * step
+                z0 = origin + tz * (tile_size - 1) * step
+                row = []
+                for sz in range(tile_size):
+                    for sx in range(tile_size):
+                        row.append(quantize(height(x0 + sx * step, z0 + sz * step)))
+                fd.write(struct.pack("<%dH" % len(row), *row))
+        print("level %d: %dx%d tiles, %.1f m spacing" % (level, count, count, step))
+
+print("wrote %s, %.0f x %.0f m from (%.0f, %.0f)" % (out, extent, extent, origin, origin))
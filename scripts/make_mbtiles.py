@@ -0,0 +1,82 @@
+import math
+import sqlite3
+import struct
+import sys
+import zlib
+
+# Writes a test MBTiles file for the background layer (see background.h).
+# Tiles are flat colored PNGs with a dark border and a checker pattern, the
+# color changes with the tile coordinates so seams and misplaced tiles are
+# easy to spot.
+#
+#   python make_mbtiles.py field.mbtiles latitude longitude [minzoom] [maxzoom] [radius]
+#
+# Only the tiles within radius tiles of the coordinate are written, use the
+# first fix of the track so the renderer finds them.
+
+TILE = 256
+
+def tile_xy(lat, lon, zoom):
+    n = 1 << zoom
+    x = (lon + 180.0) / 360.0 * n
+    phi = math.radians(lat)
+    y = (1.0 - math.asinh(math.tan(phi)) / math.pi) / 2.0 * n
+    return int(x), int(y)
+
+def png(width, height, pixel):
+    raw = bytearray()
+    for j in range(height):
+        raw.append(0) # no filter
+        for i in range(width):
+            raw.extend(pixel(i, j))
+
+    def chunk(kind, data):
+        body = kind + data
+        return struct.pack(">I", len(data)) + body + struct.pack(">I", zlib.crc32(body) & 0xffffffff)
+
+    header = struct.pack(">IIBBBBB", width, height, 8, 2, 0, 0, 0)
+    return (b"\x89PNG\r\n\x1a\n" + chunk(b"IHDR", header) +
+            chunk(b"IDAT", zlib.compress(bytes(raw), 6)) + chunk(b"IEND", b""))
+
+def tile_image(x, y, zoom):
+    base = ((x * 67) % 160 + 60, (y * 101) % 160 + 60, (zoom * 37) % 160 + 60)
+    def pixel(i, j):
+        if i < 2 or j < 2 or i >= TILE - 2 or j >= TILE - 2:
+            return (20, 20, 20)
+        if ((i // 32) + (j // 32)) % 2:
+            return tuple(c * 3 // 4 for c in base)
+        return base
+    return png(TILE, TILE, pixel)
+
+out = sys.argv[1] if len(sys.argv) > 1 else "field.mbtiles"
+lat = float(sys.argv[2]) if len(sys.argv) > 2 else -23.5505
+lon = float(sys.argv[3]) if len(sys.argv) > 3 else -46.6333
+min_zoom = int(sys.argv[4]) if len(sys.argv) > 4 else 14
+max_zoom = int(sys.argv[5]) if len(sys.argv) > 5 else 19
+radius = int(sys.argv[6]) if len(sys.argv) > 6 else 4
+
+db = sqlite3.connect(out)
+db.execute("DROP TABLE IF EXISTS metadata")
+db.execute("DROP TABLE IF EXISTS tiles")
+db.execute("CREATE TABLE metadata (name TEXT, value TEXT)")
+db.execute("CREATE TABLE tiles (zoom_level INTEGER, tile_column INTEGER, "
+           "tile_row INTEGER, tile_data BLOB)")
+db.execute("CREATE UNIQUE INDEX tile_index ON tiles (zoom_level, tile_column, tile_row)")
+db.executemany("INSERT INTO metadata VALUES (?, ?)",
+               [("name", "test"), ("format", "png"), ("type", "baselayer"),
+                ("minzoom", str(min_zoom)), ("maxzoom", str(max_zoom))])
+
+count = 0
+for zoom in range(min_zoom, max_zoom + 1):
+    cx, cy = tile_xy(lat, lon, zoom)
+    n = 1 << zoom
+    for y in range(max(0, cy - radius), min(n, cy + radius + 1)):
+        for x in range(max(0, cx - radius), min(n, cx + radius + 1)):
+            row = n - 1 - y # TMS
+            db.execute("INSERT INTO tiles VALUES (?, ?, ?, ?)",
+                       (zoom, x, row, sqlite3.Binary(tile_image(x, y, zoom))))
+            count += 1
+
+db.commit()
+db.close()
+print("wrote %d tiles to %s" % (count, out))
@@ -0,0 +1,328 @@
+#include "shaderlibrary.h"
+#include "graphics.h"
+#include "terrain.h"
+#include "background.h"
+#include <QFile>
+#include <QSaveFile>
+#include <QDir>
+#include <QTextStream>
+#include <QStandardPaths>
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QOpenGLContext>
+#include <QOpenGLExtraFunctions>
+#include <QDebug>
+
+/* Bump when the layout of the cache files changes */
+#define SHADER_CACHE_VERSION 1
+
+static const char *vertexPaths[ShaderKindCount] = {
+    ":/shaders/floor_vertex.glsl",
+    ":/shaders/pathing_vertex.glsl",
+    ":/shaders/pathing2_vertex.glsl",
+    ":/shaders/composite_vertex.glsl",
+    ":/shaders/terrain_vertex.glsl",
+};
+
+static const char *fragmentPaths[ShaderKindCount] = {
+    ":/shaders/floor_frag.glsl",
+    ":/shaders/pathing_frag.glsl",
+    ":/shaders/pathing2_frag.glsl",
+    ":/shaders/composite_frag.glsl",
+    ":/shaders/terrain_frag.glsl",
+};
+
+ShaderLibrary::ShaderLibrary(){
+    runningES = true;
+    binarySupport = false;
+    cacheHits = 0;
+    cacheMisses = 0;
+    cacheHitNs = 0;
+    compileNs = 0;
+    for(int i = 0; i < ShaderKindCount; i += 1){
+        lastLinked[i] = nullptr;
+    }
+}
+
+ShaderLibrary::~ShaderLibrary(){
+    clear();
+}
+
+void ShaderLibrary::clear(){
+    for(QOpenGLShaderProgram *program : variants){
+        Graphics::release_program(program);
+        delete program;
+    }
+    variants.clear();
+    failed.clear();
+    for(int i = 0; i < ShaderKindCount; i += 1){
+        lastLinked[i] = nullptr;
+    }
+}
+
+int ShaderLibrary::variant_count(){
+    return variants.size();
+}
+
+QString ShaderLibrary::load_source(QString path){
+    QString code;
+    QFile file(path);
+    if(file.open(QFile::ReadOnly)){
+        QTextStream ss(&file);
+        code = ss.readAll();
+    }else{
+        qDebug() << "Failed to open shader " << path;
+    }
+    return code;
+}
+
+void ShaderLibrary::load_sources(bool isES){
+    if(runningES != isES){
+        clear(); // variants were compiled for another profile
+    }
+
+    runningES = isES;
+    binarySupport = false;
+    driverKey.clear();
+
+    QOpenGLContext *glCtx = QOpenGLContext::currentContext();
+    if(glCtx){
+        QOpenGLExtraFunctions *f = glCtx->extraFunctions();
+        GLint formats = 0;
+        f->glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+        binarySupport = formats > 0;
+        driverKey += reinterpret_cast<const char *>(f->glGetString(GL_VENDOR));
+        driverKey += '|';
+        driverKey += reinterpret_cast<const char *>(f->glGetString(GL_RENDERER));
+        driverKey += '|';
+        driverKey += reinterpret_cast<const char *>(f->glGetString(GL_VERSION));
+    }
+
+    cacheDirectory = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) +
+                     "/shaders";
+    if(binarySupport && !QDir().mkpath(cacheDirectory)){
+        qDebug() << "Could not create shader cache at " << cacheDirectory;
+        binarySupport = false;
+    }
+
+    frameDataSource = load_source(":/shaders/frame_data.glsl");
+    terrainSource   = load_source(":/shaders/terrain_sample.glsl");
+    backgroundSource = load_source(":/shaders/background_sample.glsl");
+    for(int i = 0; i < ShaderKindCount; i += 1){
+        vertexSources[i]   = load_source(vertexPaths[i]);
+        fragmentSources[i] = load_source(fragmentPaths[i]);
+    }
+}
+
+/*
+ * Only the path program depends on the boom layout, keep the other kinds
+ * independent of it or we would compile a copy of them for every session.
+ */
+QString ShaderLibrary::defines_for(ShaderKind kind, const GPSOptions &options){
+    QString defines;
+    if(kind == ShaderPath && options.debugSectionColors){
+        defines += "#define DEBUG_SECTION_COLORS\n";
+    }
+
+    bool draped = kind == ShaderPath && !options.terrainPath.isEmpty();
+    if(kind == ShaderTerrain || draped){
+        defines += "#define TERRAIN\n";
+        defines += "#define TERRAIN_GRID " + QString::number(TERRAIN_GRID) + "\n";
+    }
+
+    bool ground = kind == ShaderFloor || kind == ShaderTerrain;
+    if(ground && !options.backgroundPath.isEmpty()){
+        defines += "#define BACKGROUND\n";
+        defines += "#define BACKGROUND_GRID " + QString::number(BACKGROUND_GRID) + "\n";
+        defines += "#define BACKGROUND_TILE_SIZE " + QString::number(BACKGROUND_TILE_SIZE) + "\n";
+        defines += "#define BACKGROUND_ATLAS_SIDE " + QString::number(BACKGROUND_ATLAS_SIDE) + "\n";
+    }
+
+    if(kind == ShaderPath && options.segments > 0){
+        int count = options.segments > MAX_SEGMENTS ? MAX_SEGMENTS : options.segments;
+        bool uniformWidth = true;
+        for(int i = 1; i < count && uniformWidth; i += 1){
+            uniformWidth = qAbs(options.segmentsLength[i] -
+                                options.segmentsLength[0]) < 1e-4f;
+        }
+
+        defines += "#define SECTION_COUNT " + QString::number(count) + "\n";
+        if(options.measureOverdraw){
+            defines += "#define MEASURE_OVERDRAW\n";
+        }
+        if(options.sectionLoop){
+            defines += "#define SECTION_LOOP\n";
+        }
+        if(uniformWidth){
+            defines += "#define UNIFORM_SECTIONS\n";
+        }
+    }
+
+    return defines;
+}
+
+QString ShaderLibrary::binary_path(const QString &vertex, const QString &fragment){
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(QByteArray::number(SHADER_CACHE_VERSION));
+    hash.addData(driverKey);
+    hash.addData(vertex.toUtf8());
+    hash.addData(fragment.toUtf8());
+    return cacheDirectory + "/" + QString::fromLatin1(hash.result().toHex()) + ".bin";
+}
+
+/*
+ * Cache file layout: GLenum binary format followed by the binary itself.
+ * With no shaders attached QOpenGLShaderProgram::link() only checks the
+ * link status, which is how it learns the binary was accepted.
+ */
+bool ShaderLibrary::load_binary(QOpenGLShaderProgram *program, const QString &path){
+    QFile file(path);
+    if(!file.open(QFile::ReadOnly)) return false;
+
+    QByteArray data = file.readAll();
+    file.close();
+    if(data.size() <= SCAST(int, sizeof(GLenum))) return false;
+
+    GLenum format = 0;
+    memcpy(&format, data.constData(), sizeof(GLenum));
+    if(!program->create()) return false;
+
+    QOpenGLExtraFunctions *f = QOpenGLContext::currentContext()->extraFunctions();
+    f->glProgramBinary(program->programId(), format, data.constData() + sizeof(GLenum),
+                       data.size() - SCAST(int, sizeof(GLenum)));
+    if(!program->link()){
+        QFile::remove(path); // stale, the driver changed under us
+        return false;
+    }
+
+    return true;
+}
+
+void ShaderLibrary::store_binary(QOpenGLShaderProgram *program, const QString &path){
+    QOpenGLExtraFunctions *f = QOpenGLContext::currentContext()->extraFunctions();
+    GLint length = 0;
+    f->glGetProgramiv(program->programId(), GL_PROGRAM_BINARY_LENGTH, &length);
+    if(length <= 0) return;
+
+    QByteArray data(SCAST(int, sizeof(GLenum)) + length, 0);
+    GLenum format = 0;
+    GLsizei written = 0;
+    f->glGetProgramBinary(program->programId(), length, &written, &format,
+                          data.data() + sizeof(GLenum));
+    if(written <= 0) return;
+
+    memcpy(data.data(), &format, sizeof(GLenum));
+    data.resize(SCAST(int, sizeof(GLenum)) + written);
+
+    // written aside and renamed, a crash can't leave a torn binary to load
+    QSaveFile file(path);
+    if(!file.open(QIODevice::WriteOnly) || file.write(data) != data.size() || !file.commit()){
+        qDebug() << "Could not write shader cache " << path << " " << file.errorString();
+    }
+}
+
+void ShaderLibrary::report_timings(){
+    qDebug() << "Shaders: " << cacheHits << " from cache in "
+             << cacheHitNs / 1000000.0 << " ms, " << cacheMisses
+             << " compiled in " << compileNs / 1000000.0 << " ms";
+}
+
+QOpenGLShaderProgram * ShaderLibrary::compile_variant(ShaderKind kind, QString defines){
+    QString preamble;
+    if(runningES){
+        preamble = "#version 300 es\n"
+                   "precision mediump float;\n";
+    }else{
+        preamble = "#version 330\n";
+    }
+
+    preamble += "#define PATH_POSITION_SCALE " + QString::number(PATH_POSITION_SCALE, 'f', 1) + "\n";
+    preamble += defines;
+    preamble += frameDataSource;
+
+    // heights are only read by the vertex stage and imagery by the fragment one
+    QString terrain, background;
+    if(defines.contains("#define TERRAIN\n")){
+        terrain = terrainSource;
+    }
+    if(defines.contains("#define BACKGROUND\n")){
+        background = backgroundSource;
+    }
+
+    QString vertex   = preamble + terrain + "#line 1\n" + vertexSources[kind];
+    QString fragment = preamble + background + "#line 1\n" + fragmentSources[kind];
+    QString path;
+
+    QElapsedTimer timer;
+    timer.start();
+    QOpenGLShaderProgram *program = new QOpenGLShaderProgram();
+    if(binarySupport){
+        path = binary_path(vertex, fragment);
+        if(load_binary(program, path)){
+            cacheHits += 1;
+            cacheHitNs += timer.nsecsElapsed();
+            return program;
+        }
+
+        // a failed glProgramBinary leaves the object unusable, start over
+        delete program;
+        program = new QOpenGLShaderProgram();
+    }
+
+    bool vOk = program->addShaderFromSourceCode(QOpenGLShader::Vertex, vertex);
+    bool fOk = program->addShaderFromSourceCode(QOpenGLShader::Fragment, fragment);
+    if(!vOk || !fOk){
+        qDebug() << "Failed to compile shader variant " << kind << "\n" << defines;
+        delete program;
+        return nullptr;
+    }
+
+    if(binarySupport){
+        QOpenGLContext::currentContext()->extraFunctions()->glProgramParameteri(
+                    program->programId(), GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+
+    if(!program->link()){
+        qDebug() << "Failed to link shader variant " << kind << "\n" << defines
+                 << program->log();
+        delete program;
+        return nullptr;
+    }
+
+    if(binarySupport){
+        store_binary(program, path);
+    }
+
+    cacheMisses += 1;
+    compileNs += timer.nsecsElapsed();
+    return program;
+}
+
+/*
+ * A variant that does not compile or link is never kept, the last variant
+ * of @kind handed out is returned in its place (nullptr when there is none)
+ * and the configuration is not tried again until clear().
+ */
+QOpenGLShaderProgram * ShaderLibrary::get_program(ShaderKind kind, const GPSOptions &options){
+    QString defines = defines_for(kind, options);
+    QString key = QString::number(SCAST(int, kind)) + "|" + defines;
+    QHash<QString, QOpenGLShaderProgram *>::iterator it = variants.find(key);
+    if(it != variants.end()){
+        lastLinked[kind] = it.value();
+        return it.value();
+    }
+
+    if(failed.contains(key)){
+        return lastLinked[kind];
+    }
+
+    QOpenGLShaderProgram *program = compile_variant(kind, defines);
+    if(!program){
+        failed.insert(key);
+        return lastLinked[kind];
+    }
+
+    variants.insert(key, program);
+    lastLinked[kind] = program;
+    return program;
+}
@@ -0,0 +1,95 @@
+#ifndef SHADERLIBRARY_H
+#define SHADERLIBRARY_H
+#include <QOpenGLShaderProgram>
+#include <QHash>
+#include <QSet>
+#include <QString>
+#include <QByteArray>
+#include "gpsoptions.h"
+
+/*
+ * Every program the renderer uses, the library keeps one source pair
+ * per kind and compiles variants of it on demand.
+ */
+enum ShaderKind{
+    ShaderFloor = 0,
+    ShaderPathing,
+    ShaderPath,
+    ShaderComposite,
+    ShaderTerrain,
+    ShaderKindCount
+};
+
+/*
+ * Shader permutation layer. Sources are loaded once from resources and a
+ * preamble is prepended containing the #version line plus a set of defines
+ * that describe the active boom configuration:
+ *
+ *      SECTION_COUNT       - number of sections, replaces the segmentCount uniform;
+ *      UNIFORM_SECTIONS    - all sections have the same width, the section of a
+ *                            fragment can be computed without the lookup table;
+ *      DEBUG_SECTION_COLORS - GPSOptions::debugSectionColors is on, every path
+ *                            section is drawn in its own color;
+ *      MEASURE_OVERDRAW    - path fragments that would be shaded output a count
+ *                            instead of a color, the discards still apply;
+ *      SECTION_LOOP        - GPSOptions::sectionLoop is on, the section of a path
+ *                            fragment is found walking pData like before the
+ *                            lookup table, only the benchmark sets it;
+ *      TERRAIN             - GPSOptions::terrainPath is set, the vertex stage gets
+ *                            terrain_height() from shaders/terrain_sample.glsl
+ *                            and TERRAIN_GRID;
+ *      BACKGROUND          - GPSOptions::backgroundPath is set, the fragment stage
+ *                            of the floor and terrain gets background_color()
+ *                            from shaders/background_sample.glsl.
+ *
+ * The FrameData uniform block (shaders/frame_data.glsl) follows the defines
+ * so every program sees the same per-frame state.
+ *
+ * Each variant is compiled the first time it is requested and kept until
+ * clear() is called, so switching between sessions with different booms
+ * does not recompile anything already seen. Programs are owned by the
+ * library and are linked as soon as they are created, get_program never
+ * returns one that failed to link.
+ *
+ * Linked programs are also kept on disk with glGetProgramBinary, keyed by a
+ * hash of the driver strings and the final sources, so the next start can
+ * skip compiling. A binary the driver refuses (driver update, different GPU)
+ * is removed and the variant is compiled from source again.
+ */
+class ShaderLibrary{
+public:
+    ShaderLibrary();
+    ~ShaderLibrary();
+    void load_sources(bool isES);
+    void clear();
+    QOpenGLShaderProgram * get_program(ShaderKind kind, const GPSOptions &options);
+    int variant_count();
+    void report_timings();
+
+    static QString defines_for(ShaderKind kind, const GPSOptions &options);
+
+private:
+    QString load_source(QString path);
+    QOpenGLShaderProgram * compile_variant(ShaderKind kind, QString defines);
+    QString binary_path(const QString &vertex, const QString &fragment);
+    bool load_binary(QOpenGLShaderProgram *program, const QString &path);
+    void store_binary(QOpenGLShaderProgram *program, const QString &path);
+
+    QHash<QString, QOpenGLShaderProgram *> variants;
+    QSet<QString> failed;
+    QOpenGLShaderProgram *lastLinked[ShaderKindCount];
+    QString frameDataSource;
+    QString terrainSource;
+    QString backgroundSource;
+    QString vertexSources[ShaderKindCount];
+    QString fragmentSources[ShaderKindCount];
+    bool runningES;
+    bool binarySupport;
+    QString cacheDirectory;
+    QByteArray driverKey;
+
+    int cacheHits, cacheMisses;
+    qint64 cacheHitNs, compileNs;
+};
+
+#endif // SHADERLIBRARY_H
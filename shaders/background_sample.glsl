@@ -0,0 +1,31 @@
+/*
+ * Background imagery, fragment stage only and only with BACKGROUND defined.
+ * The BACKGROUND_GRID x BACKGROUND_GRID tiles around the camera live in
+ * slots of backgroundAtlas, backgroundSlots maps each of them to its slot
+ * or to -1 while it is not decoded yet.
+ *
+ * backgroundWindow: world x of the west edge, world z of the north edge,
+ * tile width and height in meters. Tile rows go south, like image rows.
+ */
+uniform highp sampler2D backgroundAtlas;
+uniform highp vec4 backgroundWindow;
+uniform highp int backgroundSlots[BACKGROUND_GRID * BACKGROUND_GRID];
+
+/* Imagery color at xz, alpha is 0 where there is no tile */
+highp vec4 background_color(highp vec2 xz){
+    highp vec2 local = vec2(xz.x - backgroundWindow.x, backgroundWindow.y - xz.y) /
+                       backgroundWindow.zw;
+    ivec2 cell = ivec2(floor(local));
+    if(any(lessThan(cell, ivec2(0))) || any(greaterThanEqual(cell, ivec2(BACKGROUND_GRID))))
+        return vec4(0.0);
+
+    int slot = backgroundSlots[cell.y * BACKGROUND_GRID + cell.x];
+    if(slot < 0) return vec4(0.0);
+
+    // half a texel inset so the filter never reads the neighbour slot
+    highp vec2 texel = vec2(0.5) + (local - vec2(cell)) * float(BACKGROUND_TILE_SIZE - 1);
+    highp vec2 corner = vec2(float(slot % BACKGROUND_ATLAS_SIDE),
+                             float(slot / BACKGROUND_ATLAS_SIDE)) * float(BACKGROUND_TILE_SIZE);
+    highp vec2 uv = (corner + texel) / float(BACKGROUND_TILE_SIZE * BACKGROUND_ATLAS_SIDE);
+    return vec4(texture(backgroundAtlas, uv).rgb, 1.0);
+}
@@ -0,0 +1,23 @@
+#ifdef GL_ES
+out vec4 OUT_COLOR_VAR;
+uniform highp sampler2D coverageLayer;
+in highp vec2 layerCoord;
+#else
+#define OUT_COLOR_VAR fragColor
+out vec4 fragColor;
+
+uniform sampler2D coverageLayer;
+in vec2 layerCoord;
+#endif
+
+/*
+ * The layer is cleared to zero and every path fragment writes alpha 1, so
+ * after filtering rgb is already weighted by coverage and alpha is the
+ * coverage itself. Blended with ONE, ONE_MINUS_SRC_ALPHA this replaces the
+ * floor where paths were drawn and smooths the upscaled edges.
+ */
+void main(void){
+    vec4 layer = texture(coverageLayer, layerCoord);
+    if(layer.a <= 0.0) discard;
+    OUT_COLOR_VAR = layer;
+}
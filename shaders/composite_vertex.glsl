@@ -0,0 +1,17 @@
+#ifdef GL_ES
+uniform highp vec2 layerScale;
+out highp vec2 layerCoord;
+#else
+uniform vec2 layerScale;
+out vec2 layerCoord;
+#endif
+
+/*
+ * Same fullscreen triangle as the floor. The layer texture is allocated in
+ * aligned sizes so only the layerScale corner of it holds the rendered paths.
+ */
+void main() {
+    vec2 p = vec2(float((gl_VertexID << 1) & 2), float(gl_VertexID & 2));
+    layerCoord = p * layerScale;
+    gl_Position = vec4(p * 2.0 - 1.0, 0.0, 1.0);
+}
@@ -0,0 +1,58 @@
+#ifdef GL_ES
+out vec4 OUT_COLOR_VAR;
+uniform highp vec4 baseColor;
+uniform highp vec4 lineColor;
+uniform highp mat4 inverseViewProjection;
+in highp vec2 ndcPosition;
+#else
+#define OUT_COLOR_VAR fragColor
+out vec4 fragColor;
+
+uniform vec4 baseColor;
+uniform vec4 lineColor;
+uniform mat4 inverseViewProjection;
+in vec2 ndcPosition;
+#endif
+
+float get_grad_scale(){
+    if(zoomLevel < 3) return 0.05;
+    if(zoomLevel < 5) return 0.07;
+    return 0.1;
+}
+
+/*
+ * World positions are reconstructed per fragment, highp on ES where the
+ * preamble defaults to mediump: at 16 bits the grid swims and the depth is
+ * off a few hundred meters from the origin.
+ */
+highp vec3 unproject(highp vec2 ndc, highp float z){
+    highp vec4 p = inverseViewProjection * vec4(ndc, z, 1.0);
+    return p.xyz / p.w;
+}
+
+void main(void){
+    highp vec3 nearPoint = unproject(ndcPosition, -1.0);
+    highp vec3 farPoint  = unproject(ndcPosition,  1.0);
+    highp vec3 ray = farPoint - nearPoint;
+    if(abs(ray.y) < 1e-6) discard;
+
+    // floor is the y = 0 plane, anything outside [near, far] is clipped
+    highp float t = -nearPoint.y / ray.y;
+    if(t < 0.0 || t > 1.0) discard;
+    highp vec3 vPosition = nearPoint + t * ray;
+
+    vec2 stepSize = vec2(8.5);
+    highp vec2 coord = vPosition.xz / stepSize;
+    highp vec2 frac = fract(coord);
+    float grad = get_grad_scale();
+    vec2 mult = smoothstep(0.0, grad, frac) - smoothstep(1.0-grad, 1.0, frac);
+    vec3 col = mix(lineColor.rgb, baseColor.rgb, mult.x * mult.y);
+#ifdef BACKGROUND
+    vec4 imagery = background_color(vPosition.xz);
+    col = mix(col, imagery.rgb, imagery.a);
+#endif
+
+    highp vec4 clip = projection * view * vec4(vPosition, 1.0);
+    gl_FragDepth = 0.5 * (clip.z / clip.w) + 0.5;
+    OUT_COLOR_VAR = vec4(col, 0.0);
+}
@@ -0,0 +1,15 @@
+#ifdef GL_ES
+out highp vec2 ndcPosition;
+#else
+out vec2 ndcPosition;
+#endif
+
+/*
+ * No attributes, the three vertices of a triangle covering the
+ * viewport are generated from the vertex index: (-1,-1) (3,-1) (-1,3).
+ */
+void main() {
+    vec2 p = vec2(float((gl_VertexID << 1) & 2), float(gl_VertexID & 2));
+    ndcPosition = p * 2.0 - 1.0;
+    gl_Position = vec4(ndcPosition, 0.0, 1.0);
+}
@@ -0,0 +1,14 @@
+/*
+ * Per frame state shared by every program, uploaded once per frame by
+ * Graphics::frame_uniforms_update_GL33. Layout must match frame_data_std140_t.
+ */
+layout(std140) uniform FrameData{
+    highp mat4 projection;
+    highp mat4 view;
+    highp mat4 viewportMatrix;
+    highp int zoomLevel;
+    highp int segmentCount;
+    highp float segmentLength;
+    highp float framePadding;
+    highp vec4 pData[20];
+};
@@ -2,12 +2,10 @@
 out vec4 OUT_COLOR_VAR;
 uniform highp vec4 baseColor;
 uniform highp vec4 lineColor;
-uniform highp float pData[80];
-uniform highp int segmentCount;
+uniform highp usampler2D sectionLookup;
 
-flat in highp float segLength;
-flat in highp vec4 appMask;
-flat in highp vec4 hitMask;
+flat in highp uvec4 appMask;
+flat in highp uvec4 hitMask;
 smooth in highp float vertexSegment;
 #else
 #define OUT_COLOR_VAR fragColor
@@ -15,15 +13,19 @@ out vec4 fragColor;
 
 uniform vec4 baseColor;
 uniform vec4 lineColor;
-uniform float pData[80];
-uniform int segmentCount;
+uniform usampler2D sectionLookup;
 
-flat in float segLength;
-flat in vec4 appMask;
-flat in vec4 hitMask;
+flat in uvec4 appMask;
+flat in uvec4 hitMask;
 in float vertexSegment;
 #endif
 
+#ifdef SECTION_COUNT
+#define SEGMENT_COUNT SECTION_COUNT
+#else
+#define SEGMENT_COUNT segmentCount
+#endif
+
 vec4 get_base_color(int fragSegment){
     if(fragSegment == 0) return vec4(1.0, 0.2, 0.1, 1.0);
     if(fragSegment == 1) return vec4(0.2, 1.0, 0.1, 1.0);
@@ -34,49 +36,58 @@ vec4 get_base_color(int fragSegment){
     return vec4(0.0, 0.0, 0.0, 1.0);
 }
 
-int compute_bit_is_set(vec4 value,int segment){
-    int index = segment / 20;
-    int num = segment % 20;
-
-    if(index < 4)
-    {
-        int mask = int(value[index]);
-        return (mask >> num) & 1;
-    }
-
-    //error
-    return 0;
+/* Masks are 4 x 32 bits, bit i lives at word i / 32 */
+uint compute_bit_is_set(uvec4 value, int segment){
+    return (value[segment >> 5] >> uint(segment & 31)) & 1u;
 }
 
+/*
+ * Section widths are baked on the CPU into sectionLookup, one texel
+ * per normalized position along the boom, so this is a single fetch.
+ * When every section has the same width the normalized position already
+ * is the section index and the fetch is compiled out. SECTION_LOOP keeps
+ * the walk over pData the shader did before the lookup, for the benchmark.
+ */
 int compute_segment(){
-    float start = 0.0;
-    float uFragSeg = vertexSegment / float(segmentCount);
-    for(int i = 0; i < segmentCount; i += 1){
-        start += pData[i];
-        float f = start / segLength;
-        if(f > uFragSeg){
-            return i;
-        }
+#if defined(SECTION_LOOP)
+    highp float start = 0.0;
+    highp float uFragSeg = vertexSegment / float(SEGMENT_COUNT);
+    for(int i = 0; i < SEGMENT_COUNT; i += 1){
+        start += pData[i >> 2][i & 3];
+        if(start / segmentLength > uFragSeg) return i;
     }
-
-    //error
-    return int(ceil(vertexSegment) -1.0);
+    return int(ceil(vertexSegment) - 1.0);
+#elif defined(UNIFORM_SECTIONS) && defined(SECTION_COUNT)
+    return clamp(int(vertexSegment), 0, SECTION_COUNT - 1);
+#else
+    int lutSize = textureSize(sectionLookup, 0).x;
+    float uFragSeg = vertexSegment / float(SEGMENT_COUNT);
+    int texel = clamp(int(uFragSeg * float(lutSize)), 0, lutSize - 1);
+    return int(texelFetch(sectionLookup, ivec2(texel, 0), 0).r);
+#endif
 }
 
 void main(void){
     int fragSegment = compute_segment();
-    if(fragSegment > segmentCount || fragSegment < 0) discard;
-    int first = fragSegment;
-    int isIntersect = compute_bit_is_set(hitMask , first);
-    int isOff       = compute_bit_is_set(appMask , first);
+    if(fragSegment >= SEGMENT_COUNT || fragSegment < 0) discard;
+    uint isIntersect = compute_bit_is_set(hitMask, fragSegment);
+    uint isOff       = compute_bit_is_set(appMask, fragSegment);
+#ifdef DEBUG_SECTION_COLORS
+    vec4 color = get_base_color(fragSegment % 6);
+#else
     vec4 color = baseColor;
+#endif
     color.a = 1.0;
-    if(isOff != 0){
-        if(isIntersect != 0){
+    if(isOff != 0u){
+        if(isIntersect != 0u){
             color = color * 0.5;
             color.a = 0.5;
         }
+#ifdef MEASURE_OVERDRAW
+        // one unit per shaded fragment, accumulated with additive blending
+        OUT_COLOR_VAR = vec4(1.0 / 255.0, 0.0, 0.0, 0.0);
+#else
         OUT_COLOR_VAR =  color;
+#endif
     }else discard;
 }
-
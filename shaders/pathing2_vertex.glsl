@@ -1,47 +1,61 @@
 #ifdef GL_ES
-layout(location = 0) in highp vec3 position;
-layout(location = 1) in highp mat3 maskData;
+layout(location = 0) in highp vec3 quantized;
+layout(location = 1) in highp float segment;
+layout(location = 2) in highp uint maskIndex;
 uniform highp mat4 model;
-uniform highp mat4 view;
-uniform highp mat4 projection;
-uniform highp float segmentLength;
-uniform highp int segmentCount;
-
-flat out highp vec4 appMask;
-flat out highp vec4 hitMask;
-flat out highp float segLength;
+uniform highp vec2 containerOrigin;
+uniform highp usampler2D pathMasks;
+
+flat out highp uvec4 appMask;
+flat out highp uvec4 hitMask;
 smooth out highp float vertexSegment;
 #else
-layout(location = 0) in vec3 position;
-layout(location = 1) in mat3 maskData;
+layout(location = 0) in vec3 quantized;
+layout(location = 1) in float segment;
+layout(location = 2) in uint maskIndex;
 uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+uniform vec2 containerOrigin;
 uniform float elevation;
-uniform float segmentLength;
-uniform int segmentCount;
+uniform usampler2D pathMasks;
 
-flat out vec4 appMask;
-flat out vec4 hitMask;
-flat out float segLength;
+flat out uvec4 appMask;
+flat out uvec4 hitMask;
 out float vertexSegment;
 #endif
 
-void main(void){
-    int i = 0;
-    int ivertexSeg = 0;
-    int target = 0;
+#ifdef SECTION_COUNT
+#define SEGMENT_COUNT SECTION_COUNT
+#else
+#define SEGMENT_COUNT segmentCount
+#endif
 
-    target = int( maskData[1][1] );
-    target = (target == segmentCount-1 ? target+1 : target);
+/* Each mask record takes two texels: hit followed by app */
+uvec4 fetch_mask_texel(int texel){
+    int width = textureSize(pathMasks, 0).x;
+    return texelFetch(pathMasks, ivec2(texel % width, texel / width), 0);
+}
+
+void main(void){
+    int target = int( segment );
+    target = (target == SEGMENT_COUNT-1 ? target+1 : target);
     vertexSegment = float(target);
-    segLength = segmentLength;
 
-    hitMask = vec4(maskData[0], maskData[1][0]);
-    appMask = vec4(maskData[1][2], maskData[2][0],maskData[2][1],maskData[2][2]);
+    int record = 2 * int(maskIndex);
+    hitMask = fetch_mask_texel(record);
+    appMask = fetch_mask_texel(record + 1);
+
+    // quantized holds (x, z, elevation) relative to the container center,
+    // world positions are highp on ES where the preamble defaults to mediump
+    highp vec3 position = quantized / PATH_POSITION_SCALE;
+    position = vec3(containerOrigin.x + position.x, position.z,
+                    containerOrigin.y + position.y);
+#ifdef TERRAIN
+    // drape on the ground, the stacking elevation stays as an offset above it
+    position.y += terrain_height(position.xz);
+#endif
 
-    mat4 MV = view * model;
-    vec4 pos = vec4(position, 1.0);
-    vec3 eyeSpacePosition = vec3(MV * pos);
+    highp mat4 MV = view * model;
+    highp vec4 pos = vec4(position, 1.0);
+    highp vec3 eyeSpacePosition = vec3(MV * pos);
     gl_Position = projection * vec4(eyeSpacePosition, 1.0);
 }
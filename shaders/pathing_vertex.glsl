@@ -2,13 +2,9 @@
 in vec4 position;
 //in vec3 normals;
 uniform highp mat4 model;
-uniform highp mat4 view;
-uniform highp mat4 projection;
 #else
 layout(location = 0) in vec4 position;
 uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
 #endif
 
 flat out int mask;
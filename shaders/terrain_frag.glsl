@@ -2,16 +2,17 @@
 out vec4 OUT_COLOR_VAR;
 uniform highp vec4 baseColor;
 uniform highp vec4 lineColor;
-uniform highp int zoomLevel;
+in highp vec3 vPosition;
+in highp vec3 vNormal;
 #else
 #define OUT_COLOR_VAR fragColor
 out vec4 fragColor;
 
 uniform vec4 baseColor;
 uniform vec4 lineColor;
-uniform int zoomLevel;
-#endif
 in vec3 vPosition;
+in vec3 vNormal;
+#endif
 
 float get_grad_scale(){
     if(zoomLevel < 3) return 0.05;
@@ -19,6 +20,7 @@ float get_grad_scale(){
     return 0.1;
 }
 
+/* Same grid as floor_frag.glsl, shaded by the slope */
 void main(void){
     vec2 stepSize = vec2(8.5);
     vec2 coord = vPosition.xz / stepSize;
@@ -26,5 +28,11 @@ void main(void){
     float grad = get_grad_scale();
     vec2 mult = smoothstep(0.0, grad, frac) - smoothstep(1.0-grad, 1.0, frac);
     vec3 col = mix(lineColor.rgb, baseColor.rgb, mult.x * mult.y);
-    OUT_COLOR_VAR = vec4(col, 0.0);
+#ifdef BACKGROUND
+    vec4 imagery = background_color(vPosition.xz);
+    col = mix(col, imagery.rgb, imagery.a);
+#endif
+
+    float light = 0.6 + 0.4 * max(dot(normalize(vNormal), normalize(vec3(0.4, 1.0, 0.3))), 0.0);
+    OUT_COLOR_VAR = vec4(col * light, 0.0);
 }
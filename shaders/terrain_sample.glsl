@@ -0,0 +1,41 @@
+/*
+ * Terrain heights, vertex stage only and only with TERRAIN defined. The
+ * TERRAIN_GRID x TERRAIN_GRID tiles around the camera are layers of
+ * terrainHeights, terrainLayers maps each of them to its layer or to -1
+ * when neither it nor a coarser tile covering it is loaded, which reads as
+ * the flat world. terrainCells places the tile in its layer: scale and
+ * offset of the part of a coarser tile standing in for it, 1, 0, 0 for the
+ * tile itself.
+ *
+ * terrainWindow: world x, z of the window corner, tile size in meters,
+ * samples per tile side (borders are shared with the neighbour tile).
+ * Coordinates and heights are highp, on ES the preamble defaults to mediump
+ * which can't hold world positions past a few hundred meters.
+ */
+uniform highp sampler2DArray terrainHeights;
+uniform highp vec4 terrainWindow;
+uniform highp int terrainLayers[TERRAIN_GRID * TERRAIN_GRID];
+uniform highp vec3 terrainCells[TERRAIN_GRID * TERRAIN_GRID];
+
+highp float terrain_height(highp vec2 xz){
+    highp vec2 local = (xz - terrainWindow.xy) / terrainWindow.z;
+    ivec2 cell = ivec2(floor(local));
+    if(any(lessThan(cell, ivec2(0))) || any(greaterThanEqual(cell, ivec2(TERRAIN_GRID))))
+        return 0.0;
+
+    int index = cell.y * TERRAIN_GRID + cell.x;
+    int layer = terrainLayers[index];
+    if(layer < 0) return 0.0;
+
+    int last = int(terrainWindow.w) - 1;
+    highp vec3 place = terrainCells[index];
+    highp vec2 st = (place.yz + (local - vec2(cell)) * place.x) * float(last);
+    ivec2 p = min(ivec2(st), ivec2(last - 1));
+    highp vec2 f = st - vec2(p);
+
+    highp float h00 = texelFetch(terrainHeights, ivec3(p, layer), 0).r;
+    highp float h10 = texelFetch(terrainHeights, ivec3(p + ivec2(1, 0), layer), 0).r;
+    highp float h01 = texelFetch(terrainHeights, ivec3(p + ivec2(0, 1), layer), 0).r;
+    highp float h11 = texelFetch(terrainHeights, ivec3(p + ivec2(1, 1), layer), 0).r;
+    return mix(mix(h00, h10, f.x), mix(h01, h11, f.x), f.y);
+}
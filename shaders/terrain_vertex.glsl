@@ -0,0 +1,27 @@
+#ifdef GL_ES
+layout(location = 0) in highp vec2 gridPosition;
+out highp vec3 vPosition;
+out highp vec3 vNormal;
+#else
+layout(location = 0) in vec2 gridPosition;
+out vec3 vPosition;
+out vec3 vNormal;
+#endif
+
+/*
+ * gridPosition spans [0, 1] over the whole tile window, the mesh is
+ * displaced by the same heights the paths are draped with.
+ */
+void main(void){
+    highp vec2 xz = terrainWindow.xy + gridPosition * terrainWindow.z * float(TERRAIN_GRID);
+    highp float h = terrain_height(xz);
+
+    // one sample step of the current level for the slope
+    highp float d = terrainWindow.z / (terrainWindow.w - 1.0);
+    highp float hx = terrain_height(xz + vec2(d, 0.0));
+    highp float hz = terrain_height(xz + vec2(0.0, d));
+    vNormal = normalize(vec3(h - hx, d, h - hz));
+
+    vPosition = vec3(xz.x, h, xz.y);
+    gl_Position = projection * view * vec4(vPosition, 1.0);
+}
@@ -0,0 +1,471 @@
+#include "snapshot.h"
+#include "graphics.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QSaveFile>
+#include <QElapsedTimer>
+#include <QDebug>
+#include <map>
+
+/* Sequential reader over the snapshot bytes, every take is bounds checked */
+struct snapshot_reader_t{
+    const uchar *data;
+    qint64 size;
+    qint64 offset;
+
+    const uchar * take(qint64 bytes){
+        if(bytes < 0 || offset + bytes > size) return nullptr;
+        const uchar *ptr = data + offset;
+        offset += bytes;
+        return ptr;
+    }
+};
+
+static void append_bytes(QByteArray *out, const void *data, size_t bytes){
+    out->append(reinterpret_cast<const char *>(data), SCAST(int, bytes));
+}
+
+/* Appends the elements of @data from @first on */
+template<typename T>
+static void append_vector(QByteArray *out, const std::vector<T> *data, size_t first = 0){
+    if(data && data->size() > first){
+        append_bytes(out, data->data() + first, (data->size() - first) * sizeof(T));
+    }
+}
+
+template<typename T>
+static quint32 count_of(const std::vector<T> *data){
+    return data ? SCAST(quint32, data->size()) : 0;
+}
+
+/* Leaves below @vox with triangles, these are the only voxels with state */
+static void collect_leaves(Voxel2D::Voxel *vox, std::vector<Voxel2D::Voxel *> *leaves){
+    if(!vox) return;
+    if(vox->canHoldData && vox->triangleHash && !vox->triangleHash->empty()){
+        leaves->push_back(vox);
+    }
+
+    collect_leaves(vox->childPP, leaves);
+    collect_leaves(vox->childPN, leaves);
+    collect_leaves(vox->childNP, leaves);
+    collect_leaves(vox->childNN, leaves);
+}
+
+/* Whether the header was written by this build for the current section setup */
+static bool header_matches(const struct snapshot_header_t &header){
+    GPSOptions options = Metrics::get_gps_option();
+    if(header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION ||
+       header.tailSize != sizeof(struct snapshot_tail_t) ||
+       header.vertexSize != sizeof(path_vertex_t) ||
+       header.maskSize != sizeof(path_mask_t) ||
+       header.frameSize != sizeof(struct snapshot_frame_t))
+    {
+        return false;
+    }
+
+    if(!voxWorld || header.voxelBaseLength != voxWorld->voxelBaseLength ||
+       header.segments != options.segments)
+    {
+        return false;
+    }
+
+    for(int i = 0; i < options.segments && i < MAX_SEGMENTS; i += 1){
+        if(header.segmentsLength[i] != configSegments[i]) return false;
+    }
+
+    return true;
+}
+
+/* Sizes a container or a leaf reached in the frames checked so far */
+struct snapshot_sizes_t{
+    quint32 vertices, indices, masks, triangles;
+};
+
+typedef std::map<std::pair<float, float>, struct snapshot_sizes_t> snapshot_sizes_map;
+
+/*
+ * Walks the containers of a frame. With @apply false it only checks that
+ * every record fits in the frame, continues what the previous frames left
+ * in @sizes and that every index points inside its arrays. With @apply true
+ * it appends the containers and leaves to voxWorld.
+ */
+static bool walk_containers(struct snapshot_reader_t reader, quint32 containers, bool apply,
+                            snapshot_sizes_map *containerSizes, snapshot_sizes_map *leafSizes)
+{
+    for(quint32 c = 0; c < containers; c += 1){
+        struct snapshot_container_t record;
+        const uchar *ptr = reader.take(sizeof(record));
+        if(!ptr) return false;
+        memcpy(&record, ptr, sizeof(record));
+
+        const path_vertex_t *vertices = reinterpret_cast<const path_vertex_t *>(
+                    reader.take(SCAST(qint64, record.vertices) * sizeof(path_vertex_t)));
+        const GLuint *indices = reinterpret_cast<const GLuint *>(
+                    reader.take(SCAST(qint64, record.indices) * sizeof(GLuint)));
+        const path_mask_t *masks = reinterpret_cast<const path_mask_t *>(
+                    reader.take(SCAST(qint64, record.masks) * sizeof(path_mask_t)));
+        const GLuint *sequence = reinterpret_cast<const GLuint *>(
+                    reader.take(SCAST(qint64, record.sequence) * sizeof(GLuint)));
+        if(!vertices || !indices || !masks || !sequence) return false;
+
+        Voxel2D::Voxel *container = nullptr;
+        struct snapshot_sizes_t *sizes = nullptr;
+        if(apply){
+            container = voxWorld->quadtree_find_or_build_container(Vec2{record.centerX,
+                                                                         record.centerY});
+            container->trianglesVertex->insert(container->trianglesVertex->end(),
+                                               vertices, vertices + record.vertices);
+            container->trianglesIndex->insert(container->trianglesIndex->end(),
+                                              indices, indices + record.indices);
+            container->trianglesMaskEx->insert(container->trianglesMaskEx->end(),
+                                               masks, masks + record.masks);
+            container->trianglesSequence->insert(container->trianglesSequence->end(),
+                                                 sequence, sequence + record.sequence);
+            container->savedVertices = SCAST(unsigned int, container->trianglesVertex->size());
+            container->savedIndices  = SCAST(unsigned int, container->trianglesIndex->size());
+            container->savedMasks    = SCAST(unsigned int, container->trianglesMaskEx->size());
+            voxWorld->list_add_voxel(container);
+        }else{
+            sizes = &(*containerSizes)[std::make_pair(record.centerX, record.centerY)];
+            if(record.firstVertex != sizes->vertices || record.firstIndex != sizes->indices ||
+               record.firstMask != sizes->masks || SCAST(quint64, record.sequence) * 3 != record.indices)
+            {
+                return false;
+            }
+
+            sizes->vertices += record.vertices;
+            sizes->indices  += record.indices;
+            sizes->masks    += record.masks;
+            for(quint32 i = 0; i < record.indices; i += 1){
+                if(indices[i] >= sizes->vertices) return false;
+            }
+            for(quint32 i = 0; i < record.vertices; i += 1){
+                if(vertices[i].mask >= sizes->masks) return false;
+            }
+        }
+
+        for(quint32 l = 0; l < record.leaves; l += 1){
+            struct snapshot_leaf_t leaf;
+            ptr = reader.take(sizeof(leaf));
+            if(!ptr) return false;
+            memcpy(&leaf, ptr, sizeof(leaf));
+
+            const uint2 *starts = reinterpret_cast<const uint2 *>(
+                        reader.take(SCAST(qint64, leaf.triangles) * sizeof(uint2)));
+            if(!starts) return false;
+
+            if(apply){
+                Voxel2D::Voxel *vox = voxWorld->quadtree_find_or_build(Vec2{leaf.centerX,
+                                                                            leaf.centerY});
+                if(vox->containerVoxel != container){
+                    qDebug() << "Warning: snapshot leaf outside of its container";
+                    continue;
+                }
+                vox->triangleHash->insert(vox->triangleHash->end(), starts, starts + leaf.triangles);
+                vox->savedTriangles = SCAST(unsigned int, vox->triangleHash->size());
+            }else{
+                struct snapshot_sizes_t *leafSize =
+                        &(*leafSizes)[std::make_pair(leaf.centerX, leaf.centerY)];
+                if(leaf.first != leafSize->triangles) return false;
+                leafSize->triangles += leaf.triangles;
+                for(quint32 i = 0; i < leaf.triangles; i += 1){
+                    if(SCAST(quint64, starts[i].a) + 2 >= sizes->indices) return false;
+                }
+            }
+        }
+    }
+
+    return reader.offset == reader.size;
+}
+
+/*
+ * Walks the frame records after the header and returns where the complete
+ * frames end, -1 without any. A frame cut short by a crash while it was
+ * appended is left out together with whatever follows it.
+ */
+static qint64 frames_end(struct snapshot_reader_t reader, struct snapshot_frame_t *last){
+    quint32 index = 0;
+    qint64 end = reader.offset;
+    for(;;){
+        struct snapshot_frame_t frame;
+        const uchar *ptr = reader.take(sizeof(frame));
+        if(!ptr) break;
+        memcpy(&frame, ptr, sizeof(frame));
+        if(frame.magic != SNAPSHOT_FRAME_MAGIC || frame.index != index ||
+           frame.size < SCAST(qint64, sizeof(frame)) || frame.size > reader.size - end)
+        {
+            break;
+        }
+
+        end += frame.size;
+        reader.offset = end;
+        *last = frame;
+        index += 1;
+    }
+
+    return index > 0 ? end : -1;
+}
+
+/*
+ * Walks the frames in @reader, which must end where frames_end() said. With
+ * @apply false every frame is checked, with @apply true they are built into
+ * voxWorld in order and the tail of the last one goes to Metrics.
+ */
+static bool walk_frames(struct snapshot_reader_t reader, bool apply){
+    snapshot_sizes_map containerSizes, leafSizes;
+    struct snapshot_tail_t tail;
+    const glm::vec3 *dynamic = nullptr;
+    while(reader.offset < reader.size){
+        struct snapshot_frame_t frame;
+        memcpy(&frame, reader.take(sizeof(frame)), sizeof(frame));
+
+        struct snapshot_reader_t body = reader;
+        body.size = reader.offset - SCAST(qint64, sizeof(frame)) + frame.size;
+        const uchar *ptr = body.take(sizeof(tail));
+        if(!ptr) return false;
+        memcpy(&tail, ptr, sizeof(tail));
+
+        dynamic = reinterpret_cast<const glm::vec3 *>(
+                    body.take(SCAST(qint64, tail.dynamicTriangles) * 3 * sizeof(glm::vec3)));
+        if(!dynamic || tail.segmentCount > SNAPSHOT_TAIL_SEGMENTS ||
+           !walk_containers(body, frame.containers, apply, &containerSizes, &leafSizes))
+        {
+            return false;
+        }
+        reader.offset = body.size;
+    }
+
+    if(apply && dynamic) Metrics::set_snapshot_tail(&tail, dynamic);
+    return dynamic != nullptr;
+}
+
+/*
+ * Maps @file, or reads it when it can't be mapped, and checks its header.
+ * @reader is left at the first frame.
+ */
+static bool open_snapshot(QFile *file, QByteArray *fallback, struct snapshot_reader_t *reader){
+    if(!file->exists() || !file->open(QIODevice::ReadOnly)) return false;
+
+    qint64 size = file->size();
+    const uchar *data = file->map(0, size);
+    if(!data){
+        *fallback = file->readAll();
+        data = reinterpret_cast<const uchar *>(fallback->constData());
+        size = fallback->size();
+    }
+
+    reader->data   = data;
+    reader->size   = size;
+    reader->offset = 0;
+
+    struct snapshot_header_t header;
+    const uchar *ptr = reader->take(sizeof(header));
+    if(!ptr) return false;
+    memcpy(&header, ptr, sizeof(header));
+    return header_matches(header);
+}
+
+/* Snapshot file for @session, next to the database file */
+QString Snapshot::path_for(const QString &database, const QString &session){
+    QFileInfo info(database);
+    return info.absoluteDir().filePath(info.completeBaseName() + "." + session + ".snapshot");
+}
+
+/*
+ * Serializes the voxel world and the Metrics tail as frame @frame of the
+ * file. Frame 0 starts the file and holds every container, later ones only
+ * what grew since the previous capture. @rows is the number of database
+ * rows the geometry was built from and the rest of the arguments describe
+ * the last of them, they are checked against the database on load.
+ */
+QByteArray Snapshot::capture(quint32 frame, qint64 rows, double latitude, double longitude,
+                             const unsigned char *mask, int segCount)
+{
+    QByteArray out;
+    if(!voxWorld) return out;
+
+    bool whole = frame == 0;
+    struct snapshot_header_t header;
+    memset(&header, 0, sizeof(header));
+    GPSOptions options = Metrics::get_gps_option();
+    header.magic      = SNAPSHOT_MAGIC;
+    header.version    = SNAPSHOT_VERSION;
+    header.tailSize   = sizeof(struct snapshot_tail_t);
+    header.vertexSize = sizeof(path_vertex_t);
+    header.maskSize   = sizeof(path_mask_t);
+    header.frameSize  = sizeof(struct snapshot_frame_t);
+    header.segments   = options.segments;
+    memcpy(header.segmentsLength, configSegments, sizeof(header.segmentsLength));
+    header.voxelBaseLength = voxWorld->voxelBaseLength;
+
+    struct snapshot_frame_t record;
+    memset(&record, 0, sizeof(record));
+    record.magic           = SNAPSHOT_FRAME_MAGIC;
+    record.index           = frame;
+    record.rows            = rows;
+    record.anchorLatitude  = latitude;
+    record.anchorLongitude = longitude;
+    memcpy(record.anchorMask, mask, MAX_MASK_SEG);
+    record.anchorSegCount  = segCount;
+
+    struct snapshot_tail_t tail;
+    std::vector<glm::vec3> dynamic;
+    Metrics::get_snapshot_tail(&tail, &dynamic);
+
+    // only the provider thread inserts, reading here needs no voxel lock
+    QByteArray body;
+    for(Voxel2D::Voxel *vox = voxWorld->voxelListHead; vox; vox = vox->listNext){
+        struct snapshot_container_t crecord;
+        crecord.centerX     = vox->center.x;
+        crecord.centerY     = vox->center.y;
+        crecord.firstVertex = whole ? 0 : vox->savedVertices;
+        crecord.firstIndex  = whole ? 0 : vox->savedIndices;
+        crecord.firstMask   = whole ? 0 : vox->savedMasks;
+
+        // a triangle reaches its container and all of its leaves in the same
+        // insert, containers with no new indices have nothing new below them
+        quint32 indices = count_of(vox->trianglesIndex);
+        if(indices == crecord.firstIndex) continue;
+
+        std::vector<Voxel2D::Voxel *> leaves, changed;
+        collect_leaves(vox, &leaves);
+        for(Voxel2D::Voxel *leaf : leaves){
+            if(whole || leaf->triangleHash->size() > leaf->savedTriangles) changed.push_back(leaf);
+        }
+
+        crecord.vertices = count_of(vox->trianglesVertex) - crecord.firstVertex;
+        crecord.indices  = indices - crecord.firstIndex;
+        crecord.masks    = count_of(vox->trianglesMaskEx) - crecord.firstMask;
+        crecord.sequence = count_of(vox->trianglesSequence) - crecord.firstIndex / 3;
+        crecord.leaves   = SCAST(quint32, changed.size());
+        append_bytes(&body, &crecord, sizeof(crecord));
+        append_vector(&body, vox->trianglesVertex, crecord.firstVertex);
+        append_vector(&body, vox->trianglesIndex, crecord.firstIndex);
+        append_vector(&body, vox->trianglesMaskEx, crecord.firstMask);
+        append_vector(&body, vox->trianglesSequence, crecord.firstIndex / 3);
+        vox->savedVertices = count_of(vox->trianglesVertex);
+        vox->savedIndices  = indices;
+        vox->savedMasks    = count_of(vox->trianglesMaskEx);
+
+        for(Voxel2D::Voxel *leaf : changed){
+            struct snapshot_leaf_t lrecord;
+            lrecord.centerX   = leaf->center.x;
+            lrecord.centerY   = leaf->center.y;
+            lrecord.first     = whole ? 0 : leaf->savedTriangles;
+            lrecord.triangles = count_of(leaf->triangleHash) - lrecord.first;
+            append_bytes(&body, &lrecord, sizeof(lrecord));
+            append_vector(&body, leaf->triangleHash, lrecord.first);
+            leaf->savedTriangles = count_of(leaf->triangleHash);
+        }
+        record.containers += 1;
+    }
+
+    record.size = SCAST(qint64, sizeof(record) + sizeof(tail) +
+                        dynamic.size() * sizeof(glm::vec3)) + body.size();
+    out.reserve(SCAST(int, record.size + (whole ? SCAST(qint64, sizeof(header)) : 0)));
+    if(whole) append_bytes(&out, &header, sizeof(header));
+    append_bytes(&out, &record, sizeof(record));
+    append_bytes(&out, &tail, sizeof(tail));
+    append_vector(&out, &dynamic);
+    out.append(body);
+    return out;
+}
+
+/*
+ * Writes a capture to @path. Frame 0 replaces the file, a crash while
+ * writing leaves the previous one. Later frames are appended with @append,
+ * a crash then leaves a frame cut short that peek() and adopt() skip.
+ */
+bool Snapshot::save(const QString &path, const QByteArray &data, bool append){
+    if(data.isEmpty()) return false;
+
+    if(append){
+        QFile file(path);
+        if(!file.exists() || !file.open(QIODevice::WriteOnly | QIODevice::Append) ||
+           file.write(data) != data.size() || !file.flush())
+        {
+            qDebug() << "Failed to append snapshot " << path << " " << file.errorString();
+            return false;
+        }
+        return true;
+    }
+
+    QSaveFile file(path);
+    if(!file.open(QIODevice::WriteOnly)){
+        qDebug() << "Failed to write snapshot " << path << " " << file.errorString();
+        return false;
+    }
+
+    if(file.write(data) != data.size() || !file.commit()){
+        qDebug() << "Failed to write snapshot " << path << " " << file.errorString();
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Reads the record of the last complete frame of the snapshot at @path,
+ * false when there is none or the file does not belong to the current build
+ * or section setup. Only the frame records are read.
+ */
+bool Snapshot::peek(const QString &path, struct snapshot_frame_t *last){
+    QFile file(path);
+    QByteArray fallback;
+    struct snapshot_reader_t reader;
+    if(!open_snapshot(&file, &fallback, &reader) || frames_end(reader, last) < 0){
+        if(file.exists()) qDebug() << "Ignoring snapshot " << path;
+        return false;
+    }
+
+    return last->rows > 0;
+}
+
+/*
+ * Maps the snapshot at @path and moves its containers into voxWorld and the
+ * tail of its last frame into Metrics. The world must be empty, the file is
+ * checked completely before anything is touched so a damaged file leaves
+ * everything as it was. A frame cut short is cut from the file as well so
+ * the next one is appended after the last complete frame.
+ */
+bool Snapshot::adopt(const QString &path){
+    if(!voxWorld || voxWorld->listTotalVoxels != 0 || Metrics::get_sequence_total() != 0){
+        qDebug() << "Snapshot needs an empty world, replaying instead";
+        return false;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
+    QFile file(path);
+    QByteArray fallback;
+    struct snapshot_reader_t reader;
+    struct snapshot_frame_t last;
+    if(!open_snapshot(&file, &fallback, &reader)) return false;
+
+    qint64 size = reader.size;
+    qint64 end = frames_end(reader, &last);
+    if(end < 0) return false;
+    reader.size = end;
+    if(!walk_frames(reader, false)){
+        qDebug() << "Damaged snapshot " << path;
+        return false;
+    }
+
+    voxWorld->lock_voxels();
+    walk_frames(reader, true);
+    voxWorld->unlock_voxels();
+    file.close();
+
+    if(end < size){
+        qDebug() << "Dropping" << size - end << "bytes of an unfinished snapshot frame";
+        if(!QFile::resize(path, end)){
+            qDebug() << "Failed to cut snapshot " << path << ", frames appended later are lost";
+        }
+    }
+
+    qDebug() << "Adopted snapshot of" << last.rows << "rows," << last.index + 1
+             << "frames in" << timer.elapsed() << "ms";
+    return true;
+}
@@ -0,0 +1,131 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+#include "common.h"
+#include <QByteArray>
+#include <QString>
+
+#define SNAPSHOT_MAGIC              0x504e5347 // "GSNP"
+#define SNAPSHOT_FRAME_MAGIC        0x4d524647 // "GFRM"
+#define SNAPSHOT_VERSION            2
+
+/* Rows stored by a running session between two snapshots */
+#define SNAPSHOT_EVERY_ROWS         1800
+
+/*
+ * Frames appended to a snapshot file before it is written whole again.
+ * Containers touched by many frames are read back in many pieces, this
+ * bounds that for adopt().
+ */
+#define SNAPSHOT_MAX_FRAMES         32
+
+/* Polyline segments kept, Polyline2D::insertOne only looks at the last two */
+#define SNAPSHOT_TAIL_SEGMENTS      2
+
+struct snapshot_point_t{
+    float x, y;
+    qint32 valid;
+};
+
+/*
+ * State Metrics carries from one fix to the next: the Orientation_t, the
+ * elevation used by the intersection tests and the end of the Pathing
+ * polyline. Followed in the file by dynamicTriangles * 3 glm::vec3.
+ */
+struct snapshot_tail_t{
+    double latitude, longitude, altitude;
+    double fromNorthAngle;
+    double dX, dY, dZ, dA;
+    float realPos[3], realDir[3];
+    float dir[3], prevDir[3], pos[3];
+    float distance;
+    qint32 valid, changed, isFirst;
+    float currentElevation;
+
+    quint8 currentHitMaskEx[MAX_MASK_SEG];
+    quint8 movementHitMaskEx[MAX_MASK_SEG];
+    qint32 lineCount;
+    float thickness;
+    quint32 totalTriangles;
+    struct snapshot_point_t lastPoint, lastPolyPoint;
+    struct snapshot_point_t nextStart1, nextStart2;
+    struct snapshot_point_t start1, start2, end1, end2;
+    qint32 segmentCount;
+    struct snapshot_point_t segments[SNAPSHOT_TAIL_SEGMENTS][6]; // center, edge1, edge2 (a, b)
+
+    float loadLastPos[3], loadCurrPos[3];
+    qint32 dynamicTriangles;
+};
+
+/*
+ * Snapshot file header, native endianness since the file is a cache of the
+ * database written and read by the same unit. The sizes of the records are
+ * stored so a build with a different layout ignores the file. Frames follow
+ * the header, see snapshot_frame_t.
+ */
+struct snapshot_header_t{
+    quint32 magic;
+    quint32 version;
+    quint32 tailSize, vertexSize, maskSize, frameSize;
+    qint32 segments;
+    float segmentsLength[MAX_SEGMENTS];
+    float voxelBaseLength;
+};
+
+/*
+ * A snapshot is taken every SNAPSHOT_EVERY_ROWS rows and appended to the
+ * file as a frame holding only what grew since the previous one, the first
+ * frame holds everything. The frame carries the tail of its moment, then
+ * every container that changed in list order: a snapshot_container_t
+ * followed by its new vertices, indices, mask records and sequence stamps,
+ * then its changed leaves, a snapshot_leaf_t followed by the new uint2
+ * triangle starts of the leaf. Containers and leaves only ever grow so the
+ * records say how much they held before and the frames are applied in order.
+ */
+struct snapshot_frame_t{
+    quint32 magic;
+    quint32 index; // frames before this one in the file
+    qint64 size;   // bytes of the frame, this record included
+    qint64 rows;   // database rows the geometry was built from
+    double anchorLatitude, anchorLongitude; // coordinate of row 'rows - 1'
+    quint8 anchorMask[MAX_MASK_SEG];
+    quint8 padding[2];
+    qint32 anchorSegCount;
+    quint32 containers;
+};
+
+struct snapshot_container_t{
+    float centerX, centerY;
+    quint32 firstVertex, firstIndex, firstMask; // already in previous frames
+    quint32 vertices, indices, masks, sequence; // in this frame
+    quint32 leaves;
+};
+
+struct snapshot_leaf_t{
+    float centerX, centerY;
+    quint32 first; // triangles already in previous frames
+    quint32 triangles;
+};
+
+/*
+ * Persisted geometry of a session, kept next to the database so reopening
+ * a session reads the voxel containers back instead of running every stored
+ * fix through Metrics::update_orientation again. Only the rows stored after
+ * the snapshot are replayed.
+ *
+ * capture() and adopt() must be called with the series lock held (or
+ * between Metrics::load_start and Metrics::load_finish), save() does the
+ * file write and should be called after releasing it. A frame is only worth
+ * appending to the file the previous capture went to, after a failed save
+ * capture frame 0 again.
+ */
+class Snapshot{
+public:
+    static QString path_for(const QString &database, const QString &session);
+    static QByteArray capture(quint32 frame, qint64 rows, double latitude, double longitude,
+                              const unsigned char *mask, int segCount);
+    static bool save(const QString &path, const QByteArray &data, bool append);
+    static bool peek(const QString &path, struct snapshot_frame_t *last);
+    static bool adopt(const QString &path);
+};
+
+#endif // SNAPSHOT_H
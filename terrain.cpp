@@ -0,0 +1,496 @@
+#include "terrain.h"
+#include "gldiagnostics.h"
+#include <QtEndian>
+#include <QtMath>
+#include <QDebug>
+
+#define TERRAIN_NO_TILE (~SCAST(quint64, 0))
+
+static int tiles_at_level(quint32 tiles, int level){
+    return SCAST(int, (tiles + (1u << level) - 1u) >> level);
+}
+
+static quint16 read_sample(const uchar *data, qint64 offset){
+    return qFromLittleEndian<quint16>(data + offset);
+}
+
+/* Little endian IEEE float from the file, swapped through its bits */
+static float float_from_little_endian(float value){
+    quint32 bits;
+    memcpy(&bits, &value, sizeof(bits));
+    bits = qFromLittleEndian(bits);
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+/*
+ * Byte offset of sample (sx, sz) of tile (tx, tz) within its level, tile
+ * rows are laid out along x as described in terrain.h.
+ */
+static qint64 sample_offset(const struct dem_header_t &header, int level,
+                            int tx, int tz, int sx, int sz)
+{
+    qint64 tileSamples = SCAST(qint64, header.tileSize) * header.tileSize;
+    qint64 tile = SCAST(qint64, tz) * tiles_at_level(header.tilesX, level) + tx;
+    return 2 * (tile * tileSamples + SCAST(qint64, sz) * header.tileSize + sx);
+}
+
+static void decode_tile(const uchar *data, const struct dem_header_t &header,
+                        const QVector<qint64> &levelOffsets, quint64 key,
+                        QVector<float> *heights)
+{
+    int level = SCAST(int, key >> 48);
+    int tz = SCAST(int, (key >> 24) & 0xffffff);
+    int tx = SCAST(int, key & 0xffffff);
+    int size = SCAST(int, header.tileSize);
+
+    heights->resize(size * size);
+    const uchar *tile = data + levelOffsets[level] + sample_offset(header, level, tx, tz, 0, 0);
+    float *out = heights->data();
+    for(int i = 0; i < size * size; i += 1){
+        out[i] = header.heightOffset + read_sample(tile, 2 * i) * header.heightScale;
+    }
+}
+
+TerrainLoader::TerrainLoader(const uchar *_data, const struct dem_header_t &_header,
+                             const QVector<qint64> &_levelOffsets)
+{
+    data = _data;
+    header = _header;
+    levelOffsets = _levelOffsets;
+    stopping = false;
+}
+
+/* Hands @key back undecoded so the tile can be requested again, hold the mutex */
+void TerrainLoader::drop(quint64 key){
+    struct terrain_tile_t dropped;
+    dropped.key = key;
+    dropped.dropped = true;
+    ready.enqueue(dropped);
+}
+
+/*
+ * Queues @keys. Queued requests that are not in @window, the tiles the
+ * window still misses, are stale after the camera moved or changed level
+ * and are dropped.
+ */
+void TerrainLoader::request(const QVector<quint64> &keys, const QVector<quint64> &window){
+    QMutexLocker locker(&mutex);
+    for(int i = requests.size() - 1; i >= 0; i -= 1){
+        if(!window.contains(requests.at(i))) drop(requests.takeAt(i));
+    }
+
+    for(quint64 key : keys) requests.enqueue(key);
+    while(requests.size() > TERRAIN_MAX_QUEUE){
+        drop(requests.dequeue());
+    }
+
+    if(!requests.isEmpty()) wakeUp.wakeOne();
+}
+
+bool TerrainLoader::take_ready(struct terrain_tile_t *tile){
+    QMutexLocker locker(&mutex);
+    if(ready.isEmpty()) return false;
+    *tile = ready.dequeue();
+    return true;
+}
+
+void TerrainLoader::stop(){
+    mutex.lock();
+    stopping = true;
+    wakeUp.wakeOne();
+    mutex.unlock();
+    wait();
+}
+
+void TerrainLoader::run(){
+    for(;;){
+        mutex.lock();
+        while(!stopping && requests.isEmpty()){
+            wakeUp.wait(&mutex);
+        }
+
+        if(stopping){
+            mutex.unlock();
+            return;
+        }
+
+        struct terrain_tile_t tile;
+        tile.key = requests.takeLast(); // newest first
+        tile.dropped = false;
+        mutex.unlock();
+
+        decode_tile(data, header, levelOffsets, tile.key, &tile.heights);
+
+        mutex.lock();
+        ready.enqueue(tile);
+        mutex.unlock();
+    }
+}
+
+Terrain::Terrain(){
+    data = nullptr;
+    loader = nullptr;
+    texture = 0;
+    frame = 0;
+    level = 0;
+    windowX = 0;
+    windowZ = 0;
+    memset(&header, 0, sizeof(header));
+    for(int i = 0; i < TERRAIN_CACHE_LAYERS; i += 1){
+        layerKeys[i] = TERRAIN_NO_TILE;
+        layerUsed[i] = 0;
+    }
+    for(int i = 0; i < TERRAIN_GRID * TERRAIN_GRID; i += 1){
+        windowLayers[i] = -1;
+        windowCells[3 * i + 0] = 1.0f;
+        windowCells[3 * i + 1] = 0.0f;
+        windowCells[3 * i + 2] = 0.0f;
+    }
+}
+
+/*
+ * GL objects must be released with release_gl() while the context is
+ * current, only the thread and the mapping can be dropped here.
+ */
+Terrain::~Terrain(){
+    if(loader){
+        loader->stop();
+        delete loader;
+    }
+    if(data){
+        file.unmap(const_cast<uchar *>(data));
+    }
+}
+
+bool Terrain::is_open(){
+    return data != nullptr;
+}
+
+QString Terrain::file_path(){
+    return file.fileName();
+}
+
+bool Terrain::open(const QString &path){
+    if(data){
+        qDebug() << "Terrain already open, close it first";
+        return false;
+    }
+
+    file.setFileName(path);
+    if(!file.open(QFile::ReadOnly)){
+        qDebug() << "Failed to open terrain " << path;
+        return false;
+    }
+
+    qint64 size = file.size();
+    if(size < SCAST(qint64, sizeof(header))){
+        qDebug() << "Terrain file too small " << path;
+        file.close();
+        return false;
+    }
+
+    const uchar *mapped = file.map(0, size);
+    if(!mapped){
+        qDebug() << "Failed to map terrain " << path;
+        file.close();
+        return false;
+    }
+
+    memcpy(&header, mapped, sizeof(header));
+    header.magic     = qFromLittleEndian(header.magic);
+    header.version   = qFromLittleEndian(header.version);
+    header.tileSize  = qFromLittleEndian(header.tileSize);
+    header.levels    = qFromLittleEndian(header.levels);
+    header.tilesX    = qFromLittleEndian(header.tilesX);
+    header.tilesZ    = qFromLittleEndian(header.tilesZ);
+    header.originX      = float_from_little_endian(header.originX);
+    header.originZ      = float_from_little_endian(header.originZ);
+    header.spacing      = float_from_little_endian(header.spacing);
+    header.heightScale  = float_from_little_endian(header.heightScale);
+    header.heightOffset = float_from_little_endian(header.heightOffset);
+
+    bool valid = header.magic == DEM_MAGIC && header.version == DEM_VERSION &&
+                 header.tileSize >= 2 && header.tileSize <= 1025 &&
+                 header.levels >= 1 && header.levels <= 16 &&
+                 header.tilesX >= 1 && header.tilesX < (1u << 24) &&
+                 header.tilesZ >= 1 && header.tilesZ < (1u << 24) &&
+                 header.spacing > 0.0f;
+
+    levelOffsets.clear();
+    qint64 offset = sizeof(header);
+    for(int l = 0; valid && l < SCAST(int, header.levels); l += 1){
+        levelOffsets.push_back(offset);
+        offset += SCAST(qint64, tiles_at_level(header.tilesX, l)) *
+                  tiles_at_level(header.tilesZ, l) *
+                  header.tileSize * header.tileSize * 2;
+    }
+
+    if(!valid || offset > size){
+        qDebug() << "Invalid terrain file " << path;
+        file.unmap(const_cast<uchar *>(mapped));
+        file.close();
+        return false;
+    }
+
+    data = mapped;
+    loader = new TerrainLoader(data, header, levelOffsets);
+    loader->start(QThread::LowPriority);
+
+    qDebug() << "Terrain " << path << ": " << header.tilesX << "x" << header.tilesZ
+             << " tiles of " << header.tileSize << " samples, " << header.levels << " levels";
+    return true;
+}
+
+void Terrain::close(OpenGLFunctions *GLptr){
+    release_gl(GLptr);
+    if(loader){
+        loader->stop();
+        delete loader;
+        loader = nullptr;
+    }
+
+    if(data){
+        file.unmap(const_cast<uchar *>(data));
+        data = nullptr;
+    }
+
+    file.close();
+    pending.clear();
+    for(int i = 0; i < TERRAIN_GRID * TERRAIN_GRID; i += 1){
+        windowLayers[i] = -1;
+    }
+}
+
+void Terrain::release_gl(OpenGLFunctions *GLptr){
+    if(texture){
+        GL_CHK(glDeleteTextures(1, &texture), GLptr);
+        texture = 0;
+    }
+
+    residentLayers.clear();
+    for(int i = 0; i < TERRAIN_CACHE_LAYERS; i += 1){
+        layerKeys[i] = TERRAIN_NO_TILE;
+        layerUsed[i] = 0;
+    }
+}
+
+quint64 Terrain::tile_key(int lvl, int tx, int tz){
+    return (SCAST(quint64, lvl) << 48) | (SCAST(quint64, tz) << 24) | SCAST(quint64, tx);
+}
+
+int Terrain::level_tiles_x(int lvl){
+    return tiles_at_level(header.tilesX, lvl);
+}
+
+int Terrain::level_tiles_z(int lvl){
+    return tiles_at_level(header.tilesZ, lvl);
+}
+
+float Terrain::tile_world_size(int lvl){
+    return (header.tileSize - 1) * header.spacing * SCAST(float, 1 << lvl);
+}
+
+float Terrain::sample(int lvl, int tx, int tz, int sx, int sz){
+    quint16 s = read_sample(data, levelOffsets[lvl] +
+                            sample_offset(header, lvl, tx, tz, sx, sz));
+    return header.heightOffset + s * header.heightScale;
+}
+
+/*
+ * Finest level height at (@x, @z), bilinear like the shaders. Read straight
+ * from the mapping, this is meant for a handful of points per frame (the
+ * target), not for meshes. Outside the DEM the world is flat at 0.
+ */
+float Terrain::height_at(float x, float z){
+    if(!data) return 0.0f;
+
+    int last = SCAST(int, header.tileSize) - 1;
+    float u = (x - header.originX) / header.spacing;
+    float v = (z - header.originZ) / header.spacing;
+    if(u < 0.0f || v < 0.0f) return 0.0f;
+
+    int tx = SCAST(int, u) / last;
+    int tz = SCAST(int, v) / last;
+    if(tx >= level_tiles_x(0) || tz >= level_tiles_z(0)) return 0.0f;
+
+    float su = u - tx * last;
+    float sv = v - tz * last;
+    int sx = qMin(SCAST(int, su), last - 1);
+    int sz = qMin(SCAST(int, sv), last - 1);
+    float fx = su - sx;
+    float fz = sv - sz;
+
+    float h00 = sample(0, tx, tz, sx, sz);
+    float h10 = sample(0, tx, tz, sx + 1, sz);
+    float h01 = sample(0, tx, tz, sx, sz + 1);
+    float h11 = sample(0, tx, tz, sx + 1, sz + 1);
+    return (h00 * (1.0f - fx) + h10 * fx) * (1.0f - fz) +
+           (h01 * (1.0f - fx) + h11 * fx) * fz;
+}
+
+/*
+ * Empty layer if there is one, otherwise the least recently used. Layers
+ * referenced by the current window, its own tiles or the coarser ones
+ * standing in for them, were stamped this frame and are only picked when
+ * the cache is smaller than twice the window, which it is not.
+ */
+int Terrain::acquire_layer(){
+    int best = 0;
+    for(int i = 0; i < TERRAIN_CACHE_LAYERS; i += 1){
+        if(layerKeys[i] == TERRAIN_NO_TILE) return i;
+        if(layerUsed[i] < layerUsed[best]) best = i;
+    }
+
+    residentLayers.remove(layerKeys[best]);
+    layerKeys[best] = TERRAIN_NO_TILE;
+    return best;
+}
+
+/*
+ * Per frame step: upload what the loader finished, pick the level from
+ * @cameraDistance and the window around @focus, and request the tiles of
+ * the window that are neither resident nor on their way. A missing tile is
+ * drawn from the closest coarser level resident meanwhile, the tile of
+ * level + k covering it holds it in one of its 2^k x 2^k parts. Requests
+ * left over from a previous window are dropped from the loader queue.
+ */
+void Terrain::update(QVector3D focus, float cameraDistance, OpenGLFunctions *GLptr){
+    if(!data) return;
+    frame += 1;
+
+    int size = SCAST(int, header.tileSize);
+    if(!texture){
+        GL_CHK(glGenTextures(1, &texture), GLptr);
+        GL_CHK(glBindTexture(GL_TEXTURE_2D_ARRAY, texture), GLptr);
+        // R32F is not filterable on ES, the shaders interpolate with texelFetch
+        GL_CHK(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST), GLptr);
+        GL_CHK(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST), GLptr);
+        GL_CHK(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE), GLptr);
+        GL_CHK(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE), GLptr);
+        GL_CHK(glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R32F, size, size,
+                            TERRAIN_CACHE_LAYERS, 0, GL_RED, GL_FLOAT, nullptr), GLptr);
+        GL_CHK(glBindTexture(GL_TEXTURE_2D_ARRAY, 0), GLptr);
+    }
+
+    struct terrain_tile_t tile;
+    int uploads = 0;
+    while(uploads < TERRAIN_UPLOADS_PER_FRAME && loader->take_ready(&tile)){
+        pending.remove(tile.key);
+        if(tile.dropped || residentLayers.contains(tile.key)) continue;
+
+        int layer = acquire_layer();
+        GL_CHK(glBindTexture(GL_TEXTURE_2D_ARRAY, texture), GLptr);
+        GL_CHK(glPixelStorei(GL_UNPACK_ALIGNMENT, 4), GLptr);
+        GL_CHK(glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, size, size, 1,
+                               GL_RED, GL_FLOAT, tile.heights.constData()), GLptr);
+        GL_STAT_UPLOAD(tile.heights.size() * sizeof(float));
+        GL_CHK(glBindTexture(GL_TEXTURE_2D_ARRAY, 0), GLptr);
+
+        residentLayers.insert(tile.key, layer);
+        layerKeys[layer] = tile.key;
+        layerUsed[layer] = frame;
+        uploads += 1;
+    }
+
+    level = 0;
+    float reach = TERRAIN_LOD_DISTANCE;
+    while(level < SCAST(int, header.levels) - 1 && cameraDistance > reach){
+        level += 1;
+        reach *= 2.0f;
+    }
+
+    float tileSize = tile_world_size(level);
+    windowX = qFloor((focus.x() - header.originX) / tileSize - TERRAIN_GRID * 0.5f + 0.5f);
+    windowZ = qFloor((focus.z() - header.originZ) / tileSize - TERRAIN_GRID * 0.5f + 0.5f);
+
+    int tilesX = level_tiles_x(level);
+    int tilesZ = level_tiles_z(level);
+    QVector<quint64> requests, missing;
+    for(int j = 0; j < TERRAIN_GRID; j += 1){
+        for(int i = 0; i < TERRAIN_GRID; i += 1){
+            int tx = windowX + i;
+            int tz = windowZ + j;
+            GLint *layer = &windowLayers[j * TERRAIN_GRID + i];
+            GLfloat *cell = &windowCells[3 * (j * TERRAIN_GRID + i)];
+            *layer = -1;
+            cell[0] = 1.0f;
+            cell[1] = 0.0f;
+            cell[2] = 0.0f;
+            if(tx < 0 || tz < 0 || tx >= tilesX || tz >= tilesZ) continue;
+
+            quint64 key = tile_key(level, tx, tz);
+            QHash<quint64, int>::iterator it = residentLayers.find(key);
+            if(it != residentLayers.end()){
+                *layer = it.value();
+                layerUsed[it.value()] = frame;
+                continue;
+            }
+
+            if(!pending.contains(key)){
+                pending.insert(key, true);
+                requests.push_back(key);
+            }
+            missing.push_back(key);
+
+            int coarsest = SCAST(int, header.levels) - 1 - level;
+            for(int k = 1; k <= coarsest; k += 1){
+                it = residentLayers.find(tile_key(level + k, tx >> k, tz >> k));
+                if(it == residentLayers.end()) continue;
+
+                int parts = 1 << k;
+                *layer = it.value();
+                layerUsed[it.value()] = frame;
+                cell[0] = 1.0f / parts;
+                cell[1] = SCAST(float, tx & (parts - 1)) / parts;
+                cell[2] = SCAST(float, tz & (parts - 1)) / parts;
+                break;
+            }
+
+            // nothing coarser either, the coarsest tile is asked for too and
+            // queued last so the loader, newest first, decodes it first
+            if(*layer < 0 && coarsest > 0){
+                quint64 base = tile_key(level + coarsest, tx >> coarsest, tz >> coarsest);
+                if(!pending.contains(base)){
+                    pending.insert(base, true);
+                    requests.push_back(base);
+                }
+                if(!missing.contains(base)) missing.push_back(base);
+            }
+        }
+    }
+
+    if(!pending.isEmpty()){
+        loader->request(requests, missing);
+    }
+}
+
+/*
+ * Sets the terrain uniforms of the bound @program and binds the height array
+ * to TERRAIN_TEXTURE_UNIT. Without a DEM every tile reads as missing.
+ */
+void Terrain::bind_heights(QOpenGLShaderProgram *program, OpenGLFunctions *GLptr){
+    if(data){
+        float size = tile_world_size(level);
+        program->setUniformValue("terrainWindow",
+                                 QVector4D(header.originX + windowX * size,
+                                           header.originZ + windowZ * size,
+                                           size, SCAST(float, header.tileSize)));
+        program->setUniformValueArray("terrainLayers", windowLayers,
+                                      TERRAIN_GRID * TERRAIN_GRID);
+        program->setUniformValueArray("terrainCells", windowCells,
+                                      TERRAIN_GRID * TERRAIN_GRID, 3);
+        GL_STAT_UNIFORM(3);
+    }else{
+        GLint missing[TERRAIN_GRID * TERRAIN_GRID];
+        for(int i = 0; i < TERRAIN_GRID * TERRAIN_GRID; i += 1) missing[i] = -1;
+        program->setUniformValue("terrainWindow", QVector4D(0, 0, 1, 2));
+        program->setUniformValueArray("terrainLayers", missing,
+                                      TERRAIN_GRID * TERRAIN_GRID);
+        GL_STAT_UNIFORM(2);
+    }
+
+    GL_CHK(glActiveTexture(GL_TEXTURE0 + TERRAIN_TEXTURE_UNIT), GLptr);
+    GL_CHK(glBindTexture(GL_TEXTURE_2D_ARRAY, texture), GLptr);
+    GL_CHK(glActiveTexture(GL_TEXTURE0), GLptr);
+}
@@ -0,0 +1,158 @@
+#ifndef TERRAIN_H
+#define TERRAIN_H
+#include "common.h"
+#include <QFile>
+#include <QHash>
+#include <QMutex>
+#include <QQueue>
+#include <QThread>
+#include <QVector>
+#include <QWaitCondition>
+
+/*
+ * Tiles kept around the camera, per side. The shaders index a
+ * TERRAIN_GRID x TERRAIN_GRID table so this is also a shader define.
+ */
+#define TERRAIN_GRID                4
+
+/* Layers of the height texture array, tiles resident on the GPU */
+#define TERRAIN_CACHE_LAYERS        48
+
+/* Tiles moved from the loader thread to the texture array per frame */
+#define TERRAIN_UPLOADS_PER_FRAME   4
+
+/*
+ * Requests waiting for the loader. It takes the newest first, once the
+ * queue is full the oldest requests are dropped.
+ */
+#define TERRAIN_MAX_QUEUE           32
+
+/* Quads per side of the terrain mesh covering the tile window */
+#define TERRAIN_MESH_RESOLUTION     128
+
+/*
+ * Camera distance the finest level is used up to, each level after
+ * that covers twice the distance of the previous one.
+ */
+#define TERRAIN_LOD_DISTANCE        120.0f
+
+/* Texture unit the height array is bound to while drawing */
+#define TERRAIN_TEXTURE_UNIT        2
+
+#define DEM_MAGIC                   0x4d454447 // "GDEM"
+#define DEM_VERSION                 1
+
+/*
+ * DEM file header, little endian, followed by the tiles of every level.
+ * Heights are in the renderer frame: x/z in meters from the session origin,
+ * the same frame Metrics places the path in.
+ *
+ * Level l has a sample spacing of spacing * 2^l and ceil(tilesX / 2^l) x
+ * ceil(tilesZ / 2^l) tiles. Tiles are tileSize x tileSize uint16 samples,
+ * row major along x, and neighbouring tiles share their border samples so
+ * one tile covers (tileSize - 1) * spacing * 2^l meters. A sample s is
+ * heightOffset + s * heightScale meters. Levels are stored finest first,
+ * tiles of a level in rows along x.
+ */
+struct dem_header_t{
+    quint32 magic;
+    quint32 version;
+    quint32 tileSize;
+    quint32 levels;
+    quint32 tilesX, tilesZ;
+    float originX, originZ;
+    float spacing;
+    float heightScale;
+    float heightOffset;
+};
+
+struct terrain_tile_t{
+    quint64 key;
+    bool dropped; // left the queue undecoded, no heights
+    QVector<float> heights;
+};
+
+/*
+ * Worker decoding requested tiles out of the mapped file. Reading the
+ * mapping may fault pages in from storage so it is kept away from the
+ * render thread, which only copies finished tiles to the GPU.
+ */
+class TerrainLoader : public QThread{
+    Q_OBJECT
+public:
+    TerrainLoader(const uchar *data, const struct dem_header_t &header,
+                  const QVector<qint64> &levelOffsets);
+    void request(const QVector<quint64> &keys, const QVector<quint64> &window);
+    bool take_ready(struct terrain_tile_t *tile);
+    void stop();
+
+protected:
+    void run() override;
+
+private:
+    void drop(quint64 key);
+
+    const uchar *data;
+    struct dem_header_t header;
+    QVector<qint64> levelOffsets;
+    QMutex mutex;
+    QWaitCondition wakeUp;
+    QQueue<quint64> requests;
+    QQueue<struct terrain_tile_t> ready;
+    bool stopping;
+};
+
+/*
+ * Streams the tiles of a DEM file around the camera. The file is memory
+ * mapped, update() picks the level of detail from the camera distance and
+ * the TERRAIN_GRID x TERRAIN_GRID window of tiles around the focus point,
+ * missing tiles are requested from the loader and the ones it finished are
+ * uploaded to a GL_TEXTURE_2D_ARRAY used as an LRU cache.
+ *
+ * Programs compiled with TERRAIN include shaders/terrain_sample.glsl, which
+ * reads heights through bind_heights(). Until a tile arrives its part of
+ * the window samples the closest coarser level that is resident, or 0, the
+ * flat world, when none is.
+ */
+class Terrain{
+public:
+    Terrain();
+    ~Terrain();
+    bool open(const QString &path);
+    void close(OpenGLFunctions *GLptr);
+    bool is_open();
+    QString file_path();
+
+    float height_at(float x, float z);
+    void update(QVector3D focus, float cameraDistance, OpenGLFunctions *GLptr);
+    void bind_heights(QOpenGLShaderProgram *program, OpenGLFunctions *GLptr);
+    void release_gl(OpenGLFunctions *GLptr);
+
+private:
+    quint64 tile_key(int level, int tx, int tz);
+    int level_tiles_x(int level);
+    int level_tiles_z(int level);
+    float tile_world_size(int level);
+    float sample(int level, int tx, int tz, int sx, int sz);
+    int acquire_layer();
+
+    QFile file;
+    const uchar *data;
+    struct dem_header_t header;
+    QVector<qint64> levelOffsets;
+    TerrainLoader *loader;
+
+    GLuint texture;
+    QHash<quint64, int> residentLayers;
+    QHash<quint64, bool> pending;
+    quint64 layerKeys[TERRAIN_CACHE_LAYERS];
+    qint64 layerUsed[TERRAIN_CACHE_LAYERS];
+    qint64 frame;
+
+    int level;
+    int windowX, windowZ;
+    GLint windowLayers[TERRAIN_GRID * TERRAIN_GRID];
+    GLfloat windowCells[TERRAIN_GRID * TERRAIN_GRID * 3]; // scale, offset x, z in the layer
+};
+
+#endif // TERRAIN_H
@@ -0,0 +1,15 @@
+# Point storage round trip test, see tests/database/main.cpp. 'make check' runs it.
+QT += positioning sql
+QT -= gui
+CONFIG += console testcase
+CONFIG -= app_bundle
+
+TARGET = database_test
+INCLUDEPATH += $$PWD/../..
+DEPENDPATH += $$PWD/../..
+
+SOURCES += main.cpp \
+    ../../database.cpp
+
+HEADERS += \
+    ../../database.h
@@ -0,0 +1,252 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QTemporaryDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QTextStream>
+#include <qmath.h>
+#include "database.h"
+
+/* Sections of the boom for most rows, some rows switch to TEST_NARROW_SECTIONS */
+#define TEST_SECTIONS        80
+#define TEST_NARROW_SECTIONS 24
+
+/**
+ * Checks the point storage formats read back what was written:
+ *
+ *      database_test [--rows 1100] [work directory]
+ *
+ * A DatabaseStorageBlocks session is written through Database like
+ * GPSProvider writes it, rows spanning several blocks and more than one mask
+ * keyframe, with jumps between laps, masks that stay, change a few bytes and
+ * change their section count. It is streamed back whole and from an anchor
+ * in the middle of a block, every coordinate must be within the fixed point
+ * step of DATABASE_BLOCK_SCALE and every mask must be the one written.
+ *
+ * A DBJournal is written and its tail damaged the two ways a power cut can
+ * leave it, a last record cut short and one whose bytes did not all reach
+ * the disk. Each time open() must cut the file back to the last good record
+ * and keep every record before it, and appending must go on from there.
+ *
+ * Exits with 0 when every check passes.
+ */
+
+/* Row @row of the test track, a field pass with a jump to the next lap */
+static DBGeoCoordinate track_row(int row){
+    DBGeoCoordinate coord;
+    int lap = row / 300;
+    int step = row % 300;
+    double north = (lap % 2) ? 299 - step : step;
+    coord.coord = QGeoCoordinate(-22.0 + north * 0.0000091 + lap * 0.01,
+                                 -47.0 - lap * 0.00002 + qSin(step * 0.05) * 0.000004);
+
+    coord.segCount = (row / 150) % 4 == 3 ? TEST_NARROW_SECTIONS : TEST_SECTIONS;
+    memset(coord.applicationMaskEx, 0, sizeof(coord.applicationMaskEx));
+    for(int s = 0; s < coord.segCount; s += 1){
+        if((row / 40 + s) % 7 != 0 && !(row % 97 < 3 && s % 5 == 0)){
+            coord.applicationMaskEx[s / 8] |= static_cast<unsigned char>(1 << (s % 8));
+        }
+    }
+    coord.time = 0;
+    coord.seq = -1;
+    return coord;
+}
+
+static bool same_row(const DBGeoCoordinate &written, const DBGeoCoordinate &read){
+    double step = 0.5 / DATABASE_BLOCK_SCALE + 1e-12;
+    int bytes = (written.segCount + 7) / 8;
+    return qAbs(written.coord.latitude()  - read.coord.latitude())  <= step &&
+           qAbs(written.coord.longitude() - read.coord.longitude()) <= step &&
+           written.segCount == read.segCount &&
+           memcmp(written.applicationMaskEx, read.applicationMaskEx, bytes) == 0;
+}
+
+/* Compares @read with the rows written from @first on, reports the first mismatch */
+static int compare_rows(QTextStream &out, const char *what, const QVector<DBGeoCoordinate> &read,
+                        int first, int rows)
+{
+    if(read.size() != rows - first){
+        out << "FAIL: " << what << " read " << read.size() << " rows, "
+            << rows - first << " were written\n";
+        return 1;
+    }
+
+    for(int i = 0; i < read.size(); i += 1){
+        if(!same_row(track_row(first + i), read[i])){
+            out << "FAIL: " << what << " row " << first + i << " differs from what was written\n";
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static QVector<DBGeoCoordinate> take_all(DBLoadStream *stream){
+    QVector<DBGeoCoordinate> rows, chunk;
+    while(stream->take(&chunk)) rows += chunk;
+    return rows;
+}
+
+static int check_blocks(QTextStream &out, const QString &directory, int rows){
+    QString path = QDir(directory).filePath("blocks.db");
+    QFile::remove(path);
+    QFile::remove(path + "-wal");
+    QFile::remove(path + "-shm");
+
+    Database::set_storage(DatabaseStorageBlocks);
+    Database::init(path, true);
+
+    DBSession session;
+    session.name = "Blocks";
+    session.samples = 1;
+    session.qdate = QDateTime::currentDateTime();
+    QStringList widths;
+    for(int i = 0; i < TEST_SECTIONS; i += 1) widths << "0.2";
+    session.segments = widths.join("|");
+    Database::open_session(session);
+
+    for(int row = 0; row < rows; row += 1){
+        Database::insert_gps_coord(track_row(row));
+    }
+    Database::flush();
+
+    int failed = compare_rows(out, "blocks", take_all(Database::stream_all()), 0, rows);
+
+    // resume in the middle of the second block, like a snapshot reload does
+    int from = DATABASE_BLOCK_POINTS + DATABASE_BLOCK_POINTS / 3;
+    DBLoadStream *stream = Database::stream_all(from, track_row(from - 1));
+    QVector<DBGeoCoordinate> tail = take_all(stream);
+    if(!stream->is_anchored()){
+        out << "FAIL: blocks did not resume at row " << from << "\n";
+        failed = 1;
+    }else{
+        failed |= compare_rows(out, "blocks from the anchor", tail, from, rows);
+    }
+
+    if(!failed){
+        out << "PASS: " << rows << " rows in blocks of " << DATABASE_BLOCK_POINTS
+            << " read back, also from row " << from << "\n";
+    }
+    return failed;
+}
+
+/* Records of the journal at @path, as DBJournal::open would keep them */
+static QVector<DBGeoCoordinate> journal_rows(const QString &path, qint64 sessionId){
+    QVector<DBGeoCoordinate> rows;
+    QFile file(path);
+    qint64 records = 0;
+    const struct DBJournalRecord *first = DBJournal::map(&file, sessionId, &records);
+    for(qint64 i = 0; first && i < records; i += 1){
+        DBGeoCoordinate coord;
+        DBJournal::to_coordinate(first[i], &coord);
+        rows.push_back(coord);
+    }
+    return rows;
+}
+
+/* Reopens the journal at @path and checks it kept @good records and nothing after them */
+static int reopen_journal(QTextStream &out, const char *what, DBJournal *journal,
+                          const QString &path, qint64 sessionId, int good)
+{
+    qint64 size = static_cast<qint64>(sizeof(struct DBJournalHeader)) +
+                  good * static_cast<qint64>(sizeof(struct DBJournalRecord));
+    if(!journal->open(path, sessionId, DatabaseSyncOff)){
+        out << "FAIL: " << what << ", the journal did not open\n";
+        return 1;
+    }
+    if(journal->records() != good || QFileInfo(path).size() != size){
+        out << "FAIL: " << what << ", " << journal->records() << " records in "
+            << QFileInfo(path).size() << " bytes, expected " << good << " in " << size << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+static int check_journal(QTextStream &out, const QString &directory, int rows){
+    const qint64 sessionId = 1;
+    QString path = DBJournal::path_for(QDir(directory).filePath("journal.db"), sessionId);
+    QFile::remove(path);
+    QFile::remove(path + ".damaged");
+
+    DBJournal journal;
+    if(!journal.open(path, sessionId, DatabaseSyncOff)){
+        out << "FAIL: could not create " << path << "\n";
+        return 1;
+    }
+    QVector<DBGeoCoordinate> batch;
+    for(int row = 0; row < rows; row += 1){
+        batch.push_back(track_row(row));
+        if(batch.size() == DATABASE_COMMIT_ROWS || row == rows - 1){
+            journal.append(batch);
+            batch.clear();
+        }
+    }
+    journal.close();
+
+    int failed = reopen_journal(out, "whole journal", &journal, path, sessionId, rows);
+    journal.close();
+
+    // a power cut while appending, half of the last record made it
+    qint64 recordSize = static_cast<qint64>(sizeof(struct DBJournalRecord));
+    QFile::resize(path, QFileInfo(path).size() - recordSize / 2);
+    failed |= reopen_journal(out, "torn tail", &journal, path, sessionId, rows - 1);
+    journal.close();
+
+    // the last record is all there but one of its sectors was not written
+    QFile file(path);
+    char byte = 0;
+    qint64 at = QFileInfo(path).size() - recordSize + 4;
+    if(file.open(QIODevice::ReadWrite) && file.seek(at) && file.getChar(&byte) && file.seek(at)){
+        file.putChar(static_cast<char>(~byte));
+    }
+    file.close();
+    failed |= reopen_journal(out, "corrupt tail", &journal, path, sessionId, rows - 2);
+
+    // appending goes on from the last good record
+    QVector<DBGeoCoordinate> next;
+    next.push_back(track_row(rows - 2));
+    journal.append(next);
+    journal.close();
+    failed |= reopen_journal(out, "append after recovery", &journal, path, sessionId, rows - 1);
+    journal.close();
+
+    if(!failed){
+        failed = compare_rows(out, "journal", journal_rows(path, sessionId), 0, rows - 1);
+    }
+    if(!failed){
+        out << "PASS: " << rows << " journal records, torn and corrupt tails cut back\n";
+    }
+    return failed;
+}
+
+int main(int argc, char *argv[]){
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("database_test");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Point storage round trip test");
+    parser.addHelpOption();
+    QCommandLineOption rowsOption("rows", "Rows written.", "count",
+                                  QString::number(4 * DATABASE_BLOCK_POINTS + 76));
+    parser.addOption(rowsOption);
+    parser.addPositionalArgument("directory", "Where the files are written, "
+                                              "a temporary directory by default.");
+    parser.process(app);
+
+    QTextStream out(stdout);
+    int rows = parser.value(rowsOption).toInt();
+    if(rows < 2 * DATABASE_BLOCK_POINTS){
+        out << "--rows must be at least " << 2 * DATABASE_BLOCK_POINTS << "\n";
+        return 1;
+    }
+
+    QTemporaryDir temporary;
+    QString directory = parser.positionalArguments().isEmpty() ? temporary.path() :
+                                                                 parser.positionalArguments().at(0);
+
+    int failed = check_journal(out, directory, rows);
+    failed |= check_blocks(out, directory, rows);
+
+    Database::finalize();
+    return failed;
+}
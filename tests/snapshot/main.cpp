@@ -0,0 +1,222 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QTemporaryDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QTextStream>
+#include <qmath.h>
+#include "graphics.h"
+#include "snapshot.h"
+
+/* Fixes per lane of the synthetic field pass, one meter apart */
+#define TEST_LANE_FIXES     120
+
+/* Lanes before the pass goes over the field again, overlapping the first */
+#define TEST_FIELD_LANES    24
+
+/**
+ * Checks that a session reopened from its snapshot gets the geometry a full
+ * replay builds:
+ *
+ *      snapshot_test [--rows 6300] [work directory]
+ *
+ * A synthetic field pass, lanes narrower than the implement that go over the
+ * field twice, is replayed through Metrics the way GPSProvider reloads a
+ * session. Snapshots are taken every SNAPSHOT_EVERY_ROWS rows like a running
+ * session takes them, so the file gets a whole first frame and incremental
+ * ones after it, and a last frame is left cut short like a crash while
+ * appending would. Then the world is rebuilt twice from the same state, once
+ * replaying every row and once adopting the snapshot and replaying the rows
+ * after it, and every container and leaf of the two is compared.
+ *
+ * Exits with 0 when they match.
+ */
+
+static uchar allOn[MAX_MASK_SEG];
+
+/* Row @row of the pass, lanes run north and south, @east apart */
+static QGeoCoordinate track_row(int row, double east){
+    const double lat0 = -22.0, lon0 = -47.0;
+    int lane = (row / TEST_LANE_FIXES) % TEST_FIELD_LANES;
+    int step = row % TEST_LANE_FIXES;
+    double north = (lane % 2) ? TEST_LANE_FIXES - 1 - step : step;
+    double metersLon = 111320.0 * qCos(qDegreesToRadians(lat0));
+    return QGeoCoordinate(lat0 + north / 111320.0, lon0 + (lane * east) / metersLon);
+}
+
+/* Empty world continuing from @fresh, the state Metrics had before any fix */
+static void reset_world(const GPSOptions &options, const struct snapshot_tail_t &fresh){
+    Metrics::finalize(options);
+    Metrics::initialize(options);
+    Metrics::initialize();
+    Metrics::set_line_state(allOn);
+    Metrics::load_start();
+    Metrics::set_snapshot_tail(&fresh, nullptr);
+}
+
+static void replay(int first, int last, double east){
+    for(int row = first; row < last; row += 1){
+        Metrics::load_updateEx(track_row(row, east), allOn);
+    }
+}
+
+static void append_center(QByteArray *out, const Vec2 &center){
+    out->append(reinterpret_cast<const char *>(&center.x), sizeof(center.x));
+    out->append(reinterpret_cast<const char *>(&center.y), sizeof(center.y));
+}
+
+static void collect_leaves(Voxel2D::Voxel *vox, QByteArray *out){
+    if(!vox) return;
+    if(vox->canHoldData && vox->triangleHash && !vox->triangleHash->empty()){
+        append_center(out, vox->center);
+        out->append(reinterpret_cast<const char *>(vox->triangleHash->data()),
+                    SCAST(int, vox->triangleHash->size() * sizeof(uint2)));
+    }
+
+    collect_leaves(vox->childPP, out);
+    collect_leaves(vox->childPN, out);
+    collect_leaves(vox->childNP, out);
+    collect_leaves(vox->childNN, out);
+}
+
+template<typename T>
+static void append_vector(QByteArray *out, const std::vector<T> *data){
+    quint32 count = SCAST(quint32, data->size());
+    out->append(reinterpret_cast<const char *>(&count), sizeof(count));
+    out->append(reinterpret_cast<const char *>(data->data()), SCAST(int, count * sizeof(T)));
+}
+
+/* Bytes of every container of voxWorld in list order, leaves included */
+static QVector<QByteArray> dump_world(){
+    QVector<QByteArray> containers;
+    for(Voxel2D::Voxel *vox = voxWorld->voxelListHead; vox; vox = vox->listNext){
+        QByteArray out;
+        append_center(&out, vox->center);
+        append_vector(&out, vox->trianglesVertex);
+        append_vector(&out, vox->trianglesIndex);
+        append_vector(&out, vox->trianglesMaskEx);
+        append_vector(&out, vox->trianglesSequence);
+        collect_leaves(vox, &out);
+        containers.push_back(out);
+    }
+    return containers;
+}
+
+int main(int argc, char *argv[]){
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("snapshot_test");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Snapshot round trip test");
+    parser.addHelpOption();
+    QCommandLineOption rowsOption("rows", "Rows of the session.", "count",
+                                  QString::number(3 * SNAPSHOT_EVERY_ROWS + 900));
+    parser.addOption(rowsOption);
+    parser.addPositionalArgument("directory", "Where the snapshot is written, "
+                                              "a temporary directory by default.");
+    parser.process(app);
+
+    QTextStream out(stdout);
+    int rows = parser.value(rowsOption).toInt();
+    if(rows < 2 * SNAPSHOT_EVERY_ROWS + 1){
+        out << "--rows must be over " << 2 * SNAPSHOT_EVERY_ROWS << "\n";
+        return 1;
+    }
+
+    QTemporaryDir temporary;
+    QString directory = parser.positionalArguments().isEmpty() ? temporary.path() :
+                                                                 parser.positionalArguments().at(0);
+    QString path = QDir(directory).filePath("test.snapshot");
+    QFile::remove(path);
+
+    memset(allOn, 0xFF, MAX_MASK_SEG);
+    QVector<float> segmentsLen(4, 0.5f);
+    GPSOptions options(segmentsLen, 1);
+    double east = 0.75 * 4 * 0.5; // lanes overlap by a quarter of the implement
+    Metrics::initialize(options);
+    Metrics::initialize();
+
+    struct snapshot_tail_t fresh;
+    std::vector<glm::vec3> freshDynamic;
+    Metrics::load_start();
+    Metrics::get_snapshot_tail(&fresh, &freshDynamic);
+    Metrics::load_finish();
+
+    // a running session, a frame every SNAPSHOT_EVERY_ROWS rows
+    reset_world(options, fresh);
+    quint32 frames = 0;
+    int snapshotRows = 0;
+    for(int row = SNAPSHOT_EVERY_ROWS; row <= rows; row += SNAPSHOT_EVERY_ROWS){
+        replay(row - SNAPSHOT_EVERY_ROWS, row, east);
+        QGeoCoordinate anchor = track_row(row - 1, east);
+        QByteArray data = Snapshot::capture(frames, row, anchor.latitude(), anchor.longitude(),
+                                            allOn, options.segments);
+        if(!Snapshot::save(path, data, frames > 0)){
+            out << "FAIL: could not write " << path << "\n";
+            return 1;
+        }
+        out << "Frame " << frames << ": " << row << " rows, " << data.size() << " bytes\n";
+        frames += 1;
+        snapshotRows = row;
+    }
+
+    // one more frame cut short, what a crash while appending leaves
+    replay(snapshotRows, rows, east);
+    QGeoCoordinate anchor = track_row(rows - 1, east);
+    QByteArray torn = Snapshot::capture(frames, rows, anchor.latitude(), anchor.longitude(),
+                                        allOn, options.segments);
+    qint64 complete = QFileInfo(path).size();
+    Snapshot::save(path, torn.left(torn.size() / 2), true);
+    Metrics::load_finish();
+
+    // the reference, every row replayed
+    reset_world(options, fresh);
+    replay(0, rows, east);
+    QVector<QByteArray> expected = dump_world();
+    unsigned int expectedTotal = Metrics::get_sequence_total();
+    Metrics::load_finish();
+
+    // the reopened session, the snapshot and the rows after it
+    reset_world(options, fresh);
+    struct snapshot_frame_t last;
+    if(!Snapshot::peek(path, &last) || last.rows != snapshotRows || last.index + 1 != frames){
+        out << "FAIL: the last complete frame is not the one written last\n";
+        return 1;
+    }
+    if(!Snapshot::adopt(path)){
+        out << "FAIL: the snapshot was not adopted\n";
+        return 1;
+    }
+    if(QFileInfo(path).size() != complete){
+        out << "FAIL: the frame cut short was left in the file\n";
+        return 1;
+    }
+    replay(SCAST(int, last.rows), rows, east);
+    QVector<QByteArray> adopted = dump_world();
+    unsigned int adoptedTotal = Metrics::get_sequence_total();
+    Metrics::load_finish();
+
+    int failed = 0;
+    if(expected.size() != adopted.size()){
+        out << "FAIL: " << adopted.size() << " containers, replay has " << expected.size() << "\n";
+        failed = 1;
+    }
+    for(int i = 0; i < expected.size() && i < adopted.size(); i += 1){
+        if(expected[i] != adopted[i]){
+            out << "FAIL: container " << i << " differs from the replay\n";
+            failed = 1;
+        }
+    }
+    if(expectedTotal != adoptedTotal){
+        out << "FAIL: " << adoptedTotal << " triangles, replay has " << expectedTotal << "\n";
+        failed = 1;
+    }
+
+    Metrics::finalize(options);
+    if(!failed){
+        out << "PASS: " << expected.size() << " containers, " << expectedTotal
+            << " triangles match the replay\n";
+    }
+    return failed;
+}
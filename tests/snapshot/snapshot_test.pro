@@ -0,0 +1,33 @@
+# Snapshot round trip test, see tests/snapshot/main.cpp. 'make check' runs it.
+QT += gui positioning sql
+QT -= widgets
+CONFIG += console testcase
+CONFIG -= app_bundle
+
+TARGET = snapshot_test
+INCLUDEPATH += $$PWD/../..
+DEPENDPATH += $$PWD/../..
+
+DEFINES += HAVE_GL33
+
+SOURCES += main.cpp \
+    ../../gpsoptions.cpp \
+    ../../graphics.cpp \
+    ../../view.cpp \
+    ../../pathing.cpp \
+    ../../database.cpp \
+    ../../gldiagnostics.cpp \
+    ../../terrain.cpp \
+    ../../background.cpp \
+    ../../snapshot.cpp
+
+HEADERS += \
+    ../../gpsoptions.h \
+    ../../graphics.h \
+    ../../view.h \
+    ../../pathing.h \
+    ../../database.h \
+    ../../gldiagnostics.h \
+    ../../terrain.h \
+    ../../background.h \
+    ../../snapshot.h
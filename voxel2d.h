@@ -3,6 +3,7 @@
 
 #include <polyline2d/include/Vec2.h>
 #include <vector>
+#include <algorithm>
 #include <common.h>
 #include <QDebug>
 #include <QMutex>
@@ -14,6 +15,7 @@
 //#define QUADTREE_LEN_SIZE 2560 // 2560^2 = 6553600 ~ 655,36 Hec
 #define QUADTREE_CONTAINER_LEVEL 5 // use either 5 or 6 for the container level
 #define MINIMAL_TRIANGLE_OFFSET 80
+#define VERTEX_REUSE_WINDOW 16 // how many recent vertices are checked for sharing
 
 #define ABS(x) (x) < 0 ? -(x) : (x)
 #define MAX2(x, y) (x) > (y) ? (x) : (y)
@@ -24,8 +26,10 @@
         This contains a structure of a Quadtree where each leaf (last child) is a 2D voxel.
         Triangles are stored in a 2-scheme structure:
         1 - Child voxels (leaf) contains an array of start indexes that can find
-            a triangle by invoking start + 0, start + 1, start + 2 on the actual
-            container structure (containerVoxel).
+            a triangle by invoking start + 0, start + 1, start + 2 on the index list
+            of the actual container structure (containerVoxel). Vertices are shared
+            between triangles of the same fix (and between fixes when nothing
+            changed) so always go through trianglesIndex.
         2 - The actual triangle store location is at a voxel that is 'QUADTREE_CONTAINER_LEVEL'
             after the root node.
 
@@ -122,8 +126,10 @@ public:
         struct voxel *childNP, *childNN;
         int canHoldData; // inform if this voxel can hold data or is a guiding voxel for quadtree
         std::vector<uint2> *triangleHash; // list of triangles start indices
-        std::vector<glm::vec3> *trianglesVertex; // geometry triangles for fast draw calls
-        std::vector<glm::mat3> *trianglesMaskEx; // geometry triangles masks for fast draw calls
+        std::vector<path_vertex_t> *trianglesVertex; // geometry vertices for fast draw calls
+        std::vector<GLuint> *trianglesIndex; // geometry triangles, 3 indices each
+        std::vector<path_mask_t> *trianglesMaskEx; // one mask record per fix
+        std::vector<GLuint> *trianglesSequence; // totalTriangles at insertion, one per triangle
         int voxelLevel; // how far we have to go from head to reach this voxel (head is level 0)
         Vec2 center; // graphical center position
         float l2; // half of voxels length 1D
@@ -132,6 +138,8 @@ public:
         int insertFlag;
         unsigned int startFlagged;
         int inserted; // indicates if this voxel is part of the geometry list
+        // sizes of the vectors already in the snapshot file, see Snapshot::capture
+        unsigned int savedVertices, savedIndices, savedMasks, savedTriangles;
         Vec2 p0, p1, p2, p3;
 
         ~voxel() {
@@ -148,8 +156,12 @@ public:
                 delete triangleHash;
             if (trianglesVertex)
                 delete trianglesVertex;
+            if (trianglesIndex)
+                delete trianglesIndex;
             if (trianglesMaskEx)
                 delete trianglesMaskEx;
+            if (trianglesSequence)
+                delete trianglesSequence;
 
             inserted = 0;
         }
@@ -165,8 +177,14 @@ public:
             insertFlag = 0;
             voxelLevel = -1;
             inserted = 0;
+            savedVertices = 0;
+            savedIndices = 0;
+            savedMasks = 0;
+            savedTriangles = 0;
             trianglesVertex = nullptr;
+            trianglesIndex = nullptr;
             trianglesMaskEx = nullptr;
+            trianglesSequence = nullptr;
 
             triangleHash = nullptr;
             containerVoxel = nullptr;
@@ -229,6 +247,91 @@ public:
             return t;
         }
 
+        /**
+         * Container only. Returns the index of the mask record, consecutive
+         * triangles of a fix carry the same masks so only the last record is checked.
+         */
+        GLuint push_mask(const path_mask_t &mask){
+            size_t count = trianglesMaskEx->size();
+            if(count > 0){
+                const path_mask_t &last = trianglesMaskEx->at(count - 1);
+                if(last.hitMask == mask.hitMask && last.appMask == mask.appMask){
+                    return SCAST(GLuint, count - 1);
+                }
+            }
+
+            trianglesMaskEx->push_back(mask);
+            return SCAST(GLuint, count);
+        }
+
+        /**
+         * Container only. Amount of indices, from the start of trianglesIndex, of
+         * the triangles inserted up to @cutoff (a totalTriangles value). Triangles
+         * are appended in time order so the stamps never decrease and the state of
+         * the container at any past moment is a prefix of its index list.
+         */
+        size_t indices_until(unsigned int cutoff){
+            std::vector<GLuint>::iterator it = std::upper_bound(trianglesSequence->begin(),
+                                                                trianglesSequence->end(),
+                                                                cutoff);
+            return 3 * SCAST(size_t, it - trianglesSequence->begin());
+        }
+
+        /**
+         * Container only. Quantizes a world coordinate into the fixed point
+         * space of this container, see PATH_POSITION_SCALE.
+         */
+        GLshort quantize(float value, float origin){
+            static int warned = 0;
+            float q = (value - origin) * PATH_POSITION_SCALE;
+            if(q > 32767.0f || q < -32768.0f){
+                if(!warned){
+                    qDebug() << "Warning: vertex out of container range, clamping";
+                    warned = 1;
+                }
+                q = q > 0.0f ? 32767.0f : -32768.0f;
+            }
+            return SCAST(GLshort, q < 0.0f ? q - 0.5f : q + 0.5f);
+        }
+
+        /**
+         * Container only. Returns the world position of the given vertex.
+         */
+        glm::vec3 vertex_position(const path_vertex_t &v){
+            return glm::vec3(center.x + SCAST(float, v.x) / PATH_POSITION_SCALE,
+                             SCAST(float, v.elevation) / PATH_POSITION_SCALE,
+                             center.y + SCAST(float, v.z) / PATH_POSITION_SCALE);
+        }
+
+        /**
+         * Container only. Returns the index of a vertex equal to the given one
+         * among the last VERTEX_REUSE_WINDOW vertices or pushes a new one.
+         * Polyline2D emits shared corners with the exact same coordinates so
+         * comparing the quantized values is enough.
+         */
+        GLuint push_vertex(Vec2 position, float elevation, int segment, GLuint mask){
+            path_vertex_t vertex;
+            vertex.x         = quantize(position.x, center.x);
+            vertex.z         = quantize(position.y, center.y);
+            vertex.elevation = quantize(elevation, 0.0f);
+            vertex.segment   = SCAST(GLshort, segment);
+            vertex.mask      = mask;
+
+            size_t count = trianglesVertex->size();
+            size_t first = count > VERTEX_REUSE_WINDOW ? count - VERTEX_REUSE_WINDOW : 0;
+            for(size_t i = count; i > first; i -= 1){
+                const path_vertex_t &v = trianglesVertex->at(i - 1);
+                if(v.mask == vertex.mask && v.segment == vertex.segment &&
+                   v.x == vertex.x && v.z == vertex.z && v.elevation == vertex.elevation)
+                {
+                    return SCAST(GLuint, i - 1);
+                }
+            }
+
+            trianglesVertex->push_back(vertex);
+            return SCAST(GLuint, count);
+        }
+
         /**
          * Inserts a triangle in this voxel if this start point was not flagged before.
          * For insertions we can have multi-voxel insertion, meaning this voxel will be
@@ -252,7 +355,7 @@ public:
             if(insertFlag == 0){
                 if(containerVoxel->insertFlag == 0){
                     containerVoxel->insertFlag = 1;
-                    containerVoxel->startFlagged = SCAST(unsigned int, containerVoxel->trianglesVertex->size());
+                    containerVoxel->startFlagged = SCAST(unsigned int, containerVoxel->trianglesIndex->size());
                     int segmentCount = 0;
                     int f0 = get_location(v0, segmentCount);
                     int f1 = get_location(v1, segmentCount);
@@ -260,35 +363,16 @@ public:
                     segmentCount += 1;
 
 
-                    int h0,h1,h2,h3,m0,m1,m2,m3;
-                    h0 = h1 = h2 = h3 = m0 = m1 = m2 = m3 = 0;
-
-                    h0 = (int)BitHelper::bitExtracted((unsigned int)hitMask[2], 4, 0);
-                    h0 = hitMask[0] | hitMask[1] << 8 | h0 << 16 ;
-                    h1 = (int)BitHelper::bitExtracted((unsigned int)hitMask[2], 4, 4);
-                    h1 |= hitMask[3] << 4 | hitMask[4] << 12 ;
-                    h2 = (int)BitHelper::bitExtracted((unsigned int)hitMask[7], 4, 0);
-                    h2 = hitMask[5] | hitMask[6] << 8 | h2 << 16 ;
-                    h3 = (int)BitHelper::bitExtracted((unsigned int)hitMask[7], 4, 4);
-                    h3 |= hitMask[8] << 4 | hitMask[9] << 12 ;
-
-                    m0 = (int)BitHelper::bitExtracted((unsigned int)appMask[2], 4, 0);
-                    m0 = appMask[0] | appMask[1] << 8 | m0 << 16 ;
-                    m1 = (int)BitHelper::bitExtracted((unsigned int)appMask[2], 4, 4);
-                    m1 |= appMask[3] << 4 | appMask[4] << 12 ;
-                    m2 = (int)BitHelper::bitExtracted((unsigned int)appMask[7], 4, 0);
-                    m2 = appMask[5] | appMask[6] << 8 | m2 << 16 ;
-                    m3 = (int)BitHelper::bitExtracted((unsigned int)appMask[7], 4, 4);
-                    m3 |= appMask[8] << 4 | appMask[9] << 12 ;
-
-                    containerVoxel->trianglesVertex->push_back(glm::vec3(v0.x, elevation, v0.y));
-                    containerVoxel->trianglesMaskEx->push_back(glm::mat3(h0,h1,h2,h3,f0,m0,m1,m2,m3));
-
-                    containerVoxel->trianglesVertex->push_back(glm::vec3(v1.x, elevation, v1.y));
-                    containerVoxel->trianglesMaskEx->push_back(glm::mat3(h0,h1,h2,h3,f1,m0,m1,m2,m3));
+                    path_mask_t vmask;
+                    BitHelper::mask_to_words(hitMask, MAX_MASK_SEG, &vmask.hitMask[0], MAX_MASK_WORDS);
+                    BitHelper::mask_to_words(appMask, MAX_MASK_SEG, &vmask.appMask[0], MAX_MASK_WORDS);
 
-                    containerVoxel->trianglesVertex->push_back(glm::vec3(v2.x, elevation, v2.y));
-                    containerVoxel->trianglesMaskEx->push_back(glm::mat3(h0,h1,h2,h3,f2,m0,m1,m2,m3));
+                    GLuint mask = containerVoxel->push_mask(vmask);
+                    std::vector<GLuint> *indices = containerVoxel->trianglesIndex;
+                    indices->push_back(containerVoxel->push_vertex(v0, elevation, f0, mask));
+                    indices->push_back(containerVoxel->push_vertex(v1, elevation, f1, mask));
+                    indices->push_back(containerVoxel->push_vertex(v2, elevation, f2, mask));
+                    containerVoxel->trianglesSequence->push_back(total);
                 }
                 uint2 u2;
                 u2.a = containerVoxel->startFlagged;
@@ -418,9 +502,13 @@ public:
             for(size_t i = 0; i < triangleHash->size(); i += 1){
                 uint2 uid2 = triangleHash->at(i);
                 unsigned int id = uid2.a;
-                glm::vec3 gt0 = containerVoxel->trianglesVertex->at(id + 0);
-                glm::vec3 gt1 = containerVoxel->trianglesVertex->at(id + 1);
-                glm::vec3 gt2 = containerVoxel->trianglesVertex->at(id + 2);
+                std::vector<GLuint> *indices = containerVoxel->trianglesIndex;
+                const path_vertex_t &pv0 = containerVoxel->trianglesVertex->at(indices->at(id + 0));
+                const path_vertex_t &pv1 = containerVoxel->trianglesVertex->at(indices->at(id + 1));
+                const path_vertex_t &pv2 = containerVoxel->trianglesVertex->at(indices->at(id + 2));
+                glm::vec3 gt0 = containerVoxel->vertex_position(pv0);
+                glm::vec3 gt1 = containerVoxel->vertex_position(pv1);
+                glm::vec3 gt2 = containerVoxel->vertex_position(pv2);
                 Vec2 p0{gt0.x, gt0.z};
                 Vec2 p1{gt1.x, gt1.z};
                 Vec2 p2{gt2.x, gt2.z};
@@ -435,30 +523,16 @@ public:
 
                     *ok = true;
                     if(rv == 0){
-                        glm::mat3 gt30 = containerVoxel->trianglesMaskEx->at(id + 0);
-                        glm::mat3 gt31 = containerVoxel->trianglesMaskEx->at(id + 1);
-                        glm::mat3 gt32 = containerVoxel->trianglesMaskEx->at(id + 2);
+                        path_mask_t gt30 = containerVoxel->trianglesMaskEx->at(pv0.mask);
 
                         //  I don' understand why configure triangle with only one point and three segment number
-                        vec5 gt40(gt0.x, gt0.z, gt30[1][1], gt0.y, 0);
-                        vec5 gt41(gt1.x, gt1.z, gt31[1][1], gt1.y, 0);
-                        vec5 gt42(gt2.x, gt2.z, gt32[1][1], gt2.y, 0);
-
-                        unsigned char mask[10]="";
-                        mask[0] = BitHelper::bitExtracted((unsigned int)gt30[1][2],8,0);
-                        mask[1] = BitHelper::bitExtracted((unsigned int)gt30[1][2],8,8);
-                        mask[2] = BitHelper::bitExtracted((unsigned int)gt30[1][2],4,16);
-                        mask[2] = mask[2] << 4 | BitHelper::bitExtracted((unsigned int)gt30[2][0],4,0);
-                        mask[3] = BitHelper::bitExtracted((unsigned int)gt30[2][0],8,4);
-                        mask[4] = BitHelper::bitExtracted((unsigned int)gt30[2][0],8,12);
-                        mask[5] = BitHelper::bitExtracted((unsigned int)gt30[2][1],8,0);
-                        mask[6] = BitHelper::bitExtracted((unsigned int)gt30[2][1],8,8);
-                        mask[7] = BitHelper::bitExtracted((unsigned int)gt30[2][1],4,16);
-                        mask[7] = mask[7] << 4 | BitHelper::bitExtracted((unsigned int)gt30[2][2],4,0);
-                        mask[8] = BitHelper::bitExtracted((unsigned int)gt30[2][2],8,4);
-                        mask[9] = BitHelper::bitExtracted((unsigned int)gt30[2][2],8,12);
-
-                        QString ret = print_binary_mask(mask,segCount);
+                        vec5 gt40(gt0.x, gt0.z, SCAST(float, pv0.segment), gt0.y, 0);
+                        vec5 gt41(gt1.x, gt1.z, SCAST(float, pv1.segment), gt1.y, 0);
+                        vec5 gt42(gt2.x, gt2.z, SCAST(float, pv2.segment), gt2.y, 0);
+
+                        unsigned char mask[MAX_MASK_SEG];
+                        BitHelper::words_to_mask(&gt30.appMask[0], MAX_MASK_WORDS, mask, MAX_MASK_SEG);
+
                         seghit = get_triangle_segment_stateEx(gt40, gt41, gt42, mask, p, segCount);
                         //***********************************************************************************************
                         rv = seghit < 0 ? 0 : seghit;
@@ -673,8 +747,10 @@ public:
                 if ( (*ptr)->voxelLevel == QUADTREE_CONTAINER_LEVEL )
                 {
                     (*ptr)->containerVoxel = *ptr;
-                    (*ptr)->trianglesVertex = new std::vector<glm::vec3>();
-                    (*ptr)->trianglesMaskEx = new std::vector<glm::mat3>();
+                    (*ptr)->trianglesVertex = new std::vector<path_vertex_t>();
+                    (*ptr)->trianglesIndex  = new std::vector<GLuint>();
+                    (*ptr)->trianglesMaskEx = new std::vector<path_mask_t>();
+                    (*ptr)->trianglesSequence = new std::vector<GLuint>();
                 }
                 else if ( (*ptr)->voxelLevel > QUADTREE_CONTAINER_LEVEL )
                 {
@@ -682,8 +758,10 @@ public:
 
                     if ( !(*ptr)->containerVoxel->trianglesVertex )
                     {
-                        (*ptr)->containerVoxel->trianglesVertex = new std::vector<glm::vec3>();
-                        (*ptr)->containerVoxel->trianglesMaskEx = new std::vector<glm::mat3>();
+                        (*ptr)->containerVoxel->trianglesVertex = new std::vector<path_vertex_t>();
+                        (*ptr)->containerVoxel->trianglesIndex  = new std::vector<GLuint>();
+                        (*ptr)->containerVoxel->trianglesMaskEx = new std::vector<path_mask_t>();
+                        (*ptr)->containerVoxel->trianglesSequence = new std::vector<GLuint>();
                     }
                 }
 
@@ -805,6 +883,19 @@ public:
             return aux;
         }
 
+        /**
+         * Returns the container voxel covering pos, building the quadtree down to
+         * it but no further. Used to restore containers saved in a snapshot.
+         */
+        Voxel * quadtree_find_or_build_container(Vec2 pos){
+            Voxel *aux = quadTree;
+            bool found = false;
+            while(aux->voxelLevel < QUADTREE_CONTAINER_LEVEL){
+                aux = quadtree_choose_or_make_child(aux, pos, found);
+            }
+            return aux;
+        }
+
         void update_center_voxel(Vec2 objPosition){
             centerVoxel = quadtree_find_or_build(objPosition);
         }